@@ -0,0 +1,78 @@
+//
+// Created by Omer Mersin on 11/24/24.
+//
+// Cost of handling one incoming DHT message of each kind, text and binary: every message is
+// fed to DHT::handleIncomingMessage repeatedly with replies going nowhere, and the average
+// time per call is reported. The DHT starts with 60 known nodes; lists carry 20 records.
+// Logging is left as shipped: per-message debug lines are off, table changes are printed.
+//
+// Usage: bench_dht_dispatch [iterations per message]
+#include "networking/dht.h"
+#include "networking/dht_protocol.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+using Clock = std::chrono::steady_clock;
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+
+    DHT dht("self", "10.0.0.1", 1);
+    dht.setSendCallback([](const std::string &, const std::string &, int) {});
+    for (int i = 0; i < 60; i++) {
+        dht.addNode({"n" + std::to_string(i), "10.0.1." + std::to_string(i), 2000 + i});
+    }
+
+    std::vector<DHTNode> nodes;
+    for (int i = 0; i < 20; i++) {
+        nodes.push_back({"user" + std::to_string(i * 7919), "203.0.113." + std::to_string(i), 40000 + i});
+    }
+    std::string records;
+    for (const auto &node : nodes) {
+        records += node.id + "," + node.ip + "," + std::to_string(node.port) + ";";
+    }
+    std::string key = "abcdef0123456789";
+    NodeId target = nodeIdOf("x");
+
+    // Answers to lookups carry a transaction nothing is waiting for, so they are parsed and dropped
+    std::string routingTable, lookupAnswer, provide, providers, findNode;
+    appendDhtHeader(routingTable, DhtMessageType::RoutingTable);
+    appendNodeList(routingTable, nodes);
+    appendDhtHeader(lookupAnswer, DhtMessageType::Nodes, 7);
+    appendNodeList(lookupAnswer, nodes);
+    appendDhtHeader(provide, DhtMessageType::Provide);
+    appendDhtKey(provide, key);
+    appendDhtHeader(providers, DhtMessageType::Providers);
+    appendDhtKey(providers, key);
+    appendEndpointList(providers, {{"1.2.3.4", 5}, {"5.6.7.8", 9}});
+    appendDhtHeader(findNode, DhtMessageType::FindNode, 9);
+    findNode.append(reinterpret_cast<const char *>(target.data()), target.size());
+
+    const std::pair<const char *, std::string> cases[] = {
+            {"KEEPALIVE", "KEEPALIVE"},
+            {"ROUTING_TABLE (20)", "ROUTING_TABLE " + records},
+            {"NODES (20)", "NODES 7 " + records},
+            {"PROVIDE", "PROVIDE " + key},
+            {"PROVIDERS (2)", "PROVIDERS " + key + " 1.2.3.4,5;5.6.7.8,9;"},
+            {"FIND_NODE", "FIND_NODE 9 x"},
+            {"binary RoutingTable (20)", routingTable},
+            {"binary Nodes (20)", lookupAnswer},
+            {"binary Provide", provide},
+            {"binary Providers (2)", providers},
+            {"binary FindNode", findNode},
+    };
+    std::vector<std::pair<const char *, double>> results;
+    for (const auto &[name, message] : cases) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            dht.handleIncomingMessage(message, "10.0.1.3", 2003);
+        }
+        results.emplace_back(name, std::chrono::duration<double, std::nano>(Clock::now() - start).count() / iterations);
+    }
+
+    for (const auto &[name, ns] : results) {
+        std::cout << name << ": " << static_cast<uint64_t>(ns) << " ns/message" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+// Transfer throughput on loopback: one Peer shares a file of random bytes, another downloads
+// it, and the run reports MB/s from accepting the offer to the verified rename.
+//
+// Usage: bench_file_transfer [MiB] [batch size] [directory]
+#include "transfer/file_transfer.h"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <random>
+
+int main(int argc, char **argv) {
+    size_t mebibytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 512;
+    size_t batchSize = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 32;
+    std::filesystem::path directory = argc > 3 ? argv[3] : std::filesystem::temp_directory_path();
+    std::string source = (directory / "bench_transfer.src").string();
+    std::string target = (directory / "bench_transfer.dst").string();
+
+    // Random content, so nothing compresses and every chunk hashes differently
+    {
+        std::ofstream out(source, std::ios::binary | std::ios::trunc);
+        std::mt19937_64 random(1);
+        std::vector<uint64_t> block(1 << 17);
+        for (size_t i = 0; i < mebibytes; i++) {
+            for (auto &word : block) {
+                word = random();
+            }
+            out.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(block.size() * 8));
+        }
+    }
+    std::filesystem::remove(target);
+    std::filesystem::remove(target + ".part");
+
+    PeerConfig config;
+    config.batchSize = batchSize;
+    config.receiveBufferBytes = 8 << 20;
+    std::cout.setstate(std::ios::failbit);  // Peer logs every start and stop
+    Peer sender, receiver;
+    sender.setConfig(config);
+    receiver.setConfig(config);
+    FileTransfer serving(sender), fetching(receiver);
+
+    std::promise<FileOffer> offered;
+    std::promise<std::pair<bool, std::string>> finished;
+    bool once = false;
+    fetching.setOfferCallback([&](const FileOffer &offer) {
+        // Offers are repeated until the first request arrives
+        if (!once) {
+            once = true;
+            offered.set_value(offer);
+        }
+    });
+    fetching.setCompletionCallback([&](uint64_t, bool success, const std::string &detail) {
+        finished.set_value({success, detail});
+    });
+    sender.bind(47301);
+    receiver.bind(47302);
+    sender.startListening();
+    receiver.startListening();
+
+    serving.offerFile(source, "127.0.0.1", 47302);
+    FileOffer offer = offered.get_future().get();
+    auto start = std::chrono::steady_clock::now();
+    fetching.download(offer, target);
+    auto [success, detail] = finished.get_future().get();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto stats = fetching.getStats();
+    PeerStats transport = receiver.getStats();
+    sender.stopListening();
+    receiver.stopListening();
+    std::cout.clear();
+
+    std::cout << (success ? "complete" : "failed: " + detail) << ", " << offer.size / (1 << 20) << " MiB in "
+              << seconds << " s, " << offer.size / 1e6 / seconds << " MB/s" << std::endl;
+    std::cout << "blocks " << stats.blocksReceived << ", duplicates " << stats.duplicateBlocks
+              << ", request timeouts " << stats.requestTimeouts << ", kernel drops " << transport.kernelDrops
+              << std::endl;
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(target);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+// Loopback comparison of the receive backends: the same burst of datagrams is sent to a
+// Peer listening with recvmmsg and then with io_uring, and each run reports throughput and
+// how many datagrams every receive syscall returned.
+//
+// Usage: bench_receive_backends [datagrams] [payload bytes] [batch size] [port]
+#include "networking/batch_io.h"
+#include "networking/peer.h"
+#include "networking/uring_receiver.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+using boost::asio::ip::udp;
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    size_t received = 0;
+    double seconds = 0;
+    PeerStats stats;
+};
+
+static Result run(bool ioUring, size_t datagrams, size_t payload, size_t batchSize, int port) {
+    Peer receiver;
+    PeerConfig config;
+    config.batchSize = batchSize;
+    config.ioUring = ioUring;
+    config.receiveBufferBytes = 8 << 20;
+    receiver.setConfig(config);
+
+    std::atomic<size_t> received{0};
+    std::atomic<Clock::rep> last{0};
+    receiver.setMessageCallback([&](std::string_view, const udp::endpoint &, BufferLease) {
+        received.fetch_add(1, std::memory_order_relaxed);
+        last.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    });
+    receiver.bind(port);
+    receiver.startListening();
+
+    boost::asio::io_context io;
+    udp::socket sender(io, udp::endpoint(udp::v4(), 0));
+    udp::endpoint destination(boost::asio::ip::make_address("127.0.0.1"), port);
+
+    std::string message(payload, 'x');
+    SendBatch batch(64);
+    auto start = Clock::now();
+    for (size_t i = 0; i < datagrams; i++) {
+        // Pace the sender so the comparison measures receiving rather than socket buffer drops
+        if (batch.add(message, destination)) {
+            batch.flush(sender.native_handle());
+            while (i + 1 - received.load(std::memory_order_relaxed) > 4096) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    batch.flush(sender.native_handle());
+
+    auto deadline = Clock::now() + std::chrono::seconds(2);
+    while (received.load() < datagrams && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    receiver.stopListening();
+
+    Result result;
+    result.received = received.load();
+    result.seconds = std::chrono::duration<double>(Clock::time_point(Clock::duration(last.load())) - start).count();
+    result.stats = receiver.getStats();
+    return result;
+}
+
+int main(int argc, char **argv) {
+    size_t datagrams = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t payload = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+    size_t batchSize = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 32;
+    int port = argc > 4 ? std::atoi(argv[4]) : 47100;
+
+    std::cout.setstate(std::ios::failbit);  // Peer logs every start and stop
+    Result recvmmsg = run(false, datagrams, payload, batchSize, port);
+    Result uring{};
+    bool uringRan = UringReceiver::compiledIn();
+    if (uringRan) {
+        uring = run(true, datagrams, payload, batchSize, port);
+    }
+    std::cout.clear();
+
+    auto report = [](const char *name, const Result &result) {
+        std::cout << name << ": " << result.received << " datagrams in " << result.seconds << " s, "
+                  << result.received / result.seconds / 1e6 << " M datagrams/s, "
+                  << static_cast<double>(result.stats.datagramsReceived) / std::max<uint64_t>(result.stats.receiveCalls, 1)
+                  << " datagrams per receive call" << std::endl;
+    };
+    report("recvmmsg", recvmmsg);
+    if (uringRan) {
+        report("io_uring", uring);
+    } else {
+        std::cout << "io_uring: not compiled in" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+//
+// Created by Omer Mersin on 11/18/24.
+//
+
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <boost/asio.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#include "networking/buffer_pool.h"
+#include "networking/timestamps.h"
+
+// Receives a batch of datagrams with a single recvmmsg() call.
+// Falls back to one recvfrom() per call on platforms without recvmmsg.
+class ReceiveBatch {
+public:
+    ReceiveBatch(size_t batchSize, size_t bufferSize);
+
+    // Blocks until at least one datagram is available, then returns up to
+    // capacity() datagrams. Throws boost::system::system_error on failure.
+    // With wait false it returns 0 instead of blocking when nothing is queued.
+    size_t receive(int fd, bool wait = true);
+
+    size_t capacity() const { return batchSize; }
+    const char *data(size_t i) const { return leases[i] ? leases[i].data() : buffers.data() + i * bufferSize; }
+    size_t length(size_t i) const { return lengths[i]; }
+    boost::asio::ip::udp::endpoint sender(size_t i) const;
+
+    // Receive straight into pool slabs so datagrams can be handed off without copying.
+    // Slots fall back to the batch's own buffers while the pool is exhausted.
+    void attachPool(BufferPool *pool);
+
+    // Moves the slab holding datagram i out of the batch. Empty if the slot
+    // was served from the fallback buffer.
+    BufferLease take(size_t i);
+
+    // Lets the kernel merge consecutive datagrams from one sender (UDP_GRO). Slots grow
+    // to hold a merged datagram, so pool slabs are only used if they are that large.
+    // Returns false if the kernel does not support it.
+    bool enableGro(int fd);
+
+    // Non-zero when datagram i is several merged datagrams of this size (the last may be shorter)
+    size_t segmentSize(size_t i) const { return segmentSizes[i]; }
+
+    // Has the kernel stamp each datagram on arrival (see enableReceiveTimestamps)
+    bool enableTimestamps(int fd);
+    // When datagram i reached the socket; zero unless timestamps are enabled
+    ReceiveTimestamps::Clock::time_point kernelTime(size_t i) const { return kernelTimes[i]; }
+
+private:
+    size_t batchSize;
+    size_t bufferSize;
+    std::vector<char> buffers;
+    std::vector<size_t> lengths;
+    std::vector<sockaddr_storage> addresses;
+    BufferPool *pool = nullptr;
+    std::vector<BufferLease> leases;
+    std::vector<size_t> segmentSizes;
+    std::vector<ReceiveTimestamps::Clock::time_point> kernelTimes;
+    bool gro = false;
+    bool timestamps = false;
+
+    void prepareSlot(size_t i);
+#ifdef __linux__
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> iovecs;
+    std::vector<char> controls;  // Ancillary data buffer per slot
+#endif
+};
+
+// Collects outgoing datagrams and flushes them with a single sendmmsg() call.
+class SendBatch {
+public:
+    explicit SendBatch(size_t batchSize);
+
+    // Returns true once the batch is full and should be flushed.
+    bool add(const std::string &message, const boost::asio::ip::udp::endpoint &destination);
+
+    // Sends everything queued so far, waiting for room when the send buffer is full on a
+    // non-blocking descriptor. Returns the number of sendmmsg/sendto calls issued.
+    // Throws boost::system::system_error on failure.
+    size_t flush(int fd);
+
+    size_t size() const { return messages.size(); }
+    bool empty() const { return messages.empty(); }
+    size_t capacity() const { return batchSize; }
+
+private:
+    size_t batchSize;
+    std::vector<std::string> messages;
+    std::vector<boost::asio::ip::udp::endpoint> destinations;
+#ifdef __linux__
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> iovecs;
+#endif
+};
+
+// Sends datagrams that share one destination as UDP_SEGMENT (GSO) super-datagrams:
+// each run of equally sized datagrams, where only the last may be shorter, costs one
+// sendmsg and one pass through the stack. Other platforms send them one by one.
+class SegmentedSend {
+public:
+    // True if the kernel accepts UDP_SEGMENT on this socket
+    static bool supported(int fd);
+
+    // Returns the number of sendmsg calls; a full send buffer is waited out as in SendBatch.
+    // On failure sent holds how many leading datagrams
+    // made it out before boost::system::system_error was thrown, so a fallback can resume there.
+    static size_t send(int fd, const std::vector<std::string_view> &datagrams,
+                       const boost::asio::ip::udp::endpoint &destination, size_t &sent);
+};
+
+// One datagram straight to the descriptor. Safe alongside asynchronous operations on the
+// same socket, since it never touches the asio socket object; if asio has made the descriptor
+// non-blocking it waits for room instead of failing. Returns the bytes sent, 0 on error.
+size_t sendDatagram(int fd, std::string_view datagram, const boost::asio::ip::udp::endpoint &destination,
+                    boost::system::error_code &error);
+
+#endif // BATCH_IO_H
@@ -0,0 +1,78 @@
+//
+// Created by Omer Mersin on 11/18/24.
+//
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class BufferPool;
+
+// Move-only handle to one pool slab. The slab returns to the pool when the
+// lease is destroyed, so consumers keep a packet alive simply by holding it.
+class BufferLease {
+public:
+    BufferLease() = default;
+    BufferLease(BufferPool *pool, uint32_t index);
+    BufferLease(BufferLease &&other) noexcept;
+    BufferLease &operator=(BufferLease &&other) noexcept;
+    BufferLease(const BufferLease &) = delete;
+    BufferLease &operator=(const BufferLease &) = delete;
+    ~BufferLease();
+
+    // Wraps heap storage for payloads that outgrow a slab, such as reassembled messages
+    static BufferLease adopt(std::string bytes);
+
+    explicit operator bool() const { return pool != nullptr || owned != nullptr; }
+    char *data() const;
+    size_t capacity() const;
+    size_t size() const { return length; }
+    void setSize(size_t size) { length = size; }
+    // Skips bytes at the start of the slab, e.g. headers written ahead of the payload
+    void setOffset(size_t bytes) { offset = bytes; }
+    std::string_view view() const { return {data(), length}; }
+    void release();
+
+private:
+    BufferPool *pool = nullptr;
+    uint32_t index = 0;
+    size_t offset = 0;
+    size_t length = 0;
+    std::unique_ptr<std::string> owned;
+};
+
+// Fixed set of equally sized slabs carved from one allocation up front.
+// acquire()/release are lock-free so every listener thread can share one pool.
+class BufferPool {
+public:
+    BufferPool(size_t slabCount, size_t slabSize);
+
+    // Returns an empty lease when every slab is in use
+    BufferLease acquire();
+
+    size_t slabSize() const { return slabBytes; }
+    size_t slabCount() const { return count; }
+    size_t available() const { return free.load(std::memory_order_relaxed); }
+
+private:
+    friend class BufferLease;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    char *slab(uint32_t index) { return storage.get() + static_cast<size_t>(index) * slabBytes; }
+    void release(uint32_t index);
+
+    size_t count;
+    size_t slabBytes;
+    std::unique_ptr<char[]> storage;
+    std::unique_ptr<std::atomic<uint32_t>[]> next;  // Free-list links, one per slab
+    std::atomic<uint64_t> head;                      // ABA tag in the high half, slab index in the low half
+    std::atomic<size_t> free;
+};
+
+#endif // BUFFER_POOL_H
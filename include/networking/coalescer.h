@@ -0,0 +1,66 @@
+//
+// Created by Omer Mersin on 11/21/24.
+//
+
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Bundle frame: magic, type, then repeated [length (u16)][message bytes]
+constexpr size_t BUNDLE_ENTRY_OVERHEAD = 2;
+
+// Per-destination outbound queues that pack small messages into one datagram.
+// A destination's bundle is sent as soon as the next message would overflow the
+// datagram, or when its oldest message has waited for the latency budget.
+class Coalescer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Datagram {
+        boost::asio::ip::udp::endpoint destination;
+        std::string bytes;
+        size_t messages;
+    };
+
+    enum class AddResult {
+        Rejected,  // Can never share a datagram; the caller sends it directly
+        Queued,    // Joined a bundle that was already waiting
+        Opened,    // Started a new bundle, so a new deadline is pending
+    };
+
+    explicit Coalescer(std::chrono::microseconds latencyBudget);
+
+    // Bundles that became full are appended to ready. maxDatagramSize is the destination's
+    // current datagram size, so a bundle grows with what path MTU discovery found.
+    AddResult add(const std::string &message, const boost::asio::ip::udp::endpoint &destination,
+                  size_t maxDatagramSize, Clock::time_point now, std::vector<Datagram> &ready);
+
+    // Moves out every bundle whose deadline has passed
+    void collectDue(Clock::time_point now, std::vector<Datagram> &ready);
+    void collectAll(std::vector<Datagram> &ready);
+
+    std::optional<Clock::time_point> nextDeadline() const;
+
+private:
+    struct Queue {
+        std::string bundle;
+        size_t messages = 0;
+        Clock::time_point deadline;
+    };
+
+    void seal(const boost::asio::ip::udp::endpoint &destination, Queue &queue, std::vector<Datagram> &ready);
+
+    std::chrono::microseconds latencyBudget;
+
+    mutable std::mutex mutex;
+    std::map<boost::asio::ip::udp::endpoint, Queue> queues;
+};
+
+#endif // COALESCER_H
@@ -0,0 +1,69 @@
+//
+// Created by Omer Mersin on 11/24/24.
+//
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Compressed frame: magic, type, codec, dictionary id (u32, 0 = none), original size (u32), codec output.
+// The decompressed bytes are handled as if they had arrived as a datagram of their own.
+constexpr size_t COMPRESSED_HEADER_SIZE = 11;
+// Capabilities frame: magic, type, codec mask, dictionary id (u32), flags
+constexpr size_t CAPABILITIES_FRAME_SIZE = 8;
+constexpr uint8_t CAPABILITIES_WANT_REPLY = 0x01;
+// Most original bytes a frame may claim per byte of codec output (about LZ4's own limit).
+// compress() gives up beyond it, so decompress() can refuse larger claims before allocating.
+constexpr size_t MAX_COMPRESSION_RATIO = 255;
+
+enum class Codec : uint8_t {
+    None = 0,
+    Zstd = 1,   // Built with P2P_HAVE_ZSTD; best ratio, especially with a dictionary
+    Lz4 = 2,    // Built with P2P_HAVE_LZ4; cheapest to run
+};
+
+inline uint8_t codecBit(Codec codec) {
+    return static_cast<uint8_t>(1u << static_cast<uint8_t>(codec));
+}
+
+// Stateless payload compressor shared by every destination. Codec contexts are kept
+// per thread, so compress() and decompress() may run concurrently; setDictionary()
+// must happen before traffic flows.
+class Compressor {
+public:
+    Compressor();
+    ~Compressor();
+
+    // Codecs this build can both compress and decompress, as a mask of codecBit()s
+    static uint8_t available();
+    // Preferred codec present in both masks, or Codec::None
+    static Codec choose(uint8_t local, uint8_t remote);
+
+    // Raw sample text, used as history by both codecs. Both sides must load the same bytes;
+    // the id is derived from the content, so no separate numbering is needed.
+    void setDictionary(std::string dictionary);
+    uint32_t dictionaryId() const;
+
+    // Builds a Compressed frame for payload. Returns nothing if the codec is unavailable,
+    // the frame would be larger than maxFrameSize or it beats MAX_COMPRESSION_RATIO.
+    std::optional<std::string> compress(std::string_view payload, Codec codec, bool useDictionary,
+                                        size_t maxFrameSize) const;
+
+    // Throws std::runtime_error for malformed frames, an unknown dictionary, or output above
+    // maxSize or MAX_COMPRESSION_RATIO times the codec output; nothing is allocated for those
+    std::string decompress(const char *frame, size_t len, size_t maxSize) const;
+
+    static std::string encodeCapabilities(uint8_t codecs, uint32_t dictionaryId, bool wantReply);
+
+private:
+    struct Dictionary;
+    std::shared_ptr<const Dictionary> dictionary;
+};
+
+#endif // COMPRESSION_H
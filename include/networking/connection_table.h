@@ -0,0 +1,115 @@
+//
+// Created by Omer Mersin on 11/26/24.
+//
+
+#ifndef CONNECTION_TABLE_H
+#define CONNECTION_TABLE_H
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "networking/endpoint.h"
+
+// Copy of one remote endpoint's transport state
+struct ConnectionInfo {
+    CompactEndpoint endpoint;
+    std::chrono::steady_clock::time_point lastSeen;  // Last datagram from it, or when it was first sent to
+    uint64_t datagramsReceived = 0;
+    uint64_t bytesReceived = 0;
+    std::optional<std::chrono::microseconds> srtt;   // Nothing until the first RTT sample
+    std::chrono::microseconds rttvar{0};
+    double lossRate = 0.0;                           // Exponentially weighted, 0 to 1
+    size_t datagramSize = 0;                         // Set by path MTU discovery; 0 until then
+
+    // Compression negotiation (see Compressor)
+    bool capabilitiesOffered = false;
+    uint8_t codecs = 0;
+    uint32_t dictionaryId = 0;
+};
+
+// Everything the transport knows about each remote endpoint, in one flat table of
+// cache-line-sized entries. Lookups hash a CompactEndpoint under a shared lock and
+// updates are atomic stores into the entry, so receive threads never serialize on it;
+// only the first datagram from a new endpoint takes the exclusive lock.
+//
+// RTT samples and delivery outcomes come from whoever can time a request and its
+// answer: the reliable channels, file transfers and the DHT.
+class ConnectionTable {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Once capacity endpoints are tracked, a new one replaces roughly the least recently seen
+    explicit ConnectionTable(size_t capacity = 65536);
+    void setCapacity(size_t capacity);
+
+    // Receive path: one lookup and a few relaxed stores per call
+    void touch(const CompactEndpoint &remote, size_t bytes, size_t datagrams, Clock::time_point now);
+    // RFC 6298 estimator; concurrent samples are merged without locking
+    void addRttSample(const CompactEndpoint &remote, std::chrono::microseconds sample);
+    void addDeliveries(const CompactEndpoint &remote, size_t delivered, size_t lost);
+
+    std::optional<ConnectionInfo> get(const CompactEndpoint &remote) const;
+    std::optional<std::chrono::microseconds> srtt(const CompactEndpoint &remote) const;
+    // srtt + 4 * rttvar within the reliable channel's bounds, or fallback before any sample
+    std::chrono::microseconds retransmitTimeout(const CompactEndpoint &remote,
+                                                std::chrono::microseconds fallback) const;
+    // The count candidates with the lowest srtt; unmeasured ones follow in their given order
+    std::vector<boost::asio::ip::udp::endpoint> fastest(std::vector<boost::asio::ip::udp::endpoint> candidates,
+                                                        size_t count) const;
+
+    struct CodecState {
+        bool offered = false;
+        uint8_t codecs = 0;
+        uint32_t dictionaryId = 0;
+    };
+    // Marks our capabilities as offered and returns the state from before. Untracked
+    // endpoints report an offer already made and no codecs, so they get neither.
+    CodecState offerCodecs(const CompactEndpoint &remote);
+    void setCodecs(const CompactEndpoint &remote, uint8_t codecs, uint32_t dictionaryId, bool offered);
+
+    // Largest datagram to send to remote (see PathMtu); 0 while unknown
+    size_t datagramSize(const CompactEndpoint &remote) const;
+    void setDatagramSize(const CompactEndpoint &remote, size_t size);
+
+    // Forgets endpoints silent since before cutoff; returns how many
+    size_t expire(Clock::time_point cutoff);
+    size_t size() const;
+
+private:
+    // One cache line per endpoint, so threads updating different peers never share a line
+    struct alignas(64) Entry {
+        CompactEndpoint endpoint;
+        std::atomic<bool> offered{false};
+        std::atomic<uint8_t> codecs{0};
+        std::atomic<uint32_t> dictionaryId{0};
+        std::atomic<uint32_t> lossPpm{0};          // Loss rate in parts per million
+        std::atomic<uint16_t> datagramSize{0};
+        std::atomic<Clock::rep> lastSeen{0};
+        std::atomic<uint64_t> datagrams{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> rtt{0};               // srtt << 32 | rttvar, in microseconds; 0 before any sample
+
+        void reset(const CompactEndpoint &remote, Clock::time_point now);
+    };
+    static_assert(sizeof(Entry) == 64, "Entry should fill exactly one cache line");
+
+    template <typename Update>
+    bool update(const CompactEndpoint &remote, Clock::time_point now, Update &&apply);
+    const Entry *findLocked(const CompactEndpoint &remote) const;
+    uint32_t evictLocked();
+
+    mutable std::shared_mutex mutex;
+    std::unordered_map<CompactEndpoint, uint32_t, CompactEndpointHash> index;
+    std::deque<Entry> entries;        // Deque keeps entries in place as it grows
+    std::vector<uint32_t> freeSlots;  // Entries of expired endpoints, reused before growing
+    size_t capacity;
+    size_t hand = 0;                  // Where the next eviction starts sampling
+};
+
+#endif // CONNECTION_TABLE_H
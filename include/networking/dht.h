@@ -5,42 +5,223 @@
 #ifndef DHT_H
 #define DHT_H
 
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <string_view>
 #include <map>
+#include <optional>
+#include <utility>
 #include <vector>
 #include <mutex>
+#include <functional>
+#include "networking/routing_table.h"
+#include "networking/timer_wheel.h"
 
-struct DHTNode {
-    std::string id;       // Unique node ID
-    std::string ip;       // Node IP address
-    int port;             // Node port
+struct DhtMessage;
+
+// A node that said it can serve the content stored under a key
+struct DHTProvider {
+    std::string ip;
+    int port;
+    std::chrono::steady_clock::time_point lastSeen{};  // Last time the record was received
 };
 
 class DHT {
 public:
-    DHT(const std::string &selfID, const std::string &selfIP, int selfPort);
+    DHT(const std::string &selfID, const std::string &selfIP, int selfPort,
+        TimerService &timers = TimerService::shared());
+    ~DHT();
 
     void addNode(const DHTNode &node);
     void removeNode(const std::string &id);
+    // Local only: throws unless the node or key is already known here
     DHTNode findNode(const std::string &id);
-    void publish(const std::string &key, const std::string &value);
     std::string lookup(const std::string &key);
+    // Up to count known nodes closest to target by XOR distance, this node excluded
+    std::vector<DHTNode> closestNodes(const NodeId &target, size_t count) const;
+    // Stores the pair here and on the BUCKET_SIZE known nodes closest to the key; repeated on
+    // each republish, so the copies there do not expire
+    void publish(const std::string &key, const std::string &value);
+
+    // Iterative Kademlia lookups (FIND_NODE / FIND_VALUE). LOOKUP_ALPHA queries go out at a
+    // time to the closest nodes not yet asked, each answer adding the closer nodes it knows,
+    // until the BUCKET_SIZE closest have all answered or failed. A lookup ends early when the
+    // node or value turns up, and with nothing once timeout passes. done runs exactly once:
+    // at once if the answer is known locally, otherwise from the thread handling incoming
+    // messages or the timer thread, and never once the DHT is destroyed. A node found this
+    // way joins the routing table.
+    void findNode(const std::string &id, std::chrono::milliseconds timeout,
+                  std::function<void(std::optional<DHTNode>)> done);
+    void lookup(const std::string &key, std::chrono::milliseconds timeout,
+                std::function<void(std::optional<std::string>)> done);
     void announceSelf();
-    void handleIncomingMessage(const std::string &message, const std::string &ip, int port);
+    void announceTo(const std::string &ip, int port);
+    // Binary messages (see dht_protocol.h) and the text commands older nodes send
+    void handleIncomingMessage(std::string_view message, const std::string &ip, int port);
 
-    // Get all nodes in the routing table
+    // This node followed by every node in the routing table
     std::vector<DHTNode> getRoutingTable() const;
     void sendMessage(const std::string &message, const std::string &ip, int port);
+    // Asks the node for its routing table: all of it the first time, and from then on only the
+    // nodes it added since the version last received. Answers come a page at a time, each
+    // page requesting the next. Maintenance repeats this every republish interval.
     void discoverNodes(const std::string &bootstrapIP, int bootstrapPort);
+
+    // Records this node as a provider of key and tells every known node; repeated on each
+    // republish for as long as the DHT runs, so other nodes' records do not expire
+    void provide(const std::string &key);
+    void stopProviding(const std::string &key);
+    // Asks the LOOKUP_FANOUT fastest known nodes for their providers of key; answers arrive
+    // through the provider callback
+    void findProviders(const std::string &key);
+    // Providers of key known locally, including this node
+    std::vector<DHTProvider> getProviders(const std::string &key) const;
+    // Called with every PROVIDERS answer, from the thread handling incoming messages
+    void setProviderCallback(std::function<void(const std::string&, const std::vector<DHTProvider>&)> callback);
+
+    // Round trips of DISCOVER and GET_PROVIDERS are reported to onSample; estimate ranks
+    // nodes for lookups, with unmeasured nodes (nullopt) after all measured ones
+    void setRttCallbacks(std::function<void(const std::string&, int, std::chrono::microseconds)> onSample,
+                         std::function<std::optional<std::chrono::microseconds>(const std::string&, int)> estimate);
+
+    static constexpr size_t LOOKUP_FANOUT = 8;
+    static constexpr size_t LOOKUP_ALPHA = 3;
+
+    // Bounds on what other nodes can make this one keep. Keys are content IDs or node names,
+    // values a datagram's worth; a full store or provider list ignores new records until
+    // old ones expire, while refreshes of existing ones always go through.
+    static constexpr size_t MAX_KEY_SIZE = 256;
+    static constexpr size_t MAX_VALUE_SIZE = 1024;
+    static constexpr size_t MAX_STORED_VALUES = 4096;
+    static constexpr size_t MAX_PROVIDERS_PER_KEY = RoutingTable::BUCKET_SIZE;
+    static constexpr size_t MAX_PROVIDER_RECORDS = 16384;
+    // Nodes whose routing tables are kept in sync with
+    static constexpr size_t MAX_TABLE_CURSORS = 64;
+
+    // Discover, Announce and Provide, binary or text, can arrive in floods and are safe to
+    // lose under load, unlike replies such as RoutingTable
+    static bool isDiscoveryMessage(std::string_view message);
+
+    // Sample text of the commands and headers DHT traffic repeats, for Peer::setCompressionDictionary.
+    // Every build derives the same bytes, so nodes agree on it without exchanging it.
+    static std::string compressionDictionary();
+
+    // Transport for outgoing DHT messages; without one, sends go nowhere
+    void setSendCallback(std::function<void(const std::string&, const std::string&, int)> callback);
+    // Logs every message sent and received. Off by default: writing the lines costs more than
+    // handling most messages. Changes to the routing table are always logged.
+    void setDebugLogging(bool enabled);
+
+    // Drops nodes, provider records and stored values not heard from within nodeTimeout and
+    // re-announces this node, its provided keys and its published values every republishInterval,
+    // which should be well below the timeout other nodes use
+    void startMaintenance(std::chrono::seconds nodeTimeout = std::chrono::minutes(15),
+                          std::chrono::seconds republishInterval = std::chrono::minutes(5));
+    void stopMaintenance();
+    size_t expireNodes(std::chrono::steady_clock::time_point now);
+    size_t expireProviders(std::chrono::steady_clock::time_point now);
+    size_t expireValues(std::chrono::steady_clock::time_point now);
 private:
+    void handleBinaryMessage(const DhtMessage &message, const std::string &ip, int port);
+    void handleTextMessage(std::string_view message, const std::string &ip, int port);
+    void relayAnnouncement(const DHTNode &node);
+    void touchNode(const std::string &ip, int port);
+    void addProvider(const std::string &key, const std::string &ip, int port);
+    // STORE is taken only from nodes that have answered a query with its transaction ID
+    void storeValue(std::string_view key, std::string_view value, const std::string &ip, int port);
+    void querySent(const std::string &ip, int port);
+    void answerReceived(const std::string &ip, int port);
+    void reprovide();
+    void syncRoutingTables();
+    std::string routingTablePage(uint32_t transaction, uint32_t epoch, uint64_t since) const;
+
+    struct Candidate {
+        enum class State { Unqueried, Waiting, Answered, Failed };
+        NodeId distance;
+        DHTNode node;
+        State state = State::Unqueried;
+        uint32_t transaction = 0;  // Of the query in flight, while Waiting
+    };
+
+    struct Lookup {
+        std::string target;  // Node ID or key, as sent in queries
+        NodeId key;
+        bool findValue = false;
+        std::vector<Candidate> candidates;  // Increasing distance from key
+        size_t inFlight = 0;
+        std::function<void(std::optional<DHTNode>)> nodeDone;
+        std::function<void(std::optional<std::string>)> valueDone;
+    };
+
+    struct Query {
+        uint64_t lookup;
+        std::chrono::steady_clock::time_point sentAt;
+    };
+
+    // Position in another node's routing table history
+    struct TableCursor {
+        uint32_t epoch;
+        uint64_t version;
+    };
+
+    struct StoredValue {
+        std::string value;
+        std::chrono::steady_clock::time_point lastSeen{};  // Last time the value was stored
+        bool local = false;  // Published here; never expires
+    };
+
+    struct Outgoing {
+        std::string message;
+        std::string ip;
+        int port;
+    };
+
+    void startLookup(Lookup lookup, std::chrono::milliseconds timeout);
+    // Sends queries up to LOOKUP_ALPHA in flight; false once there is nothing left to ask
+    bool advanceLookup(uint64_t id, Lookup &lookup, std::vector<Outgoing> &out);
+    void addCandidates(Lookup &lookup, const std::vector<RoutingTable::Contact> &contacts);
+    void onLookupAnswer(uint32_t transaction, const std::string &ip, int port,
+                        const std::vector<RoutingTable::Contact> &contacts, const std::optional<std::string> &value);
+    void onQueryTimeout(uint32_t transaction);
+    // Removes the lookup and reports the result; call without dhtMutex held
+    void finishLookup(uint64_t id, std::optional<DHTNode> node, std::optional<std::string> value);
+    std::chrono::milliseconds queryTimeout(const std::string &ip, int port) const;
+    std::vector<RoutingTable::Contact> closestWithSelf(const NodeId &target) const;
+    std::string closestNodesMessage(std::string_view transaction, const NodeId &target) const;
+
     std::string selfID;
     std::string selfIP;
     int selfPort;
 
-    std::map<std::string, DHTNode> routingTable; // Maps node ID to node details
-    std::map<std::string, std::string> keyValueStore; // Stores key-value pairs
+    RoutingTable routingTable;  // Other nodes, in k-buckets around nodeIdOf(selfID)
+    std::map<std::string, StoredValue> keyValueStore; // Stores key-value pairs
+    std::map<std::string, std::vector<DHTProvider>> providerStore;  // Content key to its providers
+    size_t providerRecords = 0;  // Across all keys in providerStore
+    std::vector<std::string> providedKeys;  // Keys this node provides itself
     mutable std::mutex dhtMutex;
+    std::function<void(const std::string&, const std::string&, int)> sendCallback;
+    std::function<void(const std::string&, const std::vector<DHTProvider>&)> providerCallback;
+    std::function<void(const std::string&, int, std::chrono::microseconds)> rttSampleCallback;
+    std::function<std::optional<std::chrono::microseconds>(const std::string&, int)> rttEstimator;
+    // Outstanding DISCOVER and GET_PROVIDERS queries by node, to time their answers
+    std::map<std::pair<std::string, int>, std::chrono::steady_clock::time_point> queriesSent;
+    // Nodes that answered a lookup query or DISCOVER with its transaction ID, with the time of
+    // their last answer; a spoofed source cannot see the ID, so it cannot get in here
+    std::map<std::pair<std::string, int>, std::chrono::steady_clock::time_point> answeredBy;
+    // Routing table versions received from the nodes discovered through, dropped as they expire
+    std::map<std::pair<std::string, int>, TableCursor> tableCursors;
+    // Transaction of the outstanding DISCOVER to each node, which its next page must carry
+    std::map<std::pair<std::string, int>, uint32_t> discoveriesSent;
+
+    TimerService &timers;
+    std::atomic<bool> debugLogging{false};
+    std::chrono::seconds nodeTimeout{0};  // Zero until maintenance starts
 
+    std::map<uint64_t, Lookup> lookups;  // Also the owner tag of lookup timers
+    std::map<uint32_t, Query> queries;   // Lookup queries in flight by transaction ID
+    uint64_t nextLookup = 1;
+    uint32_t nextTransaction = 1;
 };
 
 #endif // DHT_H
\ No newline at end of file
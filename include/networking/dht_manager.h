@@ -6,6 +6,7 @@
 #define DHT_MANAGER_H
 
 #include <libtorrent/session.hpp>
+#include <chrono>
 #include <string>
 #include <utility> // for std::pair
 
@@ -22,8 +23,9 @@ public:
     // Announce username with public IP and port
     void announceUsername(const std::string& username, const std::string& publicIP, int publicPort);
 
-    // Find peer by username
-    std::pair<std::string, int> findPeer(const std::string& username);
+    // Find peer by username; returns {"", 0} if the DHT has not answered within timeout
+    std::pair<std::string, int> findPeer(const std::string& username,
+                                         std::chrono::milliseconds timeout = std::chrono::seconds(10));
 };
 
 #endif
\ No newline at end of file
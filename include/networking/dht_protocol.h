@@ -0,0 +1,109 @@
+//
+// Created by Omer Mersin on 11/28/24.
+//
+
+#ifndef DHT_PROTOCOL_H
+#define DHT_PROTOCOL_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "networking/framing.h"
+#include "networking/routing_table.h"
+
+// Binary DHT messages. Every message starts with a fixed header:
+//   magic (0xFF), version, type, transaction ID (u32, big-endian)
+// 0xFF never occurs in UTF-8 and differs from FRAME_MAGIC, so these share the transport
+// with chat and the legacy text DHT commands without being mistaken for either.
+//
+// Node lists hold compact records: node ID (20 bytes), address (4 or 16 bytes) and port,
+// 26 bytes for IPv4 and 38 for IPv6. A list is a u16 count of IPv4 records, those records,
+// and IPv6 records up to the end of the message. Endpoint lists have the same layout
+// without the node IDs (6 and 18 bytes). Keys are a u16 length and the key bytes.
+constexpr uint8_t DHT_MAGIC = 0xFF;
+constexpr uint8_t DHT_PROTOCOL_VERSION = 1;
+constexpr size_t DHT_HEADER_SIZE = 7;
+constexpr size_t NODE_RECORD_V4_SIZE = 26;
+constexpr size_t NODE_RECORD_V6_SIZE = 38;
+// Records per RoutingTablePage; keeps an all-IPv6 page within a 1200-byte datagram
+constexpr size_t ROUTING_PAGE_NODES = 28;
+constexpr size_t TABLE_CURSOR_SIZE = 12;
+
+enum class DhtMessageType : uint8_t {
+    Discover = 1,      // Sender's node ID, optionally followed by a table cursor: the epoch (u32)
+                       // and version (u64) of the responder's table it last synced to. Answered
+                       // with RoutingTablePage when the cursor is there, else with RoutingTable
+    RoutingTable = 2,  // Node list: the responder and its routing table
+    Announce = 3,      // Hop count (u8), the announced node's record, then its name
+    Provide = 4,       // Key
+    GetProviders = 5,  // Key; answered with Providers
+    Providers = 6,     // Key, then an endpoint list
+    FindNode = 7,      // Target node ID (20 bytes); answered with Nodes
+    FindValue = 8,     // Key; answered with Value or Nodes
+    Nodes = 9,         // Node list: the closest the responder knows
+    Value = 10,        // The value, up to the end of the message
+    Store = 11,        // Key, then the value up to the end of the message
+    RoutingTablePage = 12,  // Table cursor the page brings the requester up to, whether more pages
+                            // follow (u8), then a node list of the nodes added since the requested
+                            // version (led by the responder when the requester starts afresh)
+};
+
+// A view of a received message; body points into the datagram it was decoded from
+struct DhtMessage {
+    DhtMessageType type;
+    uint32_t transaction;
+    std::string_view body;
+};
+
+struct NodeRecord {
+    NodeId id;
+    std::array<uint8_t, 16> address;  // IPv4 uses the first 4 bytes
+    bool v4;
+    uint16_t port;
+
+    std::string ip() const;
+};
+
+inline bool isDhtMessage(std::string_view datagram) {
+    return !datagram.empty() && static_cast<uint8_t>(datagram[0]) == DHT_MAGIC;
+}
+
+// Nothing unless the header is complete and of a version this node speaks
+std::optional<DhtMessage> decodeDhtMessage(std::string_view datagram);
+// Reads a key at the front of body and advances body past it
+std::optional<std::string_view> readDhtKey(std::string_view &body);
+bool readNodeRecord(std::string_view &body, bool v4, bool withId, NodeRecord &record);
+// True if list is a whole node list (withId) or endpoint list
+bool isRecordList(std::string_view list, bool withId);
+
+// Calls visit(const NodeRecord &) for each record straight from the buffer. Endpoint lists
+// give records with a zero ID. False, having visited nothing, if the list is malformed.
+template<typename Visit>
+bool forEachRecord(std::string_view list, bool withId, Visit &&visit) {
+    if (!isRecordList(list, withId)) {
+        return false;
+    }
+    size_t v4Count = readU16(list.data());
+    list.remove_prefix(2);
+    NodeRecord record;
+    for (size_t i = 0; !list.empty(); i++) {
+        readNodeRecord(list, i < v4Count, withId, record);
+        visit(record);
+    }
+    return true;
+}
+
+void appendDhtHeader(std::string &out, DhtMessageType type, uint32_t transaction = 0);
+void appendDhtKey(std::string &out, std::string_view key);
+// Nodes whose ip is not an address literal are left out
+void appendNodeList(std::string &out, const std::vector<DHTNode> &nodes);
+void appendNodeList(std::string &out, const std::vector<RoutingTable::Contact> &contacts);
+void appendEndpointList(std::string &out, const std::vector<std::pair<std::string, int>> &endpoints);
+// False, appending nothing, if ip is not an address literal
+bool appendNodeRecord(std::string &out, const NodeId &id, const std::string &ip, int port, bool withId = true);
+
+#endif // DHT_PROTOCOL_H
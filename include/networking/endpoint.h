@@ -0,0 +1,89 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 18-byte binary address: IPv6 bytes (IPv4 stored as v4-mapped) plus port.
+// Cheap to copy, compare and hash, unlike an "ip" string + int port pair.
+struct CompactEndpoint {
+    std::array<uint8_t, 16> address{};
+    uint16_t port = 0;
+
+    static CompactEndpoint fromUdp(const boost::asio::ip::udp::endpoint &endpoint);
+    boost::asio::ip::udp::endpoint toUdp() const;
+    bool isV4() const;
+    std::string toString() const;
+
+    bool operator==(const CompactEndpoint &other) const {
+        return port == other.port && address == other.address;
+    }
+    bool operator!=(const CompactEndpoint &other) const { return !(*this == other); }
+};
+
+struct CompactEndpointHash {
+    size_t operator()(const CompactEndpoint &endpoint) const;
+};
+
+using EndpointHandle = uint32_t;
+constexpr EndpointHandle INVALID_ENDPOINT = UINT32_MAX;
+
+// Resolves "ip", port pairs to parsed endpoints once. Later lookups hash the ip
+// string without parsing or allocating, and callers that keep the handle skip
+// the lookup altogether.
+//
+// Holds at most capacity endpoints. Past that, one not used recently is evicted,
+// chosen by the CLOCK approximation of LRU so that lookups stay under the shared
+// lock. A handle carries its slot's generation, so once its endpoint is evicted
+// get() throws rather than returning whichever endpoint took the slot.
+class EndpointCache {
+public:
+    // Slot indexes take the low 20 bits of a handle; the last one would make INVALID_ENDPOINT
+    static constexpr size_t MAX_CAPACITY = (size_t(1) << 20) - 1;
+
+    explicit EndpointCache(size_t capacity = 65536);
+    // Evicts down to the new capacity, clamped to MAX_CAPACITY
+    void setCapacity(size_t capacity);
+
+    // Throws boost::system::system_error if ip is not a valid address
+    EndpointHandle resolve(const std::string &ip, int port);
+    // Throws std::out_of_range for unknown or evicted handles
+    boost::asio::ip::udp::endpoint get(EndpointHandle handle) const;
+    size_t size() const;
+
+private:
+    struct Slot {
+        boost::asio::ip::udp::endpoint endpoint;
+        std::string ip;
+        int port = 0;
+        uint32_t generation = 0;
+        bool used = false;
+        mutable std::atomic<bool> referenced{false};  // Set by lookups, cleared by the clock hand
+    };
+
+    Slot *find(EndpointHandle handle) const;
+    size_t victim();
+    void evict(size_t index);
+
+    mutable std::shared_mutex mutex;
+    size_t capacity;
+    size_t count = 0;
+    size_t hand = 0;  // Next slot the clock inspects
+    std::unordered_map<std::string, std::vector<std::pair<int, EndpointHandle>>> byAddress;
+    std::deque<Slot> slots;  // Deque, since slots hold atomics and must not move
+    std::vector<size_t> freeSlots;  // Emptied by a capacity cut
+};
+
+#endif // ENDPOINT_H
@@ -0,0 +1,71 @@
+//
+// Created by Omer Mersin on 11/19/24.
+//
+
+#ifndef FRAGMENTATION_H
+#define FRAGMENTATION_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Fragment frame: magic, type, message id (u32), fragment index (u16), fragment count (u16)
+constexpr size_t FRAGMENT_HEADER_SIZE = 10;
+
+class Fragmenter {
+public:
+    // Splits message into Fragment frames of at most maxDatagramSize bytes each
+    static std::vector<std::string> split(const std::string &message, uint32_t messageId, size_t maxDatagramSize);
+};
+
+// Collects fragments per (sender, message id) until a message is complete.
+// Memory is bounded: incomplete messages expire after a timeout, and the
+// oldest ones are evicted once their total footprint, payload and per-fragment
+// bookkeeping alike, exceeds the budget. A header announcing more fragments than
+// a maxMessageSize message split into minFragmentPayload pieces is rejected.
+class Reassembler {
+public:
+    Reassembler(size_t maxBufferedBytes, size_t maxMessageSize, size_t minFragmentPayload,
+                std::chrono::milliseconds timeout);
+
+    // Returns the full message once its last missing fragment arrives
+    std::optional<std::string> add(const boost::asio::ip::udp::endpoint &sender, const char *frame, size_t len);
+
+    size_t bufferedBytes() const;
+    uint64_t expiredMessages() const;
+
+private:
+    using Key = std::pair<boost::asio::ip::udp::endpoint, uint32_t>;
+    struct Partial {
+        std::vector<std::string> fragments;
+        size_t received = 0;
+        size_t bytes = 0;
+        std::chrono::steady_clock::time_point firstSeen;
+        std::list<Key>::iterator arrival;
+    };
+
+    void expire(std::chrono::steady_clock::time_point now);
+    void evictOldest();
+    void erase(std::map<Key, Partial>::iterator it);
+    static size_t overhead(const Partial &partial);
+
+    size_t maxBufferedBytes;
+    size_t maxMessageSize;
+    size_t maxFragments;
+    std::chrono::milliseconds timeout;
+
+    mutable std::mutex mutex;
+    std::map<Key, Partial> partials;
+    std::list<Key> arrivals;  // Keys of partials, oldest first
+    size_t buffered = 0;
+    uint64_t expired = 0;
+    std::chrono::steady_clock::time_point lastSweep;
+};
+
+#endif // FRAGMENTATION_H
@@ -0,0 +1,73 @@
+//
+// Created by Omer Mersin on 11/19/24.
+//
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Every transport-level frame starts with FRAME_MAGIC followed by a FrameType byte.
+// 0xFE never occurs in UTF-8 text, so plain text messages (chat, DHT commands)
+// are still sent unframed and cannot be mistaken for a frame.
+constexpr uint8_t FRAME_MAGIC = 0xFE;
+constexpr size_t FRAME_HEADER_SIZE = 2;
+
+enum class FrameType : uint8_t {
+    Fragment = 1,   // One piece of a message larger than a datagram
+    Reliable = 2,   // Sequenced payload on a reliable channel
+    Ack = 3,        // Cumulative + selective acknowledgement for a reliable channel
+    Bundle = 4,     // Several small messages coalesced into one datagram
+    Compressed = 5, // Payload compressed with a codec both sides offered
+    Capabilities = 6, // Codecs and dictionary a peer can decompress
+    Transfer = 7,   // File transfer message, handed to the transfer handler
+    Probe = 8,      // Padded path MTU probe (see PathMtu)
+    ProbeAck = 9,   // Answer to a probe that arrived whole
+    Reset = 10,     // Receiver has no state for a reliable channel's epoch; the sender restarts it
+};
+
+inline bool isFrame(const char *data, size_t len) {
+    return len >= FRAME_HEADER_SIZE && static_cast<uint8_t>(data[0]) == FRAME_MAGIC;
+}
+
+inline FrameType frameType(const char *data) {
+    return static_cast<FrameType>(static_cast<uint8_t>(data[1]));
+}
+
+inline void appendFrameHeader(std::string &out, FrameType type) {
+    out.push_back(static_cast<char>(FRAME_MAGIC));
+    out.push_back(static_cast<char>(type));
+}
+
+// Big-endian field helpers shared by the frame encoders
+inline void appendU16(std::string &out, uint16_t value) {
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+inline void appendU32(std::string &out, uint32_t value) {
+    appendU16(out, static_cast<uint16_t>(value >> 16));
+    appendU16(out, static_cast<uint16_t>(value));
+}
+
+inline void appendU64(std::string &out, uint64_t value) {
+    appendU32(out, static_cast<uint32_t>(value >> 32));
+    appendU32(out, static_cast<uint32_t>(value));
+}
+
+inline uint16_t readU16(const char *data) {
+    const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+    return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+inline uint32_t readU32(const char *data) {
+    return static_cast<uint32_t>(readU16(data)) << 16 | readU16(data + 2);
+}
+
+inline uint64_t readU64(const char *data) {
+    return static_cast<uint64_t>(readU32(data)) << 32 | readU32(data + 4);
+}
+
+#endif // FRAMING_H
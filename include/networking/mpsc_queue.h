@@ -0,0 +1,104 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// Bounded lock-free queue for many producers and one consumer (Vyukov's array queue).
+// Each cell carries a sequence number that tells producers and the consumer whose turn
+// it is, so a push or pop is one CAS or one load plus a store, with no allocation.
+template<typename T>
+class MpscQueue {
+public:
+    explicit MpscQueue(size_t capacity) : mask(roundUp(capacity) - 1), cells(new Cell[mask + 1]) {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Returns false, leaving value untouched, when the queue is full.
+    bool tryPush(T &&value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only
+    bool tryPop(T &value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        Cell &cell = cells[position & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(position + mask + 1, std::memory_order_release);
+        head.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer thread only. Moves up to max items onto out and returns how many.
+    size_t drain(std::vector<T> &out, size_t max = SIZE_MAX) {
+        size_t count = 0;
+        T value;
+        while (count < max && tryPop(value)) {
+            out.push_back(std::move(value));
+            count++;
+        }
+        return count;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // Approximate while producers are active
+    size_t size() const {
+        size_t consumed = head.load(std::memory_order_relaxed);
+        size_t produced = tail.load(std::memory_order_relaxed);
+        return produced > consumed ? produced - consumed : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t roundUp(size_t capacity) {
+        if (capacity == 0) {
+            throw std::invalid_argument("Queue capacity must be positive.");
+        }
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<size_t> head{0};  // Written by the consumer only
+};
+
+#endif // MPSC_QUEUE_H
@@ -5,11 +5,39 @@
 #ifndef NAT_H
 #define NAT_H
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <string>
+#include "networking/timer_wheel.h"
 
 class NAT {
 public:
+    // Sends one datagram from the socket whose mapping should be opened or kept alive
+    using SendFunction = std::function<void(const std::string &message, const std::string &ip, int port)>;
+
+    // Payload of punch and keepalive datagrams; receivers only note that the sender is alive
+    static constexpr const char *KEEPALIVE = "KEEPALIVE";
+
+    explicit NAT(TimerService &timers = TimerService::shared());
+    ~NAT();
+
+    void setSendFunction(SendFunction send);
     void punchHole(const std::string &ip, int port);
+
+    // Re-sends a keepalive every interval so the NAT mapping towards ip:port does not time out.
+    // Typical UDP mappings last 30 s or more, so the default leaves room for one lost datagram.
+    void startKeepAlive(const std::string &ip, int port, std::chrono::seconds interval = std::chrono::seconds(15));
+    void stopKeepAlive(const std::string &ip, int port);
+
+private:
+    void sendKeepAlive(const std::string &ip, int port);
+
+    TimerService &timers;
+    std::mutex natMutex;
+    SendFunction send;
+    std::map<std::pair<std::string, int>, TimerId> keepAlives;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,104 @@
+//
+// Created by Omer Mersin on 11/27/24.
+//
+
+#ifndef PATH_MTU_H
+#define PATH_MTU_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Probe frame: magic, type, probe id (u32), probed size (u16), zero padding up to that size.
+// ProbeAck frame: magic, type, echoed probe id (u32), echoed size (u16).
+constexpr size_t PROBE_HEADER_SIZE = 8;
+
+// Packetization-layer path MTU discovery (RFC 8899) towards each destination. A probe is
+// a datagram padded to the size under test and sent with DF set; the receiver answers only
+// if it arrived whole, so an answer proves the size crosses the path end to end. Probes
+// carry no application data, so a lost one costs a timer rather than a message.
+//
+// A search tries the largest size first, then the configured size, then the base size,
+// and binary-searches between whatever worked and what did not. Destinations that never
+// answer (peers without probe support) keep the configured size. Finished searches are
+// repeated after the raise interval so a path that changed is picked up again.
+class PathMtu {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Output {
+        std::vector<std::pair<boost::asio::ip::udp::endpoint, std::string>> probes;  // Frames to send
+        std::vector<std::pair<boost::asio::ip::udp::endpoint, size_t>> sizes;       // New datagram sizes
+        std::vector<std::pair<boost::asio::ip::udp::endpoint, std::chrono::microseconds>> rttSamples;
+    };
+
+    // Sizes are UDP payload bytes. initialSize is used until a search says otherwise.
+    PathMtu(size_t baseSize, size_t initialSize, size_t maxSize, Clock::duration raiseInterval);
+
+    // Starts a search towards destination unless one exists; probeTimeout is how long to wait
+    // for each answer until the first one gives an RTT to go by. Returns the size to send with meanwhile.
+    size_t start(const boost::asio::ip::udp::endpoint &destination, Clock::duration probeTimeout,
+                 Clock::time_point now, Output &out);
+    void onAck(const boost::asio::ip::udp::endpoint &source, const char *frame, size_t len,
+               Clock::time_point now, Output &out);
+    // The local stack refused the probe outright (EMSGSIZE), which rules the size out at once
+    void onTooBig(const boost::asio::ip::udp::endpoint &destination, const std::string &probe,
+                  Clock::time_point now, Output &out);
+    void onTimer(Clock::time_point now, Output &out);
+
+    std::optional<Clock::time_point> nextDeadline() const;
+    // Forgets every destination keep rejects; returns how many
+    size_t retain(const std::function<bool(const boost::asio::ip::udp::endpoint &)> &keep);
+
+    // The ProbeAck for a probe that arrived intact; nothing if it was truncated or malformed
+    static std::optional<std::string> answer(const char *frame, size_t len);
+
+    // Unanswered probes of one size before the size is given up on
+    static constexpr int PROBE_ATTEMPTS = 3;
+    // A search stops once the untested range is narrower than this
+    static constexpr size_t GRANULARITY = 16;
+
+private:
+    enum class Stage { Max, Initial, Base, Binary, Done };
+
+    struct Search {
+        Stage stage = Stage::Max;
+        size_t low = 0;          // Largest size known to work, once verified
+        size_t high = 0;         // Largest size not yet ruled out
+        bool verified = false;
+        size_t published = 0;    // Size last reported in Output::sizes
+        size_t probing = 0;      // Size of the probe in flight
+        uint32_t firstProbeId = 0;  // Ids from here to probeId are attempts at the current size
+        uint32_t probeId = 0;
+        int attempts = 0;
+        Clock::duration timeout{};
+        Clock::time_point sentAt;    // First attempt at the current size
+        Clock::time_point deadline;  // Probe timeout, or when a finished search starts over
+    };
+
+    void restart(Search &search);
+    void advance(const boost::asio::ip::udp::endpoint &destination, Search &search, Clock::time_point now,
+                 Output &out);
+    void fail(const boost::asio::ip::udp::endpoint &destination, Search &search, Clock::time_point now,
+              Output &out);
+    void sendProbe(const boost::asio::ip::udp::endpoint &destination, Search &search, Clock::time_point now,
+                   Output &out);
+    void publish(const boost::asio::ip::udp::endpoint &destination, Search &search, Output &out);
+
+    size_t baseSize;
+    size_t initialSize;
+    size_t maxSize;
+    Clock::duration raiseInterval;
+
+    mutable std::mutex mutex;
+    std::map<boost::asio::ip::udp::endpoint, Search> searches;
+    uint32_t nextProbeId = 1;
+};
+
+#endif // PATH_MTU_H
@@ -6,18 +6,168 @@
 #define PEER_H
 
 #include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <optional>
+#include <vector>
+#include "networking/batch_io.h"
+#include "networking/buffer_pool.h"
+#include "networking/coalescer.h"
+#include "networking/compression.h"
+#include "networking/connection_table.h"
+#include "networking/endpoint.h"
+#include "networking/fragmentation.h"
+#include "networking/mpsc_queue.h"
+#include "networking/path_mtu.h"
+#include "networking/reliable_channel.h"
+#include "networking/timer_wheel.h"
+#include "networking/timestamps.h"
+#include "networking/uring_receiver.h"
+#include "networking/wakeup.h"
+
+// Load-shedding class of a received message. Under pressure Bulk is dropped first,
+// then Normal; Critical is only lost when the inbound queue is completely full.
+enum class MessagePriority { Bulk, Normal, Critical };
+
+// Transport tunables. Apply with Peer::setConfig() before startListening().
+struct PeerConfig {
+    size_t batchSize = 1;   // Datagrams per recvmmsg/sendmmsg call; 1 disables batching
+    size_t ioThreads = 0;   // Threads running the io_context; 0 keeps the blocking listener thread
+    size_t shards = 1;      // SO_REUSEPORT sockets on the bound port, each with its own pinned listener
+    size_t bufferSlabs = 4096;  // Receive slabs pre-allocated for the span-based message callback
+    bool ioUring = false;   // Receive with io_uring multishot recvmsg (Linux); falls back to recvmmsg if unavailable
+    bool udpOffload = true; // UDP_SEGMENT for multi-datagram sends and UDP_GRO in the recvmmsg listener, if supported
+
+    // Framing: messages larger than one datagram are split into fragments and reassembled
+    size_t maxDatagramSize = 1472;                      // Ethernet MTU minus IPv4 and UDP headers
+    size_t maxMessageSize = 1 << 20;                    // Largest message accepted for reassembly
+    size_t reassemblyBytes = 16 << 20;                  // Budget for all incomplete messages together
+    std::chrono::milliseconds reassemblyTimeout{5000};  // Incomplete messages are dropped after this
+
+    // Longest a coalesced message waits for others to the same destination
+    std::chrono::microseconds coalesceDelay{5000};
+
+    // Backpressure: inbound queue depths at which each priority starts being shed
+    size_t shedBulkDepth = 1024;
+    size_t shedNormalDepth = 3072;
+    int receiveBufferBytes = 0;  // SO_RCVBUF for every receive socket; 0 keeps the kernel default
+
+    // Compression is negotiated per destination; only codecs compiled in are offered
+    bool compression = false;
+    size_t compressionThreshold = 48;  // Payloads shorter than this are always sent as they are
+
+    // Per-endpoint state (RTT, loss, codecs) is kept for at most this many endpoints and
+    // forgotten after connectionIdleTimeout without traffic from them. Resolved send
+    // addresses (see resolveEndpoint) are capped at the same count.
+    size_t maxConnections = 65536;
+    std::chrono::seconds connectionIdleTimeout{600};
+    // Reliable channels are opened by sendReliable() or an incoming Reliable frame. Beyond
+    // this many the least recently used is closed, and channels with nothing in flight are
+    // closed after connectionIdleTimeout.
+    size_t maxReliableChannels = 1024;
+
+    // Path MTU discovery (see PathMtu): fragmentation, coalescing and compression size each
+    // destination's datagrams by what probing confirmed instead of maxDatagramSize. Everything
+    // is then sent with DF set, and receive buffers grow to hold maxProbedDatagramSize.
+    // Transfer frames handed to sendFrames() keep their own size.
+    bool pathMtuDiscovery = false;
+    size_t minDatagramSize = 1200;          // Assumed to cross any path (RFC 8899 BASE_PLPMTU)
+    size_t maxProbedDatagramSize = 8972;    // Jumbo frame MTU minus IPv4 and UDP headers
+    std::chrono::seconds pathMtuRaiseInterval{600};  // Finished searches are repeated after this
+
+    // Stamp received messages (see ReceiveTimestamps), including the kernel's own arrival
+    // time. The io thread pool then has a single reader that drains the socket with recvmmsg
+    // once it is readable, to get the stamps along with the datagrams, instead of one
+    // async_receive_from per io thread.
+    bool receiveTimestamps = false;
+};
+
+// Snapshot of transport counters. Occupancy is the average fraction of each
+// batch that was actually filled, so 1.0 means every syscall moved batchSize datagrams.
+struct PeerStats {
+    size_t batchSize = 1;
+    uint64_t receiveCalls = 0;
+    uint64_t datagramsReceived = 0;
+    uint64_t sendCalls = 0;
+    uint64_t datagramsSent = 0;
+    uint64_t poolExhausted = 0;  // Datagrams dropped because every receive slab was leased out
+    uint64_t messagesReassembled = 0;
+    uint64_t reassemblyExpired = 0;  // Incomplete messages dropped on timeout or memory pressure
+    uint64_t reliableRetransmits = 0;
+    uint64_t coalescedMessages = 0;
+    uint64_t coalescedDatagrams = 0;  // Datagrams that carried the coalesced messages
+    uint64_t segmentedSends = 0;  // sendmsg calls that handed the kernel several datagrams via UDP_SEGMENT
+    uint64_t groMerged = 0;       // Received buffers holding several datagrams merged by UDP_GRO
+    uint64_t inboundDropped = 0;  // Messages dropped because the inbound queue was full
+    uint64_t shedBulk = 0;        // Bulk messages shed past shedBulkDepth
+    uint64_t shedNormal = 0;      // Normal messages shed past shedNormalDepth
+    uint64_t kernelDrops = 0;     // Datagrams the kernel dropped on a full socket receive buffer
+    uint64_t compressedPayloads = 0;
+    uint64_t compressionSaved = 0;  // Bytes kept off the wire by compression
+    uint64_t mtuProbes = 0;         // Path MTU probes sent
+
+    // Latency totals over the messages passed to Peer::recordLatency(), in nanoseconds
+    uint64_t latencySamples = 0;
+    uint64_t kernelQueueNanos = 0;
+    uint64_t dispatchNanos = 0;
+    uint64_t decryptNanos = 0;
+    uint64_t handlingNanos = 0;
+
+    double receiveOccupancy() const;
+    double sendOccupancy() const;
+};
 
 class Peer {
 public:
-    Peer();
+    // Retransmit and coalescing deadlines are scheduled on timers
+    explicit Peer(TimerService &timers = TimerService::shared());
     ~Peer();
 
     void bind(int localPort);
     void sendMessage(const std::string &message, const std::string &ip, int port);
+
+    // Parses ip once (throws if invalid); keep the handle to send to the same peer without any lookup.
+    // A handle whose endpoint was evicted from the cache (see maxConnections) sends nothing.
+    EndpointHandle resolveEndpoint(const std::string &ip, int port);
+    void sendMessage(const std::string &message, EndpointHandle destination);
+
+    // Bulk transfer to one destination. Same-sized datagrams (file chunks, fragments of large
+    // messages) leave as UDP_SEGMENT super-datagrams when the kernel supports it.
+    void sendBulk(const std::vector<std::string> &messages, const std::string &ip, int port);
+    void sendBulk(const std::vector<std::string> &messages, EndpointHandle destination);
+
+    // Batched sends: messages are held until the batch fills or flushMessages() is called
+    void queueMessage(const std::string &message, const std::string &ip, int port);
+    void flushMessages();
+
+    // Small messages to the same destination share a datagram, delayed by at most
+    // PeerConfig::coalesceDelay. Deadlines are enforced while the peer is listening.
+    void sendCoalesced(const std::string &message, const std::string &ip, int port);
+    void flushCoalesced();
+
+    // Acknowledged, ordered delivery with retransmission and congestion control
+    void sendReliable(const std::string &message, const std::string &ip, int port);
+    std::optional<ReliableChannel::Stats> getReliableStats(const std::string &ip, int port) const;
+
+    // Non-blocking send. The handler runs on an io thread once the datagram is handed to the kernel.
+    using SendHandler = std::function<void(const boost::system::error_code&, size_t)>;
+    void asyncSendMessage(const std::string &message, const std::string &ip, int port,
+                          SendHandler handler = nullptr);
     void startListening();
+    // Returns promptly: blocked listeners are woken rather than left waiting for a datagram
     void stopListening();
+    // Moves to localPort without dropping queued outbound traffic; listening resumes if it was active
+    void rebind(int localPort);
     std::pair<std::string, int> getPublicAddress(const std::string &stunServer, int port);
 
     // Encryption methods
@@ -28,14 +178,239 @@ public:
     // Callback for received messages
     void setMessageCallback(std::function<void(const std::string&, const std::string&, int)> callback);
 
+    // Zero-copy alternative: the view points into a pooled slab that stays valid for as
+    // long as the consumer holds the lease. Leases must be released before the Peer is destroyed.
+    using MessageViewCallback = std::function<void(std::string_view, const boost::asio::ip::udp::endpoint&,
+                                                   BufferLease)>;
+    void setMessageCallback(MessageViewCallback callback);
+
+    // Queued delivery: instead of running a callback per message on the listener threads,
+    // messages wait in a bounded lock-free queue for one consumer to drain in bursts. notify
+    // runs on a listener thread whenever the queue gains messages after being drained, so a
+    // consumer on another thread wakes once per burst. Takes precedence over the callbacks.
+    // drainInbound() is for the consumer thread only; if it returns max, drain again.
+    struct InboundMessage {
+        boost::asio::ip::udp::endpoint sender;
+        BufferLease payload;
+        ReceiveTimestamps times;  // Only stamped with PeerConfig::receiveTimestamps
+    };
+    void setInboundQueue(size_t capacity, std::function<void()> notify);
+    size_t drainInbound(std::vector<InboundMessage> &out, size_t max = SIZE_MAX);
+
+    // Adds a drained message's stages to the latency totals in PeerStats, once the
+    // consumer has stamped its own decrypted and handled times
+    void recordLatency(const ReceiveTimestamps &times);
+
+    // Decides what to shed once the inbound queue backs up; only consulted under pressure.
+    // Without one, every message is Normal.
+    using PriorityClassifier = std::function<MessagePriority(std::string_view)>;
+    void setPriorityClassifier(PriorityClassifier classifier);
+
+    // Transfer frames (see transfer/file_transfer.h) bypass the message path and go to this
+    // handler on the listener threads. Set before startListening().
+    using FrameHandler = std::function<void(const char*, size_t, const boost::asio::ip::udp::endpoint&)>;
+    void setTransferHandler(FrameHandler handler);
+    // Ready-made frames, one per datagram and each within maxDatagramSize, sent exactly as
+    // given: no compression, coalescing or fragmentation. Same-sized runs go out through GSO.
+    void sendFrames(const std::vector<std::string_view> &frames, const boost::asio::ip::udp::endpoint &destination);
+    // Largest datagram sent to destination: what path MTU discovery confirmed, else maxDatagramSize
+    size_t datagramLimit(const boost::asio::ip::udp::endpoint &destination);
+
+    // Shared dictionary for small payloads (see Compressor::setDictionary); only used
+    // towards peers that loaded the same one. Set before sending or listening.
+    void setCompressionDictionary(std::string dictionary);
+
+    // Per-endpoint RTT, loss and last-seen state. Layers above that time their own requests
+    // (file transfers, DHT lookups) feed samples in and use it to pick timeouts and peers.
+    ConnectionTable &connections() { return connectionTable; }
+    const ConnectionTable &connections() const { return connectionTable; }
+
+    void setConfig(const PeerConfig &config);
+
+    PeerStats getStats() const;               // Totals across all shards
+    std::vector<PeerStats> getShardStats() const;
+
 private:
+    // One outstanding async_receive_from per io thread, each with its own buffer
+    struct ReceiveSlot {
+        std::vector<char> buffer;
+        BufferLease lease;
+        boost::asio::ip::udp::endpoint sender;
+    };
+
+    // Extra SO_REUSEPORT socket; shard 0 is the Peer's own socket
+    struct ReceiveShard {
+        explicit ReceiveShard(boost::asio::io_context &io) : socket(io) {}
+        boost::asio::ip::udp::socket socket;
+        std::thread thread;
+        std::atomic<uint64_t> receiveCalls{0};
+        std::atomic<uint64_t> datagramsReceived{0};
+    };
+
+    struct ReliablePeer {
+        explicit ReliablePeer(uint32_t epoch) : channel(epoch) {}
+        std::mutex mutex;
+        ReliableChannel channel;
+        std::optional<ReliableChannel::Clock::time_point> armedFor;  // Earliest timer pending for the channel
+        ReliableChannel::Clock::time_point lastUsed;  // Guarded by channelsMutex
+    };
+
     boost::asio::io_context io_context;
     boost::asio::ip::udp::socket socket;
+    std::vector<std::unique_ptr<ReceiveShard>> extraShards;
+    // Asynchronous operations on socket are only started from here. Synchronous sends bypass
+    // the socket object and go to its descriptor (sendDatagram, SendBatch, SegmentedSend), so
+    // they may run on any thread while the io pool is running.
+    boost::asio::strand<boost::asio::io_context::executor_type> ioStrand;
+    std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> ioWork;
+    std::vector<std::thread> ioPool;
+    // Asynchronous sends posted but not yet completed; the last to complete signals sendsDrained
+    size_t pendingSends = 0;
+    std::mutex pendingMutex;
+    std::condition_variable sendsDrained;
+    std::vector<std::unique_ptr<ReceiveSlot>> receiveSlots;
+    std::unique_ptr<ReceiveBatch> timestampBatch;  // Replaces the slots with PeerConfig::receiveTimestamps
+
+    // Asynchronous sends hold this shared while they start; rebind() takes it to switch sockets.
+    // Sends made meanwhile wait in deferredSends and go out from the new socket.
+    struct DeferredSend {
+        std::string message;
+        std::string ip;
+        int port;
+        SendHandler handler;
+    };
+    std::shared_mutex rebindMutex;
+    bool rebinding = false;  // Guarded by rebindMutex
+    std::mutex deferredMutex;
+    std::vector<DeferredSend> deferredSends;
     std::thread listenerThread;
-    bool running;
+    std::atomic<bool> running{false};
+    Wakeup stopWake;  // Signalled to interrupt blocked listeners
     std::string sharedKey; // Shared encryption key
     // Callback function for message notifications
     std::function<void(const std::string&, const std::string&, int)> messageCallback;
+
+    MessageViewCallback messageViewCallback;
+    std::unique_ptr<BufferPool> bufferPool;
+    std::atomic<uint64_t> poolExhausted{0};
+
+    // Declared after the pool so queued leases are released before it goes away
+    std::unique_ptr<MpscQueue<InboundMessage>> inbound;
+    std::function<void()> inboundNotify;
+    std::atomic<bool> inboundScheduled{false};
+    std::atomic<uint64_t> inboundDropped{0};
+
+    PriorityClassifier priorityClassifier;
+    FrameHandler transferHandler;
+    std::atomic<uint64_t> shedBulk{0};
+    std::atomic<uint64_t> shedNormal{0};
+
+    std::unique_ptr<Reassembler> reassembler;
+    std::atomic<uint32_t> nextMessageId{0};
+    std::atomic<uint64_t> messagesReassembled{0};
+
+    mutable std::mutex channelsMutex;
+    std::map<boost::asio::ip::udp::endpoint, std::shared_ptr<ReliablePeer>> channels;
+    TimerService &timers;
+    std::mutex timerMutex;
+    bool timerRunning = false;  // Deadlines are only scheduled while listening
+    std::optional<Coalescer::Clock::time_point> coalesceArmedFor;
+
+    std::unique_ptr<Coalescer> coalescer;
+    std::unique_ptr<PathMtu> pathMtu;
+    std::optional<PathMtu::Clock::time_point> probeArmedFor;
+    std::atomic<uint64_t> mtuProbes{0};
+    std::atomic<uint64_t> coalescedMessages{0};
+    std::atomic<uint64_t> coalescedDatagrams{0};
+
+    // Also holds what each destination can decompress, learned from its Capabilities frame
+    ConnectionTable connectionTable;
+    Compressor compressor;
+    std::atomic<uint64_t> compressedPayloads{0};
+    std::atomic<uint64_t> compressionSaved{0};
+
+    std::atomic<bool> gsoEnabled{false};
+    std::atomic<uint64_t> segmentedSends{0};
+    std::atomic<uint64_t> groMerged{0};
+
+    EndpointCache endpoints;
+
+    PeerConfig config;
+    std::mutex sendMutex;
+    std::unique_ptr<SendBatch> sendBatch;
+
+    std::atomic<uint64_t> receiveCalls{0};
+    std::atomic<uint64_t> datagramsReceived{0};
+    std::atomic<uint64_t> sendCalls{0};
+    std::atomic<uint64_t> datagramsSent{0};
+
+    std::atomic<uint64_t> latencySamples{0};
+    std::atomic<uint64_t> kernelQueueNanos{0};
+    std::atomic<uint64_t> dispatchNanos{0};
+    std::atomic<uint64_t> decryptNanos{0};
+    std::atomic<uint64_t> handlingNanos{0};
+
+    void listenOn(boost::asio::ip::udp::socket &listenSocket, std::atomic<uint64_t> &calls,
+                  std::atomic<uint64_t> &datagrams);
+    void deliverBatch(ReceiveBatch &batch, size_t count, bool gro, std::atomic<uint64_t> &datagrams);
+    void listenBatched(boost::asio::ip::udp::socket &listenSocket, std::atomic<uint64_t> &calls,
+                       std::atomic<uint64_t> &datagrams);
+    bool listenUring(boost::asio::ip::udp::socket &listenSocket, std::atomic<uint64_t> &calls,
+                     std::atomic<uint64_t> &datagrams);
+    void startShardListeners();
+    void stopReceiving();
+    void closeSockets();
+    void resumeDeferredSends();
+    void applySocketOptions(boost::asio::ip::udp::socket &target);
+    bool shed(const char *data, size_t len);
+    void deliver(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender, BufferLease lease,
+                 const ReceiveTimestamps &times);
+    void dispatch(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender, BufferLease lease,
+                  const ReceiveTimestamps &times);
+    void handleFrame(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender,
+                     const ReceiveTimestamps &times);
+    size_t receiveDatagramSize() const;
+    bool needsFraming(const std::string &message, size_t limit) const;
+    size_t sendFragments(const std::string &message, const boost::asio::ip::udp::endpoint &destination,
+                         size_t limit);
+    void sendBurst(const std::vector<std::string_view> &datagrams, const boost::asio::ip::udp::endpoint &destination);
+    void deliverCopy(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender,
+                     const ReceiveTimestamps &times);
+    bool compressPayload(std::string_view payload, const boost::asio::ip::udp::endpoint &destination, size_t limit,
+                         std::string &frame);
+    bool compressMessage(const std::string &message, const boost::asio::ip::udp::endpoint &destination, size_t limit,
+                         std::string &frame);
+    void sendCapabilities(const boost::asio::ip::udp::endpoint &destination, bool wantReply);
+    void onCapabilities(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender);
+    void onCompressed(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender,
+                      const ReceiveTimestamps &times);
+    std::shared_ptr<ReliablePeer> reliablePeer(const boost::asio::ip::udp::endpoint &remote, bool create = true);
+    void expireChannels(ReliableChannel::Clock::time_point cutoff);
+    void emit(const boost::asio::ip::udp::endpoint &remote, ReliableChannel::Output &out,
+              const ReceiveTimestamps &times = {});
+    void armChannelTimer(const boost::asio::ip::udp::endpoint &remoteEndpoint, ReliablePeer &remote);
+    void onChannelTimer(const boost::asio::ip::udp::endpoint &remoteEndpoint);
+    ReceiveTimestamps noteReceived(const boost::asio::ip::udp::endpoint &sender, size_t bytes, size_t datagrams,
+                                   ConnectionTable::Clock::time_point now,
+                                   ReceiveTimestamps::Clock::time_point kernelTime = {});
+    void armCoalesceTimer();
+    void onCoalesceTimer();
+    void sendProbes(PathMtu::Output &out);
+    void armProbeTimer();
+    void onProbeTimer();
+    void startTimers();
+    void sendDatagrams(const std::vector<Coalescer::Datagram> &datagrams);
+    void dispatchCopy(const char *data, size_t len, const boost::asio::ip::udp::endpoint &sender,
+                      const ReceiveTimestamps &times);
+    void startAsyncEngine();
+    void stopAsyncEngine();
+    void sendStarted();
+    void sendFinished();
+    void startReceive(size_t slot);
+    void waitReadable();
+    void onReadable(const boost::system::error_code &error);
+    void onReceive(size_t slot, const boost::system::error_code &error, size_t len);
+    void flushLocked();
 };
 
 #endif // PEER_H
\ No newline at end of file
@@ -0,0 +1,131 @@
+//
+// Created by Omer Mersin on 11/20/24.
+//
+
+#ifndef RELIABLE_CHANNEL_H
+#define RELIABLE_CHANNEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Reliable frame: magic, type, sender epoch (u32), sequence number (u32), payload
+constexpr size_t RELIABLE_HEADER_SIZE = 10;
+// Ack frame: magic, type, echoed epoch (u32), cumulative ack (u32), SACK bitmap (u64)
+constexpr size_t ACK_FRAME_SIZE = 18;
+// Reset frame: magic, type, echoed epoch (u32)
+constexpr size_t RESET_FRAME_SIZE = 6;
+
+// Reliable, ordered message stream to one remote endpoint on top of plain datagrams.
+// Each message gets a sequence number; the receiver answers every data frame with a
+// cumulative ack plus a 64-bit selective-ack bitmap. Holes reported by three later
+// SACKs are retransmitted immediately, anything else on RTO (RFC 6298 estimator).
+// The congestion window follows CUBIC (RFC 8312).
+//
+// A receiver that lost its state (closed idle or evicted) cannot place frames from the middle
+// of an epoch, so it answers them with a reset; the sender then renumbers everything not yet
+// acknowledged from 0 under a new epoch. Messages in flight at that moment may arrive twice.
+//
+// Not thread-safe: the owner serializes calls. Methods never do I/O themselves;
+// they append frames to send and in-order payloads to deliver to an Output, so
+// the owner can act on them after releasing its lock.
+class ReliableChannel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Output {
+        std::vector<std::string> frames;     // Datagrams to put on the wire
+        std::vector<std::string> delivered;  // Payloads now deliverable in order
+        std::vector<std::chrono::microseconds> rttSamples;  // Measured by acks handled in this call
+        size_t acked = 0;                    // Packets newly acknowledged
+        size_t lost = 0;                     // Packets declared lost
+    };
+
+    struct Stats {
+        double cwnd;
+        double ssthresh;
+        std::chrono::microseconds srtt;
+        std::chrono::microseconds rttvar;
+        std::chrono::microseconds rto;
+        size_t inFlight;
+        size_t queued;
+        uint64_t retransmits;
+        uint64_t fastRetransmits;
+        uint64_t timeouts;
+    };
+
+    explicit ReliableChannel(uint32_t epoch);
+
+    // Starts the RTT estimator from what other traffic to the same peer measured, instead
+    // of the conservative 1 s initial RTO. Ignored once the channel has samples of its own.
+    void seedRtt(std::chrono::microseconds srtt, std::chrono::microseconds rttvar);
+
+    void send(std::string payload, Clock::time_point now, Output &out);
+    void onData(const char *frame, size_t len, Clock::time_point now, Output &out);
+    void onAck(const char *frame, size_t len, Clock::time_point now, Output &out);
+    void onReset(const char *frame, size_t len, Clock::time_point now, Output &out);
+    void onTimer(Clock::time_point now, Output &out);
+
+    Stats stats() const;
+    // When onTimer() next has work; nothing is due without a deadline
+    std::optional<Clock::time_point> nextDeadline() const { return rtoDeadline; }
+    bool idle() const { return outstanding.empty() && pending.empty(); }
+
+    // Upper bound on unacknowledged plus out-of-order packets on either side
+    static constexpr uint64_t WINDOW = 4096;
+
+private:
+    struct Outstanding {
+        std::string frame;
+        Clock::time_point sentAt;
+        int transmissions = 1;
+        bool lost = false;  // Waiting for retransmission after an RTO
+    };
+
+    void transmitPending(Clock::time_point now, Output &out);
+    void retransmit(Outstanding &packet, Clock::time_point now, Output &out);
+    size_t inFlight() const { return outstanding.size() - lostCount; }
+    void sampleRtt(std::chrono::microseconds sample);
+    void onLoss(uint64_t seq, Clock::time_point now);
+    void onAcked(size_t packets, Clock::time_point now);
+    std::string makeAck() const;
+    std::string makeReset(uint32_t senderEpoch) const;
+
+    // Sender state
+    uint32_t epoch;
+    uint64_t nextSeq = 0;
+    std::map<uint64_t, Outstanding> outstanding;
+    size_t lostCount = 0;
+    std::deque<std::string> pending;
+    std::optional<Clock::time_point> rtoDeadline;
+
+    // RTT estimator (RFC 6298)
+    std::optional<std::chrono::microseconds> srtt;
+    std::chrono::microseconds rttvar{0};
+    std::chrono::microseconds rto{std::chrono::seconds(1)};
+
+    // CUBIC congestion control
+    double cwnd = 10.0;
+    double ssthresh = 1e9;
+    double wMax = 0.0;
+    double originPoint = 0.0;
+    double k = 0.0;
+    double tcpEstimate = 0.0;
+    std::optional<Clock::time_point> epochStart;
+    uint64_t recoveryPoint = 0;  // No further window cuts until this sequence is acked
+
+    // Receiver state
+    std::optional<uint32_t> remoteEpoch;
+    uint64_t expected = 0;
+    std::map<uint64_t, std::string> reorder;
+
+    uint64_t retransmits = 0;
+    uint64_t fastRetransmits = 0;
+    uint64_t timeouts = 0;
+};
+
+#endif // RELIABLE_CHANNEL_H
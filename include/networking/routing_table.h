@@ -0,0 +1,132 @@
+//
+// Created by Omer Mersin on 11/27/24.
+//
+
+#ifndef ROUTING_TABLE_H
+#define ROUTING_TABLE_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct DHTNode {
+    std::string id;       // Unique node ID
+    std::string ip;       // Node IP address
+    int port;             // Node port
+    std::chrono::steady_clock::time_point lastSeen{};  // Last time the node was added or heard from
+};
+
+// Position of a node in the keyspace: the SHA-1 of its textual ID, compared as a
+// big-endian 160-bit number
+using NodeId = std::array<uint8_t, 20>;
+
+// An ID of exactly 40 hex digits is taken as the key itself. That is how nodes learned
+// from binary node records, which carry only the key, are named until they announce a name.
+NodeId nodeIdOf(const std::string &id);
+std::string toHex(const NodeId &key);
+bool isKeyName(const std::string &id);
+NodeId xorDistance(const NodeId &a, const NodeId &b);
+// Leading bits a and b share, 0 to 160
+size_t commonPrefixLength(const NodeId &a, const NodeId &b);
+
+// Kademlia routing table around this node's ID. Bucket i holds the nodes sharing exactly
+// i leading bits with it; the last bucket holds everything closer and is split when it
+// overflows, so the table keeps at most BUCKET_SIZE nodes per distance range and
+// O(BUCKET_SIZE * log N) in total. A full bucket that cannot split keeps its nodes in
+// least-recently-seen order: newcomers displace the front one only once it has been
+// silent for staleAfter, and otherwise wait in the bucket's replacement cache until a
+// node is removed or expires.
+//
+// Every node joining a bucket (newly added, displacing a stale node or promoted from a
+// replacement cache) bumps the table's version and is stamped with it, so the nodes added
+// since any earlier version can be listed without keeping a change log. The epoch is drawn
+// at random per table, telling a version of this table from one of a restarted node.
+//
+// An index from endpoint to the keys of the nodes there lets touch(), which runs for every
+// incoming message, go straight to their buckets.
+//
+// Not thread-safe; the DHT guards it with its own mutex. This node itself is never stored.
+class RoutingTable {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t BUCKET_SIZE = 20;
+    static constexpr size_t ID_BITS = 160;
+
+    enum class Insertion {
+        Added,      // New in a bucket, possibly displacing a stale node
+        Refreshed,  // Already in the table; now the most recently seen of its bucket, endpoint unchanged
+                    // (a node known only by key takes the name given, though)
+        Cached,     // Its bucket is full of live nodes; held as a replacement
+        Ignored     // This node's own ID
+    };
+
+    // A node together with its key, so callers that need both do not hash the ID again
+    struct Contact {
+        NodeId key;
+        DHTNode node;
+        uint64_t version = 0;  // Table version at which the node joined its bucket
+    };
+
+    explicit RoutingTable(const NodeId &self, Clock::duration staleAfter = Clock::duration::max());
+    void setStaleAfter(Clock::duration staleAfter);
+
+    Insertion insert(const DHTNode &node, Clock::time_point now);
+    // Refreshes every node at the endpoint, including replacements
+    void touch(const std::string &ip, int port, Clock::time_point now);
+    // The freshest replacement, if any, takes the removed node's place
+    bool remove(const std::string &id);
+    std::optional<DHTNode> find(const std::string &id) const;
+
+    // Up to count nodes in increasing XOR distance from target
+    std::vector<Contact> closest(const NodeId &target, size_t count) const;
+    std::vector<DHTNode> nodes() const;
+    // Nodes that joined after version and are still in the table, oldest first. Nodes removed
+    // since are simply missing, so a copy synced from this keeps them until it expires them.
+    std::vector<Contact> addedSince(uint64_t version) const;
+    // Removes nodes not heard from since cutoff, refilling buckets from their replacement
+    // caches, and returns them
+    std::vector<DHTNode> expire(Clock::time_point cutoff);
+
+    size_t size() const;
+    size_t bucketCount() const { return buckets.size(); }
+    const NodeId &selfKey() const { return self; }
+    uint32_t epoch() const { return tableEpoch; }
+    uint64_t version() const { return tableVersion; }
+
+private:
+    struct Bucket {
+        std::vector<Contact> entries;       // Least recently seen first
+        std::vector<Contact> replacements;  // Least recently seen first, at most BUCKET_SIZE
+    };
+
+    struct EndpointHash {
+        size_t operator()(const std::pair<std::string, int> &endpoint) const {
+            return std::hash<std::string>()(endpoint.first) * 31 + static_cast<size_t>(endpoint.second);
+        }
+    };
+
+    size_t bucketIndex(const NodeId &key) const;
+    // Called for every contact entering or leaving a bucket or replacement cache
+    void indexAdd(const Contact &entry);
+    void indexRemove(const Contact &entry);
+    void split();
+    void promote(Bucket &bucket);
+    void stamp(Contact &entry);
+
+    NodeId self;
+    Clock::duration staleAfter;
+    std::vector<Bucket> buckets;
+    // Keys of the nodes at each endpoint, in buckets or replacement caches
+    std::unordered_map<std::pair<std::string, int>, std::vector<NodeId>, EndpointHash> endpoints;
+    uint32_t tableEpoch;
+    uint64_t tableVersion = 0;
+};
+
+#endif // ROUTING_TABLE_H
@@ -5,13 +5,18 @@
 #ifndef STUN_H
 #define STUN_H
 
+#include <chrono>
 #include <string>
 #include <boost/asio.hpp>
+#include "networking/timer_wheel.h"
 
 class STUN {
 public:
-    // Retrieve public IP and port from the STUN server
-    static std::pair<std::string, int> getPublicAddress(const std::string &stunServer, int port);
+    // Retrieve public IP and port from the STUN server. The request is retransmitted on the
+    // RFC 5389 schedule (500 ms, doubling) until an answer arrives or timeout passes.
+    static std::pair<std::string, int> getPublicAddress(const std::string &stunServer, int port,
+                                                        std::chrono::milliseconds timeout = std::chrono::seconds(3),
+                                                        TimerService &timers = TimerService::shared());
 };
 
 #endif
\ No newline at end of file
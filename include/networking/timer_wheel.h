@@ -0,0 +1,139 @@
+//
+// Created by Omer Mersin on 11/24/24.
+//
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using TimerId = uint64_t;
+constexpr TimerId INVALID_TIMER = 0;
+
+// Hierarchical timing wheel (Varghese & Lauck): four levels of 256 slots cover 2^32
+// ticks. A timer sits in the level matching the highest byte where its expiry differs
+// from the current tick and drops one level each time the wheel turns past it, so
+// add, cancel and expiry are O(1) no matter how many timers are pending.
+//
+// Not thread-safe; TimerService serializes access.
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+
+    struct Expired {
+        TimerId id;
+        const void *owner;
+        Callback callback;
+    };
+
+    explicit TimerWheel(uint64_t startTick = 0);
+
+    // Expiries at or before the current tick fire on the next advance()
+    TimerId add(uint64_t expiryTick, uint64_t intervalTicks, const void *owner, Callback callback);
+    bool cancel(TimerId id);
+    size_t cancelAll(const void *owner);
+
+    // Moves the wheel to tick and appends every timer that expired on the way.
+    // Repeating timers are re-armed before their callback is handed out.
+    void advance(uint64_t tick, std::vector<Expired> &out);
+
+    // Earliest tick at which advance() may have work; UINT64_MAX when nothing is pending
+    uint64_t nextEventTick() const;
+    uint64_t currentTick() const { return current; }
+    size_t size() const { return count; }
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t OVERFLOW = LEVELS * SLOTS;  // More than 2^32 ticks out
+    static constexpr uint32_t DUE = LEVELS * SLOTS + 1;   // Fires on the next advance()
+
+    struct Node {
+        uint64_t expiry = 0;
+        uint64_t interval = 0;
+        const void *owner = nullptr;
+        Callback callback;
+        uint32_t generation = 1;
+        uint32_t prev = NONE;
+        uint32_t next = NONE;
+        uint32_t bucket = NONE;  // level * SLOTS + slot, OVERFLOW, DUE, or NONE when free
+    };
+
+    static TimerId makeId(uint32_t index, uint32_t generation) {
+        return (static_cast<uint64_t>(generation) << 32) | index;
+    }
+    Node *lookup(TimerId id);
+    void place(uint32_t index);
+    void link(uint32_t index, uint32_t bucket);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    void cascade(int level);
+    void expireSlot(uint32_t bucket, std::vector<Expired> &out);
+    void fire(uint32_t index, std::vector<Expired> &out);
+    int nextOccupied(int level, uint32_t from) const;
+
+    uint64_t current;
+    size_t count = 0;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> freeNodes;
+    std::array<uint32_t, LEVELS * SLOTS + 2> heads;
+    std::array<std::array<uint64_t, SLOTS / 64>, LEVELS> occupied{};  // Non-empty slots per level
+};
+
+// Shared timer thread for retransmits, keepalives, expiries and request timeouts.
+// Callbacks run on the service thread, one at a time and outside the service lock,
+// so they may schedule or cancel timers themselves but should not block for long.
+class TimerService {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerService(std::chrono::microseconds tick = std::chrono::milliseconds(1));
+    ~TimerService();
+    TimerService(const TimerService &) = delete;
+    TimerService &operator=(const TimerService &) = delete;
+
+    // Process-wide instance used by Peer, DHT, STUN and NAT unless given another
+    static TimerService &shared();
+
+    // owner tags the timer for cancelAll(); callbacks never fire early, and late by at most one tick
+    TimerId schedule(Clock::duration delay, TimerWheel::Callback callback, const void *owner = nullptr);
+    TimerId scheduleAt(Clock::time_point when, TimerWheel::Callback callback, const void *owner = nullptr);
+    TimerId scheduleEvery(Clock::duration interval, TimerWheel::Callback callback, const void *owner = nullptr);
+
+    // Both return once the callback can no longer run: a pending timer is removed, and a call
+    // already in progress on another thread is waited for. Safe to call from a callback.
+    bool cancel(TimerId id);
+    void cancelAll(const void *owner);
+
+    size_t pending() const;
+
+private:
+    void run();
+    uint64_t toTick(Clock::time_point when, bool roundUp) const;
+    bool onServiceThread() const { return std::this_thread::get_id() == thread.get_id(); }
+
+    const Clock::duration tick;
+    const Clock::time_point epoch;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    TimerWheel wheel;
+    std::vector<TimerWheel::Expired> ready;  // Expired batch being run; entries from readyNext on are pending
+    size_t readyNext = 0;
+    uint64_t wakeTick = 0;  // When the sleeping service thread looks again; 0 while it is awake
+    TimerId runningId = INVALID_TIMER;
+    const void *runningOwner = nullptr;
+    bool stopping = false;
+    std::thread thread;
+};
+
+#endif // TIMER_WHEEL_H
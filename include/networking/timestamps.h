@@ -0,0 +1,46 @@
+//
+// Created by Omer Mersin on 11/26/24.
+//
+
+#ifndef TIMESTAMPS_H
+#define TIMESTAMPS_H
+
+#include <chrono>
+#include <cstddef>
+#include <sys/socket.h>
+
+// When one received message passed each stage on its way to the application. Every
+// stamp is on the realtime clock the kernel uses for software timestamps, and stays
+// zero when that stage was not measured. The peer fills in kernel, received and
+// dequeued; consumers stamp decrypted and handled themselves with Clock::now().
+struct ReceiveTimestamps {
+    using Clock = std::chrono::system_clock;
+
+    Clock::time_point kernel{};     // Datagram reached the socket (SO_TIMESTAMPING / SO_TIMESTAMPNS)
+    Clock::time_point received{};   // Listener read it from the socket
+    Clock::time_point dequeued{};   // Consumer drained it from the inbound queue
+    Clock::time_point decrypted{};
+    Clock::time_point handled{};
+
+    // Each stage is the time since the previous one; zero if either end is missing
+    std::chrono::nanoseconds kernelQueue() const;
+    std::chrono::nanoseconds dispatch() const;
+    std::chrono::nanoseconds decrypt() const;
+    std::chrono::nanoseconds handling() const;
+};
+
+// Room for the largest timestamp control message, to add to a receive's control buffer
+constexpr size_t TIMESTAMP_CONTROL_SPACE = CMSG_SPACE(3 * sizeof(timespec));
+
+// Asks the kernel to stamp every datagram as it arrives: SO_TIMESTAMPING with software
+// receive stamps, else SO_TIMESTAMPNS. Returns false if neither is supported.
+bool enableReceiveTimestamps(int fd);
+
+// The stamp carried in a recvmsg control buffer, or zero if it holds none
+ReceiveTimestamps::Clock::time_point kernelTimestamp(const msghdr &header);
+
+// The stamp of the last datagram read from fd with a plain recvfrom (SIOCGSTAMPNS).
+// Only meaningful when a single thread reads the socket.
+ReceiveTimestamps::Clock::time_point lastKernelTimestamp(int fd);
+
+#endif // TIMESTAMPS_H
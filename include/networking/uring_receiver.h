@@ -0,0 +1,94 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+
+#ifndef URING_RECEIVER_H
+#define URING_RECEIVER_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "networking/buffer_pool.h"
+#include "networking/timestamps.h"
+
+// Receives on a UDP socket through io_uring (Linux 6.0+, built with P2P_HAVE_IO_URING).
+// One multishot recvmsg stays armed and the kernel writes each datagram straight into
+// a pool slab taken from a provided-buffer ring, so the steady state costs one
+// io_uring_enter per wakeup regardless of how many datagrams arrived.
+class UringReceiver {
+public:
+    struct Datagram {
+        boost::asio::ip::udp::endpoint sender;
+        BufferLease lease;  // data()/size() cover just the payload
+        ReceiveTimestamps::Clock::time_point kernelTime{};  // Zero unless timestamps were requested
+    };
+
+    // Bytes the kernel writes ahead of each payload: io_uring_recvmsg_out, the sender address
+    // and room for a receive timestamp. Pool slabs must be at least this much larger than the
+    // biggest expected datagram.
+    static constexpr size_t HEADROOM = 16 + sizeof(sockaddr_in6) + TIMESTAMP_CONTROL_SPACE;
+
+    // Throws boost::system::system_error if io_uring or one of the features it needs is unavailable.
+    // With timestamps, each datagram carries the time the kernel received it.
+    UringReceiver(int fd, BufferPool &pool, size_t bufferCount, bool timestamps = false);
+    ~UringReceiver();
+    UringReceiver(const UringReceiver &) = delete;
+    UringReceiver &operator=(const UringReceiver &) = delete;
+
+    // Waits up to timeout for at least one datagram and appends everything completed to out
+    size_t receive(std::vector<Datagram> &out, std::chrono::milliseconds timeout);
+
+    // Ends the current and every later receive() as soon as fd becomes readable
+    void watch(int fd);
+    bool woken() const { return wokenUp; }
+
+    static bool compiledIn();
+    uint64_t truncated() const { return truncatedCount; }
+
+private:
+    int socketFd;
+    BufferPool &pool;
+    int ringFd = -1;
+
+    // Submission and completion rings shared with the kernel
+    void *sqMap = nullptr;
+    size_t sqMapSize = 0;
+    void *cqMap = nullptr;
+    size_t cqMapSize = 0;
+    void *sqeMap = nullptr;
+    size_t sqeMapSize = 0;
+    unsigned *sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned *sqArray = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    void *cqes = nullptr;
+
+    // Provided-buffer ring: slot i lends the slab held by slots[i] to the kernel
+    void *bufferRing = nullptr;
+    size_t bufferRingSize = 0;
+    uint16_t bufferMask = 0;
+    uint16_t bufferTail = 0;
+    std::vector<BufferLease> slots;
+    std::vector<uint16_t> emptySlots;  // Waiting for the pool to free a slab
+
+    msghdr header{};
+    bool armed = false;
+    bool wokenUp = false;
+    uint64_t truncatedCount = 0;
+
+    void setupRing(unsigned completions);
+    void setupBuffers(size_t bufferCount);
+    void *nextSqe();
+    int enter(unsigned submit, unsigned waitFor, std::chrono::milliseconds timeout);
+    void provide(uint16_t slot);
+    void refill();
+    void arm();
+    void teardown();
+};
+
+#endif // URING_RECEIVER_H
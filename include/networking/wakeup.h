@@ -0,0 +1,31 @@
+//
+// Created by Omer Mersin on 11/23/24.
+//
+
+#ifndef WAKEUP_H
+#define WAKEUP_H
+
+// Lets one thread interrupt others that are blocked waiting on sockets. Listeners
+// wait for their socket and this descriptor together, so signal() ends every wait
+// at once instead of leaving threads parked until the next datagram arrives.
+class Wakeup {
+public:
+    Wakeup();
+    ~Wakeup();
+    Wakeup(const Wakeup &) = delete;
+    Wakeup &operator=(const Wakeup &) = delete;
+
+    // Stays signalled until reset(), so late waiters return immediately too
+    void signal();
+    void reset();
+    int fd() const { return readFd; }
+
+    // Blocks until socketFd is readable (true) or signal() was called (false)
+    bool waitReadable(int socketFd) const;
+
+private:
+    int readFd = -1;
+    int writeFd = -1;
+};
+
+#endif // WAKEUP_H
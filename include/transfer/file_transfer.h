@@ -0,0 +1,288 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "networking/peer.h"
+#include "networking/timer_wheel.h"
+#include "transfer/mapped_file.h"
+#include "transfer/merkle.h"
+
+// Every transfer message is one Transfer frame: magic, type, kind, transfer id (u64), then
+//   Offer, Info:     file size (u64), chunk size (u32), Merkle root (32), cookie (u64), file name
+//   InfoRequest:     zero padding up to INFO_REQUEST_SIZE
+//   ManifestRequest: page (u32), cookie (u64)
+//   Manifest:        page (u32), leaf count (u8), proof length (u8), chunk hashes, proof
+//   HaveRequest:     first chunk (u32), cookie (u64)
+//   Have:            first chunk (u32), count (u32), one bit per chunk, most significant first
+//   ChunkRequest:    chunk (u32), block size (u16), mask of the wanted blocks (u64), cookie (u64)
+//   Block:           chunk (u32), block (u8), file data
+//   Cancel:          nothing
+// Files are content-addressed: the transfer id is the start of the content id, so every
+// peer holding a file, or part of it, serves it under the same id. Receivers pull; they ask
+// for what they need and repeat whatever goes unanswered, so holders keep no state per receiver.
+//
+// The cookie proves the requester receives what is sent to its address. Holders derive it
+// from the address and a secret, hand it out in Offer and Info, and only answer requests
+// that echo it, so a forged source address cannot turn a request into a flood of blocks.
+// Info, the one answer to an unproven address, is at most AMPLIFICATION_LIMIT times the
+// size of the padded InfoRequest.
+constexpr size_t TRANSFER_HEADER_SIZE = 11;
+constexpr size_t TRANSFER_BLOCK_HEADER_SIZE = TRANSFER_HEADER_SIZE + 5;
+constexpr size_t BLOCKS_PER_CHUNK = 64;        // One bit per block in a ChunkRequest mask
+constexpr size_t HAVE_PAGE_CHUNKS = 8192;      // Chunks described by one Have message
+constexpr size_t INFO_REQUEST_SIZE = 128;      // InfoRequest frames are padded to this
+constexpr size_t AMPLIFICATION_LIMIT = 3;      // Bytes answered per byte received from an unproven address
+
+enum class TransferMessage : uint8_t {
+    Offer = 1,
+    ManifestRequest = 2,
+    Manifest = 3,
+    ChunkRequest = 4,
+    Block = 5,
+    Cancel = 6,
+    InfoRequest = 7,
+    Info = 8,
+    HaveRequest = 9,
+    Have = 10,
+};
+
+struct TransferConfig {
+    uint16_t blockSize = 1400;  // File bytes per datagram; with the header it must fit maxDatagramSize
+    size_t initialWindow = 4;   // Chunks requested at once from a new source
+    size_t maxWindow = 64;      // Per source: grows per verified chunk up to this and halves on a timeout
+    std::chrono::milliseconds requestTimeout{250};  // Unanswered requests are repeated after this, or after
+                                                    // the source's retransmit timeout if that is longer
+    int sourceTimeouts = 8;     // Timeouts in a row after which a source is given up on
+    std::chrono::milliseconds haveInterval{2000};   // How often partial sources are asked what they have
+    std::chrono::milliseconds offerInterval{1000};  // Offers are repeated until the receiver asks for data
+    int offerAttempts = 5;
+    std::chrono::milliseconds idleTimeout{15000};   // A download fails after this long without data
+};
+
+struct FileOffer {
+    uint64_t id = 0;
+    Digest content{};  // Content id; id is its first eight bytes
+    Digest root{};     // Merkle root over the chunk hashes
+    std::string name;  // File name only, never a path
+    uint64_t size = 0;
+    uint32_t chunkSize = 0;
+    boost::asio::ip::udp::endpoint sender;
+    uint64_t cookie = 0;  // Proof of our address from sender, echoed in requests to it
+};
+
+// Chunked, content-addressed file transfer over a Peer. Files are memory-mapped on both
+// sides: blocks are copied straight from a holder's mapping into a datagram and from the
+// datagram into the receiver's mapping. Every chunk is checked against its hash, and every
+// manifest page against the Merkle root, before it is trusted, so a download can draw on
+// any number of sources at once, including peers that only have part of the file yet.
+// Chunks are requested rarest first; once all are in flight, the last ones are asked of a
+// second source as well (endgame). Interrupted downloads resume from their .part file.
+//
+// Construct before the peer starts listening and destroy after it stops. Callbacks run on
+// the peer's listener threads or the timer thread.
+class FileTransfer {
+public:
+    using udp = boost::asio::ip::udp;
+    using OfferCallback = std::function<void(const FileOffer&)>;
+    using ProgressCallback = std::function<void(uint64_t id, uint64_t bytesDone, uint64_t size)>;
+    using CompletionCallback = std::function<void(uint64_t id, bool success, const std::string &detail)>;
+
+    struct Stats {
+        uint64_t blocksSent = 0;
+        uint64_t blocksReceived = 0;
+        uint64_t duplicateBlocks = 0;  // Arrived after their chunk was already complete or re-requested
+        uint64_t corruptChunks = 0;    // Failed the hash check and were fetched again
+        uint64_t requestTimeouts = 0;  // Chunk requests repeated for lack of an answer
+        uint64_t resumedBytes = 0;     // Verified from a previous attempt instead of being fetched
+        uint64_t endgameRequests = 0;  // Chunks also requested from a second source near the end
+        uint64_t sourcesDropped = 0;   // Sources given up on after repeated timeouts
+    };
+
+    explicit FileTransfer(Peer &peer, const TransferConfig &config = TransferConfig(),
+                          TimerService &timers = TimerService::shared());
+    ~FileTransfer();
+    FileTransfer(const FileTransfer &) = delete;
+    FileTransfer &operator=(const FileTransfer &) = delete;
+
+    // Maps and hashes path and serves it to anyone asking for its content id until cancel()
+    // or destruction. Hashing reads the whole file, so keep it off latency-sensitive threads.
+    // Throws std::runtime_error.
+    FileOffer share(const std::string &path);
+    // share(), then offers the file to ip:port; returns the transfer id
+    uint64_t offerFile(const std::string &path, const std::string &ip, int port);
+
+    // Accepts an offer. Data is written to savePath + ".part" and renamed to savePath once
+    // every chunk has been verified; the file is then served like a shared one. A .part left
+    // by an interrupted attempt is checked chunk by chunk and only chunks that are missing or
+    // damaged are fetched again.
+    void download(const FileOffer &offer, const std::string &savePath);
+    // Downloads by content id from sources (e.g. DHT providers); returns the transfer id.
+    // Size and name are learned from the first source to answer.
+    uint64_t fetch(const Digest &content, const std::string &savePath, const std::vector<udp::endpoint> &sources);
+    // Another holder of a file being downloaded; ignored once it is complete
+    void addSource(uint64_t id, const udp::endpoint &source);
+
+    // Stops serving or fetching id; a partial download keeps its .part for a later resume
+    void cancel(uint64_t id);
+
+    // Set before offers can arrive
+    void setOfferCallback(OfferCallback callback);
+    void setProgressCallback(ProgressCallback callback);    // At most once per timer tick per download
+    void setCompletionCallback(CompletionCallback callback);
+
+    Stats getStats() const;
+
+    static uint64_t transferId(const Digest &content);
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr uint32_t NO_SOURCE = UINT32_MAX;
+
+    struct Source {
+        udp::endpoint endpoint;
+        uint64_t cookie = 0;
+        bool cookieKnown = false;     // Nothing but InfoRequest is sent until the source hands out a cookie
+        bool alive = true;
+        bool seed = false;            // Has every chunk; no need to keep asking
+        std::vector<uint8_t> has;     // Per chunk, from its Have messages
+        uint32_t hasCount = 0;
+        Clock::time_point nextHavePoll;
+        size_t inFlight = 0;
+        size_t window = 0;
+        int timeouts = 0;             // In a row; any block from the source resets it
+    };
+
+    struct InFlight {
+        uint64_t received = 0;
+        uint64_t allBlocks = 0;
+        Clock::time_point requestedAt;
+        uint32_t requests = 0;               // Only a chunk requested once gives an RTT sample (Karn)
+        uint32_t source = NO_SOURCE;
+        uint32_t endgameSource = NO_SOURCE;  // Second source asked for the same chunk
+    };
+
+    // Download state of a file that is not complete yet
+    struct Fetch {
+        std::string savePath;
+        std::vector<Source> sources;
+        uint16_t blockSize = 0;
+        Clock::time_point infoRequestedAt;
+        std::vector<uint8_t> pages;   // PageMissing, PageRequested or PageReceived
+        uint32_t pagesReceived = 0;
+        Clock::time_point pagesRequestedAt;
+        bool resuming = false;        // A .part existed; chunks below verifyCursor have been checked
+        uint32_t verifyCursor = 0;
+        std::unordered_map<uint32_t, InFlight> inFlight;
+        std::vector<uint16_t> availability;  // Live sources holding each chunk
+        std::vector<uint32_t> pickOrder;     // Chunks still needed, rarest first
+        size_t pickStart = 0;                // Entries before this are complete
+        bool orderDirty = true;
+        uint32_t nextSource = 0;             // Round-robin start when filling windows
+        uint64_t bytesDone = 0;
+        uint64_t bytesReported = UINT64_MAX;
+        Clock::time_point lastData;
+    };
+
+    // A file this peer holds, fully or in part, or is about to fetch
+    struct Blob {
+        FileOffer info;
+        bool infoKnown = false;       // False only while a fetch waits for its first Info
+        MappedFile file;
+        uint32_t chunkCount = 0;
+        std::vector<Digest> leaves;   // Chunk hashes
+        MerkleTree tree;              // Built once every chunk hash is known; needed to serve the manifest
+        std::vector<uint8_t> chunkDone;
+        uint32_t chunksDone = 0;
+        std::unique_ptr<Fetch> fetch;
+
+        udp::endpoint offeredTo;      // Offer state, for files offered to a peer
+        int offersLeft = 0;
+        Clock::time_point nextOffer;
+        bool answered = true;
+    };
+
+    // Work gathered under the lock and carried out after it is released
+    struct Actions {
+        std::vector<std::pair<udp::endpoint, std::string>> frames;
+        std::vector<std::function<void()>> callbacks;
+    };
+
+    void onFrame(const char *data, size_t len, const udp::endpoint &sender);
+    void onOffer(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, bool info);
+    void onInfoRequest(uint64_t id, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onManifestRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onManifest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onHaveRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onHave(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onChunkRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onBlock(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, Actions &actions);
+    void onCancel(uint64_t id, const udp::endpoint &sender, Actions &actions);
+    void onTick();
+
+    // The helpers below run with mutex held
+    Blob *findBlob(uint64_t id);
+    Blob *findServed(uint64_t id);
+    Blob *findFetch(uint64_t id);
+    uint32_t sourceIndex(const Fetch &fetch, const udp::endpoint &endpoint) const;
+    void addSourceLocked(uint64_t id, Blob &blob, const udp::endpoint &endpoint, std::optional<uint64_t> cookie,
+                         Actions &actions);
+    void startFetch(uint64_t id, Blob &blob, Actions &actions);
+    void requestInfo(uint64_t id, Source &source, Actions &actions);
+    void requestHave(uint64_t id, Blob &blob, Source &source, Actions &actions);
+    void requestPages(uint64_t id, Blob &blob, bool retry, Actions &actions);
+    void manifestComplete(Blob &blob);
+    void verifyResumed(Blob &blob, size_t budget);
+    void chunkComplete(Blob &blob, uint32_t chunk);
+    void dropSource(Blob &blob, uint32_t index);
+    void rebuildPickOrder(Blob &blob);
+    bool pickChunk(uint64_t id, Blob &blob, uint32_t index, Actions &actions);
+    void fillWindows(uint64_t id, Blob &blob, Actions &actions);
+    void requestChunk(uint64_t id, Blob &blob, uint32_t chunk, uint32_t source, uint64_t mask, Actions &actions);
+    bool chunkVerified(const Blob &blob, uint32_t chunk) const;
+    void finish(uint64_t id, bool success, const std::string &detail, Actions &actions);
+    void ensureTicker();
+    uint64_t addressCookie(const udp::endpoint &endpoint) const;
+
+    void run(Actions &actions);
+
+    Peer &peer;
+    TransferConfig config;
+    TimerService &timers;
+    std::array<unsigned char, 32> cookieSecret{};  // Random per instance; cookies change with it
+
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, std::unique_ptr<Blob>> blobs;
+    std::unordered_map<uint64_t, Clock::time_point> offersSeen;  // Offers are repeated; the application hears of each once
+    TimerId ticker = INVALID_TIMER;  // Runs only while something is pending
+
+    OfferCallback offerCallback;
+    ProgressCallback progressCallback;
+    CompletionCallback completionCallback;
+
+    std::atomic<uint64_t> blocksSent{0};
+    std::atomic<uint64_t> blocksReceived{0};
+    std::atomic<uint64_t> duplicateBlocks{0};
+    std::atomic<uint64_t> corruptChunks{0};
+    std::atomic<uint64_t> requestTimeouts{0};
+    std::atomic<uint64_t> resumedBytes{0};
+    std::atomic<uint64_t> endgameRequests{0};
+    std::atomic<uint64_t> sourcesDropped{0};
+};
+
+#endif // FILE_TRANSFER_H
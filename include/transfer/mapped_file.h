@@ -0,0 +1,47 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory-mapped file. Reads come straight out of the page cache and writes land in it
+// without a copy through a user-space buffer. Errors throw std::runtime_error.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    static MappedFile openReadOnly(const std::string &path);
+    // Creates path if needed and sizes it to size with its disk space reserved, so running
+    // out of space throws here rather than faulting in a write; existing contents up to size are kept
+    static MappedFile openWritable(const std::string &path, uint64_t size);
+
+    const char *data() const { return mapping; }
+    char *data() { return mapping; }
+    uint64_t size() const { return length; }
+    bool isOpen() const { return fd >= 0; }
+
+    // Sequential access hint for streaming through the whole file
+    void adviseSequential();
+    // Writes dirty pages back to disk
+    void sync();
+    void close();
+
+private:
+    static MappedFile map(const std::string &path, bool writable, uint64_t size);
+
+    int fd = -1;
+    char *mapping = nullptr;
+    uint64_t length = 0;
+};
+
+#endif // MAPPED_FILE_H
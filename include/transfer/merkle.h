@@ -0,0 +1,51 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using Digest = std::array<unsigned char, 32>;
+
+Digest sha256(const char *data, size_t len);
+std::string toHex(const Digest &digest);
+// False unless text is exactly 64 hex digits
+bool fromHex(const std::string &text, Digest &digest);
+
+// Binary SHA-256 hash tree over the chunk hashes of a file. Leaves are padded with zero
+// digests to a power of two of at least PAGE_LEAVES, so every manifest page is a complete
+// subtree and can be checked against the root with one proof per page rather than per leaf.
+// Inner nodes hash 0x01 || left || right, keeping them distinct from chunk hashes.
+class MerkleTree {
+public:
+    static constexpr size_t PAGE_LEAVES = 16;
+
+    MerkleTree() = default;
+    explicit MerkleTree(const std::vector<Digest> &leaves);
+
+    bool empty() const { return levels.empty(); }
+    const Digest &root() const { return levels.back().front(); }
+    size_t pageCount() const { return levels.front().size() / PAGE_LEAVES; }
+    // Sibling digests from the page's subtree up to the root
+    std::vector<Digest> proof(size_t page) const;
+
+    // Leaves in the padded tree for leafCount real ones
+    static size_t paddedSize(size_t leafCount);
+    // Checks the count leaves of page (the rest of the page being padding) against root
+    static bool verifyPage(size_t leafCount, size_t page, const Digest *leaves, size_t count,
+                           const std::vector<Digest> &proof, const Digest &root);
+
+    // Names a file by its contents: binds the tree root to the size and chunking it was built with
+    static Digest contentId(uint64_t size, uint32_t chunkSize, const Digest &root);
+
+private:
+    std::vector<std::vector<Digest>> levels;  // Padded leaves first, root last
+};
+
+#endif // MERKLE_H
@@ -8,8 +8,13 @@
 #include <QMainWindow>
 #include <QMutex>
 #include <QThread>
+#include <chrono>
+#include <functional>
+#include <vector>
 #include "networking/peer.h"
 #include "networking/dht.h"
+#include "networking/nat.h"
+#include "transfer/file_transfer.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -24,18 +29,33 @@ public:
 
 private slots:
     void onSendButtonClicked();
+    void onSendFileButtonClicked();
+    void onShareFileButtonClicked();
+    void onFetchButtonClicked();
 
 private:
     Ui::MainWindow *ui;
     Peer peer;
+    FileTransfer transfers;  // Hooked into peer, so it must be declared after it
+    NAT nat;                 // Sends through peer, so it must be declared after it
     DHT *dht;             // Pointer to the DHT instance
     QMutex logMutex;
 
     QString publicIP;     // To store the public IP of the user
     int publicPort;       // To store the public port of the user
 
+    std::vector<Peer::InboundMessage> inboundBatch;  // Reused between drains
+
+    static constexpr std::chrono::seconds PEER_LOOKUP_TIMEOUT{5};
+
     void appendLog(const QString &message);
+    void processInbound();
     void initializeP2P();
+    void onFileOffered(const FileOffer &offer);
+    void onProvidersFound(const std::string &key, const std::vector<DHTProvider> &providers);
+    void resolvePeerID(const QString &peerID, std::function<void(const std::string &, int)> then);
+    void sendFileTo(const std::string &ip, int port);
+    Peer::SendHandler sendResultHandler();
 };
 
 #endif // MAINWINDOW_H
\ No newline at end of file
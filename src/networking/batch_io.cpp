@@ -0,0 +1,332 @@
+//
+// Created by Omer Mersin on 11/18/24.
+//
+#include "networking/batch_io.h"
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+
+using boost::asio::ip::udp;
+
+static boost::system::system_error lastError(const char *what) {
+    return boost::system::system_error(
+            boost::system::error_code(errno, boost::system::system_category()), what);
+}
+
+// Once asio runs asynchronous operations on a socket its descriptor is non-blocking, and a
+// full send buffer fails the send with EAGAIN. Waits for room in that case; true if the send
+// should be retried, false to report errno.
+static bool waitWritable(int fd) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+    }
+    pollfd writable{fd, POLLOUT, 0};
+    return poll(&writable, 1, -1) >= 0 || errno == EINTR;
+}
+
+#ifdef __linux__
+// UDP_GRO segment size followed by a receive timestamp
+static const size_t CONTROL_SPACE = CMSG_SPACE(sizeof(int)) + TIMESTAMP_CONTROL_SPACE;
+
+// Largest UDP payload over IPv4 and the kernel's cap on segments per GSO send
+static constexpr size_t MAX_GSO_BYTES = 65507;
+static constexpr size_t MAX_GSO_SEGMENTS = 64;
+#endif
+
+ReceiveBatch::ReceiveBatch(size_t batchSize, size_t bufferSize)
+        : batchSize(batchSize == 0 ? 1 : batchSize), bufferSize(bufferSize),
+          buffers(this->batchSize * bufferSize), lengths(this->batchSize),
+          addresses(this->batchSize), leases(this->batchSize), segmentSizes(this->batchSize),
+          kernelTimes(this->batchSize) {
+#ifdef __linux__
+    headers.resize(this->batchSize);
+    iovecs.resize(this->batchSize);
+    controls.resize(this->batchSize * CONTROL_SPACE);
+    for (size_t i = 0; i < this->batchSize; ++i) {
+        iovecs[i].iov_base = buffers.data() + i * bufferSize;
+        iovecs[i].iov_len = bufferSize;
+    }
+#endif
+}
+
+void ReceiveBatch::attachPool(BufferPool *bufferPool) {
+    pool = bufferPool;
+    for (auto &lease : leases) {
+        lease.release();
+    }
+}
+
+bool ReceiveBatch::enableGro(int fd) {
+#ifdef __linux__
+    int on = 1;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        return false;
+    }
+    gro = true;
+    bufferSize = 65535;
+    buffers.assign(batchSize * bufferSize, 0);
+    for (auto &lease : leases) {
+        lease.release();
+    }
+    return true;
+#else
+    (void) fd;
+    return false;
+#endif
+}
+
+bool ReceiveBatch::enableTimestamps(int fd) {
+    timestamps = enableReceiveTimestamps(fd);
+    return timestamps;
+}
+
+// Give slot i a pool slab if it lacks one; slabs survive across calls until taken
+void ReceiveBatch::prepareSlot(size_t i) {
+    if (pool && !leases[i] && pool->slabSize() >= bufferSize) {
+        leases[i] = pool->acquire();
+    }
+#ifdef __linux__
+    if (leases[i]) {
+        iovecs[i].iov_base = leases[i].data();
+        iovecs[i].iov_len = leases[i].capacity();
+    } else {
+        iovecs[i].iov_base = buffers.data() + i * bufferSize;
+        iovecs[i].iov_len = bufferSize;
+    }
+#endif
+}
+
+BufferLease ReceiveBatch::take(size_t i) {
+    leases[i].setSize(lengths[i]);
+    return std::move(leases[i]);
+}
+
+size_t ReceiveBatch::receive(int fd, bool wait) {
+#ifdef __linux__
+    // recvmmsg overwrites msg_namelen and msg_len, so the headers are reset every call
+    for (size_t i = 0; i < batchSize; ++i) {
+        prepareSlot(i);
+        std::memset(&headers[i], 0, sizeof(mmsghdr));
+        headers[i].msg_hdr.msg_iov = &iovecs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        if (gro || timestamps) {
+            headers[i].msg_hdr.msg_control = controls.data() + i * CONTROL_SPACE;
+            headers[i].msg_hdr.msg_controllen = CONTROL_SPACE;
+        }
+    }
+
+    int count;
+    do {
+        // MSG_WAITFORONE: block for the first datagram, then take whatever else is queued
+        count = recvmmsg(fd, headers.data(), static_cast<unsigned int>(batchSize),
+                         wait ? MSG_WAITFORONE : MSG_DONTWAIT, nullptr);
+    } while (count < 0 && errno == EINTR);
+
+    if (count < 0) {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        throw lastError("recvmmsg");
+    }
+    for (int i = 0; i < count; ++i) {
+        lengths[i] = headers[i].msg_len;
+        segmentSizes[i] = 0;
+        if (timestamps) {
+            kernelTimes[i] = kernelTimestamp(headers[i].msg_hdr);
+        }
+        if (!gro) continue;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr); cmsg;
+             cmsg = CMSG_NXTHDR(&headers[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                segmentSizes[i] = static_cast<size_t>(segment);
+            }
+        }
+    }
+    return static_cast<size_t>(count);
+#else
+    prepareSlot(0);
+    char *target = leases[0] ? leases[0].data() : buffers.data();
+    size_t targetLen = leases[0] ? leases[0].capacity() : bufferSize;
+    socklen_t addressLen = sizeof(sockaddr_storage);
+    ssize_t len;
+    do {
+        len = recvfrom(fd, target, targetLen, wait ? 0 : MSG_DONTWAIT,
+                       reinterpret_cast<sockaddr *>(&addresses[0]), &addressLen);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        throw lastError("recvfrom");
+    }
+    lengths[0] = static_cast<size_t>(len);
+    return 1;
+#endif
+}
+
+udp::endpoint ReceiveBatch::sender(size_t i) const {
+    udp::endpoint endpoint;
+    const auto *address = reinterpret_cast<const sockaddr *>(&addresses[i]);
+    size_t len = address->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    std::memcpy(endpoint.data(), address, len);
+    endpoint.resize(len);
+    return endpoint;
+}
+
+SendBatch::SendBatch(size_t batchSize) : batchSize(batchSize == 0 ? 1 : batchSize) {
+    messages.reserve(this->batchSize);
+    destinations.reserve(this->batchSize);
+#ifdef __linux__
+    headers.resize(this->batchSize);
+    iovecs.resize(this->batchSize);
+#endif
+}
+
+bool SendBatch::add(const std::string &message, const udp::endpoint &destination) {
+    messages.push_back(message);
+    destinations.push_back(destination);
+    return messages.size() >= batchSize;
+}
+
+size_t SendBatch::flush(int fd) {
+    size_t calls = 0;
+#ifdef __linux__
+    size_t sent = 0;
+    while (sent < messages.size()) {
+        size_t count = std::min(messages.size() - sent, batchSize);
+        for (size_t i = 0; i < count; ++i) {
+            iovecs[i].iov_base = const_cast<char *>(messages[sent + i].data());
+            iovecs[i].iov_len = messages[sent + i].size();
+            std::memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+            headers[i].msg_hdr.msg_name = const_cast<sockaddr *>(destinations[sent + i].data());
+            headers[i].msg_hdr.msg_namelen = static_cast<socklen_t>(destinations[sent + i].size());
+        }
+
+        int result = sendmmsg(fd, headers.data(), static_cast<unsigned int>(count), 0);
+        if (result < 0) {
+            // An interrupted or blocked call sent nothing, so only completed ones are counted
+            if (errno == EINTR || waitWritable(fd)) continue;
+            messages.clear();
+            destinations.clear();
+            throw lastError("sendmmsg");
+        }
+        // A short count means the kernel stopped early; retry from the first unsent datagram
+        ++calls;
+        sent += static_cast<size_t>(result);
+    }
+#else
+    for (size_t i = 0; i < messages.size(); ++i) {
+        ++calls;
+        if (sendto(fd, messages[i].data(), messages[i].size(), 0,
+                   destinations[i].data(), static_cast<socklen_t>(destinations[i].size())) < 0) {
+            if (errno == EINTR || waitWritable(fd)) {
+                --i;
+                continue;
+            }
+            messages.clear();
+            destinations.clear();
+            throw lastError("sendto");
+        }
+    }
+#endif
+    messages.clear();
+    destinations.clear();
+    return calls;
+}
+
+bool SegmentedSend::supported(int fd) {
+#ifdef __linux__
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+    return getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+#else
+    (void) fd;
+    return false;
+#endif
+}
+
+size_t SegmentedSend::send(int fd, const std::vector<std::string_view> &datagrams, const udp::endpoint &destination,
+                           size_t &sent) {
+    size_t calls = 0;
+    sent = 0;
+#ifdef __linux__
+    std::vector<iovec> iovecs(std::min(datagrams.size(), MAX_GSO_SEGMENTS));
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint16_t))];
+    while (sent < datagrams.size()) {
+        // Extend the run while sizes match; a shorter datagram can only close it
+        size_t segment = datagrams[sent].size();
+        size_t count = 0;
+        size_t bytes = 0;
+        while (sent + count < datagrams.size() && count < MAX_GSO_SEGMENTS) {
+            size_t size = datagrams[sent + count].size();
+            if (size > segment || bytes + size > MAX_GSO_BYTES || (count > 0 && segment == 0)) break;
+            iovecs[count].iov_base = const_cast<char *>(datagrams[sent + count].data());
+            iovecs[count].iov_len = size;
+            bytes += size;
+            ++count;
+            if (size < segment) break;
+        }
+
+        msghdr header{};
+        header.msg_name = const_cast<sockaddr *>(destination.data());
+        header.msg_namelen = static_cast<socklen_t>(destination.size());
+        header.msg_iov = iovecs.data();
+        header.msg_iovlen = count;
+        if (count > 1) {
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            auto segmentSize = static_cast<uint16_t>(segment);
+            std::memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+        }
+
+        if (sendmsg(fd, &header, 0) < 0) {
+            if (errno == EINTR || waitWritable(fd)) continue;
+            throw lastError("sendmsg");
+        }
+        ++calls;
+        sent += count;
+    }
+#else
+    for (; sent < datagrams.size(); ++sent) {
+        ++calls;
+        if (sendto(fd, datagrams[sent].data(), datagrams[sent].size(), 0,
+                   destination.data(), static_cast<socklen_t>(destination.size())) < 0) {
+            if (errno == EINTR || waitWritable(fd)) {
+                --sent;
+                continue;
+            }
+            throw lastError("sendto");
+        }
+    }
+#endif
+    return calls;
+}
+
+size_t sendDatagram(int fd, std::string_view datagram, const udp::endpoint &destination,
+                    boost::system::error_code &error) {
+    error.clear();
+    for (;;) {
+        ssize_t len = sendto(fd, datagram.data(), datagram.size(), 0, destination.data(),
+                             static_cast<socklen_t>(destination.size()));
+        if (len >= 0) {
+            return static_cast<size_t>(len);
+        }
+        if (errno == EINTR || waitWritable(fd)) continue;
+        error = boost::system::error_code(errno, boost::system::system_category());
+        return 0;
+    }
+}
@@ -0,0 +1,101 @@
+//
+// Created by Omer Mersin on 11/18/24.
+//
+#include "networking/buffer_pool.h"
+#include <stdexcept>
+
+BufferLease::BufferLease(BufferPool *pool, uint32_t index) : pool(pool), index(index) {}
+
+BufferLease::BufferLease(BufferLease &&other) noexcept
+        : pool(other.pool), index(other.index), offset(other.offset), length(other.length),
+          owned(std::move(other.owned)) {
+    other.pool = nullptr;
+}
+
+BufferLease &BufferLease::operator=(BufferLease &&other) noexcept {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        index = other.index;
+        offset = other.offset;
+        length = other.length;
+        owned = std::move(other.owned);
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+BufferLease::~BufferLease() {
+    release();
+}
+
+BufferLease BufferLease::adopt(std::string bytes) {
+    BufferLease lease;
+    lease.length = bytes.size();
+    lease.owned = std::make_unique<std::string>(std::move(bytes));
+    return lease;
+}
+
+char *BufferLease::data() const {
+    if (owned) return owned->data() + offset;
+    return pool ? pool->slab(index) + offset : nullptr;
+}
+
+size_t BufferLease::capacity() const {
+    if (owned) return owned->size() - offset;
+    return pool ? pool->slabSize() - offset : 0;
+}
+
+void BufferLease::release() {
+    if (pool) {
+        pool->release(index);
+        pool = nullptr;
+    }
+    owned.reset();
+    offset = 0;
+    length = 0;
+}
+
+BufferPool::BufferPool(size_t slabCount, size_t slabSize)
+        : count(slabCount), slabBytes(slabSize),
+          storage(new char[slabCount * slabSize]),
+          next(new std::atomic<uint32_t>[slabCount]),
+          head(0), free(slabCount) {
+    if (slabCount == 0 || slabCount >= NONE) {
+        throw std::invalid_argument("Buffer pool slab count out of range.");
+    }
+    for (size_t i = 0; i < slabCount; ++i) {
+        next[i].store(i + 1 < slabCount ? static_cast<uint32_t>(i + 1) : NONE, std::memory_order_relaxed);
+    }
+}
+
+BufferLease BufferPool::acquire() {
+    uint64_t current = head.load(std::memory_order_acquire);
+    for (;;) {
+        auto index = static_cast<uint32_t>(current);
+        if (index == NONE) {
+            return {};
+        }
+        uint64_t tag = (current >> 32) + 1;
+        uint64_t replacement = (tag << 32) | next[index].load(std::memory_order_relaxed);
+        if (head.compare_exchange_weak(current, replacement,
+                                       std::memory_order_acq_rel, std::memory_order_acquire)) {
+            free.fetch_sub(1, std::memory_order_relaxed);
+            return {this, index};
+        }
+    }
+}
+
+void BufferPool::release(uint32_t index) {
+    uint64_t current = head.load(std::memory_order_relaxed);
+    for (;;) {
+        next[index].store(static_cast<uint32_t>(current), std::memory_order_relaxed);
+        uint64_t tag = (current >> 32) + 1;
+        uint64_t replacement = (tag << 32) | index;
+        if (head.compare_exchange_weak(current, replacement,
+                                       std::memory_order_release, std::memory_order_relaxed)) {
+            free.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+//
+// Created by Omer Mersin on 11/21/24.
+//
+#include "networking/coalescer.h"
+#include "networking/framing.h"
+
+Coalescer::Coalescer(std::chrono::microseconds latencyBudget) : latencyBudget(latencyBudget) {}
+
+Coalescer::AddResult Coalescer::add(const std::string &message, const boost::asio::ip::udp::endpoint &destination,
+                                    size_t maxDatagramSize, Clock::time_point now, std::vector<Datagram> &ready) {
+    // Frame-looking messages would be ambiguous if a lone entry were later sent unwrapped
+    if (FRAME_HEADER_SIZE + BUNDLE_ENTRY_OVERHEAD + message.size() > maxDatagramSize ||
+        isFrame(message.data(), message.size())) {
+        return AddResult::Rejected;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Queue &queue = queues[destination];
+    if (queue.messages > 0 && queue.bundle.size() + BUNDLE_ENTRY_OVERHEAD + message.size() > maxDatagramSize) {
+        seal(destination, queue, ready);
+    }
+    AddResult result = AddResult::Queued;
+    if (queue.messages == 0) {
+        queue.bundle.clear();
+        appendFrameHeader(queue.bundle, FrameType::Bundle);
+        queue.deadline = now + latencyBudget;
+        result = AddResult::Opened;
+    }
+    appendU16(queue.bundle, static_cast<uint16_t>(message.size()));
+    queue.bundle += message;
+    queue.messages++;
+    return result;
+}
+
+void Coalescer::collectDue(Clock::time_point now, std::vector<Datagram> &ready) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = queues.begin(); it != queues.end();) {
+        if (it->second.messages == 0) {
+            // Drop idle destinations so the map only tracks peers with traffic in flight
+            it = queues.erase(it);
+            continue;
+        }
+        if (it->second.deadline <= now) {
+            seal(it->first, it->second, ready);
+        }
+        ++it;
+    }
+}
+
+void Coalescer::collectAll(std::vector<Datagram> &ready) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[destination, queue] : queues) {
+        if (queue.messages > 0) {
+            seal(destination, queue, ready);
+        }
+    }
+}
+
+std::optional<Coalescer::Clock::time_point> Coalescer::nextDeadline() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::optional<Clock::time_point> earliest;
+    for (const auto &[destination, queue] : queues) {
+        if (queue.messages > 0 && (!earliest || queue.deadline < *earliest)) {
+            earliest = queue.deadline;
+        }
+    }
+    return earliest;
+}
+
+// Caller must hold mutex. A bundle of one goes out as the bare message to save the framing.
+void Coalescer::seal(const boost::asio::ip::udp::endpoint &destination, Queue &queue, std::vector<Datagram> &ready) {
+    if (queue.messages == 1) {
+        ready.push_back({destination, queue.bundle.substr(FRAME_HEADER_SIZE + BUNDLE_ENTRY_OVERHEAD), 1});
+    } else {
+        ready.push_back({destination, std::move(queue.bundle), queue.messages});
+    }
+    queue.bundle.clear();
+    queue.messages = 0;
+}
@@ -0,0 +1,263 @@
+//
+// Created by Omer Mersin on 11/24/24.
+//
+#include "networking/compression.h"
+#include "networking/framing.h"
+#include <algorithm>
+#include <stdexcept>
+#ifdef P2P_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef P2P_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+static constexpr int ZSTD_LEVEL = 3;
+static constexpr size_t LZ4_WINDOW = 64 * 1024;  // LZ4 only looks back this far into a dictionary
+
+struct Compressor::Dictionary {
+    std::string content;
+    uint32_t id = 0;
+#ifdef P2P_HAVE_ZSTD
+    ZSTD_CDict *compressDict = nullptr;
+    ZSTD_DDict *decompressDict = nullptr;
+
+    ~Dictionary() {
+        ZSTD_freeCDict(compressDict);
+        ZSTD_freeDDict(decompressDict);
+    }
+#endif
+};
+
+#ifdef P2P_HAVE_ZSTD
+// Contexts keep their tables between calls, so each thread allocates them once
+struct ZstdContexts {
+    ZSTD_CCtx *compress = ZSTD_createCCtx();
+    ZSTD_DCtx *decompress = ZSTD_createDCtx();
+
+    ~ZstdContexts() {
+        ZSTD_freeCCtx(compress);
+        ZSTD_freeDCtx(decompress);
+    }
+};
+
+static ZstdContexts &zstdContexts() {
+    thread_local ZstdContexts contexts;
+    return contexts;
+}
+#endif
+
+#ifdef P2P_HAVE_LZ4
+struct Lz4Stream {
+    LZ4_stream_t *stream = LZ4_createStream();
+
+    ~Lz4Stream() { LZ4_freeStream(stream); }
+};
+
+static LZ4_stream_t *lz4Stream() {
+    thread_local Lz4Stream stream;
+    return stream.stream;
+}
+#endif
+
+// FNV-1a over the content; never 0, which means "no dictionary" on the wire
+static uint32_t contentId(const std::string &content) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char byte : content) {
+        hash = (hash ^ byte) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+Compressor::Compressor() = default;
+Compressor::~Compressor() = default;
+
+uint8_t Compressor::available() {
+    uint8_t codecs = 0;
+#ifdef P2P_HAVE_ZSTD
+    codecs |= codecBit(Codec::Zstd);
+#endif
+#ifdef P2P_HAVE_LZ4
+    codecs |= codecBit(Codec::Lz4);
+#endif
+    return codecs;
+}
+
+Codec Compressor::choose(uint8_t local, uint8_t remote) {
+    uint8_t common = local & remote;
+    for (Codec codec : {Codec::Zstd, Codec::Lz4}) {
+        if (common & codecBit(codec)) {
+            return codec;
+        }
+    }
+    return Codec::None;
+}
+
+void Compressor::setDictionary(std::string content) {
+    if (content.empty()) {
+        dictionary.reset();
+        return;
+    }
+    auto loaded = std::make_shared<Dictionary>();
+    loaded->id = contentId(content);
+    loaded->content = std::move(content);
+#ifdef P2P_HAVE_ZSTD
+    loaded->compressDict = ZSTD_createCDict(loaded->content.data(), loaded->content.size(), ZSTD_LEVEL);
+    loaded->decompressDict = ZSTD_createDDict(loaded->content.data(), loaded->content.size());
+    if (!loaded->compressDict || !loaded->decompressDict) {
+        throw std::runtime_error("Failed to load compression dictionary.");
+    }
+#endif
+    dictionary = std::move(loaded);
+}
+
+uint32_t Compressor::dictionaryId() const {
+    return dictionary ? dictionary->id : 0;
+}
+
+std::optional<std::string> Compressor::compress(std::string_view payload, Codec codec, bool useDictionary,
+                                                size_t maxFrameSize) const {
+    if (maxFrameSize <= COMPRESSED_HEADER_SIZE || payload.size() > UINT32_MAX) {
+        return std::nullopt;
+    }
+    const Dictionary *dict = useDictionary ? dictionary.get() : nullptr;
+    std::string frame;
+    appendFrameHeader(frame, FrameType::Compressed);
+    frame.push_back(static_cast<char>(codec));
+    appendU32(frame, dict ? dict->id : 0);
+    appendU32(frame, static_cast<uint32_t>(payload.size()));
+
+    // Codecs write straight into the space left under the limit and fail if it runs out
+    [[maybe_unused]] size_t capacity = maxFrameSize - COMPRESSED_HEADER_SIZE;
+    frame.resize(maxFrameSize);
+    [[maybe_unused]] char *out = frame.data() + COMPRESSED_HEADER_SIZE;
+    size_t written = 0;
+    switch (codec) {
+#ifdef P2P_HAVE_ZSTD
+        case Codec::Zstd: {
+            ZSTD_CCtx *context = zstdContexts().compress;
+            size_t result = dict
+                            ? ZSTD_compress_usingCDict(context, out, capacity, payload.data(), payload.size(),
+                                                       dict->compressDict)
+                            : ZSTD_compressCCtx(context, out, capacity, payload.data(), payload.size(), ZSTD_LEVEL);
+            if (ZSTD_isError(result)) {
+                return std::nullopt;
+            }
+            written = result;
+            break;
+        }
+#endif
+#ifdef P2P_HAVE_LZ4
+        case Codec::Lz4: {
+            int limit = static_cast<int>(std::min<size_t>(capacity, INT32_MAX));
+            int result;
+            if (dict) {
+                LZ4_stream_t *stream = lz4Stream();
+                LZ4_resetStream_fast(stream);
+                size_t window = std::min(dict->content.size(), LZ4_WINDOW);
+                LZ4_loadDict(stream, dict->content.data() + dict->content.size() - window, static_cast<int>(window));
+                result = LZ4_compress_fast_continue(stream, payload.data(), out, static_cast<int>(payload.size()),
+                                                    limit, 1);
+            } else {
+                result = LZ4_compress_default(payload.data(), out, static_cast<int>(payload.size()), limit);
+            }
+            if (result <= 0) {
+                return std::nullopt;
+            }
+            written = static_cast<size_t>(result);
+            break;
+        }
+#endif
+        default:
+            return std::nullopt;
+    }
+    if (payload.size() > written * MAX_COMPRESSION_RATIO) {
+        return std::nullopt;
+    }
+    frame.resize(COMPRESSED_HEADER_SIZE + written);
+    return frame;
+}
+
+std::string Compressor::decompress(const char *frame, size_t len, size_t maxSize) const {
+    if (len < COMPRESSED_HEADER_SIZE) {
+        throw std::runtime_error("Truncated compressed frame.");
+    }
+    auto codec = static_cast<Codec>(static_cast<uint8_t>(frame[2]));
+    uint32_t dictId = readU32(frame + 3);
+    uint32_t originalSize = readU32(frame + 7);
+    if (originalSize > maxSize) {
+        throw std::runtime_error("Compressed message exceeds the size limit.");
+    }
+    // The claim is checked against what the codec output could expand to before it is allocated
+    if (originalSize > (len - COMPRESSED_HEADER_SIZE) * MAX_COMPRESSION_RATIO) {
+        throw std::runtime_error("Compressed message claims an impossible size.");
+    }
+    [[maybe_unused]] const Dictionary *dict = nullptr;
+    if (dictId != 0) {
+        if (!dictionary || dictionary->id != dictId) {
+            throw std::runtime_error("Compressed with an unknown dictionary.");
+        }
+        dict = dictionary.get();
+    }
+
+    [[maybe_unused]] const char *in = frame + COMPRESSED_HEADER_SIZE;
+    [[maybe_unused]] size_t inLen = len - COMPRESSED_HEADER_SIZE;
+#ifdef P2P_HAVE_ZSTD
+    // zstd frames record their content size; it must agree with the header
+    if (codec == Codec::Zstd && ZSTD_getFrameContentSize(in, inLen) != originalSize) {
+        throw std::runtime_error("Corrupt compressed frame.");
+    }
+#endif
+    std::string payload(originalSize, '\0');
+    size_t produced = SIZE_MAX;
+    switch (codec) {
+#ifdef P2P_HAVE_ZSTD
+        case Codec::Zstd: {
+            ZSTD_DCtx *context = zstdContexts().decompress;
+            size_t result = dict
+                            ? ZSTD_decompress_usingDDict(context, payload.data(), payload.size(), in, inLen,
+                                                         dict->decompressDict)
+                            : ZSTD_decompressDCtx(context, payload.data(), payload.size(), in, inLen);
+            if (!ZSTD_isError(result)) {
+                produced = result;
+            }
+            break;
+        }
+#endif
+#ifdef P2P_HAVE_LZ4
+        case Codec::Lz4: {
+            int result;
+            if (dict) {
+                size_t window = std::min(dict->content.size(), LZ4_WINDOW);
+                result = LZ4_decompress_safe_usingDict(in, payload.data(), static_cast<int>(inLen),
+                                                       static_cast<int>(payload.size()),
+                                                       dict->content.data() + dict->content.size() - window,
+                                                       static_cast<int>(window));
+            } else {
+                result = LZ4_decompress_safe(in, payload.data(), static_cast<int>(inLen),
+                                             static_cast<int>(payload.size()));
+            }
+            if (result >= 0) {
+                produced = static_cast<size_t>(result);
+            }
+            break;
+        }
+#endif
+        default:
+            throw std::runtime_error("Unsupported compression codec.");
+    }
+    if (produced != originalSize) {
+        throw std::runtime_error("Corrupt compressed frame.");
+    }
+    return payload;
+}
+
+std::string Compressor::encodeCapabilities(uint8_t codecs, uint32_t dictionaryId, bool wantReply) {
+    std::string frame;
+    frame.reserve(CAPABILITIES_FRAME_SIZE);
+    appendFrameHeader(frame, FrameType::Capabilities);
+    frame.push_back(static_cast<char>(codecs));
+    appendU32(frame, dictionaryId);
+    frame.push_back(static_cast<char>(wantReply ? CAPABILITIES_WANT_REPLY : 0));
+    return frame;
+}
@@ -0,0 +1,272 @@
+//
+// Created by Omer Mersin on 11/26/24.
+//
+#include "networking/connection_table.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using std::chrono::microseconds;
+
+static_assert(sizeof(ConnectionTable::Clock::rep) == 8, "lastSeen is stored as a 64-bit tick count");
+
+// Same bounds as the reliable channel's own estimator
+static constexpr microseconds MIN_RTO = std::chrono::milliseconds(50);
+static constexpr microseconds MAX_RTO = std::chrono::seconds(60);
+// Each delivery outcome moves the loss estimate this far towards 0 or 1
+static constexpr double LOSS_GAIN = 1.0 / 64;
+// Entries compared when the table is full; the one seen longest ago among them is replaced
+static constexpr size_t EVICTION_SAMPLES = 16;
+
+static uint64_t packRtt(uint64_t srtt, uint64_t rttvar) {
+    return std::min<uint64_t>(srtt, UINT32_MAX) << 32 | std::min<uint64_t>(rttvar, UINT32_MAX);
+}
+
+void ConnectionTable::Entry::reset(const CompactEndpoint &remote, Clock::time_point now) {
+    endpoint = remote;
+    offered.store(false, std::memory_order_relaxed);
+    codecs.store(0, std::memory_order_relaxed);
+    dictionaryId.store(0, std::memory_order_relaxed);
+    lossPpm.store(0, std::memory_order_relaxed);
+    datagramSize.store(0, std::memory_order_relaxed);
+    lastSeen.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+    datagrams.store(0, std::memory_order_relaxed);
+    bytes.store(0, std::memory_order_relaxed);
+    rtt.store(0, std::memory_order_relaxed);
+}
+
+ConnectionTable::ConnectionTable(size_t capacity) : capacity(capacity) {}
+
+void ConnectionTable::setCapacity(size_t newCapacity) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    capacity = newCapacity;
+}
+
+// Runs apply on remote's entry, creating it if needed. Known endpoints only take the
+// shared lock; apply must therefore stick to atomic operations.
+template <typename Update>
+bool ConnectionTable::update(const CompactEndpoint &remote, Clock::time_point now, Update &&apply) {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto found = index.find(remote);
+        if (found != index.end()) {
+            apply(entries[found->second]);
+            return true;
+        }
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto found = index.find(remote);
+    if (found == index.end()) {
+        if (capacity == 0) {
+            return false;
+        }
+        uint32_t slot;
+        if (index.size() >= capacity) {
+            slot = evictLocked();
+        } else if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(entries.size());
+            entries.emplace_back();
+        }
+        entries[slot].reset(remote, now);
+        found = index.emplace(remote, slot).first;
+    }
+    apply(entries[found->second]);
+    return true;
+}
+
+// Approximate LRU: the least recently seen of the next EVICTION_SAMPLES live entries after
+// the hand is forgotten and its slot returned, so a full table costs a bounded scan per newcomer
+uint32_t ConnectionTable::evictLocked() {
+    uint32_t victim = 0;
+    Clock::rep oldest = 0;
+    size_t sampled = 0;
+    for (size_t step = 0; step < entries.size() && sampled < EVICTION_SAMPLES; ++step) {
+        auto slot = static_cast<uint32_t>(hand++ % entries.size());
+        auto found = index.find(entries[slot].endpoint);
+        if (found == index.end() || found->second != slot) {
+            continue;  // Free slot
+        }
+        Clock::rep seen = entries[slot].lastSeen.load(std::memory_order_relaxed);
+        if (sampled++ == 0 || seen < oldest) {
+            victim = slot;
+            oldest = seen;
+        }
+    }
+    index.erase(entries[victim].endpoint);
+    return victim;
+}
+
+const ConnectionTable::Entry *ConnectionTable::findLocked(const CompactEndpoint &remote) const {
+    auto found = index.find(remote);
+    return found == index.end() ? nullptr : &entries[found->second];
+}
+
+void ConnectionTable::touch(const CompactEndpoint &remote, size_t bytes, size_t datagrams, Clock::time_point now) {
+    update(remote, now, [&](Entry &entry) {
+        entry.lastSeen.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+        entry.datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+        entry.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    });
+}
+
+void ConnectionTable::addRttSample(const CompactEndpoint &remote, microseconds sample) {
+    auto measured = static_cast<uint64_t>(std::max<int64_t>(sample.count(), 1));
+    update(remote, Clock::now(), [&](Entry &entry) {
+        uint64_t current = entry.rtt.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            if (current == 0) {
+                next = packRtt(measured, measured / 2);
+            } else {
+                uint64_t srtt = current >> 32;
+                uint64_t rttvar = current & UINT32_MAX;
+                uint64_t delta = srtt > measured ? srtt - measured : measured - srtt;
+                next = packRtt((srtt * 7 + measured) / 8, (rttvar * 3 + delta) / 4);
+            }
+        } while (!entry.rtt.compare_exchange_weak(current, next, std::memory_order_relaxed));
+    });
+}
+
+void ConnectionTable::addDeliveries(const CompactEndpoint &remote, size_t delivered, size_t lost) {
+    size_t outcomes = delivered + lost;
+    if (outcomes == 0) {
+        return;
+    }
+    // Equivalent to applying LOSS_GAIN once per outcome
+    double keep = std::pow(1.0 - LOSS_GAIN, static_cast<double>(outcomes));
+    double target = 1e6 * static_cast<double>(lost) / static_cast<double>(outcomes);
+    update(remote, Clock::now(), [&](Entry &entry) {
+        uint32_t current = entry.lossPpm.load(std::memory_order_relaxed);
+        uint32_t next;
+        do {
+            next = static_cast<uint32_t>(std::lround(current * keep + target * (1.0 - keep)));
+        } while (!entry.lossPpm.compare_exchange_weak(current, next, std::memory_order_relaxed));
+    });
+}
+
+std::optional<ConnectionInfo> ConnectionTable::get(const CompactEndpoint &remote) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    const Entry *entry = findLocked(remote);
+    if (!entry) {
+        return std::nullopt;
+    }
+    ConnectionInfo info;
+    info.endpoint = entry->endpoint;
+    info.lastSeen = Clock::time_point(Clock::duration(entry->lastSeen.load(std::memory_order_relaxed)));
+    info.datagramsReceived = entry->datagrams.load(std::memory_order_relaxed);
+    info.bytesReceived = entry->bytes.load(std::memory_order_relaxed);
+    uint64_t rtt = entry->rtt.load(std::memory_order_relaxed);
+    if (rtt != 0) {
+        info.srtt = microseconds(rtt >> 32);
+        info.rttvar = microseconds(rtt & UINT32_MAX);
+    }
+    info.lossRate = entry->lossPpm.load(std::memory_order_relaxed) / 1e6;
+    info.datagramSize = entry->datagramSize.load(std::memory_order_relaxed);
+    info.capabilitiesOffered = entry->offered.load(std::memory_order_relaxed);
+    info.codecs = entry->codecs.load(std::memory_order_relaxed);
+    info.dictionaryId = entry->dictionaryId.load(std::memory_order_relaxed);
+    return info;
+}
+
+std::optional<microseconds> ConnectionTable::srtt(const CompactEndpoint &remote) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    const Entry *entry = findLocked(remote);
+    uint64_t rtt = entry ? entry->rtt.load(std::memory_order_relaxed) : 0;
+    if (rtt == 0) {
+        return std::nullopt;
+    }
+    return microseconds(rtt >> 32);
+}
+
+microseconds ConnectionTable::retransmitTimeout(const CompactEndpoint &remote, microseconds fallback) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    const Entry *entry = findLocked(remote);
+    uint64_t rtt = entry ? entry->rtt.load(std::memory_order_relaxed) : 0;
+    if (rtt == 0) {
+        return fallback;
+    }
+    microseconds srtt(rtt >> 32);
+    microseconds rttvar(rtt & UINT32_MAX);
+    return std::clamp(srtt + std::max(microseconds(1000), rttvar * 4), MIN_RTO, MAX_RTO);
+}
+
+std::vector<boost::asio::ip::udp::endpoint> ConnectionTable::fastest(
+        std::vector<boost::asio::ip::udp::endpoint> candidates, size_t count) const {
+    std::vector<std::pair<uint64_t, size_t>> ranked;
+    ranked.reserve(candidates.size());
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const Entry *entry = findLocked(CompactEndpoint::fromUdp(candidates[i]));
+            uint64_t rtt = entry ? entry->rtt.load(std::memory_order_relaxed) : 0;
+            ranked.emplace_back(rtt == 0 ? UINT64_MAX : rtt >> 32, i);
+        }
+    }
+    count = std::min(count, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + static_cast<std::ptrdiff_t>(count), ranked.end());
+    std::vector<boost::asio::ip::udp::endpoint> chosen;
+    chosen.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        chosen.push_back(std::move(candidates[ranked[i].second]));
+    }
+    return chosen;
+}
+
+ConnectionTable::CodecState ConnectionTable::offerCodecs(const CompactEndpoint &remote) {
+    CodecState state{true, 0, 0};
+    update(remote, Clock::now(), [&](Entry &entry) {
+        state.offered = entry.offered.exchange(true, std::memory_order_relaxed);
+        state.codecs = entry.codecs.load(std::memory_order_relaxed);
+        state.dictionaryId = entry.dictionaryId.load(std::memory_order_relaxed);
+    });
+    return state;
+}
+
+// The codec mask and dictionary id are stored separately; a sender that briefly pairs
+// a new mask with an old id gets corrected by the receiver's Capabilities reply
+void ConnectionTable::setCodecs(const CompactEndpoint &remote, uint8_t codecs, uint32_t dictionaryId,
+                                bool offered) {
+    update(remote, Clock::now(), [&](Entry &entry) {
+        entry.codecs.store(codecs, std::memory_order_relaxed);
+        entry.dictionaryId.store(dictionaryId, std::memory_order_relaxed);
+        if (offered) {
+            entry.offered.store(true, std::memory_order_relaxed);
+        }
+    });
+}
+
+size_t ConnectionTable::datagramSize(const CompactEndpoint &remote) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    const Entry *entry = findLocked(remote);
+    return entry ? entry->datagramSize.load(std::memory_order_relaxed) : 0;
+}
+
+void ConnectionTable::setDatagramSize(const CompactEndpoint &remote, size_t size) {
+    auto stored = static_cast<uint16_t>(std::min<size_t>(size, UINT16_MAX));
+    update(remote, Clock::now(), [&](Entry &entry) {
+        entry.datagramSize.store(stored, std::memory_order_relaxed);
+    });
+}
+
+size_t ConnectionTable::expire(Clock::time_point cutoff) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    size_t expired = 0;
+    for (auto it = index.begin(); it != index.end();) {
+        if (entries[it->second].lastSeen.load(std::memory_order_relaxed) < cutoff.time_since_epoch().count()) {
+            freeSlots.push_back(it->second);
+            it = index.erase(it);
+            expired++;
+        } else {
+            ++it;
+        }
+    }
+    return expired;
+}
+
+size_t ConnectionTable::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return index.size();
+}
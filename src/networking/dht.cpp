@@ -2,128 +2,575 @@
 // Created by Omer Mersin on 11/16/24.
 //
 #include "networking/dht.h"
+#include "networking/dht_protocol.h"
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
-#include <sstream>
+#include <charconv>
 #include <vector>
-#include "utils.h"
 #include <QHash>
 #include <QString>
 
-// Discover nodes by sending a DISCOVER message to a bootstrap node
-void DHT::discoverNodes(const std::string &bootstrapIP, int bootstrapPort) {
-    sendMessage("DISCOVER", bootstrapIP, bootstrapPort);
+// Per-query timeout until a node's RTT is known, and the floor under RTT-derived ones
+static constexpr std::chrono::milliseconds DEFAULT_QUERY_TIMEOUT(1000);
+static constexpr std::chrono::milliseconds MIN_QUERY_TIMEOUT(100);
+
+// Splits the next field off text at delimiter, leaving the rest in text
+static std::string_view nextField(std::string_view &text, char delimiter) {
+    size_t end = text.find(delimiter);
+    std::string_view field = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return field;
+}
+
+// Whole-field decimal; false rather than an exception on anything else
+template<typename Number>
+static bool parseNumber(std::string_view text, Number &value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
 }
 
-void DHT::handleIncomingMessage(const std::string &message, const std::string &ip, int port) {
-    if (message == "DISCOVER") {
-        std::cout << "[DEBUG] Received DISCOVER from " << ip << ":" << port << std::endl;
+// Calls visit(id, ip, port) for each "id,ip,port;" record of a ROUTING_TABLE or NODES
+// message, or each "ip,port;" of PROVIDERS (id then empty). Malformed records are skipped.
+template<typename Visit>
+static void forEachTextRecord(std::string_view records, bool withId, Visit &&visit) {
+    while (!records.empty()) {
+        std::string_view record = nextField(records, ';');
+        std::string_view id = withId ? nextField(record, ',') : std::string_view();
+        std::string_view ip = nextField(record, ',');
+        int port;
+        if (!ip.empty() && parseNumber(record, port)) {
+            visit(id, ip, port);
+        }
+    }
+}
 
-        // Add the sender to the routing table
-        DHTNode newNode{std::to_string(qHash(QString::fromStdString(ip + ":" + std::to_string(port)))), ip, port};
-        addNode(newNode);
+static constexpr std::pair<std::string_view, DhtMessageType> TEXT_COMMANDS[] = {
+            {"DISCOVER", DhtMessageType::Discover},
+            {"ROUTING_TABLE", DhtMessageType::RoutingTable},
+            {"ANNOUNCE", DhtMessageType::Announce},
+            {"PROVIDE", DhtMessageType::Provide},
+            {"GET_PROVIDERS", DhtMessageType::GetProviders},
+            {"PROVIDERS", DhtMessageType::Providers},
+            {"FIND_NODE", DhtMessageType::FindNode},
+            {"FIND_VALUE", DhtMessageType::FindValue},
+            {"NODES", DhtMessageType::Nodes},
+            {"VALUE", DhtMessageType::Value},
+            {"STORE", DhtMessageType::Store},
+};
 
-        // Log routing table after adding the node
-        std::cout << "[DEBUG] Routing Table after DISCOVER:" << std::endl;
-        for (const auto &[id, node] : routingTable) {
-            std::cout << "Node ID: " << id << ", IP: " << node.ip << ", Port: " << node.port << std::endl;
+static std::optional<DhtMessageType> textCommand(std::string_view name) {
+    for (const auto &[command, type] : TEXT_COMMANDS) {
+        if (command == name) {
+            return type;
         }
+    }
+    return std::nullopt;
+}
 
-        // Prepare the routing table response
-        std::string response = "ROUTING_TABLE ";
-        {
-            std::lock_guard<std::mutex> lock(dhtMutex);
-            for (const auto &[id, node] : routingTable) {
-                response += id + "," + node.ip + "," + std::to_string(node.port) + ";";
-            }
+// Nodes from binary records are named by their key until they announce a name
+static DHTNode toNode(const NodeRecord &record) {
+    return {toHex(record.id), record.ip(), record.port};
+}
+
+// Discover nodes by sending a DISCOVER message to a bootstrap node
+void DHT::discoverNodes(const std::string &bootstrapIP, int bootstrapPort) {
+    // Version 0 predates every node, so the first request gets the whole table
+    TableCursor cursor{0, 0};
+    uint32_t transaction;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        if (auto it = tableCursors.find({bootstrapIP, bootstrapPort}); it != tableCursors.end()) {
+            cursor = it->second;
         }
+        // Only the answer to the latest request is taken
+        transaction = nextTransaction++;
+        discoveriesSent[{bootstrapIP, bootstrapPort}] = transaction;
+    }
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::Discover, transaction);
+    const NodeId &self = routingTable.selfKey();
+    message.append(reinterpret_cast<const char *>(self.data()), self.size());
+    appendU32(message, cursor.epoch);
+    appendU64(message, cursor.version);
+    querySent(bootstrapIP, bootstrapPort);
+    sendMessage(message, bootstrapIP, bootstrapPort);
+}
 
-        // Send routing table back to the sender
-        sendMessage(response, ip, port);
-        std::cout << "[DEBUG] Sent routing table to " << ip << ":" << port << std::endl;
-    } else if (startsWith(message, "ROUTING_TABLE")) {
-        std::cout << "[DEBUG] Received ROUTING_TABLE from " << ip << ":" << port << std::endl;
-        std::string nodes = message.substr(14);
-        std::istringstream iss(nodes);
-        std::string nodeInfo;
+void DHT::handleIncomingMessage(std::string_view message, const std::string &ip, int port) {
+    // Any traffic proves the sender is still reachable
+    touchNode(ip, port);
 
-        while (std::getline(iss, nodeInfo, ';')) {
-            if (nodeInfo.empty()) continue;
-            auto parts = split(nodeInfo, ',');
-            if (parts.size() == 3) {
-                addNode({parts[0], parts[1], std::stoi(parts[2])});
+    if (isDhtMessage(message)) {
+        if (auto decoded = decodeDhtMessage(message)) {
+            handleBinaryMessage(*decoded, ip, port);
+        } else {
+            if (debugLogging) {
+                std::cout << "[DEBUG] Unsupported DHT message version from " << ip << ":" << port << '\n';
             }
         }
+        return;
+    }
 
-        // Log routing table after update
-        std::cout << "[DEBUG] Routing Table after receiving ROUTING_TABLE:" << std::endl;
-        for (const auto &[id, node] : routingTable) {
-            std::cout << "Node ID: " << id << ", IP: " << node.ip << ", Port: " << node.port << std::endl;
+    handleTextMessage(message, ip, port);
+}
+
+// Text commands from nodes that predate the binary protocol; answers go back as text.
+// Each maps to the binary type it corresponds to, so dispatch is the same switch.
+void DHT::handleTextMessage(std::string_view message, const std::string &ip, int port) {
+    if (message == "KEEPALIVE") {
+        return;
+    }
+    std::string_view args = message;
+    auto type = textCommand(nextField(args, ' '));
+    if (!type) {
+        if (debugLogging) {
+            std::cout << "[DEBUG] Unknown message type received: " << message << '\n';
+        }
+        return;
+    }
+    std::string response;
+    switch (*type) {
+        case DhtMessageType::Discover: {
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received DISCOVER from " << ip << ":" << port << '\n';
+            }
+            // Add the sender to the routing table
+            std::string senderID = std::to_string(qHash(QString::fromStdString(ip + ":" + std::to_string(port))));
+            addNode({senderID, ip, port});
+            // One page of the nodes nearest the sender, not the whole table: the reply stays a single
+            // datagram and a spoofed DISCOVER cannot be amplified into a table-sized one
+            std::vector<DHTNode> nodes = closestNodes(nodeIdOf(senderID), ROUTING_PAGE_NODES + 1);
+            nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [&](const DHTNode &node) {
+                return node.ip == ip && node.port == port;
+            }), nodes.end());
+            nodes.resize(std::min(nodes.size(), ROUTING_PAGE_NODES));
+            response = "ROUTING_TABLE ";
+            for (const auto &node : nodes) {
+                response += node.id + "," + node.ip + "," + std::to_string(node.port) + ";";
+            }
+            sendMessage(response, ip, port);
+            if (debugLogging) {
+                std::cout << "[DEBUG] Sent routing table of " << nodes.size() << " nodes to " << ip << ":" << port
+                          << '\n';
+            }
+            break;
+        }
+        case DhtMessageType::RoutingTable: {
+            answerReceived(ip, port);
+            size_t received = 0;
+            forEachTextRecord(args, true, [&](std::string_view id, std::string_view nodeIP, int nodePort) {
+                addNode({std::string(id), std::string(nodeIP), nodePort});
+                received++;
+            });
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received ROUTING_TABLE of " << received << " nodes from " << ip << ":" << port
+                          << '\n';
+            }
+            break;
+        }
+        case DhtMessageType::Announce: {
+            std::string nodeID(args);
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received ANNOUNCE from " << ip << ":" << port << " - Node ID: " << nodeID << '\n';
+            }
+            addNode({nodeID, ip, port});
+            // Propagate ANNOUNCE to other nodes
+            std::vector<DHTNode> nodes;
+            {
+                std::lock_guard<std::mutex> lock(dhtMutex);
+                nodes = routingTable.nodes();
+            }
+            response = "ANNOUNCE " + nodeID;
+            for (const auto &node : nodes) {
+                if (node.ip != ip || node.port != port) {
+                    sendMessage(response, node.ip, node.port);
+                }
+            }
+            break;
+        }
+        case DhtMessageType::Provide:
+            if (!args.empty()) {
+                addProvider(std::string(args), ip, port);
+            }
+            break;
+        case DhtMessageType::GetProviders: {
+            std::string key(args);
+            response = "PROVIDERS " + key + " ";
+            for (const auto &provider : getProviders(key)) {
+                response += provider.ip + "," + std::to_string(provider.port) + ";";
+            }
+            sendMessage(response, ip, port);
+            break;
+        }
+        case DhtMessageType::Providers: {
+            answerReceived(ip, port);
+            std::string key(nextField(args, ' '));
+            std::vector<DHTProvider> found;
+            forEachTextRecord(args, false, [&](std::string_view, std::string_view providerIP, int providerPort) {
+                found.push_back({std::string(providerIP), providerPort});
+                addProvider(key, found.back().ip, providerPort);
+            });
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received " << found.size() << " providers of " << key
+                          << " from " << ip << ":" << port << '\n';
+            }
+            if (providerCallback && !key.empty()) {
+                providerCallback(key, found);
+            }
+            break;
+        }
+        case DhtMessageType::FindNode: {
+            // FIND_NODE <transaction> <id>
+            std::string_view transaction = nextField(args, ' ');
+            if (!args.empty()) {
+                sendMessage(closestNodesMessage(transaction, nodeIdOf(std::string(args))), ip, port);
+            }
+            break;
+        }
+        case DhtMessageType::FindValue: {
+            // FIND_VALUE <transaction> <key>, answered with the value or the nodes closest to the key
+            std::string_view transaction = nextField(args, ' ');
+            std::string key(args);
+            std::optional<std::string> value;
+            {
+                std::lock_guard<std::mutex> lock(dhtMutex);
+                if (auto it = keyValueStore.find(key); it != keyValueStore.end()) {
+                    value = it->second.value;
+                }
+            }
+            if (value) {
+                response.append("VALUE ").append(transaction).append(" ").append(*value);
+            } else {
+                response = closestNodesMessage(transaction, nodeIdOf(key));
+            }
+            sendMessage(response, ip, port);
+            break;
+        }
+        case DhtMessageType::Nodes: {
+            uint32_t transaction;
+            if (parseNumber(nextField(args, ' '), transaction)) {
+                std::vector<RoutingTable::Contact> contacts;
+                forEachTextRecord(args, true, [&contacts](std::string_view id, std::string_view nodeIP, int nodePort) {
+                    std::string name(id);
+                    contacts.push_back({nodeIdOf(name), {name, std::string(nodeIP), nodePort}});
+                });
+                onLookupAnswer(transaction, ip, port, contacts, std::nullopt);
+            }
+            break;
+        }
+        case DhtMessageType::Value: {
+            uint32_t transaction;
+            if (parseNumber(nextField(args, ' '), transaction)) {
+                onLookupAnswer(transaction, ip, port, {}, std::string(args));
+            }
+            break;
+        }
+        case DhtMessageType::Store: {
+            std::string_view key = nextField(args, ' ');
+            storeValue(key, args, ip, port);
+            break;
         }
-    } else if (startsWith(message, "ANNOUNCE")) {
-        std::string nodeID = message.substr(9); // Extract the node ID
-        std::cout << "[DEBUG] Received ANNOUNCE from " << ip << ":" << port << " - Node ID: " << nodeID << std::endl;
-        addNode({nodeID, ip, port});
+        case DhtMessageType::RoutingTablePage:
+            // Binary only
+            break;
+    }
+}
 
-        // Propagate ANNOUNCE to other nodes
-        std::lock_guard<std::mutex> lock(dhtMutex);
-        for (const auto &[id, node] : routingTable) {
-            if (node.ip != ip || node.port != port) {
-                sendMessage("ANNOUNCE " + nodeID, node.ip, node.port);
+void DHT::handleBinaryMessage(const DhtMessage &message, const std::string &ip, int port) {
+    std::string_view body = message.body;
+    std::string reply;
+    switch (message.type) {
+        case DhtMessageType::Discover: {
+            // The sender is known by its key until it announces its name
+            if (body.size() == NodeId().size() || body.size() == NodeId().size() + TABLE_CURSOR_SIZE) {
+                NodeId key;
+                std::copy(body.begin(), body.begin() + key.size(), key.begin());
+                addNode({toHex(key), ip, port});
             }
+            // Nodes from before table cursors get the whole table in one message
+            if (body.size() == NodeId().size() + TABLE_CURSOR_SIZE) {
+                const char *cursor = body.data() + NodeId().size();
+                reply = routingTablePage(message.transaction, readU32(cursor), readU64(cursor + 4));
+            } else {
+                appendDhtHeader(reply, DhtMessageType::RoutingTable, message.transaction);
+                appendNodeList(reply, getRoutingTable());
+            }
+            sendMessage(reply, ip, port);
+            break;
         }
-    } else {
-        std::cout << "[DEBUG] Unknown message type received: " << message << std::endl;
+        case DhtMessageType::RoutingTable:
+            answerReceived(ip, port);
+            forEachRecord(body, true, [this](const NodeRecord &record) { addNode(toNode(record)); });
+            break;
+        case DhtMessageType::RoutingTablePage: {
+            bool requested = false;
+            {
+                std::lock_guard<std::mutex> lock(dhtMutex);
+                auto it = discoveriesSent.find({ip, port});
+                if (it != discoveriesSent.end() && it->second == message.transaction) {
+                    discoveriesSent.erase(it);
+                    answeredBy[{ip, port}] = std::chrono::steady_clock::now();
+                    requested = true;
+                }
+            }
+            if (!requested) {
+                break;
+            }
+            answerReceived(ip, port);
+            if (body.size() < TABLE_CURSOR_SIZE + 1) {
+                break;
+            }
+            TableCursor cursor{readU32(body.data()), readU64(body.data() + 4)};
+            bool more = body[TABLE_CURSOR_SIZE] != 0;
+            body.remove_prefix(TABLE_CURSOR_SIZE + 1);
+            size_t received = 0;
+            if (!forEachRecord(body, true, [&](const NodeRecord &record) {
+                addNode(toNode(record));
+                received++;
+            })) {
+                break;
+            }
+            bool advanced;
+            {
+                std::lock_guard<std::mutex> lock(dhtMutex);
+                // With no room for its cursor a node is synced from once, and never paged through
+                auto it = tableCursors.find({ip, port});
+                if (it == tableCursors.end()) {
+                    advanced = tableCursors.size() < MAX_TABLE_CURSORS;
+                    if (advanced) {
+                        tableCursors.emplace(std::make_pair(ip, port), cursor);
+                    }
+                } else {
+                    advanced = it->second.epoch != cursor.epoch || it->second.version < cursor.version;
+                    it->second = cursor;
+                }
+            }
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received " << received << " routing table nodes up to version " << cursor.version
+                          << " from " << ip << ":" << port << '\n';
+            }
+            // A page that moved the cursor nowhere would only ask for itself again
+            if (more && advanced) {
+                discoverNodes(ip, port);
+            }
+            break;
+        }
+        case DhtMessageType::Announce: {
+            if (body.empty()) {
+                break;
+            }
+            uint8_t hops = static_cast<uint8_t>(body.front());
+            body.remove_prefix(1);
+            auto name = readDhtKey(body);
+            std::optional<NodeRecord> record;
+            if (!name || name->empty() ||
+                !forEachRecord(body, true, [&record](const NodeRecord &r) { record = r; })) {
+                break;
+            }
+            // The announcing node itself is best reached where its datagram came from;
+            // relayed announcements carry that endpoint in the record
+            if (hops == 0) {
+                DHTNode node{std::string(*name), ip, port};
+                addNode(node);
+                relayAnnouncement(node);
+            } else if (record) {
+                addNode({std::string(*name), record->ip(), record->port});
+            }
+            break;
+        }
+        case DhtMessageType::Provide:
+            if (auto key = readDhtKey(body); key && !key->empty()) {
+                addProvider(std::string(*key), ip, port);
+            }
+            break;
+        case DhtMessageType::GetProviders:
+            if (auto key = readDhtKey(body)) {
+                std::vector<std::pair<std::string, int>> endpoints;
+                for (const auto &provider : getProviders(std::string(*key))) {
+                    endpoints.emplace_back(provider.ip, provider.port);
+                }
+                appendDhtHeader(reply, DhtMessageType::Providers, message.transaction);
+                appendDhtKey(reply, *key);
+                appendEndpointList(reply, endpoints);
+                sendMessage(reply, ip, port);
+            }
+            break;
+        case DhtMessageType::Providers: {
+            answerReceived(ip, port);
+            auto key = readDhtKey(body);
+            if (!key || key->empty()) {
+                break;
+            }
+            std::string name(*key);
+            std::vector<DHTProvider> found;
+            if (!forEachRecord(body, false, [&](const NodeRecord &record) {
+                found.push_back({record.ip(), record.port});
+                addProvider(name, found.back().ip, found.back().port);
+            })) {
+                break;
+            }
+            if (debugLogging) {
+                std::cout << "[DEBUG] Received " << found.size() << " providers of " << name
+                          << " from " << ip << ":" << port << '\n';
+            }
+            if (providerCallback) {
+                providerCallback(name, found);
+            }
+            break;
+        }
+        case DhtMessageType::FindNode:
+            if (body.size() == NodeId().size()) {
+                NodeId target;
+                std::copy(body.begin(), body.end(), target.begin());
+                appendDhtHeader(reply, DhtMessageType::Nodes, message.transaction);
+                appendNodeList(reply, closestWithSelf(target));
+                sendMessage(reply, ip, port);
+            }
+            break;
+        case DhtMessageType::FindValue: {
+            auto key = readDhtKey(body);
+            if (!key) {
+                break;
+            }
+            std::string name(*key);
+            std::optional<std::string> value;
+            {
+                std::lock_guard<std::mutex> lock(dhtMutex);
+                if (auto it = keyValueStore.find(name); it != keyValueStore.end()) {
+                    value = it->second.value;
+                }
+            }
+            if (value) {
+                appendDhtHeader(reply, DhtMessageType::Value, message.transaction);
+                reply += *value;
+            } else {
+                appendDhtHeader(reply, DhtMessageType::Nodes, message.transaction);
+                appendNodeList(reply, closestWithSelf(nodeIdOf(name)));
+            }
+            sendMessage(reply, ip, port);
+            break;
+        }
+        case DhtMessageType::Nodes: {
+            std::vector<RoutingTable::Contact> contacts;
+            if (forEachRecord(body, true, [&contacts](const NodeRecord &record) {
+                    contacts.push_back({record.id, toNode(record)});
+                })) {
+                onLookupAnswer(message.transaction, ip, port, contacts, std::nullopt);
+            }
+            break;
+        }
+        case DhtMessageType::Value:
+            onLookupAnswer(message.transaction, ip, port, {}, std::string(body));
+            break;
+        case DhtMessageType::Store:
+            if (auto key = readDhtKey(body)) {
+                storeValue(*key, body, ip, port);
+            }
+            break;
+        default:
+            if (debugLogging) {
+                std::cout << "[DEBUG] Unknown DHT message type " << static_cast<int>(message.type)
+                          << " from " << ip << ":" << port << '\n';
+            }
+            break;
     }
 }
 
 // Constructor: Initialize the DHT with self-node information
-DHT::DHT(const std::string &selfID, const std::string &selfIP, int selfPort)
-        : selfID(selfID), selfIP(selfIP), selfPort(selfPort) {
-    if (!selfIP.empty() && selfPort > 0) {
-        addNode({selfID, selfIP, selfPort});
-    } else {
+DHT::DHT(const std::string &selfID, const std::string &selfIP, int selfPort, TimerService &timers)
+        : selfID(selfID), selfIP(selfIP), selfPort(selfPort), routingTable(nodeIdOf(selfID)), timers(timers) {
+    if (selfIP.empty() || selfPort <= 0) {
         std::cerr << "Error: Bootstrap node must have a valid IP and Port." << std::endl;
     }
 }
 
+DHT::~DHT() {
+    stopMaintenance();
+    timers.cancelAll(&lookups);
+}
+
 // Add a node to the routing table
 void DHT::addNode(const DHTNode &node) {
-    std::lock_guard<std::mutex> lock(dhtMutex);
-
-    // Avoid duplicate or invalid entries
-    if (routingTable.find(node.id) != routingTable.end()) {
-        std::cout << "[DEBUG] Node already exists in the routing table: " << node.id << std::endl;
+    // This node is not kept in its own table, under its ID or any other
+    if (node.id == selfID || (node.ip == selfIP && node.port == selfPort)) {
         return;
     }
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    switch (routingTable.insert(node, std::chrono::steady_clock::now())) {
+        case RoutingTable::Insertion::Added:
+            std::cout << "[DEBUG] Adding node to routing table: ID=" << node.id
+                      << ", IP=" << node.ip << ", Port=" << node.port << '\n';
+            break;
+        case RoutingTable::Insertion::Refreshed:
+            if (debugLogging) {
+                std::cout << "[DEBUG] Node already exists in the routing table: " << node.id << '\n';
+            }
+            break;
+        case RoutingTable::Insertion::Cached:
+            if (debugLogging) {
+                std::cout << "[DEBUG] Bucket full, keeping node as a replacement: " << node.id << '\n';
+            }
+            break;
+        case RoutingTable::Insertion::Ignored:
+            break;
+    }
+}
 
-    std::cout << "[DEBUG] Adding node to routing table: ID=" << node.id
-              << ", IP=" << node.ip << ", Port=" << node.port << std::endl;
-    routingTable[node.id] = node;
+void DHT::touchNode(const std::string &ip, int port) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    routingTable.touch(ip, port, std::chrono::steady_clock::now());
 }
 
 // Remove a node from the routing table
 void DHT::removeNode(const std::string &id) {
     std::lock_guard<std::mutex> lock(dhtMutex);
-    routingTable.erase(id);
-    std::cout << "[DEBUG] Removed node from routing table: ID=" << id << std::endl;
+    routingTable.remove(id);
+    std::cout << "[DEBUG] Removed node from routing table: ID=" << id << '\n';
 }
 
 // Find a node in the routing table by its ID
 DHTNode DHT::findNode(const std::string &id) {
+    if (id == selfID) {
+        return {selfID, selfIP, selfPort, std::chrono::steady_clock::now()};
+    }
     std::lock_guard<std::mutex> lock(dhtMutex);
-    auto it = routingTable.find(id);
-    if (it == routingTable.end()) {
+    auto node = routingTable.find(id);
+    if (!node) {
         throw std::runtime_error("Node not found in the routing table.");
     }
-    return it->second;
+    return *node;
+}
+
+std::vector<DHTNode> DHT::closestNodes(const NodeId &target, size_t count) const {
+    std::vector<RoutingTable::Contact> contacts;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        contacts = routingTable.closest(target, count);
+    }
+    std::vector<DHTNode> nodes;
+    nodes.reserve(contacts.size());
+    for (auto &contact : contacts) {
+        nodes.push_back(std::move(contact.node));
+    }
+    return nodes;
 }
 
 // Publish a key-value pair to the DHT
 void DHT::publish(const std::string &key, const std::string &value) {
-    std::lock_guard<std::mutex> lock(dhtMutex);
-    keyValueStore[key] = value;
-    std::cout << "[DEBUG] Published key-value pair: " << key << " -> " << value << std::endl;
+    std::vector<DHTNode> nodes = closestNodes(nodeIdOf(key), RoutingTable::BUCKET_SIZE);
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        keyValueStore[key] = {value, std::chrono::steady_clock::now(), true};
+    }
+    std::cout << "[DEBUG] Published key-value pair: " << key << " -> " << value << '\n';
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::Store);
+    appendDhtKey(message, key);
+    message += value;
+    for (const auto &node : nodes) {
+        sendMessage(message, node.ip, node.port);
+    }
 }
 
 // Lookup a key in the DHT
@@ -133,15 +580,551 @@ std::string DHT::lookup(const std::string &key) {
     if (it == keyValueStore.end()) {
         throw std::runtime_error("Key not found in the DHT.");
     }
+    return it->second.value;
+}
+
+void DHT::findNode(const std::string &id, std::chrono::milliseconds timeout,
+                   std::function<void(std::optional<DHTNode>)> done) {
+    std::optional<DHTNode> local;
+    if (id == selfID) {
+        local = DHTNode{selfID, selfIP, selfPort, std::chrono::steady_clock::now()};
+    } else {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        local = routingTable.find(id);
+    }
+    if (local) {
+        done(local);
+        return;
+    }
+    Lookup lookup;
+    lookup.target = id;
+    lookup.key = nodeIdOf(id);
+    lookup.nodeDone = std::move(done);
+    startLookup(std::move(lookup), timeout);
+}
+
+void DHT::lookup(const std::string &key, std::chrono::milliseconds timeout,
+                 std::function<void(std::optional<std::string>)> done) {
+    std::optional<std::string> local;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        if (auto it = keyValueStore.find(key); it != keyValueStore.end()) {
+            local = it->second.value;
+        }
+    }
+    if (local) {
+        done(local);
+        return;
+    }
+    Lookup lookup;
+    lookup.target = key;
+    lookup.key = nodeIdOf(key);
+    lookup.findValue = true;
+    lookup.valueDone = std::move(done);
+    startLookup(std::move(lookup), timeout);
+}
+
+void DHT::startLookup(Lookup lookup, std::chrono::milliseconds timeout) {
+    std::vector<Outgoing> out;
+    uint64_t id;
+    bool running;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        id = nextLookup++;
+        addCandidates(lookup, routingTable.closest(lookup.key, RoutingTable::BUCKET_SIZE));
+        Lookup &started = lookups.emplace(id, std::move(lookup)).first->second;
+        running = advanceLookup(id, started, out);
+    }
+    if (!running) {
+        finishLookup(id, std::nullopt, std::nullopt);
+        return;
+    }
+    timers.schedule(timeout, [this, id] { finishLookup(id, std::nullopt, std::nullopt); }, &lookups);
+    for (const auto &query : out) {
+        sendMessage(query.message, query.ip, query.port);
+    }
+}
+
+// Failed nodes do not count towards the BUCKET_SIZE closest, so a dead node lets the
+// next one in line be asked instead
+bool DHT::advanceLookup(uint64_t id, Lookup &lookup, std::vector<Outgoing> &out) {
+    auto now = std::chrono::steady_clock::now();
+    size_t considered = 0;
+    for (auto &candidate : lookup.candidates) {
+        if (lookup.inFlight >= LOOKUP_ALPHA || considered == RoutingTable::BUCKET_SIZE) {
+            break;
+        }
+        if (candidate.state == Candidate::State::Failed) {
+            continue;
+        }
+        considered++;
+        if (candidate.state != Candidate::State::Unqueried) {
+            continue;
+        }
+        uint32_t transaction = nextTransaction++;
+        candidate.state = Candidate::State::Waiting;
+        candidate.transaction = transaction;
+        lookup.inFlight++;
+        queries[transaction] = {id, now};
+        timers.schedule(queryTimeout(candidate.node.ip, candidate.node.port),
+                        [this, transaction] { onQueryTimeout(transaction); }, &lookups);
+        std::string query;
+        if (lookup.findValue) {
+            appendDhtHeader(query, DhtMessageType::FindValue, transaction);
+            appendDhtKey(query, lookup.target);
+        } else {
+            appendDhtHeader(query, DhtMessageType::FindNode, transaction);
+            query.append(reinterpret_cast<const char *>(lookup.key.data()), lookup.key.size());
+        }
+        out.push_back({std::move(query), candidate.node.ip, candidate.node.port});
+    }
+    return lookup.inFlight > 0;
+}
+
+void DHT::addCandidates(Lookup &lookup, const std::vector<RoutingTable::Contact> &contacts) {
+    auto &candidates = lookup.candidates;
+    for (const auto &contact : contacts) {
+        const DHTNode &node = contact.node;
+        if (contact.key == routingTable.selfKey() || (node.ip == selfIP && node.port == selfPort)) {
+            continue;
+        }
+        // The same node may be named by its key in one answer and by name in another
+        Candidate candidate{xorDistance(contact.key, lookup.key), node};
+        if (std::any_of(candidates.begin(), candidates.end(),
+                        [&candidate](const Candidate &other) { return other.distance == candidate.distance; })) {
+            continue;
+        }
+        auto at = std::upper_bound(candidates.begin(), candidates.end(), candidate.distance,
+                                   [](const NodeId &distance, const Candidate &other) {
+                                       return distance < other.distance;
+                                   });
+        candidates.insert(at, std::move(candidate));
+    }
+}
+
+void DHT::onLookupAnswer(uint32_t transaction, const std::string &ip, int port,
+                         const std::vector<RoutingTable::Contact> &contacts, const std::optional<std::string> &value) {
+    std::vector<Outgoing> out;
+    uint64_t id;
+    std::chrono::steady_clock::time_point sentAt;
+    DHTNode responder;
+    std::optional<DHTNode> found;
+    bool running = true;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        auto query = queries.find(transaction);
+        if (query == queries.end()) {
+            return;
+        }
+        id = query->second.lookup;
+        sentAt = query->second.sentAt;
+        auto it = lookups.find(id);
+        if (it == lookups.end()) {
+            queries.erase(query);
+            return;
+        }
+        Lookup &lookup = it->second;
+        auto candidate = std::find_if(lookup.candidates.begin(), lookup.candidates.end(),
+                                      [transaction](const Candidate &c) {
+                                          return c.state == Candidate::State::Waiting && c.transaction == transaction;
+                                      });
+        // Only the node asked can answer
+        if (candidate == lookup.candidates.end() || candidate->node.ip != ip || candidate->node.port != port) {
+            return;
+        }
+        queries.erase(query);
+        answeredBy[{ip, port}] = std::chrono::steady_clock::now();
+        candidate->state = Candidate::State::Answered;
+        lookup.inFlight--;
+        responder = candidate->node;
+        if (!value) {
+            if (!lookup.findValue) {
+                auto match = std::find_if(contacts.begin(), contacts.end(), [&lookup](const RoutingTable::Contact &c) {
+                    return c.key == lookup.key;
+                });
+                if (match != contacts.end()) {
+                    found = match->node;
+                    found->id = lookup.target;
+                }
+            }
+            if (!found) {
+                addCandidates(lookup, contacts);
+                running = advanceLookup(id, lookup, out);
+            }
+        }
+    }
+    if (rttSampleCallback) {
+        rttSampleCallback(ip, port, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - sentAt));
+    }
+    addNode(responder);
+    if (found) {
+        addNode(*found);
+    }
+    if (found || value || !running) {
+        finishLookup(id, found, value);
+        return;
+    }
+    for (const auto &query : out) {
+        sendMessage(query.message, query.ip, query.port);
+    }
+}
+
+void DHT::onQueryTimeout(uint32_t transaction) {
+    std::vector<Outgoing> out;
+    uint64_t id;
+    bool running;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        auto query = queries.find(transaction);
+        if (query == queries.end()) {
+            return;
+        }
+        id = query->second.lookup;
+        queries.erase(query);
+        auto it = lookups.find(id);
+        if (it == lookups.end()) {
+            return;
+        }
+        Lookup &lookup = it->second;
+        for (auto &candidate : lookup.candidates) {
+            if (candidate.state == Candidate::State::Waiting && candidate.transaction == transaction) {
+                candidate.state = Candidate::State::Failed;
+                lookup.inFlight--;
+                break;
+            }
+        }
+        running = advanceLookup(id, lookup, out);
+    }
+    if (!running) {
+        finishLookup(id, std::nullopt, std::nullopt);
+        return;
+    }
+    for (const auto &query : out) {
+        sendMessage(query.message, query.ip, query.port);
+    }
+}
+
+// Runs at most once per lookup, whichever of the answer, the last query or the deadline comes first
+void DHT::finishLookup(uint64_t id, std::optional<DHTNode> node, std::optional<std::string> value) {
+    Lookup lookup;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        auto it = lookups.find(id);
+        if (it == lookups.end()) {
+            return;
+        }
+        lookup = std::move(it->second);
+        lookups.erase(it);
+        // Answers still on their way are ignored; their timers find nothing to do
+        for (auto query = queries.begin(); query != queries.end();) {
+            query = query->second.lookup == id ? queries.erase(query) : std::next(query);
+        }
+    }
+    if (lookup.nodeDone) {
+        lookup.nodeDone(std::move(node));
+    }
+    if (lookup.valueDone) {
+        lookup.valueDone(std::move(value));
+    }
+}
+
+std::chrono::milliseconds DHT::queryTimeout(const std::string &ip, int port) const {
+    auto rtt = rttEstimator ? rttEstimator(ip, port) : std::nullopt;
+    if (!rtt) {
+        return DEFAULT_QUERY_TIMEOUT;
+    }
+    return std::clamp(std::chrono::duration_cast<std::chrono::milliseconds>(*rtt * 4),
+                      MIN_QUERY_TIMEOUT, DEFAULT_QUERY_TIMEOUT);
+}
+
+// The nodes added to the table since version since, or all of them along with this node
+// when the requester last synced with another epoch, up to ROUTING_PAGE_NODES. Removals are
+// not sent, so a requester keeps a dead node until its own expiry drops it.
+std::string DHT::routingTablePage(uint32_t transaction, uint32_t epoch, uint64_t since) const {
+    std::vector<RoutingTable::Contact> page;
+    TableCursor cursor;
+    bool more;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        cursor.epoch = routingTable.epoch();
+        if (epoch != cursor.epoch) {
+            since = 0;
+        }
+        if (since == 0 && !selfIP.empty() && selfPort > 0) {
+            page.push_back({routingTable.selfKey(), {selfID, selfIP, selfPort}});
+        }
+        std::vector<RoutingTable::Contact> added = routingTable.addedSince(since);
+        size_t count = std::min(added.size(), ROUTING_PAGE_NODES - page.size());
+        more = count < added.size();
+        // Versions of nodes since removed are covered by the last page
+        cursor.version = more ? added[count - 1].version : routingTable.version();
+        page.insert(page.end(), std::make_move_iterator(added.begin()),
+                    std::make_move_iterator(added.begin() + count));
+    }
+    std::string reply;
+    appendDhtHeader(reply, DhtMessageType::RoutingTablePage, transaction);
+    appendU32(reply, cursor.epoch);
+    appendU64(reply, cursor.version);
+    reply.push_back(static_cast<char>(more));
+    appendNodeList(reply, page);
+    return reply;
+}
+
+// The BUCKET_SIZE closest nodes to target, this one included
+std::vector<RoutingTable::Contact> DHT::closestWithSelf(const NodeId &target) const {
+    std::vector<RoutingTable::Contact> contacts;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        contacts = routingTable.closest(target, RoutingTable::BUCKET_SIZE);
+    }
+    if (!selfIP.empty() && selfPort > 0) {
+        const NodeId &self = routingTable.selfKey();
+        NodeId selfDistance = xorDistance(self, target);
+        auto at = std::find_if(contacts.begin(), contacts.end(), [&](const RoutingTable::Contact &contact) {
+            return selfDistance < xorDistance(contact.key, target);
+        });
+        contacts.insert(at, {self, {selfID, selfIP, selfPort}});
+        contacts.resize(std::min(contacts.size(), RoutingTable::BUCKET_SIZE));
+    }
+    return contacts;
+}
+
+// Answer to a legacy FIND_NODE or FIND_VALUE
+std::string DHT::closestNodesMessage(std::string_view transaction, const NodeId &target) const {
+    std::string response = "NODES ";
+    response.append(transaction).append(" ");
+    for (const auto &contact : closestWithSelf(target)) {
+        const DHTNode &node = contact.node;
+        response += node.id + "," + node.ip + "," + std::to_string(node.port) + ";";
+    }
+    return response;
+}
+
+// This node's own records are always kept; the caps only hold back other nodes' new ones
+void DHT::addProvider(const std::string &key, const std::string &ip, int port) {
+    bool self = ip == selfIP && port == selfPort;
+    if (key.size() > MAX_KEY_SIZE && !self) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    auto now = std::chrono::steady_clock::now();
+    auto it = providerStore.find(key);
+    if (it != providerStore.end()) {
+        for (auto &provider : it->second) {
+            if (provider.ip == ip && provider.port == port) {
+                provider.lastSeen = now;
+                return;
+            }
+        }
+    }
+    if (!self && (providerRecords >= MAX_PROVIDER_RECORDS ||
+                  (it != providerStore.end() && it->second.size() >= MAX_PROVIDERS_PER_KEY))) {
+        return;
+    }
+    if (it == providerStore.end()) {
+        it = providerStore.emplace(key, std::vector<DHTProvider>()).first;
+    }
+    it->second.push_back({ip, port, now});
+    providerRecords++;
+}
+
+void DHT::storeValue(std::string_view key, std::string_view value, const std::string &ip, int port) {
+    if (key.empty() || key.size() > MAX_KEY_SIZE || value.size() > MAX_VALUE_SIZE) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    // A routing table slot proves nothing: an unsolicited DISCOVER is enough to get one
+    if (answeredBy.find({ip, port}) == answeredBy.end()) {
+        if (debugLogging) {
+            std::cout << "[DEBUG] Ignored STORE from unknown node " << ip << ":" << port << '\n';
+        }
+        return;
+    }
+    auto it = keyValueStore.find(std::string(key));
+    if (it == keyValueStore.end()) {
+        if (keyValueStore.size() >= MAX_STORED_VALUES) {
+            return;
+        }
+        it = keyValueStore.emplace(std::string(key), StoredValue()).first;
+    } else if (it->second.local) {
+        // Another node's copy never replaces what this one published
+        return;
+    }
+    it->second.value.assign(value.data(), value.size());
+    it->second.lastSeen = std::chrono::steady_clock::now();
+}
+
+// Provide a key: remember it for republishing and tell every node in the routing table
+void DHT::provide(const std::string &key) {
+    addProvider(key, selfIP, selfPort);
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        if (std::find(providedKeys.begin(), providedKeys.end(), key) == providedKeys.end()) {
+            providedKeys.push_back(key);
+        }
+    }
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::Provide);
+    appendDhtKey(message, key);
+    for (const auto &node : getRoutingTable()) {
+        if (node.id != selfID) {
+            sendMessage(message, node.ip, node.port);
+        }
+    }
+}
+
+// Other nodes drop the record once it is no longer republished
+void DHT::stopProviding(const std::string &key) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    providedKeys.erase(std::remove(providedKeys.begin(), providedKeys.end(), key), providedKeys.end());
+    auto it = providerStore.find(key);
+    if (it != providerStore.end()) {
+        auto &providers = it->second;
+        size_t before = providers.size();
+        providers.erase(std::remove_if(providers.begin(), providers.end(), [this](const DHTProvider &provider) {
+            return provider.ip == selfIP && provider.port == selfPort;
+        }), providers.end());
+        providerRecords -= before - providers.size();
+        if (providers.empty()) {
+            providerStore.erase(it);
+        }
+    }
+}
+
+void DHT::findProviders(const std::string &key) {
+    std::vector<std::pair<std::chrono::microseconds, DHTNode>> ranked;
+    for (auto &node : getRoutingTable()) {
+        if (node.id == selfID) {
+            continue;
+        }
+        auto rtt = rttEstimator ? rttEstimator(node.ip, node.port) : std::nullopt;
+        ranked.emplace_back(rtt.value_or(std::chrono::microseconds::max()), std::move(node));
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    ranked.resize(std::min(ranked.size(), LOOKUP_FANOUT));
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::GetProviders);
+    appendDhtKey(message, key);
+    for (const auto &[rtt, node] : ranked) {
+        querySent(node.ip, node.port);
+        sendMessage(message, node.ip, node.port);
+    }
+}
+
+std::vector<DHTProvider> DHT::getProviders(const std::string &key) const {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    auto it = providerStore.find(key);
+    if (it == providerStore.end()) {
+        return {};
+    }
     return it->second;
 }
 
+void DHT::setProviderCallback(std::function<void(const std::string&, const std::vector<DHTProvider>&)> callback) {
+    providerCallback = std::move(callback);
+}
+
+void DHT::setRttCallbacks(std::function<void(const std::string&, int, std::chrono::microseconds)> onSample,
+                          std::function<std::optional<std::chrono::microseconds>(const std::string&, int)> estimate) {
+    rttSampleCallback = std::move(onSample);
+    rttEstimator = std::move(estimate);
+}
+
+// A repeated query restarts the clock, so a late answer to the first one reads high rather than low
+void DHT::querySent(const std::string &ip, int port) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    queriesSent[{ip, port}] = std::chrono::steady_clock::now();
+}
+
+void DHT::answerReceived(const std::string &ip, int port) {
+    std::chrono::steady_clock::time_point sentAt;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        auto it = queriesSent.find({ip, port});
+        if (it == queriesSent.end()) {
+            return;
+        }
+        sentAt = it->second;
+        queriesSent.erase(it);
+    }
+    if (rttSampleCallback) {
+        rttSampleCallback(ip, port, std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - sentAt));
+    }
+}
+
+void DHT::reprovide() {
+    std::vector<std::string> keys;
+    std::vector<std::pair<std::string, std::string>> values;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        keys = providedKeys;
+        for (const auto &[key, stored] : keyValueStore) {
+            if (stored.local) {
+                values.emplace_back(key, stored.value);
+            }
+        }
+    }
+    for (const auto &key : keys) {
+        provide(key);
+    }
+    for (const auto &[key, value] : values) {
+        publish(key, value);
+    }
+}
+
+// Fetches what each node discovered through has added since the last sync
+void DHT::syncRoutingTables() {
+    std::vector<std::pair<std::string, int>> endpoints;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        for (const auto &[endpoint, cursor] : tableCursors) {
+            endpoints.push_back(endpoint);
+        }
+    }
+    for (const auto &[ip, port] : endpoints) {
+        discoverNodes(ip, port);
+    }
+}
+
 // Announce self to all nodes in the routing table
 void DHT::announceSelf() {
-    std::lock_guard<std::mutex> lock(dhtMutex);
-    for (const auto &[id, node] : routingTable) {
-        if (id != selfID) {
-            sendMessage("ANNOUNCE " + selfID, node.ip, node.port);
+    std::vector<DHTNode> nodes;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        nodes = routingTable.nodes();
+    }
+    for (const auto &node : nodes) {
+        announceTo(node.ip, node.port);
+    }
+}
+
+void DHT::announceTo(const std::string &ip, int port) {
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::Announce);
+    message.push_back(0);
+    appendDhtKey(message, selfID);
+    appendNodeList(message, {{selfID, selfIP, selfPort}});
+    sendMessage(message, ip, port);
+}
+
+// Passes a node's own announcement on once to every other known node, with the endpoint
+// it was heard from; relayed announcements are not relayed again
+void DHT::relayAnnouncement(const DHTNode &node) {
+    std::vector<DHTNode> nodes;
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        nodes = routingTable.nodes();
+    }
+    std::string message;
+    appendDhtHeader(message, DhtMessageType::Announce);
+    message.push_back(1);
+    appendDhtKey(message, node.id);
+    appendNodeList(message, {node});
+    for (const auto &other : nodes) {
+        if (other.ip != node.ip || other.port != node.port) {
+            sendMessage(message, other.ip, other.port);
         }
     }
 }
@@ -150,14 +1133,144 @@ void DHT::announceSelf() {
 std::vector<DHTNode> DHT::getRoutingTable() const {
     std::lock_guard<std::mutex> lock(dhtMutex);
     std::vector<DHTNode> nodes;
-    for (const auto &[id, node] : routingTable) {
-        nodes.push_back(node);
+    nodes.reserve(routingTable.size() + 1);
+    if (!selfIP.empty() && selfPort > 0) {
+        nodes.push_back({selfID, selfIP, selfPort, std::chrono::steady_clock::now()});
+    }
+    for (auto &node : routingTable.nodes()) {
+        nodes.push_back(std::move(node));
     }
     return nodes;
 }
 
-// Simulate sending a message to a node
+// Send a message to a node through the transport, if one is attached
 void DHT::sendMessage(const std::string &message, const std::string &ip, int port) {
-    // Simulated sending of a message
-    std::cout << "[DEBUG] Sending message to " << ip << ":" << port << " - " << message << std::endl;
-}
\ No newline at end of file
+    if (debugLogging) {
+        std::cout << "[DEBUG] Sending message to " << ip << ":" << port << " - ";
+        if (isDhtMessage(message)) {
+            std::cout << "binary type " << (message.size() > 2 ? static_cast<int>(static_cast<uint8_t>(message[2])) : 0)
+                      << ", " << message.size() << " bytes\n";
+        } else {
+            std::cout << message << '\n';
+        }
+    }
+    if (sendCallback) {
+        sendCallback(message, ip, port);
+    }
+}
+
+void DHT::setDebugLogging(bool enabled) {
+    debugLogging = enabled;
+}
+
+void DHT::setSendCallback(std::function<void(const std::string&, const std::string&, int)> callback) {
+    sendCallback = std::move(callback);
+}
+
+void DHT::startMaintenance(std::chrono::seconds nodeTimeout, std::chrono::seconds republishInterval) {
+    stopMaintenance();
+    {
+        std::lock_guard<std::mutex> lock(dhtMutex);
+        this->nodeTimeout = nodeTimeout;
+        // Live nodes announce themselves every republish interval, so one silent for longer
+        // is the first to make room in a full bucket
+        routingTable.setStaleAfter(republishInterval);
+    }
+    // Sweeping a few times per timeout keeps a dead node around at most a quarter longer
+    timers.scheduleEvery(std::max<std::chrono::seconds>(nodeTimeout / 4, std::chrono::seconds(1)),
+                         [this] {
+                             auto now = std::chrono::steady_clock::now();
+                             expireNodes(now);
+                             expireProviders(now);
+                             expireValues(now);
+                         }, this);
+    timers.scheduleEvery(republishInterval, [this] {
+        announceSelf();
+        reprovide();
+        syncRoutingTables();
+    }, this);
+}
+
+// Waits for a sweep or announce already running, so the DHT can be destroyed afterwards
+void DHT::stopMaintenance() {
+    timers.cancelAll(this);
+}
+
+size_t DHT::expireNodes(std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    if (nodeTimeout == std::chrono::seconds::zero()) {
+        return 0;
+    }
+    auto expired = routingTable.expire(now - nodeTimeout);
+    for (const auto &node : expired) {
+        std::cout << "[DEBUG] Expired node from routing table: ID=" << node.id << '\n';
+        // A node that comes back is synced from scratch
+        tableCursors.erase({node.ip, node.port});
+        discoveriesSent.erase({node.ip, node.port});
+    }
+    return expired.size();
+}
+
+size_t DHT::expireProviders(std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    if (nodeTimeout == std::chrono::seconds::zero()) {
+        return 0;
+    }
+    // Queries never answered, and nodes that stopped answering, are forgotten with the records
+    for (auto *sent : {&queriesSent, &answeredBy}) {
+        for (auto it = sent->begin(); it != sent->end();) {
+            it = now - it->second > nodeTimeout ? sent->erase(it) : std::next(it);
+        }
+    }
+    size_t expired = 0;
+    for (auto it = providerStore.begin(); it != providerStore.end();) {
+        auto &providers = it->second;
+        size_t before = providers.size();
+        // Records for this node are refreshed by reprovide() like everyone else's
+        providers.erase(std::remove_if(providers.begin(), providers.end(), [&](const DHTProvider &provider) {
+            return now - provider.lastSeen > nodeTimeout;
+        }), providers.end());
+        expired += before - providers.size();
+        it = providers.empty() ? providerStore.erase(it) : std::next(it);
+    }
+    providerRecords -= expired;
+    return expired;
+}
+
+// Other nodes' values last as long as they keep storing them, like provider records
+size_t DHT::expireValues(std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(dhtMutex);
+    if (nodeTimeout == std::chrono::seconds::zero()) {
+        return 0;
+    }
+    size_t expired = 0;
+    for (auto it = keyValueStore.begin(); it != keyValueStore.end();) {
+        if (!it->second.local && now - it->second.lastSeen > nodeTimeout) {
+            it = keyValueStore.erase(it);
+            expired++;
+        } else {
+            ++it;
+        }
+    }
+    return expired;
+}
+
+std::string DHT::compressionDictionary() {
+    std::string dictionary;
+    for (const auto &[command, type] : TEXT_COMMANDS) {
+        dictionary.append(command).append(" ");
+        appendDhtHeader(dictionary, type);
+    }
+    appendDhtHeader(dictionary, DhtMessageType::RoutingTablePage);
+    dictionary += "KEEPALIVE 127.0.0.1:";
+    return dictionary;
+}
+
+bool DHT::isDiscoveryMessage(std::string_view message) {
+    if (isDhtMessage(message)) {
+        auto type = message.size() >= DHT_HEADER_SIZE ? static_cast<DhtMessageType>(static_cast<uint8_t>(message[2])) : DhtMessageType{};
+        return type == DhtMessageType::Discover || type == DhtMessageType::Announce ||
+               type == DhtMessageType::Provide;
+    }
+    return message == "DISCOVER" || message.substr(0, 8) == "ANNOUNCE" || message.substr(0, 8) == "PROVIDE ";
+}
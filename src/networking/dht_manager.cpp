@@ -9,8 +9,8 @@
 #include <libtorrent/sha1_hash.hpp>
 #include <libtorrent/hasher.hpp>
 #include <libtorrent/bencode.hpp>
+#include <libtorrent/time.hpp>
 #include <iostream>
-#include <thread>
 
 DHTManager::DHTManager() {
     libtorrent::settings_pack settings;
@@ -49,7 +49,7 @@ void DHTManager::announceUsername(const std::string& username, const std::string
               << " and port: " << publicPort << std::endl;
 }
 
-std::pair<std::string, int> DHTManager::findPeer(const std::string& username) {
+std::pair<std::string, int> DHTManager::findPeer(const std::string& username, std::chrono::milliseconds timeout) {
     // Generate the key for the username
     std::array<char, 32> key;
     auto hash = libtorrent::hasher(username).final();
@@ -58,9 +58,19 @@ std::pair<std::string, int> DHTManager::findPeer(const std::string& username) {
     // Request the item from the DHT
     session.dht_get_item(key);
 
-    // Poll alerts to retrieve the response
+    // Sleep in the session until alerts arrive instead of polling, and give up at the deadline
     std::string peerInfo;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
     for (;;) {
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::steady_clock::duration::zero()) {
+            std::cerr << "DHT lookup for " << username << " timed out" << std::endl;
+            return {"", 0};
+        }
+        if (!session.wait_for_alert(std::chrono::duration_cast<libtorrent::time_duration>(remaining))) {
+            continue;
+        }
+
         std::vector<libtorrent::alert*> alerts;
         session.pop_alerts(&alerts);
 
@@ -75,8 +85,6 @@ std::pair<std::string, int> DHTManager::findPeer(const std::string& username) {
         if (!peerInfo.empty()) {
             break;
         }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
     // Parse the IP and port from the retrieved value
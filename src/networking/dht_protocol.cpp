@@ -0,0 +1,149 @@
+//
+// Created by Omer Mersin on 11/28/24.
+//
+#include "networking/dht_protocol.h"
+#include <arpa/inet.h>
+#include <cstring>
+
+static bool parseAddress(const std::string &ip, std::array<uint8_t, 16> &address, bool &v4) {
+    address.fill(0);
+    if (inet_pton(AF_INET, ip.c_str(), address.data()) == 1) {
+        v4 = true;
+        return true;
+    }
+    v4 = false;
+    return inet_pton(AF_INET6, ip.c_str(), address.data()) == 1;
+}
+
+std::string NodeRecord::ip() const {
+    char text[INET6_ADDRSTRLEN];
+    if (!inet_ntop(v4 ? AF_INET : AF_INET6, address.data(), text, sizeof(text))) {
+        return {};
+    }
+    return text;
+}
+
+std::optional<DhtMessage> decodeDhtMessage(std::string_view datagram) {
+    if (datagram.size() < DHT_HEADER_SIZE || !isDhtMessage(datagram) ||
+        static_cast<uint8_t>(datagram[1]) != DHT_PROTOCOL_VERSION) {
+        return std::nullopt;
+    }
+    return DhtMessage{static_cast<DhtMessageType>(static_cast<uint8_t>(datagram[2])),
+                      readU32(datagram.data() + 3), datagram.substr(DHT_HEADER_SIZE)};
+}
+
+std::optional<std::string_view> readDhtKey(std::string_view &body) {
+    if (body.size() < 2 || body.size() - 2 < readU16(body.data())) {
+        return std::nullopt;
+    }
+    std::string_view key = body.substr(2, readU16(body.data()));
+    body.remove_prefix(2 + key.size());
+    return key;
+}
+
+bool readNodeRecord(std::string_view &body, bool v4, bool withId, NodeRecord &record) {
+    size_t addressSize = v4 ? 4 : 16;
+    size_t idSize = withId ? record.id.size() : 0;
+    if (body.size() < idSize + addressSize + 2) {
+        return false;
+    }
+    if (withId) {
+        std::memcpy(record.id.data(), body.data(), idSize);
+    } else {
+        record.id.fill(0);
+    }
+    record.address.fill(0);
+    std::memcpy(record.address.data(), body.data() + idSize, addressSize);
+    record.v4 = v4;
+    record.port = readU16(body.data() + idSize + addressSize);
+    body.remove_prefix(idSize + addressSize + 2);
+    return true;
+}
+
+bool isRecordList(std::string_view list, bool withId) {
+    if (list.size() < 2) {
+        return false;
+    }
+    size_t idSize = withId ? NodeId().size() : 0;
+    size_t v4Bytes = readU16(list.data()) * (idSize + 6);
+    size_t rest = list.size() - 2;
+    return rest >= v4Bytes && (rest - v4Bytes) % (idSize + 18) == 0;
+}
+
+void appendDhtHeader(std::string &out, DhtMessageType type, uint32_t transaction) {
+    out.push_back(static_cast<char>(DHT_MAGIC));
+    out.push_back(static_cast<char>(DHT_PROTOCOL_VERSION));
+    out.push_back(static_cast<char>(type));
+    appendU32(out, transaction);
+}
+
+void appendDhtKey(std::string &out, std::string_view key) {
+    appendU16(out, static_cast<uint16_t>(key.size()));
+    out.append(key.data(), key.size());
+}
+
+bool appendNodeRecord(std::string &out, const NodeId &id, const std::string &ip, int port, bool withId) {
+    std::array<uint8_t, 16> address;
+    bool v4;
+    if (!parseAddress(ip, address, v4)) {
+        return false;
+    }
+    if (withId) {
+        out.append(reinterpret_cast<const char *>(id.data()), id.size());
+    }
+    out.append(reinterpret_cast<const char *>(address.data()), v4 ? 4 : 16);
+    appendU16(out, static_cast<uint16_t>(port));
+    return true;
+}
+
+struct ListEntry {
+    NodeId id;
+    const std::string *ip;
+    int port;
+};
+
+// IPv4 records go first behind their count, so each pass appends one family
+static void appendList(std::string &out, const std::vector<ListEntry> &entries, bool withId) {
+    size_t countAt = out.size();
+    appendU16(out, 0);
+    uint16_t v4Count = 0;
+    std::array<uint8_t, 16> address;
+    bool v4;
+    for (int pass = 0; pass < 2; pass++) {
+        for (const auto &entry : entries) {
+            if (parseAddress(*entry.ip, address, v4) && v4 == (pass == 0)) {
+                appendNodeRecord(out, entry.id, *entry.ip, entry.port, withId);
+                v4Count += v4;
+            }
+        }
+    }
+    out[countAt] = static_cast<char>(v4Count >> 8);
+    out[countAt + 1] = static_cast<char>(v4Count);
+}
+
+void appendNodeList(std::string &out, const std::vector<DHTNode> &nodes) {
+    std::vector<ListEntry> entries;
+    entries.reserve(nodes.size());
+    for (const auto &node : nodes) {
+        entries.push_back({nodeIdOf(node.id), &node.ip, node.port});
+    }
+    appendList(out, entries, true);
+}
+
+void appendNodeList(std::string &out, const std::vector<RoutingTable::Contact> &contacts) {
+    std::vector<ListEntry> entries;
+    entries.reserve(contacts.size());
+    for (const auto &contact : contacts) {
+        entries.push_back({contact.key, &contact.node.ip, contact.node.port});
+    }
+    appendList(out, entries, true);
+}
+
+void appendEndpointList(std::string &out, const std::vector<std::pair<std::string, int>> &endpoints) {
+    std::vector<ListEntry> entries;
+    entries.reserve(endpoints.size());
+    for (const auto &[ip, port] : endpoints) {
+        entries.push_back({NodeId{}, &ip, port});
+    }
+    appendList(out, entries, false);
+}
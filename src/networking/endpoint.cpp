@@ -0,0 +1,182 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+#include "networking/endpoint.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using boost::asio::ip::udp;
+
+CompactEndpoint CompactEndpoint::fromUdp(const udp::endpoint &endpoint) {
+    CompactEndpoint compact;
+    const auto &address = endpoint.address();
+    auto bytes = address.is_v4()
+                 ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes()
+                 : address.to_v6().to_bytes();
+    std::memcpy(compact.address.data(), bytes.data(), bytes.size());
+    compact.port = endpoint.port();
+    return compact;
+}
+
+bool CompactEndpoint::isV4() const {
+    static constexpr uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    return std::memcmp(address.data(), prefix, sizeof(prefix)) == 0;
+}
+
+udp::endpoint CompactEndpoint::toUdp() const {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    std::memcpy(bytes.data(), address.data(), bytes.size());
+    boost::asio::ip::address_v6 v6(bytes);
+    if (isV4()) {
+        return {boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, v6), port};
+    }
+    return {v6, port};
+}
+
+std::string CompactEndpoint::toString() const {
+    udp::endpoint endpoint = toUdp();
+    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+}
+
+size_t CompactEndpointHash::operator()(const CompactEndpoint &endpoint) const {
+    // FNV-1a over the 18 significant bytes
+    uint64_t hash = 1469598103934665603ull;
+    for (uint8_t byte : endpoint.address) {
+        hash = (hash ^ byte) * 1099511628211ull;
+    }
+    hash = (hash ^ (endpoint.port >> 8)) * 1099511628211ull;
+    hash = (hash ^ (endpoint.port & 0xFF)) * 1099511628211ull;
+    return static_cast<size_t>(hash);
+}
+
+// Handles are the slot index below SLOT_BITS and the slot's generation above
+static constexpr unsigned SLOT_BITS = 20;
+static constexpr uint32_t SLOT_MASK = (1u << SLOT_BITS) - 1;
+
+static EndpointHandle makeHandle(size_t slot, uint32_t generation) {
+    return static_cast<EndpointHandle>(generation << SLOT_BITS | static_cast<uint32_t>(slot));
+}
+
+EndpointCache::EndpointCache(size_t capacity)
+        : capacity(std::clamp<size_t>(capacity, 1, MAX_CAPACITY)) {}
+
+void EndpointCache::setCapacity(size_t newCapacity) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    capacity = std::clamp<size_t>(newCapacity, 1, MAX_CAPACITY);
+    while (count > capacity) {
+        size_t index = victim();
+        evict(index);
+        freeSlots.push_back(index);
+    }
+}
+
+EndpointHandle EndpointCache::resolve(const std::string &ip, int port) {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = byAddress.find(ip);
+        if (it != byAddress.end()) {
+            for (const auto &[cachedPort, handle] : it->second) {
+                if (cachedPort == port) {
+                    slots[handle & SLOT_MASK].referenced.store(true, std::memory_order_relaxed);
+                    return handle;
+                }
+            }
+        }
+    }
+
+    // Parse outside the lock; a racing thread may insert the same pair first
+    udp::endpoint endpoint(boost::asio::ip::make_address(ip), static_cast<unsigned short>(port));
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (auto it = byAddress.find(ip); it != byAddress.end()) {
+        for (const auto &[cachedPort, handle] : it->second) {
+            if (cachedPort == port) {
+                return handle;
+            }
+        }
+    }
+    size_t index;
+    if (count >= capacity) {
+        index = victim();
+        evict(index);
+    } else if (!freeSlots.empty()) {
+        index = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        index = slots.size();
+        slots.emplace_back();
+    }
+    Slot &slot = slots[index];
+    slot.endpoint = endpoint;
+    slot.port = port;
+    slot.used = true;
+    slot.referenced.store(false, std::memory_order_relaxed);
+    count++;
+    slot.ip = ip;
+    EndpointHandle handle = makeHandle(index, slot.generation);
+    byAddress[ip].emplace_back(port, handle);
+    return handle;
+}
+
+udp::endpoint EndpointCache::get(EndpointHandle handle) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    const Slot *slot = find(handle);
+    if (!slot) {
+        throw std::out_of_range("Unknown endpoint handle.");
+    }
+    slot->referenced.store(true, std::memory_order_relaxed);
+    return slot->endpoint;
+}
+
+size_t EndpointCache::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return count;
+}
+
+// Caller must hold the lock
+EndpointCache::Slot *EndpointCache::find(EndpointHandle handle) const {
+    size_t index = handle & SLOT_MASK;
+    if (index >= slots.size()) {
+        return nullptr;
+    }
+    auto &slot = const_cast<Slot &>(slots[index]);
+    if (!slot.used || makeHandle(index, slot.generation) != handle) {
+        return nullptr;
+    }
+    return &slot;
+}
+
+// Caller must hold the lock exclusively. The clock hand passes over slots, clearing their
+// referenced bits, until it finds one in use that was not referenced since its last pass.
+size_t EndpointCache::victim() {
+    for (;;) {
+        if (hand >= slots.size()) {
+            hand = 0;
+        }
+        Slot &slot = slots[hand++];
+        if (slot.used && !slot.referenced.exchange(false, std::memory_order_relaxed)) {
+            return hand - 1;
+        }
+    }
+}
+
+// Caller must hold the lock exclusively
+void EndpointCache::evict(size_t index) {
+    Slot &slot = slots[index];
+    auto it = byAddress.find(slot.ip);
+    if (it != byAddress.end()) {
+        auto &ports = it->second;
+        EndpointHandle handle = makeHandle(index, slot.generation);
+        ports.erase(std::remove_if(ports.begin(), ports.end(),
+                                   [handle](const auto &entry) { return entry.second == handle; }),
+                    ports.end());
+        if (ports.empty()) {
+            byAddress.erase(it);
+        }
+    }
+    slot.used = false;
+    slot.ip.clear();
+    slot.generation = (slot.generation + 1) & (UINT32_MAX >> SLOT_BITS);
+    count--;
+}
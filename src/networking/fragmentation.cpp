@@ -0,0 +1,151 @@
+//
+// Created by Omer Mersin on 11/19/24.
+//
+#include "networking/fragmentation.h"
+#include "networking/framing.h"
+#include <algorithm>
+#include <stdexcept>
+
+std::vector<std::string> Fragmenter::split(const std::string &message, uint32_t messageId, size_t maxDatagramSize) {
+    if (maxDatagramSize <= FRAGMENT_HEADER_SIZE) {
+        throw std::invalid_argument("Datagram size too small for fragmentation.");
+    }
+    size_t payloadSize = maxDatagramSize - FRAGMENT_HEADER_SIZE;
+    size_t count = message.empty() ? 1 : (message.size() + payloadSize - 1) / payloadSize;
+    if (count > UINT16_MAX) {
+        throw std::length_error("Message too large to fragment.");
+    }
+
+    std::vector<std::string> fragments;
+    fragments.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t offset = i * payloadSize;
+        size_t len = std::min(payloadSize, message.size() - offset);
+
+        std::string frame;
+        frame.reserve(FRAGMENT_HEADER_SIZE + len);
+        appendFrameHeader(frame, FrameType::Fragment);
+        appendU32(frame, messageId);
+        appendU16(frame, static_cast<uint16_t>(i));
+        appendU16(frame, static_cast<uint16_t>(count));
+        frame.append(message, offset, len);
+        fragments.push_back(std::move(frame));
+    }
+    return fragments;
+}
+
+Reassembler::Reassembler(size_t maxBufferedBytes, size_t maxMessageSize, size_t minFragmentPayload,
+                         std::chrono::milliseconds timeout)
+        : maxBufferedBytes(maxBufferedBytes), maxMessageSize(maxMessageSize),
+          maxFragments((maxMessageSize + std::max<size_t>(minFragmentPayload, 1) - 1) /
+                       std::max<size_t>(minFragmentPayload, 1)),
+          timeout(timeout) {}
+
+std::optional<std::string> Reassembler::add(const boost::asio::ip::udp::endpoint &sender,
+                                            const char *frame, size_t len) {
+    if (len < FRAGMENT_HEADER_SIZE) {
+        return std::nullopt;
+    }
+    uint32_t messageId = readU32(frame + 2);
+    uint16_t index = readU16(frame + 6);
+    uint16_t count = readU16(frame + 8);
+    const char *payload = frame + FRAGMENT_HEADER_SIZE;
+    size_t payloadLen = len - FRAGMENT_HEADER_SIZE;
+
+    if (count == 0 || index >= count || count > maxFragments) {
+        return std::nullopt;
+    }
+    if (count == 1) {
+        return std::string(payload, payloadLen);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (now - lastSweep >= timeout / 4) {
+        expire(now);
+        lastSweep = now;
+    }
+
+    auto [it, inserted] = partials.try_emplace({sender, messageId});
+    Partial &partial = it->second;
+    if (inserted) {
+        partial.fragments.resize(count);
+        partial.firstSeen = now;
+        partial.arrival = arrivals.insert(arrivals.end(), it->first);
+        buffered += overhead(partial);
+        // The newcomer is last in arrival order, so this never evicts it
+        while (buffered > maxBufferedBytes && partials.size() > 1) {
+            evictOldest();
+        }
+    } else if (partial.fragments.size() != count) {
+        return std::nullopt;
+    }
+    if (!partial.fragments[index].empty() || payloadLen == 0) {
+        return std::nullopt; // Duplicate
+    }
+    if (partial.bytes + payloadLen > maxMessageSize) {
+        erase(it);
+        return std::nullopt;
+    }
+
+    partial.fragments[index].assign(payload, payloadLen);
+    partial.bytes += payloadLen;
+    partial.received++;
+    buffered += payloadLen;
+
+    if (partial.received == count) {
+        std::string message;
+        message.reserve(partial.bytes);
+        for (const auto &fragment : partial.fragments) {
+            message += fragment;
+        }
+        erase(it);
+        return message;
+    }
+
+    while (buffered > maxBufferedBytes && !partials.empty()) {
+        evictOldest();
+    }
+    return std::nullopt;
+}
+
+size_t Reassembler::bufferedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return buffered;
+}
+
+uint64_t Reassembler::expiredMessages() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return expired;
+}
+
+// Caller must hold mutex. Arrivals are in firstSeen order, so only expired entries are visited.
+void Reassembler::expire(std::chrono::steady_clock::time_point now) {
+    while (!arrivals.empty()) {
+        auto oldest = partials.find(arrivals.front());
+        if (now - oldest->second.firstSeen < timeout) {
+            break;
+        }
+        erase(oldest);
+        expired++;
+    }
+}
+
+// Caller must hold mutex
+void Reassembler::evictOldest() {
+    erase(partials.find(arrivals.front()));
+    expired++;
+}
+
+// Caller must hold mutex
+void Reassembler::erase(std::map<Key, Partial>::iterator it) {
+    buffered -= it->second.bytes + overhead(it->second);
+    arrivals.erase(it->second.arrival);
+    partials.erase(it);
+}
+
+// Memory a partial holds besides its payload: its map and arrival list nodes and one
+// string per announced fragment
+size_t Reassembler::overhead(const Partial &partial) {
+    return sizeof(Key) * 2 + sizeof(Partial) + partial.fragments.capacity() * sizeof(std::string);
+}
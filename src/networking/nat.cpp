@@ -3,8 +3,64 @@
 //
 #include "networking/nat.h"
 #include <iostream>
+#include <optional>
+
+NAT::NAT(TimerService &timers) : timers(timers) {
+}
+
+NAT::~NAT() {
+    timers.cancelAll(this);
+}
+
+void NAT::setSendFunction(SendFunction send) {
+    std::lock_guard<std::mutex> lock(natMutex);
+    this->send = std::move(send);
+}
 
 void NAT::punchHole(const std::string &ip, int port) {
     std::cout << "Attempting NAT hole punching for " << ip << ":" << port << std::endl;
-    // Add hole punching logic here (e.g., using UDP).
-}
\ No newline at end of file
+    // An outbound datagram opens the mapping; the remote side does the same towards us
+    sendKeepAlive(ip, port);
+}
+
+// The new timer replaces the old one under the lock, so concurrent calls leave exactly one
+void NAT::startKeepAlive(const std::string &ip, int port, std::chrono::seconds interval) {
+    std::optional<TimerId> displaced;
+    {
+        std::lock_guard<std::mutex> lock(natMutex);
+        TimerId timer = timers.scheduleEvery(interval, [this, ip, port] { sendKeepAlive(ip, port); }, this);
+        auto [it, added] = keepAlives.try_emplace({ip, port}, timer);
+        if (!added) {
+            displaced = it->second;
+            it->second = timer;
+        }
+    }
+    // Outside the lock: cancel waits for a keepalive that is being sent right now
+    if (displaced) {
+        timers.cancel(*displaced);
+    }
+}
+
+void NAT::stopKeepAlive(const std::string &ip, int port) {
+    TimerId timer;
+    {
+        std::lock_guard<std::mutex> lock(natMutex);
+        auto it = keepAlives.find({ip, port});
+        if (it == keepAlives.end()) {
+            return;
+        }
+        timer = it->second;
+        keepAlives.erase(it);
+    }
+    // Outside the lock: cancel waits for a keepalive that is being sent right now
+    timers.cancel(timer);
+}
+
+void NAT::sendKeepAlive(const std::string &ip, int port) {
+    std::lock_guard<std::mutex> lock(natMutex);
+    if (send) {
+        send(KEEPALIVE, ip, port);
+    } else {
+        std::cerr << "[ERROR] No transport set for NAT keepalive to " << ip << ":" << port << std::endl;
+    }
+}
@@ -0,0 +1,224 @@
+//
+// Created by Omer Mersin on 11/27/24.
+//
+#include "networking/path_mtu.h"
+#include "networking/framing.h"
+#include <algorithm>
+
+using boost::asio::ip::udp;
+
+// Largest UDP payload over IPv4; the probed size must also fit the frame's u16 field
+static constexpr size_t MAX_UDP_PAYLOAD = 65507;
+// Floor for the probe timeout derived from measured RTTs
+static constexpr std::chrono::milliseconds MIN_PROBE_TIMEOUT(50);
+
+PathMtu::PathMtu(size_t baseSize, size_t initialSize, size_t maxSize, Clock::duration raiseInterval)
+        : baseSize(std::max(baseSize, PROBE_HEADER_SIZE)),
+          maxSize(std::clamp(maxSize, this->baseSize, MAX_UDP_PAYLOAD)), raiseInterval(raiseInterval) {
+    this->initialSize = std::clamp(initialSize, this->baseSize, this->maxSize);
+}
+
+size_t PathMtu::start(const udp::endpoint &destination, Clock::duration probeTimeout, Clock::time_point now,
+                      Output &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = searches.try_emplace(destination);
+    Search &search = it->second;
+    if (inserted) {
+        search.published = initialSize;
+        search.timeout = probeTimeout;
+        restart(search);
+        advance(destination, search, now, out);
+    }
+    return search.published;
+}
+
+void PathMtu::onAck(const udp::endpoint &source, const char *frame, size_t len, Clock::time_point now,
+                    Output &out) {
+    if (len < PROBE_HEADER_SIZE) {
+        return;
+    }
+    uint32_t id = readU32(frame + 2);
+    size_t size = readU16(frame + 6);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = searches.find(source);
+    if (it == searches.end()) {
+        return;
+    }
+    Search &search = it->second;
+    // Answers to earlier attempts at the same size still prove it; anything else is stale
+    if (search.stage == Stage::Done || size != search.probing || id < search.firstProbeId || id > search.probeId) {
+        return;
+    }
+    // Only an answer to a first attempt times the round trip unambiguously (Karn's rule)
+    if (id == search.firstProbeId && search.attempts == 1) {
+        auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - search.sentAt);
+        out.rttSamples.emplace_back(source, rtt);
+        search.timeout = std::max<Clock::duration>(rtt * 4, MIN_PROBE_TIMEOUT);
+    }
+    search.low = size;
+    search.verified = true;
+    switch (search.stage) {
+        case Stage::Max:
+            search.stage = Stage::Done;
+            break;
+        case Stage::Initial:
+        case Stage::Base:
+            search.stage = Stage::Binary;
+            break;
+        default:
+            break;
+    }
+    publish(source, search, out);
+    advance(source, search, now, out);
+}
+
+void PathMtu::onTooBig(const udp::endpoint &destination, const std::string &probe, Clock::time_point now,
+                       Output &out) {
+    if (probe.size() < PROBE_HEADER_SIZE) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = searches.find(destination);
+    if (it != searches.end() && it->second.stage != Stage::Done && readU32(probe.data() + 2) == it->second.probeId) {
+        fail(destination, it->second, now, out);
+    }
+}
+
+void PathMtu::onTimer(Clock::time_point now, Output &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[destination, search] : searches) {
+        if (search.deadline > now) {
+            continue;
+        }
+        if (search.stage == Stage::Done) {
+            restart(search);
+            advance(destination, search, now, out);
+        } else if (search.attempts < PROBE_ATTEMPTS) {
+            sendProbe(destination, search, now, out);
+        } else {
+            fail(destination, search, now, out);
+        }
+    }
+}
+
+std::optional<PathMtu::Clock::time_point> PathMtu::nextDeadline() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::optional<Clock::time_point> earliest;
+    for (const auto &[destination, search] : searches) {
+        if (!earliest || search.deadline < *earliest) {
+            earliest = search.deadline;
+        }
+    }
+    return earliest;
+}
+
+size_t PathMtu::retain(const std::function<bool(const udp::endpoint &)> &keep) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t forgotten = 0;
+    for (auto it = searches.begin(); it != searches.end();) {
+        if (keep(it->first)) {
+            ++it;
+        } else {
+            it = searches.erase(it);
+            forgotten++;
+        }
+    }
+    return forgotten;
+}
+
+std::optional<std::string> PathMtu::answer(const char *frame, size_t len) {
+    if (len < PROBE_HEADER_SIZE || readU16(frame + 6) != len) {
+        return std::nullopt;
+    }
+    std::string ack;
+    ack.reserve(PROBE_HEADER_SIZE);
+    appendFrameHeader(ack, FrameType::ProbeAck);
+    ack.append(frame + 2, PROBE_HEADER_SIZE - FRAME_HEADER_SIZE);
+    return ack;
+}
+
+// The published size survives a restart, so a repeated search never lowers it until it
+// has verified something smaller
+void PathMtu::restart(Search &search) {
+    search.stage = Stage::Max;
+    search.low = baseSize;
+    search.high = maxSize;
+    search.verified = false;
+}
+
+// Picks the next size to probe, skipping stages that have nothing left to test
+void PathMtu::advance(const udp::endpoint &destination, Search &search, Clock::time_point now, Output &out) {
+    if (search.stage == Stage::Initial && (initialSize > search.high || initialSize <= search.low)) {
+        search.stage = Stage::Base;
+    }
+    if (search.stage == Stage::Base && search.verified) {
+        search.stage = Stage::Binary;
+    }
+    if (search.stage == Stage::Binary && search.high < search.low + GRANULARITY) {
+        search.stage = Stage::Done;
+    }
+    switch (search.stage) {
+        case Stage::Max:
+            search.probing = search.high;
+            break;
+        case Stage::Initial:
+            search.probing = initialSize;
+            break;
+        case Stage::Base:
+            search.probing = baseSize;
+            break;
+        case Stage::Binary:
+            search.probing = (search.low + search.high + 1) / 2;
+            break;
+        case Stage::Done:
+            search.deadline = now + raiseInterval;
+            return;
+    }
+    search.attempts = 0;
+    search.firstProbeId = nextProbeId;
+    search.sentAt = now;
+    sendProbe(destination, search, now, out);
+}
+
+// The size in flight went unanswered PROBE_ATTEMPTS times, or could not be sent at all
+void PathMtu::fail(const udp::endpoint &destination, Search &search, Clock::time_point now, Output &out) {
+    search.high = std::min(search.high, search.probing - 1);
+    switch (search.stage) {
+        case Stage::Max:
+            search.stage = Stage::Initial;
+            break;
+        case Stage::Initial:
+            search.stage = Stage::Base;
+            break;
+        case Stage::Base:
+            // Not even the base size gets through: the peer does not answer probes
+            search.stage = Stage::Done;
+            break;
+        default:
+            break;
+    }
+    publish(destination, search, out);
+    advance(destination, search, now, out);
+}
+
+void PathMtu::sendProbe(const udp::endpoint &destination, Search &search, Clock::time_point now, Output &out) {
+    search.probeId = nextProbeId++;
+    search.attempts++;
+    search.deadline = now + search.timeout;
+    std::string frame;
+    frame.reserve(search.probing);
+    appendFrameHeader(frame, FrameType::Probe);
+    appendU32(frame, search.probeId);
+    appendU16(frame, static_cast<uint16_t>(search.probing));
+    frame.resize(search.probing, '\0');
+    out.probes.emplace_back(destination, std::move(frame));
+}
+
+// Once something is verified the search's lower bound is the size to use; before that,
+// whatever was in use stays
+void PathMtu::publish(const udp::endpoint &destination, Search &search, Output &out) {
+    if (search.verified && search.low != search.published) {
+        search.published = search.low;
+        out.sizes.emplace_back(destination, search.published);
+    }
+}
@@ -3,16 +3,76 @@
 //
 
 #include "networking/peer.h"
+#include "networking/framing.h"
+#include "networking/stun.h"
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <cstring>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <random>
 #include <boost/asio.hpp>
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#include <pthread.h>
+#endif
 
 using boost::asio::ip::udp;
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
-Peer::Peer() : socket(io_context), running(false) {}
+// Pin a thread to one core so each shard's socket queue stays cache-local
+static void pinThread(std::thread &thread, size_t index) {
+#ifdef __linux__
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % cores, &cpus);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpus) != 0) {
+        std::cerr << "[ERROR] Failed to pin listener thread to core " << index % cores << std::endl;
+    }
+#else
+    (void) thread;
+    (void) index;
+#endif
+}
+
+// Datagrams the kernel dropped because the socket's receive buffer was full (the counter
+// SO_RXQ_OVFL reports per datagram, read here on demand so every listener mode is covered)
+static uint64_t kernelDropCount(udp::socket &target) {
+#if defined(__linux__) && defined(SO_MEMINFO)
+    if (!target.is_open()) {
+        return 0;
+    }
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(target.native_handle(), SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 &&
+        len > SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+        return meminfo[SK_MEMINFO_DROPS];
+    }
+#else
+    (void) target;
+#endif
+    return 0;
+}
+
+// Sets DF on everything the socket sends and stops the kernel's own path MTU cache from
+// capping datagram sizes: path MTU discovery decides them, and probes must be able to fail
+static void setProbeMode(udp::socket &target) {
+#if defined(__linux__) && defined(IP_PMTUDISC_PROBE)
+    int mode = IP_PMTUDISC_PROBE;
+    if (setsockopt(target.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0) {
+        std::cerr << "[ERROR] Failed to set IP_MTU_DISCOVER: " << std::strerror(errno) << std::endl;
+    }
+#else
+    (void) target;
+#endif
+}
+
+Peer::Peer(TimerService &timers)
+        : socket(io_context), ioStrand(boost::asio::make_strand(io_context)), timers(timers) {
+    setConfig(config);
+}
 
 Peer::~Peer() {
     stopListening();
@@ -24,8 +84,29 @@ void Peer::bind(int localPort) {
         if (!socket.is_open()) {
             socket.open(udp::v4());
         }
+        if (config.shards > 1) {
+            socket.set_option(reuse_port(true));
+        }
+        applySocketOptions(socket);
         socket.bind(udp::endpoint(udp::v4(), localPort));
-        std::cout << "Bound to local port: " << localPort << std::endl;
+
+        // The kernel hashes flows across every socket bound to the port with SO_REUSEPORT
+        unsigned short boundPort = socket.local_endpoint().port();
+        extraShards.clear();
+        for (size_t i = 1; i < config.shards; ++i) {
+            auto shard = std::make_unique<ReceiveShard>(io_context);
+            shard->socket.open(udp::v4());
+            shard->socket.set_option(reuse_port(true));
+            applySocketOptions(shard->socket);
+            shard->socket.bind(udp::endpoint(udp::v4(), boundPort));
+            extraShards.push_back(std::move(shard));
+        }
+        gsoEnabled = config.udpOffload && SegmentedSend::supported(socket.native_handle());
+        std::cout << "Bound to local port: " << localPort;
+        if (config.shards > 1) {
+            std::cout << " (" << config.shards << " shards)";
+        }
+        std::cout << std::endl;
     } catch (const boost::system::system_error &e) {
         std::cerr << "[ERROR] Failed to bind socket: " << e.what() << std::endl;
         throw;
@@ -34,33 +115,688 @@ void Peer::bind(int localPort) {
 
 void Peer::sendMessage(const std::string &message, const std::string &ip, int port) {
     try {
-        udp::endpoint remoteEndpoint(boost::asio::ip::make_address(ip), port);
-        socket.send_to(boost::asio::buffer(message), remoteEndpoint);
-        std::cout << "Sent message: " << message << " to " << ip << ":" << port << std::endl;
+        sendMessage(message, resolveEndpoint(ip, port));
     } catch (const std::exception &e) {
         std::cerr << "Error sending message: " << e.what() << std::endl;
     }
 }
 
+void Peer::sendMessage(const std::string &message, EndpointHandle destination) {
+    try {
+        const udp::endpoint &remoteEndpoint = endpoints.get(destination);
+        size_t limit = datagramLimit(remoteEndpoint);
+        std::string compressed;
+        bool packed = compressMessage(message, remoteEndpoint, limit, compressed);
+        if (!packed && needsFraming(message, limit)) {
+            sendFragments(message, remoteEndpoint, limit);
+            return;
+        }
+        boost::system::error_code error;
+        sendDatagram(socket.native_handle(), packed ? compressed : message, remoteEndpoint, error);
+        if (error) {
+            throw boost::system::system_error(error);
+        }
+        sendCalls.fetch_add(1, std::memory_order_relaxed);
+        datagramsSent.fetch_add(1, std::memory_order_relaxed);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending message: " << e.what() << std::endl;
+    }
+}
+
+EndpointHandle Peer::resolveEndpoint(const std::string &ip, int port) {
+    return endpoints.resolve(ip, port);
+}
+
+void Peer::asyncSendMessage(const std::string &message, const std::string &ip, int port,
+                            SendHandler handler) {
+    std::shared_lock<std::shared_mutex> rebindLock(rebindMutex);
+    if (rebinding) {
+        std::lock_guard<std::mutex> lock(deferredMutex);
+        deferredSends.push_back({message, ip, port, std::move(handler)});
+        return;
+    }
+
+    udp::endpoint remoteEndpoint;
+    try {
+        remoteEndpoint = endpoints.get(endpoints.resolve(ip, port));
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending message: " << e.what() << std::endl;
+        if (handler) handler(boost::asio::error::invalid_argument, 0);
+        return;
+    }
+
+    size_t limit = datagramLimit(remoteEndpoint);
+    std::string compressed;
+    bool packed = compressMessage(message, remoteEndpoint, limit, compressed);
+
+    // Fragment bursts go out with sendmmsg on a pool thread rather than one async op per piece
+    if (!packed && needsFraming(message, limit)) {
+        auto send = [this, message, remoteEndpoint, limit, handler = std::move(handler)]() {
+            boost::system::error_code error;
+            size_t len = 0;
+            try {
+                len = sendFragments(message, remoteEndpoint, limit);
+            } catch (const boost::system::system_error &e) {
+                error = e.code();
+            } catch (const std::exception &e) {
+                std::cerr << "Error sending message: " << e.what() << std::endl;
+                error = boost::asio::error::message_size;
+            }
+            if (handler) handler(error, len);
+            sendFinished();
+        };
+        sendStarted();
+        if (ioPool.empty()) {
+            send();
+        } else {
+            boost::asio::post(io_context, std::move(send));
+        }
+        return;
+    }
+
+    // Without a running engine there is nothing to complete the operation, so send inline
+    if (ioPool.empty()) {
+        boost::system::error_code error;
+        size_t len = sendDatagram(socket.native_handle(), packed ? compressed : message, remoteEndpoint, error);
+        if (!error) {
+            sendCalls.fetch_add(1, std::memory_order_relaxed);
+            datagramsSent.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (handler) handler(error, len);
+        return;
+    }
+
+    // The payload must outlive the operation; initiation is serialized on the strand
+    auto payload = std::make_shared<std::string>(packed ? std::move(compressed) : message);
+    sendStarted();
+    boost::asio::post(ioStrand, [this, payload, remoteEndpoint, handler = std::move(handler)]() mutable {
+        socket.async_send_to(boost::asio::buffer(*payload), remoteEndpoint,
+                             [this, payload, handler = std::move(handler)](const boost::system::error_code &error,
+                                                                           size_t len) {
+                                 if (!error) {
+                                     sendCalls.fetch_add(1, std::memory_order_relaxed);
+                                     datagramsSent.fetch_add(1, std::memory_order_relaxed);
+                                 } else if (error != boost::asio::error::operation_aborted) {
+                                     std::cerr << "Error sending message: " << error.message() << std::endl;
+                                 }
+                                 if (handler) handler(error, len);
+                                 sendFinished();
+                             });
+    });
+}
+
+void Peer::sendReliable(const std::string &message, const std::string &ip, int port) {
+    try {
+        const udp::endpoint &remoteEndpoint = endpoints.get(endpoints.resolve(ip, port));
+        ReliableChannel::Output out;
+        {
+            auto channel = reliablePeer(remoteEndpoint);
+            ReliablePeer &remote = *channel;
+            std::lock_guard<std::mutex> lock(remote.mutex);
+            auto now = ReliableChannel::Clock::now();
+            size_t limit = datagramLimit(remoteEndpoint) - RELIABLE_HEADER_SIZE;
+            std::string compressed;
+            // Large messages travel as reliably sequenced fragments and reassemble after reordering
+            if (compressMessage(message, remoteEndpoint, limit, compressed)) {
+                remote.channel.send(std::move(compressed), now, out);
+            } else if (message.size() > limit || isFrame(message.data(), message.size())) {
+                for (auto &fragment : Fragmenter::split(message, nextMessageId++, limit)) {
+                    remote.channel.send(std::move(fragment), now, out);
+                }
+            } else {
+                remote.channel.send(message, now, out);
+            }
+            armChannelTimer(remoteEndpoint, remote);
+        }
+        emit(remoteEndpoint, out);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending reliable message: " << e.what() << std::endl;
+    }
+}
+
+std::optional<ReliableChannel::Stats> Peer::getReliableStats(const std::string &ip, int port) const {
+    udp::endpoint remoteEndpoint(boost::asio::ip::make_address(ip), port);
+    std::lock_guard<std::mutex> lock(channelsMutex);
+    auto it = channels.find(remoteEndpoint);
+    if (it == channels.end()) {
+        return std::nullopt;
+    }
+    std::lock_guard<std::mutex> channelLock(it->second->mutex);
+    return it->second->channel.stats();
+}
+
+// Channels are created on first use unless create is false. Callers hold a reference, so a
+// channel closed meanwhile stays valid until they are done with it.
+std::shared_ptr<Peer::ReliablePeer> Peer::reliablePeer(const udp::endpoint &remote, bool create) {
+    auto now = ReliableChannel::Clock::now();
+    std::lock_guard<std::mutex> lock(channelsMutex);
+    if (auto it = channels.find(remote); it != channels.end()) {
+        it->second->lastUsed = now;
+        return it->second;
+    }
+    if (!create) {
+        return nullptr;
+    }
+    if (channels.size() >= std::max<size_t>(config.maxReliableChannels, 1)) {
+        auto oldest = std::min_element(channels.begin(), channels.end(), [](const auto &a, const auto &b) {
+            return a.second->lastUsed < b.second->lastUsed;
+        });
+        channels.erase(oldest);
+    }
+    static thread_local std::mt19937 generator{std::random_device{}()};
+    auto entry = std::make_shared<ReliablePeer>(static_cast<uint32_t>(generator()));
+    entry->lastUsed = now;
+    // A peer already timed through other traffic skips the 1 s initial RTO
+    if (auto known = connectionTable.get(CompactEndpoint::fromUdp(remote)); known && known->srtt) {
+        entry->channel.seedRtt(*known->srtt, known->rttvar);
+    }
+    channels.emplace(remote, entry);
+    return entry;
+}
+
+// Closes channels unused since cutoff that have nothing left to send or reorder
+void Peer::expireChannels(ReliableChannel::Clock::time_point cutoff) {
+    std::lock_guard<std::mutex> lock(channelsMutex);
+    for (auto it = channels.begin(); it != channels.end();) {
+        ReliablePeer &remote = *it->second;
+        std::unique_lock<std::mutex> channelLock(remote.mutex, std::try_to_lock);
+        if (remote.lastUsed < cutoff && channelLock.owns_lock() && remote.channel.idle()) {
+            channelLock.unlock();
+            it = channels.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Performs the I/O a channel asked for, outside the channel lock
+void Peer::emit(const udp::endpoint &remote, ReliableChannel::Output &out, const ReceiveTimestamps &times) {
+    if (!out.rttSamples.empty() || out.acked > 0 || out.lost > 0) {
+        CompactEndpoint compact = CompactEndpoint::fromUdp(remote);
+        for (auto sample : out.rttSamples) {
+            connectionTable.addRttSample(compact, sample);
+        }
+        connectionTable.addDeliveries(compact, out.acked, out.lost);
+    }
+    for (const auto &frame : out.frames) {
+        boost::system::error_code error;
+        sendDatagram(socket.native_handle(), frame, remote, error);
+        if (error) {
+            std::cerr << "Error sending reliable frame: " << error.message() << std::endl;
+            continue;
+        }
+        sendCalls.fetch_add(1, std::memory_order_relaxed);
+        datagramsSent.fetch_add(1, std::memory_order_relaxed);
+    }
+    for (auto &payload : out.delivered) {
+        BufferLease lease = BufferLease::adopt(std::move(payload));
+        const char *bytes = lease.data();
+        size_t size = lease.size();
+        deliver(bytes, size, remote, std::move(lease), times);
+    }
+}
+
+// Keeps a timer pending at or before the channel's retransmission deadline. Timers are never
+// moved: a deadline that moved later is picked up when the earlier timer fires and re-arms.
+// Called with remote.mutex held.
+void Peer::armChannelTimer(const udp::endpoint &remoteEndpoint, ReliablePeer &remote) {
+    auto deadline = remote.channel.nextDeadline();
+    if (!deadline || (remote.armedFor && *remote.armedFor <= *deadline)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(timerMutex);
+    if (!timerRunning) {
+        return;
+    }
+    remote.armedFor = *deadline;
+    timers.scheduleAt(*deadline, [this, remoteEndpoint] { onChannelTimer(remoteEndpoint); }, this);
+}
+
+void Peer::onChannelTimer(const udp::endpoint &remoteEndpoint) {
+    std::shared_ptr<ReliablePeer> remote;
+    {
+        std::lock_guard<std::mutex> lock(channelsMutex);
+        auto it = channels.find(remoteEndpoint);
+        if (it == channels.end()) {
+            return;
+        }
+        remote = it->second;
+    }
+    ReliableChannel::Output out;
+    {
+        std::lock_guard<std::mutex> lock(remote->mutex);
+        auto now = ReliableChannel::Clock::now();
+        // A timer superseded by an earlier one finds a later armedFor and leaves it alone
+        if (remote->armedFor && *remote->armedFor <= now) {
+            remote->armedFor.reset();
+        }
+        remote->channel.onTimer(now, out);
+        armChannelTimer(remoteEndpoint, *remote);
+    }
+    emit(remoteEndpoint, out);
+}
+
+void Peer::armCoalesceTimer() {
+    auto deadline = coalescer->nextDeadline();
+    std::lock_guard<std::mutex> lock(timerMutex);
+    if (!deadline || !timerRunning || (coalesceArmedFor && *coalesceArmedFor <= *deadline)) {
+        return;
+    }
+    coalesceArmedFor = *deadline;
+    timers.scheduleAt(*deadline, [this] { onCoalesceTimer(); }, this);
+}
+
+void Peer::onCoalesceTimer() {
+    auto now = Coalescer::Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        if (coalesceArmedFor && *coalesceArmedFor <= now) {
+            coalesceArmedFor.reset();
+        }
+    }
+    std::vector<Coalescer::Datagram> due;
+    coalescer->collectDue(now, due);
+    sendDatagrams(due);
+    armCoalesceTimer();
+}
+
+// Sends the probes a search asked for and publishes the sizes it settled on. A probe the
+// local stack refuses rules its size out at once, which may ask for the next probe.
+void Peer::sendProbes(PathMtu::Output &out) {
+    while (!out.probes.empty() || !out.sizes.empty() || !out.rttSamples.empty()) {
+        for (const auto &[destination, size] : out.sizes) {
+            connectionTable.setDatagramSize(CompactEndpoint::fromUdp(destination), size);
+        }
+        for (const auto &[destination, sample] : out.rttSamples) {
+            connectionTable.addRttSample(CompactEndpoint::fromUdp(destination), sample);
+        }
+        PathMtu::Output next;
+        for (const auto &[destination, probe] : out.probes) {
+            boost::system::error_code error;
+            sendDatagram(socket.native_handle(), probe, destination, error);
+            if (error == boost::asio::error::message_size) {
+                pathMtu->onTooBig(destination, probe, PathMtu::Clock::now(), next);
+                continue;
+            }
+            if (error) {
+                std::cerr << "Error sending path MTU probe: " << error.message() << std::endl;
+                continue;
+            }
+            mtuProbes.fetch_add(1, std::memory_order_relaxed);
+            sendCalls.fetch_add(1, std::memory_order_relaxed);
+            datagramsSent.fetch_add(1, std::memory_order_relaxed);
+        }
+        out = std::move(next);
+    }
+    armProbeTimer();
+}
+
+void Peer::armProbeTimer() {
+    auto deadline = pathMtu->nextDeadline();
+    std::lock_guard<std::mutex> lock(timerMutex);
+    if (!deadline || !timerRunning || (probeArmedFor && *probeArmedFor <= *deadline)) {
+        return;
+    }
+    probeArmedFor = *deadline;
+    timers.scheduleAt(*deadline, [this] { onProbeTimer(); }, this);
+}
+
+void Peer::onProbeTimer() {
+    auto now = PathMtu::Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        if (probeArmedFor && *probeArmedFor <= now) {
+            probeArmedFor.reset();
+        }
+    }
+    PathMtu::Output out;
+    pathMtu->onTimer(now, out);
+    sendProbes(out);
+}
+
+// Arms every deadline that built up while no timers were scheduled
+void Peer::startTimers() {
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        timerRunning = true;
+        coalesceArmedFor.reset();
+        probeArmedFor.reset();
+    }
+    armCoalesceTimer();
+    armProbeTimer();
+    auto idle = config.connectionIdleTimeout;
+    timers.scheduleEvery(std::max<std::chrono::seconds>(idle / 4, std::chrono::seconds(1)), [this, idle] {
+        connectionTable.expire(ConnectionTable::Clock::now() - idle);
+        expireChannels(ReliableChannel::Clock::now() - idle);
+        // Searches follow their destination out of the table and start over if it comes back
+        pathMtu->retain([this](const udp::endpoint &destination) {
+            return connectionTable.datagramSize(CompactEndpoint::fromUdp(destination)) != 0;
+        });
+    }, this);
+
+    std::vector<std::pair<udp::endpoint, std::shared_ptr<ReliablePeer>>> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(channelsMutex);
+        for (const auto &[endpoint, remote] : channels) {
+            snapshot.emplace_back(endpoint, remote);
+        }
+    }
+    for (auto &[endpoint, remote] : snapshot) {
+        std::lock_guard<std::mutex> lock(remote->mutex);
+        remote->armedFor.reset();
+        armChannelTimer(endpoint, *remote);
+    }
+}
+
+void Peer::sendCoalesced(const std::string &message, const std::string &ip, int port) {
+    try {
+        EndpointHandle destination = endpoints.resolve(ip, port);
+        const udp::endpoint &remoteEndpoint = endpoints.get(destination);
+        std::vector<Coalescer::Datagram> full;
+        switch (coalescer->add(message, remoteEndpoint, datagramLimit(remoteEndpoint), Coalescer::Clock::now(),
+                               full)) {
+            case Coalescer::AddResult::Rejected:
+                sendMessage(message, destination);
+                return;
+            case Coalescer::AddResult::Opened:
+                armCoalesceTimer();
+                break;
+            case Coalescer::AddResult::Queued:
+                break;
+        }
+        sendDatagrams(full);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending message: " << e.what() << std::endl;
+    }
+}
+
+void Peer::flushCoalesced() {
+    std::vector<Coalescer::Datagram> all;
+    coalescer->collectAll(all);
+    sendDatagrams(all);
+}
+
+// Sends sealed bundles with as few sendmmsg calls as possible
+void Peer::sendDatagrams(const std::vector<Coalescer::Datagram> &datagrams) {
+    if (datagrams.empty() || !socket.is_open()) {
+        return;
+    }
+    SendBatch batch(std::min<size_t>(datagrams.size(), 64));
+    size_t messages = 0;
+    std::string compressed;
+    for (const auto &datagram : datagrams) {
+        // Whole bundles compress far better than their entries would one by one
+        bool packed = compressPayload(datagram.bytes, datagram.destination, datagramLimit(datagram.destination),
+                                      compressed);
+        batch.add(packed ? compressed : datagram.bytes, datagram.destination);
+        messages += datagram.messages;
+    }
+    try {
+        size_t calls = batch.flush(socket.native_handle());
+        sendCalls.fetch_add(calls, std::memory_order_relaxed);
+        datagramsSent.fetch_add(datagrams.size(), std::memory_order_relaxed);
+        coalescedMessages.fetch_add(messages, std::memory_order_relaxed);
+        coalescedDatagrams.fetch_add(datagrams.size(), std::memory_order_relaxed);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending coalesced messages: " << e.what() << std::endl;
+    }
+}
+
+void Peer::queueMessage(const std::string &message, const std::string &ip, int port) {
+    try {
+        const udp::endpoint &remoteEndpoint = endpoints.get(endpoints.resolve(ip, port));
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (!sendBatch) {
+            sendBatch = std::make_unique<SendBatch>(config.batchSize);
+        }
+        size_t limit = datagramLimit(remoteEndpoint);
+        std::string compressed;
+        bool packed = compressMessage(message, remoteEndpoint, limit, compressed);
+        if (packed || !needsFraming(message, limit)) {
+            if (sendBatch->add(packed ? compressed : message, remoteEndpoint)) {
+                flushLocked();
+            }
+            return;
+        }
+        for (const auto &fragment : Fragmenter::split(message, nextMessageId++, limit)) {
+            if (sendBatch->add(fragment, remoteEndpoint)) {
+                flushLocked();
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error queueing message: " << e.what() << std::endl;
+    }
+}
+
+void Peer::flushMessages() {
+    try {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        flushLocked();
+    } catch (const std::exception &e) {
+        std::cerr << "Error flushing messages: " << e.what() << std::endl;
+    }
+}
+
+// Largest datagram to send to destination: what path MTU discovery settled on, or the
+// configured size while it is still searching. The first send to a destination starts it.
+size_t Peer::datagramLimit(const udp::endpoint &destination) {
+    if (!config.pathMtuDiscovery) {
+        return config.maxDatagramSize;
+    }
+    CompactEndpoint compact = CompactEndpoint::fromUdp(destination);
+    size_t size = connectionTable.datagramSize(compact);
+    if (size != 0) {
+        return size;
+    }
+    PathMtu::Output out;
+    auto timeout = connectionTable.retransmitTimeout(compact, std::chrono::seconds(1));
+    size = pathMtu->start(destination, timeout, PathMtu::Clock::now(), out);
+    connectionTable.setDatagramSize(compact, size);
+    sendProbes(out);
+    return size;
+}
+
+// Receive buffers must hold the largest datagram any peer may have confirmed towards us
+size_t Peer::receiveDatagramSize() const {
+    return config.pathMtuDiscovery ? std::max(config.maxDatagramSize, config.maxProbedDatagramSize)
+                                   : config.maxDatagramSize;
+}
+
+// Messages that do not fit one datagram, or that could be mistaken for a frame, go out framed
+bool Peer::needsFraming(const std::string &message, size_t limit) const {
+    return message.size() > limit || isFrame(message.data(), message.size());
+}
+
+// Splits message into fragments and pushes them out with as few syscalls as the batch allows
+size_t Peer::sendFragments(const std::string &message, const udp::endpoint &destination, size_t limit) {
+    std::vector<std::string> fragments = Fragmenter::split(message, nextMessageId++, limit);
+    sendBurst(std::vector<std::string_view>(fragments.begin(), fragments.end()), destination);
+    return message.size();
+}
+
+void Peer::sendBulk(const std::vector<std::string> &messages, const std::string &ip, int port) {
+    try {
+        sendBulk(messages, resolveEndpoint(ip, port));
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending bulk messages: " << e.what() << std::endl;
+    }
+}
+
+void Peer::sendBulk(const std::vector<std::string> &messages, EndpointHandle destination) {
+    try {
+        const udp::endpoint &remoteEndpoint = endpoints.get(destination);
+        size_t limit = datagramLimit(remoteEndpoint);
+        // Oversized messages contribute their fragments, and compressed ones their frame,
+        // all of which must stay put until the send is done
+        std::vector<std::vector<std::string>> fragments(messages.size());
+        std::vector<std::string_view> datagrams;
+        datagrams.reserve(messages.size());
+        for (size_t i = 0; i < messages.size(); ++i) {
+            std::string compressed;
+            if (compressMessage(messages[i], remoteEndpoint, limit, compressed)) {
+                fragments[i].push_back(std::move(compressed));
+                datagrams.emplace_back(fragments[i].back());
+                continue;
+            }
+            if (!needsFraming(messages[i], limit)) {
+                datagrams.emplace_back(messages[i]);
+                continue;
+            }
+            fragments[i] = Fragmenter::split(messages[i], nextMessageId++, limit);
+            datagrams.insert(datagrams.end(), fragments[i].begin(), fragments[i].end());
+        }
+        sendBurst(datagrams, remoteEndpoint);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending bulk messages: " << e.what() << std::endl;
+    }
+}
+
+// Sends a run of datagrams to one destination, through GSO while the kernel accepts it.
+// Errors that mean the path cannot offload disable GSO and resend the rest with sendmmsg.
+void Peer::sendBurst(const std::vector<std::string_view> &datagrams, const udp::endpoint &destination) {
+    size_t sent = 0;
+    if (gsoEnabled && datagrams.size() > 1) {
+        try {
+            size_t calls = SegmentedSend::send(socket.native_handle(), datagrams, destination, sent);
+            sendCalls.fetch_add(calls, std::memory_order_relaxed);
+            segmentedSends.fetch_add(calls, std::memory_order_relaxed);
+            datagramsSent.fetch_add(datagrams.size(), std::memory_order_relaxed);
+            return;
+        } catch (const boost::system::system_error &e) {
+            int code = e.code().value();
+            if (code != EIO && code != EINVAL && code != EOPNOTSUPP && code != ENOPROTOOPT) {
+                datagramsSent.fetch_add(sent, std::memory_order_relaxed);
+                throw;
+            }
+            gsoEnabled = false;
+            std::cerr << "[ERROR] UDP segmentation offload unavailable, using sendmmsg: " << e.what() << std::endl;
+        }
+    }
+
+    SendBatch batch(std::min<size_t>(datagrams.size() - sent, 64));
+    for (size_t i = sent; i < datagrams.size(); ++i) {
+        batch.add(std::string(datagrams[i]), destination);
+    }
+    size_t calls = batch.flush(socket.native_handle());
+    sendCalls.fetch_add(calls, std::memory_order_relaxed);
+    datagramsSent.fetch_add(datagrams.size(), std::memory_order_relaxed);
+}
+
+void Peer::sendFrames(const std::vector<std::string_view> &frames, const udp::endpoint &destination) {
+    if (frames.empty()) {
+        return;
+    }
+    try {
+        sendBurst(frames, destination);
+    } catch (const std::exception &e) {
+        std::cerr << "Error sending frames: " << e.what() << std::endl;
+    }
+}
+
+// Caller must hold sendMutex
+void Peer::flushLocked() {
+    if (!sendBatch || sendBatch->empty() || !socket.is_open()) {
+        return;
+    }
+    size_t count = sendBatch->size();
+    size_t calls = sendBatch->flush(socket.native_handle());
+    sendCalls.fetch_add(calls, std::memory_order_relaxed);
+    datagramsSent.fetch_add(count, std::memory_order_relaxed);
+}
+
 void Peer::startListening() {
     try {
         if (!socket.is_open()) {
             throw std::runtime_error("Socket is not open. Cannot start listening.");
         }
 
+        // Span callbacks hand out pool slabs, so the pool must exist before any receive is posted.
+        // io_uring always receives into slabs, with room for the header the kernel writes first.
+        if ((messageViewCallback || config.ioUring) && !bufferPool) {
+            size_t slabSize = receiveDatagramSize() + (config.ioUring ? UringReceiver::HEADROOM : 0);
+            bufferPool = std::make_unique<BufferPool>(config.bufferSlabs, slabSize);
+        }
+
         running = true;
+        startTimers();
         std::cout << "[DEBUG] Starting to listen on: " << socket.local_endpoint().port() << std::endl;
 
+        if (config.shards > 1) {
+            startShardListeners();
+            if (config.ioThreads > 0) {
+                // Shards own all receiving; the pool only completes asynchronous sends
+                startAsyncEngine();
+            }
+            return;
+        }
+        if (config.ioUring) {
+            listenerThread = std::thread([this]() { listenOn(socket, receiveCalls, datagramsReceived); });
+            if (config.ioThreads > 0) {
+                startAsyncEngine();
+            }
+            return;
+        }
+        if (config.ioThreads > 0) {
+            startAsyncEngine();
+            return;
+        }
+        if (config.batchSize > 1) {
+            listenerThread = std::thread([this]() { listenBatched(socket, receiveCalls, datagramsReceived); });
+            return;
+        }
+
         listenerThread = std::thread([this]() {
             try {
-                char buffer[1024];
+                std::vector<char> buffer(receiveDatagramSize());
                 udp::endpoint senderEndpoint;
+                // This thread is the socket's only reader, so the last stamp is always its own datagram's
+                auto kernelTime = [this] {
+                    return config.receiveTimestamps ? lastKernelTimestamp(socket.native_handle())
+                                                    : ReceiveTimestamps::Clock::time_point{};
+                };
                 while (running) {
-                    size_t len = socket.receive_from(boost::asio::buffer(buffer), senderEndpoint);
-                    std::string message(buffer, len);
+                    // Wait in poll() rather than receive_from() so stopListening() can interrupt it
+                    if (!stopWake.waitReadable(socket.native_handle())) {
+                        break;
+                    }
+                    boost::system::error_code error;
+                    if (messageViewCallback) {
+                        BufferLease lease = bufferPool->acquire();
+                        char *target = lease ? lease.data() : buffer.data();
+                        size_t len = socket.receive_from(boost::asio::buffer(target, buffer.size()),
+                                                         senderEndpoint, MSG_DONTWAIT, error);
+                        if (error == boost::asio::error::would_block) {
+                            continue;
+                        } else if (error) {
+                            throw boost::system::system_error(error);
+                        }
+                        receiveCalls.fetch_add(1, std::memory_order_relaxed);
+                        datagramsReceived.fetch_add(1, std::memory_order_relaxed);
+                        ReceiveTimestamps times = noteReceived(senderEndpoint, len, 1, ConnectionTable::Clock::now(),
+                                                               kernelTime());
+                        deliver(target, len, senderEndpoint, std::move(lease), times);
+                        continue;
+                    }
 
-                    std::cout << "[DEBUG] Received from " << senderEndpoint.address().to_string()
-                              << ":" << senderEndpoint.port() << " - " << message << std::endl;
+                    size_t len = socket.receive_from(boost::asio::buffer(buffer), senderEndpoint, MSG_DONTWAIT, error);
+                    if (error == boost::asio::error::would_block) {
+                        continue;
+                    } else if (error) {
+                        throw boost::system::system_error(error);
+                    }
+                    receiveCalls.fetch_add(1, std::memory_order_relaxed);
+                    datagramsReceived.fetch_add(1, std::memory_order_relaxed);
+                    ReceiveTimestamps times = noteReceived(senderEndpoint, len, 1, ConnectionTable::Clock::now(),
+                                                           kernelTime());
+                    if (isFrame(buffer.data(), len)) {
+                        handleFrame(buffer.data(), len, senderEndpoint, times);
+                        continue;
+                    }
+                    if (inbound) {
+                        dispatch(buffer.data(), len, senderEndpoint, BufferLease(), times);
+                        continue;
+                    }
+                    std::string message(buffer.data(), len);
 
                     // Notify via callback
                     if (messageCallback) {
@@ -79,66 +815,657 @@ void Peer::startListening() {
     }
 }
 
-void Peer::stopListening() {
-    running = false;
-    if (listenerThread.joinable()) {
-        listenerThread.join();
+// Receive buffer sizing. SO_RCVBUFFORCE may exceed net.core.rmem_max but needs
+// CAP_NET_ADMIN, so it is tried first and SO_RCVBUF (capped by the kernel) is the fallback.
+void Peer::applySocketOptions(udp::socket &target) {
+    if (config.pathMtuDiscovery) {
+        setProbeMode(target);
     }
-    if (socket.is_open()) {
-        socket.close();
+    if (config.receiveBufferBytes <= 0) {
+        return;
+    }
+#ifdef SO_RCVBUFFORCE
+    int bytes = config.receiveBufferBytes;
+    if (setsockopt(target.native_handle(), SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) == 0) {
+        return;
+    }
+#endif
+    boost::system::error_code error;
+    target.set_option(udp::socket::receive_buffer_size(config.receiveBufferBytes), error);
+    if (error) {
+        std::cerr << "[ERROR] Failed to set receive buffer size: " << error.message() << std::endl;
     }
-    std::cout << "[DEBUG] Listener stopped and socket closed." << std::endl;
 }
 
-std::pair<std::string, int> Peer::getPublicAddress(const std::string &stunServer, int port) {
+// Picks the receive loop for one socket: io_uring when configured and supported, otherwise recvmmsg
+void Peer::listenOn(udp::socket &listenSocket, std::atomic<uint64_t> &calls, std::atomic<uint64_t> &datagrams) {
+    if (config.ioUring && listenUring(listenSocket, calls, datagrams)) {
+        return;
+    }
+    listenBatched(listenSocket, calls, datagrams);
+}
+
+// Listener loop for io_uring mode. Returns false if io_uring could not be used at all,
+// which is only known for certain once the first receive has completed or failed.
+bool Peer::listenUring(udp::socket &listenSocket, std::atomic<uint64_t> &calls,
+                       std::atomic<uint64_t> &datagrams) {
+    std::unique_ptr<UringReceiver> receiver;
     try {
-        boost::asio::ip::udp::resolver resolver(io_context);
-        auto endpoints = resolver.resolve(stunServer, std::to_string(port));
+        size_t perShard = bufferPool->slabCount() / (2 * std::max<size_t>(config.shards, 1));
+        receiver = std::make_unique<UringReceiver>(listenSocket.native_handle(), *bufferPool,
+                                                   std::min<size_t>(256, perShard), config.receiveTimestamps);
+    } catch (const std::exception &e) {
+        std::cerr << "[ERROR] io_uring unavailable, falling back to recvmmsg: " << e.what() << std::endl;
+        return false;
+    }
 
-        if (endpoints.empty()) {
-            throw std::runtime_error("Failed to resolve STUN server address.");
+    bool receivedAny = false;
+    std::vector<UringReceiver::Datagram> received;
+    try {
+        // The receiver also watches the stop signal, so the timeout is only a safety net
+        receiver->watch(stopWake.fd());
+        while (running && !receiver->woken()) {
+            received.clear();
+            size_t count = receiver->receive(received, std::chrono::seconds(1));
+            if (count == 0) {
+                continue;
+            }
+            receivedAny = true;
+            calls.fetch_add(1, std::memory_order_relaxed);
+            datagrams.fetch_add(count, std::memory_order_relaxed);
+            auto now = ConnectionTable::Clock::now();
+            for (auto &datagram : received) {
+                // Read the payload before the lease is moved into deliver()
+                const char *data = datagram.lease.data();
+                ReceiveTimestamps times = noteReceived(datagram.sender, datagram.lease.size(), 1, now,
+                                                       datagram.kernelTime);
+                deliver(data, datagram.lease.size(), datagram.sender, std::move(datagram.lease), times);
+            }
+            flushMessages();
+        }
+    } catch (const std::exception &e) {
+        if (!receivedAny && running) {
+            std::cerr << "[ERROR] io_uring receive failed, falling back to recvmmsg: " << e.what() << std::endl;
+            return false;
+        }
+        if (running) {
+            std::cerr << "[ERROR] Error receiving message: " << e.what() << std::endl;
         }
+    }
+    return true;
+}
 
-        udp::endpoint stunEndpoint = *endpoints.begin();
-        udp::socket stunSocket(io_context, udp::v4());
+// Listener loop for batched mode: one recvmmsg per wakeup, then a single
+// sendmmsg for whatever replies the callbacks queued while handling the batch.
+// Hands on the datagrams of one receive call
+void Peer::deliverBatch(ReceiveBatch &batch, size_t count, bool gro, std::atomic<uint64_t> &datagrams) {
+    auto now = ConnectionTable::Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        // Read the slot before take() moves its slab out
+        const char *data = batch.data(i);
+        size_t len = batch.length(i);
+        size_t segment = batch.segmentSize(i);
+        size_t merged = segment > 0 && segment < len ? (len + segment - 1) / segment : 1;
+        ReceiveTimestamps times = noteReceived(batch.sender(i), len, merged, now, batch.kernelTime(i));
+        if (merged > 1) {
+            // GRO merged several datagrams from one sender; split them back apart
+            groMerged.fetch_add(1, std::memory_order_relaxed);
+            datagrams.fetch_add(merged - 1, std::memory_order_relaxed);
+            for (size_t offset = 0; offset < len; offset += segment) {
+                deliverCopy(data + offset, std::min(segment, len - offset), batch.sender(i), times);
+            }
+            continue;
+        }
+        if (gro && messageViewCallback) {
+            // GRO slots outgrow the pool slabs, so span consumers get a copy
+            deliverCopy(data, len, batch.sender(i), times);
+            continue;
+        }
+        deliver(data, len, batch.sender(i), batch.take(i), times);
+    }
+}
 
-        stunSocket.bind(udp::endpoint(udp::v4(), 0));
+void Peer::listenBatched(udp::socket &listenSocket, std::atomic<uint64_t> &calls,
+                         std::atomic<uint64_t> &datagrams) {
+    try {
+        ReceiveBatch batch(config.batchSize, receiveDatagramSize());
+        if (messageViewCallback) {
+            batch.attachPool(bufferPool.get());
+        }
+        bool gro = config.udpOffload && batch.enableGro(listenSocket.native_handle());
+        if (config.receiveTimestamps && !batch.enableTimestamps(listenSocket.native_handle())) {
+            std::cerr << "[ERROR] Kernel receive timestamps unavailable on this socket" << std::endl;
+        }
+        while (running) {
+            if (!stopWake.waitReadable(listenSocket.native_handle())) {
+                break;
+            }
+            size_t count = batch.receive(listenSocket.native_handle(), false);
+            if (count == 0) {
+                continue;
+            }
+            calls.fetch_add(1, std::memory_order_relaxed);
+            datagrams.fetch_add(count, std::memory_order_relaxed);
+            deliverBatch(batch, count, gro, datagrams);
+            flushMessages();
+        }
+    } catch (const std::exception &e) {
+        if (running) {
+            std::cerr << "[ERROR] Error receiving message: " << e.what() << std::endl;
+        }
+    }
+}
+
+// One pinned listener per SO_REUSEPORT socket, shard 0 being the Peer's own socket
+void Peer::startShardListeners() {
+    listenerThread = std::thread([this]() { listenOn(socket, receiveCalls, datagramsReceived); });
+    pinThread(listenerThread, 0);
+    for (size_t i = 0; i < extraShards.size(); ++i) {
+        ReceiveShard &shard = *extraShards[i];
+        shard.thread = std::thread([this, &shard]() {
+            listenOn(shard.socket, shard.receiveCalls, shard.datagramsReceived);
+        });
+        pinThread(shard.thread, i + 1);
+    }
+}
+
+// Runs the io_context on config.ioThreads threads, each keeping one receive in flight
+void Peer::startAsyncEngine() {
+    io_context.restart();
+    ioWork.emplace(boost::asio::make_work_guard(io_context));
 
-        unsigned char request[20] = {0x00, 0x01, 0x00, 0x00}; // STUN binding request header
-        for (int i = 4; i < 20; ++i) {
-            request[i] = static_cast<unsigned char>(std::rand() % 256); // Random transaction ID
+    receiveSlots.clear();
+    timestampBatch.reset();
+    bool receiving = config.shards <= 1 && !config.ioUring;
+    if (receiving && config.receiveTimestamps) {
+        // Only recvmsg returns the kernel stamps. Threads all waiting on one socket would each
+        // wake for every datagram, so a single reader drains it instead.
+        timestampBatch = std::make_unique<ReceiveBatch>(config.batchSize, receiveDatagramSize());
+        if (messageViewCallback) {
+            timestampBatch->attachPool(bufferPool.get());
         }
+        if (!timestampBatch->enableTimestamps(socket.native_handle())) {
+            std::cerr << "[ERROR] Kernel receive timestamps unavailable on this socket" << std::endl;
+        }
+        boost::asio::post(ioStrand, [this]() { waitReadable(); });
+        receiving = false;
+    }
+    // Sharded and io_uring listeners own receiving; the pool then only completes asynchronous sends
+    for (size_t i = 0; i < config.ioThreads && receiving; ++i) {
+        receiveSlots.push_back(std::make_unique<ReceiveSlot>());
+        receiveSlots.back()->buffer.resize(receiveDatagramSize());
+        boost::asio::post(ioStrand, [this, i]() { startReceive(i); });
+    }
+    for (size_t i = 0; i < config.ioThreads; ++i) {
+        ioPool.emplace_back([this]() {
+            try {
+                io_context.run();
+            } catch (const std::exception &e) {
+                std::cerr << "[ERROR] I/O thread terminated: " << e.what() << std::endl;
+            }
+        });
+    }
+    std::cout << "[DEBUG] Async engine started with " << config.ioThreads << " I/O threads" << std::endl;
+}
 
-        stunSocket.send_to(boost::asio::buffer(request, 20), stunEndpoint);
+void Peer::stopAsyncEngine() {
+    if (ioPool.empty()) {
+        return;
+    }
+    // Outstanding receives keep the pool running, so let queued sends reach the socket first.
+    // Sends still stuck after a second are cancelled, which completes them with operation_aborted.
+    {
+        std::unique_lock<std::mutex> lock(pendingMutex);
+        auto drained = [this] { return pendingSends == 0; };
+        if (!sendsDrained.wait_for(lock, std::chrono::seconds(1), drained)) {
+            lock.unlock();
+            boost::asio::post(ioStrand, [this] {
+                boost::system::error_code ignored;
+                socket.cancel(ignored);
+            });
+            lock.lock();
+            if (!sendsDrained.wait_for(lock, std::chrono::milliseconds(100), drained)) {
+                std::cerr << "[ERROR] Stopping with " << pendingSends << " asynchronous sends not completed" << std::endl;
+            }
+        }
+    }
+    ioWork.reset();
+    io_context.stop();
+    for (auto &thread : ioPool) {
+        thread.join();
+    }
+    ioPool.clear();
+}
+
+void Peer::sendStarted() {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    pendingSends++;
+}
+
+void Peer::sendFinished() {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    if (--pendingSends == 0) {
+        sendsDrained.notify_all();
+    }
+}
+
+void Peer::startReceive(size_t slot) {
+    ReceiveSlot &receiveSlot = *receiveSlots[slot];
+    if (bufferPool && !receiveSlot.lease) {
+        receiveSlot.lease = bufferPool->acquire();
+    }
+    auto target = receiveSlot.lease ? boost::asio::buffer(receiveSlot.lease.data(), receiveSlot.lease.capacity())
+                                    : boost::asio::buffer(receiveSlot.buffer);
+    socket.async_receive_from(target, receiveSlot.sender,
+                              [this, slot](const boost::system::error_code &error, size_t len) {
+                                  onReceive(slot, error, len);
+                              });
+}
+
+void Peer::waitReadable() {
+    socket.async_wait(udp::socket::wait_read, [this](const boost::system::error_code &error) {
+        onReadable(error);
+    });
+}
+
+// Drains the socket, so one wakeup serves every datagram queued by the time it runs
+void Peer::onReadable(const boost::system::error_code &error) {
+    if (error == boost::asio::error::operation_aborted || !running) {
+        return;
+    }
+    if (error) {
+        std::cerr << "[ERROR] Error receiving message: " << error.message() << std::endl;
+    } else {
+        try {
+            size_t count;
+            while (running && (count = timestampBatch->receive(socket.native_handle(), false)) > 0) {
+                receiveCalls.fetch_add(1, std::memory_order_relaxed);
+                datagramsReceived.fetch_add(count, std::memory_order_relaxed);
+                deliverBatch(*timestampBatch, count, false, datagramsReceived);
+                flushMessages();
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "[ERROR] Error receiving message: " << e.what() << std::endl;
+        }
+    }
+    boost::asio::post(ioStrand, [this]() { waitReadable(); });
+}
+
+void Peer::onReceive(size_t slot, const boost::system::error_code &error, size_t len) {
+    if (error == boost::asio::error::operation_aborted || !running) {
+        return;
+    }
+
+    if (error) {
+        std::cerr << "[ERROR] Error receiving message: " << error.message() << std::endl;
+    } else {
+        receiveCalls.fetch_add(1, std::memory_order_relaxed);
+        datagramsReceived.fetch_add(1, std::memory_order_relaxed);
+
+        // Handlers run concurrently on the pool; only the re-arm below touches the socket
+        ReceiveSlot &receiveSlot = *receiveSlots[slot];
+        // Several threads read the socket, so there is no kernel stamp to pair with this datagram
+        ReceiveTimestamps times = noteReceived(receiveSlot.sender, len, 1, ConnectionTable::Clock::now());
+        try {
+            const char *data = receiveSlot.lease ? receiveSlot.lease.data() : receiveSlot.buffer.data();
+            deliver(data, len, receiveSlot.sender, std::move(receiveSlot.lease), times);
+            flushMessages();
+        } catch (const std::exception &e) {
+            std::cerr << "[ERROR] Message callback failed: " << e.what() << std::endl;
+        }
+    }
+    boost::asio::post(ioStrand, [this, slot]() { startReceive(slot); });
+}
 
-        unsigned char response[1024];
-        udp::endpoint senderEndpoint;
-        size_t len = stunSocket.receive_from(boost::asio::buffer(response, 1024), senderEndpoint);
+// Called once per receive with what arrived from sender, before anything is delivered.
+// Returns the timestamps every message in the receive carries from here on.
+ReceiveTimestamps Peer::noteReceived(const udp::endpoint &sender, size_t bytes, size_t datagrams,
+                                     ConnectionTable::Clock::time_point now,
+                                     ReceiveTimestamps::Clock::time_point kernelTime) {
+    connectionTable.touch(CompactEndpoint::fromUdp(sender), bytes, datagrams, now);
+    ReceiveTimestamps times;
+    if (config.receiveTimestamps) {
+        times.kernel = kernelTime;
+        times.received = ReceiveTimestamps::Clock::now();
+    }
+    return times;
+}
 
-        if (len < 20 || response[0] != 0x01 || response[1] != 0x01) {
-            throw std::runtime_error("Invalid STUN response.");
+// Entry point for every received datagram: frames are consumed here, plain messages dispatched
+void Peer::deliver(const char *data, size_t len, const udp::endpoint &sender, BufferLease lease,
+                   const ReceiveTimestamps &times) {
+    if (isFrame(data, len)) {
+        handleFrame(data, len, sender, times);
+        return;
+    }
+    dispatch(data, len, sender, std::move(lease), times);
+}
+
+void Peer::handleFrame(const char *data, size_t len, const udp::endpoint &sender, const ReceiveTimestamps &times) {
+    switch (frameType(data)) {
+        case FrameType::Reliable:
+        case FrameType::Ack:
+        case FrameType::Reset: {
+            // Only data opens a channel; an ack or reset for one we do not have concerns nothing
+            auto channel = reliablePeer(sender, frameType(data) == FrameType::Reliable);
+            if (!channel) {
+                break;
+            }
+            ReliableChannel::Output out;
+            {
+                ReliablePeer &remote = *channel;
+                std::lock_guard<std::mutex> lock(remote.mutex);
+                auto now = ReliableChannel::Clock::now();
+                if (frameType(data) == FrameType::Reliable) {
+                    remote.channel.onData(data, len, now, out);
+                } else if (frameType(data) == FrameType::Ack) {
+                    remote.channel.onAck(data, len, now, out);
+                } else {
+                    remote.channel.onReset(data, len, now, out);
+                }
+                armChannelTimer(sender, remote);
+            }
+            emit(sender, out, times);
+            break;
+        }
+        case FrameType::Bundle: {
+            // Entries are validated against the datagram bounds before anything is dispatched
+            size_t offset = FRAME_HEADER_SIZE;
+            while (offset + BUNDLE_ENTRY_OVERHEAD <= len) {
+                size_t entryLen = readU16(data + offset);
+                offset += BUNDLE_ENTRY_OVERHEAD;
+                if (offset + entryLen > len) {
+                    std::cerr << "[ERROR] Truncated bundle from " << sender << std::endl;
+                    break;
+                }
+                dispatchCopy(data + offset, entryLen, sender, times);
+                offset += entryLen;
+            }
+            break;
         }
+        case FrameType::Fragment: {
+            std::optional<std::string> message = reassembler->add(sender, data, len);
+            if (message) {
+                messagesReassembled.fetch_add(1, std::memory_order_relaxed);
+                // Reassembled messages outgrow the slabs, so the lease owns the heap copy instead
+                BufferLease lease = BufferLease::adopt(std::move(*message));
+                const char *bytes = lease.data();
+                size_t size = lease.size();
+                dispatch(bytes, size, sender, std::move(lease), times);
+            }
+            break;
+        }
+        case FrameType::Compressed:
+            onCompressed(data, len, sender, times);
+            break;
+        case FrameType::Capabilities:
+            onCapabilities(data, len, sender);
+            break;
+        case FrameType::Transfer:
+            if (transferHandler) {
+                transferHandler(data, len, sender);
+            }
+            break;
+        case FrameType::Probe:
+            // Answered whether or not we probe ourselves; a truncated probe gets no answer
+            if (auto ack = PathMtu::answer(data, len)) {
+                boost::system::error_code error;
+                sendDatagram(socket.native_handle(), *ack, sender, error);
+                if (!error) {
+                    sendCalls.fetch_add(1, std::memory_order_relaxed);
+                    datagramsSent.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            break;
+        case FrameType::ProbeAck: {
+            PathMtu::Output out;
+            pathMtu->onAck(sender, data, len, PathMtu::Clock::now(), out);
+            sendProbes(out);
+            break;
+        }
+        default:
+            std::cerr << "[ERROR] Dropping frame of unknown type " << static_cast<int>(data[1]) << std::endl;
+            break;
+    }
+}
 
-        uint16_t mappedPort = (response[26] << 8 | response[27]) ^ 0x2112;
-        std::string mappedIP = std::to_string(response[28] ^ 0x21) + "." +
-                               std::to_string(response[29] ^ 0x12) + "." +
-                               std::to_string(response[30] ^ 0xA4) + "." +
-                               std::to_string(response[31] ^ 0x42);
+// Replaces payload with a Compressed frame when the destination negotiated a codec and the
+// frame is smaller and fits in limit. Until the destination has described itself, payloads
+// go out as they are and our capabilities are offered alongside the first one.
+bool Peer::compressPayload(std::string_view payload, const udp::endpoint &destination, size_t limit,
+                           std::string &frame) {
+    if (!config.compression || payload.empty() || payload.size() < config.compressionThreshold) {
+        return false;
+    }
+    ConnectionTable::CodecState remote = connectionTable.offerCodecs(CompactEndpoint::fromUdp(destination));
+    if (!remote.offered) {
+        sendCapabilities(destination, true);
+    }
+    Codec codec = Compressor::choose(Compressor::available(), remote.codecs);
+    if (codec == Codec::None) {
+        return false;
+    }
+    bool useDictionary = compressor.dictionaryId() != 0 && remote.dictionaryId == compressor.dictionaryId();
+    auto compressed = compressor.compress(payload, codec, useDictionary, std::min(limit, payload.size() - 1));
+    if (!compressed) {
+        return false;
+    }
+    compressedPayloads.fetch_add(1, std::memory_order_relaxed);
+    compressionSaved.fetch_add(payload.size() - compressed->size(), std::memory_order_relaxed);
+    frame = std::move(*compressed);
+    return true;
+}
 
-        return {mappedIP, mappedPort};
+// Frame-looking application messages are never compressed: after decompression they
+// would be taken for frames instead of being delivered as they are
+bool Peer::compressMessage(const std::string &message, const udp::endpoint &destination, size_t limit,
+                           std::string &frame) {
+    return !isFrame(message.data(), message.size()) && compressPayload(message, destination, limit, frame);
+}
+
+void Peer::sendCapabilities(const udp::endpoint &destination, bool wantReply) {
+    std::string frame = Compressor::encodeCapabilities(Compressor::available(), compressor.dictionaryId(), wantReply);
+    boost::system::error_code error;
+    sendDatagram(socket.native_handle(), frame, destination, error);
+    if (error) {
+        std::cerr << "Error sending capabilities: " << error.message() << std::endl;
+        return;
+    }
+    sendCalls.fetch_add(1, std::memory_order_relaxed);
+    datagramsSent.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Peer::onCapabilities(const char *data, size_t len, const udp::endpoint &sender) {
+    if (len < CAPABILITIES_FRAME_SIZE || !config.compression) {
+        return;
+    }
+    bool reply = static_cast<uint8_t>(data[7]) & CAPABILITIES_WANT_REPLY;
+    connectionTable.setCodecs(CompactEndpoint::fromUdp(sender), static_cast<uint8_t>(data[2]), readU32(data + 3),
+                              reply);
+    if (reply) {
+        sendCapabilities(sender, false);
+    }
+}
+
+void Peer::onCompressed(const char *data, size_t len, const udp::endpoint &sender, const ReceiveTimestamps &times) {
+    std::string payload;
+    try {
+        payload = compressor.decompress(data, len, config.maxMessageSize);
     } catch (const std::exception &e) {
-        std::cerr << "Error during STUN resolution: " << e.what() << std::endl;
-        return {"", 0};
+        std::cerr << "[ERROR] Dropping compressed frame from " << sender << ": " << e.what() << std::endl;
+        // The sender's view of us is stale (e.g. a different dictionary); correct it
+        sendCapabilities(sender, false);
+        return;
+    }
+    if (isFrame(payload.data(), payload.size()) && frameType(payload.data()) == FrameType::Compressed) {
+        std::cerr << "[ERROR] Dropping nested compressed frame from " << sender << std::endl;
+        return;
+    }
+    BufferLease lease = BufferLease::adopt(std::move(payload));
+    const char *bytes = lease.data();
+    size_t size = lease.size();
+    deliver(bytes, size, sender, std::move(lease), times);
+}
+
+// Like deliver(), for bytes the receive buffer will reuse: plain messages are copied if needed
+void Peer::deliverCopy(const char *data, size_t len, const udp::endpoint &sender, const ReceiveTimestamps &times) {
+    if (isFrame(data, len)) {
+        handleFrame(data, len, sender, times);
+        return;
+    }
+    dispatchCopy(data, len, sender, times);
+}
+
+// Dispatches a message that lives inside a larger datagram. Span consumers get their
+// own pool slab so each message can be leased independently.
+void Peer::dispatchCopy(const char *data, size_t len, const udp::endpoint &sender, const ReceiveTimestamps &times) {
+    if (!messageViewCallback) {
+        dispatch(data, len, sender, BufferLease(), times);
+        return;
+    }
+    BufferLease lease = bufferPool->acquire();
+    if (!lease || lease.capacity() < len) {
+        poolExhausted.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::memcpy(lease.data(), data, len);
+    lease.setSize(len);
+    char *bytes = lease.data();
+    dispatch(bytes, len, sender, std::move(lease), times);
+}
+
+// Hands one message to whichever callback is installed. The lease, when present,
+// already holds the bytes at data; the span callback never sees the fallback buffers.
+void Peer::dispatch(const char *data, size_t len, const udp::endpoint &sender, BufferLease lease,
+                    const ReceiveTimestamps &times) {
+    if (inbound) {
+        if (shed(data, len)) {
+            return;
+        }
+        // Pool slabs travel through the queue as they are; anything else is copied once
+        if (!lease) {
+            lease = BufferLease::adopt(std::string(data, len));
+        }
+        lease.setSize(len);
+        if (!inbound->tryPush({sender, std::move(lease), times})) {
+            inboundDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!inboundScheduled.exchange(true, std::memory_order_acq_rel) && inboundNotify) {
+            inboundNotify();
+        }
+        return;
+    }
+    if (messageViewCallback) {
+        if (!lease) {
+            poolExhausted.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        lease.setSize(len);
+        std::string_view view = lease.view();
+        messageViewCallback(view, sender, std::move(lease));
+    } else if (messageCallback) {
+        messageCallback(std::string(data, len), sender.address().to_string(), sender.port());
+    }
+}
+
+void Peer::stopListening() {
+    stopReceiving();
+    flushCoalesced();
+    flushMessages();
+    closeSockets();
+    std::cout << "[DEBUG] Listener stopped and socket closed." << std::endl;
+}
+
+// Moves to a new port. Queued batches, coalesced bundles and reliable channel state are
+// kept and go out from the new socket once it is bound, as do asynchronous sends made
+// while the socket was being replaced.
+void Peer::rebind(int localPort) {
+    {
+        std::unique_lock<std::shared_mutex> lock(rebindMutex);
+        rebinding = true;
+    }
+    bool wasListening = running;
+    try {
+        stopReceiving();
+        closeSockets();
+        bind(localPort);
+        if (wasListening) {
+            startListening();
+        }
+    } catch (...) {
+        // Deferred sends then fail through their handlers instead of waiting forever
+        resumeDeferredSends();
+        throw;
+    }
+    resumeDeferredSends();
+    flushMessages();
+}
+
+void Peer::resumeDeferredSends() {
+    std::vector<DeferredSend> deferred;
+    {
+        std::unique_lock<std::shared_mutex> lock(rebindMutex);
+        rebinding = false;
+        std::lock_guard<std::mutex> deferredLock(deferredMutex);
+        deferred.swap(deferredSends);
+    }
+    for (auto &send : deferred) {
+        asyncSendMessage(send.message, send.ip, send.port, std::move(send.handler));
+    }
+}
+
+// Cancels this peer's timers and stops every listener and the io pool, leaving outbound queues untouched
+void Peer::stopReceiving() {
+    running = false;
+    stopWake.signal();
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        timerRunning = false;
+    }
+    timers.cancelAll(this);
+    if (listenerThread.joinable()) {
+        listenerThread.join();
+    }
+    for (auto &shard : extraShards) {
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
     }
+    stopAsyncEngine();
+    stopWake.reset();
+}
+
+void Peer::closeSockets() {
+    for (auto &shard : extraShards) {
+        if (shard->socket.is_open()) {
+            shard->socket.close();
+        }
+    }
+    extraShards.clear();
+    if (socket.is_open()) {
+        socket.close();
+    }
+    // Drain the handlers aborted by close() so no operation outlives its receive slot
+    io_context.restart();
+    io_context.poll();
+    receiveSlots.clear();
+}
+
+// Same binding request as STUN::getPublicAddress, including its retransmissions and timeout
+std::pair<std::string, int> Peer::getPublicAddress(const std::string &stunServer, int port) {
+    return STUN::getPublicAddress(stunServer, port, std::chrono::seconds(3), timers);
 }
 
 void Peer::setSharedKey(const std::string &key) {
     sharedKey = key;
 }
 
+// Output is the random IV followed by the ciphertext, so decryptMessage() can recover the IV
 std::string Peer::encryptMessage(const std::string &plaintext) {
     unsigned char iv[EVP_MAX_IV_LENGTH];
-    unsigned char ciphertext[1024];
+    // CBC output is at most one block longer than the input
+    std::vector<unsigned char> ciphertext(plaintext.size() + EVP_MAX_BLOCK_LENGTH);
     int len = 0, ciphertextLen = 0;
 
     if (RAND_bytes(iv, sizeof(iv)) != 1) {
@@ -156,14 +1483,14 @@ std::string Peer::encryptMessage(const std::string &plaintext) {
         throw std::runtime_error("Failed to initialize encryption.");
     }
 
-    if (EVP_EncryptUpdate(ctx, ciphertext, &len,
+    if (EVP_EncryptUpdate(ctx, ciphertext.data(), &len,
                           reinterpret_cast<const unsigned char *>(plaintext.c_str()), plaintext.size()) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         throw std::runtime_error("Encryption failed.");
     }
     ciphertextLen = len;
 
-    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
+    if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         throw std::runtime_error("Final encryption step failed.");
     }
@@ -171,12 +1498,22 @@ std::string Peer::encryptMessage(const std::string &plaintext) {
 
     EVP_CIPHER_CTX_free(ctx);
 
-    return std::string(reinterpret_cast<char *>(ciphertext), ciphertextLen);
+    int ivLen = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
+    std::string result(reinterpret_cast<char *>(iv), ivLen);
+    result.append(reinterpret_cast<char *>(ciphertext.data()), ciphertextLen);
+    return result;
 }
 
 std::string Peer::decryptMessage(const std::string &ciphertext) {
-    unsigned char plaintext[1024];
-    unsigned char iv[EVP_MAX_IV_LENGTH];
+    int ivLen = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
+    if (ciphertext.size() < static_cast<size_t>(ivLen)) {
+        throw std::runtime_error("Ciphertext is shorter than the IV.");
+    }
+    const auto *iv = reinterpret_cast<const unsigned char *>(ciphertext.data());
+    const auto *encrypted = reinterpret_cast<const unsigned char *>(ciphertext.data() + ivLen);
+    size_t encryptedLen = ciphertext.size() - ivLen;
+
+    std::vector<unsigned char> plaintext(encryptedLen + EVP_MAX_BLOCK_LENGTH);
     int len = 0, plaintextLen = 0;
 
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
@@ -190,14 +1527,13 @@ std::string Peer::decryptMessage(const std::string &ciphertext) {
         throw std::runtime_error("Failed to initialize decryption.");
     }
 
-    if (EVP_DecryptUpdate(ctx, plaintext, &len,
-                          reinterpret_cast<const unsigned char *>(ciphertext.c_str()), ciphertext.size()) != 1) {
+    if (EVP_DecryptUpdate(ctx, plaintext.data(), &len, encrypted, encryptedLen) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         throw std::runtime_error("Decryption failed.");
     }
     plaintextLen = len;
 
-    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) {
+    if (EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len) != 1) {
         EVP_CIPHER_CTX_free(ctx);
         throw std::runtime_error("Final decryption step failed.");
     }
@@ -205,9 +1541,173 @@ std::string Peer::decryptMessage(const std::string &ciphertext) {
 
     EVP_CIPHER_CTX_free(ctx);
 
-    return std::string(reinterpret_cast<char *>(plaintext), plaintextLen);
+    return std::string(reinterpret_cast<char *>(plaintext.data()), plaintextLen);
 }
 
 void Peer::setMessageCallback(std::function<void(const std::string&, const std::string&, int)> callback) {
     messageCallback = std::move(callback);
-}
\ No newline at end of file
+}
+
+void Peer::setMessageCallback(MessageViewCallback callback) {
+    messageViewCallback = std::move(callback);
+}
+void Peer::setInboundQueue(size_t capacity, std::function<void()> notify) {
+    inbound = std::make_unique<MpscQueue<InboundMessage>>(capacity);
+    inboundNotify = std::move(notify);
+    inboundScheduled = false;
+}
+
+// True if the message should be dropped to keep the inbound queue for higher priorities
+bool Peer::shed(const char *data, size_t len) {
+    size_t depth = inbound->size();
+    if (depth < config.shedBulkDepth && depth < config.shedNormalDepth) {
+        return false;
+    }
+    MessagePriority priority = priorityClassifier ? priorityClassifier(std::string_view(data, len))
+                                                  : MessagePriority::Normal;
+    if (priority == MessagePriority::Bulk && depth >= config.shedBulkDepth) {
+        shedBulk.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    if (priority == MessagePriority::Normal && depth >= config.shedNormalDepth) {
+        shedNormal.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void Peer::setTransferHandler(FrameHandler handler) {
+    transferHandler = std::move(handler);
+}
+
+void Peer::setPriorityClassifier(PriorityClassifier classifier) {
+    priorityClassifier = std::move(classifier);
+}
+
+size_t Peer::drainInbound(std::vector<InboundMessage> &out, size_t max) {
+    if (!inbound) {
+        return 0;
+    }
+    // Re-arm before draining: a push that lands after this point notifies again, so nothing
+    // queued behind the drain is left waiting for a burst that never comes
+    inboundScheduled.store(false, std::memory_order_release);
+    size_t first = out.size();
+    size_t drained = inbound->drain(out, max);
+    if (config.receiveTimestamps) {
+        auto now = ReceiveTimestamps::Clock::now();
+        for (size_t i = first; i < out.size(); ++i) {
+            out[i].times.dequeued = now;
+        }
+    }
+    return drained;
+}
+
+void Peer::recordLatency(const ReceiveTimestamps &times) {
+    latencySamples.fetch_add(1, std::memory_order_relaxed);
+    kernelQueueNanos.fetch_add(times.kernelQueue().count(), std::memory_order_relaxed);
+    dispatchNanos.fetch_add(times.dispatch().count(), std::memory_order_relaxed);
+    decryptNanos.fetch_add(times.decrypt().count(), std::memory_order_relaxed);
+    handlingNanos.fetch_add(times.handling().count(), std::memory_order_relaxed);
+}
+
+void Peer::setCompressionDictionary(std::string dictionary) {
+    compressor.setDictionary(std::move(dictionary));
+}
+
+void Peer::setConfig(const PeerConfig &newConfig) {
+    std::lock_guard<std::mutex> lock(sendMutex);
+    flushLocked();
+    config = newConfig;
+    sendBatch.reset();
+    // Senders running path MTU discovery may fragment down to minDatagramSize
+    size_t smallestDatagram = std::min(config.minDatagramSize, config.maxDatagramSize);
+    reassembler = std::make_unique<Reassembler>(config.reassemblyBytes, config.maxMessageSize,
+                                                smallestDatagram - std::min(smallestDatagram, FRAGMENT_HEADER_SIZE),
+                                                config.reassemblyTimeout);
+    coalescer = std::make_unique<Coalescer>(config.coalesceDelay);
+    pathMtu = std::make_unique<PathMtu>(config.minDatagramSize, config.maxDatagramSize, config.maxProbedDatagramSize,
+                                        config.pathMtuRaiseInterval);
+    connectionTable.setCapacity(config.maxConnections);
+    endpoints.setCapacity(config.maxConnections);
+}
+
+PeerStats Peer::getStats() const {
+    PeerStats stats;
+    for (const auto &shard : getShardStats()) {
+        stats.receiveCalls += shard.receiveCalls;
+        stats.datagramsReceived += shard.datagramsReceived;
+        stats.sendCalls += shard.sendCalls;
+        stats.datagramsSent += shard.datagramsSent;
+        stats.poolExhausted += shard.poolExhausted;
+        stats.messagesReassembled += shard.messagesReassembled;
+        stats.reassemblyExpired += shard.reassemblyExpired;
+        stats.reliableRetransmits += shard.reliableRetransmits;
+        stats.coalescedMessages += shard.coalescedMessages;
+        stats.coalescedDatagrams += shard.coalescedDatagrams;
+        stats.segmentedSends += shard.segmentedSends;
+        stats.groMerged += shard.groMerged;
+        stats.inboundDropped += shard.inboundDropped;
+        stats.shedBulk += shard.shedBulk;
+        stats.shedNormal += shard.shedNormal;
+        stats.kernelDrops += shard.kernelDrops;
+        stats.compressedPayloads += shard.compressedPayloads;
+        stats.compressionSaved += shard.compressionSaved;
+        stats.mtuProbes += shard.mtuProbes;
+    }
+    stats.latencySamples = latencySamples.load(std::memory_order_relaxed);
+    stats.kernelQueueNanos = kernelQueueNanos.load(std::memory_order_relaxed);
+    stats.dispatchNanos = dispatchNanos.load(std::memory_order_relaxed);
+    stats.decryptNanos = decryptNanos.load(std::memory_order_relaxed);
+    stats.handlingNanos = handlingNanos.load(std::memory_order_relaxed);
+    stats.batchSize = config.batchSize;
+    return stats;
+}
+
+// Sends always leave through shard 0, so the other shards only report receive counters
+std::vector<PeerStats> Peer::getShardStats() const {
+    std::vector<PeerStats> shards(1 + extraShards.size());
+    shards[0].batchSize = config.batchSize;
+    shards[0].receiveCalls = receiveCalls.load(std::memory_order_relaxed);
+    shards[0].datagramsReceived = datagramsReceived.load(std::memory_order_relaxed);
+    shards[0].sendCalls = sendCalls.load(std::memory_order_relaxed);
+    shards[0].datagramsSent = datagramsSent.load(std::memory_order_relaxed);
+    shards[0].poolExhausted = poolExhausted.load(std::memory_order_relaxed);
+    shards[0].messagesReassembled = messagesReassembled.load(std::memory_order_relaxed);
+    shards[0].reassemblyExpired = reassembler->expiredMessages();
+    shards[0].coalescedMessages = coalescedMessages.load(std::memory_order_relaxed);
+    shards[0].coalescedDatagrams = coalescedDatagrams.load(std::memory_order_relaxed);
+    shards[0].segmentedSends = segmentedSends.load(std::memory_order_relaxed);
+    shards[0].groMerged = groMerged.load(std::memory_order_relaxed);
+    shards[0].inboundDropped = inboundDropped.load(std::memory_order_relaxed);
+    shards[0].shedBulk = shedBulk.load(std::memory_order_relaxed);
+    shards[0].shedNormal = shedNormal.load(std::memory_order_relaxed);
+    shards[0].compressedPayloads = compressedPayloads.load(std::memory_order_relaxed);
+    shards[0].compressionSaved = compressionSaved.load(std::memory_order_relaxed);
+    shards[0].mtuProbes = mtuProbes.load(std::memory_order_relaxed);
+    // Asio's native_handle() is non-const, although reading socket options changes nothing
+    shards[0].kernelDrops = kernelDropCount(const_cast<udp::socket &>(socket));
+    {
+        std::lock_guard<std::mutex> lock(channelsMutex);
+        for (const auto &[endpoint, remote] : channels) {
+            std::lock_guard<std::mutex> channelLock(remote->mutex);
+            shards[0].reliableRetransmits += remote->channel.stats().retransmits;
+        }
+    }
+    for (size_t i = 0; i < extraShards.size(); ++i) {
+        shards[i + 1].batchSize = config.batchSize;
+        shards[i + 1].receiveCalls = extraShards[i]->receiveCalls.load(std::memory_order_relaxed);
+        shards[i + 1].datagramsReceived = extraShards[i]->datagramsReceived.load(std::memory_order_relaxed);
+        shards[i + 1].kernelDrops = kernelDropCount(extraShards[i]->socket);
+    }
+    return shards;
+}
+
+double PeerStats::receiveOccupancy() const {
+    if (receiveCalls == 0 || batchSize == 0) return 0.0;
+    return static_cast<double>(datagramsReceived) / (static_cast<double>(receiveCalls) * batchSize);
+}
+
+double PeerStats::sendOccupancy() const {
+    if (sendCalls == 0 || batchSize == 0) return 0.0;
+    return static_cast<double>(datagramsSent) / (static_cast<double>(sendCalls) * batchSize);
+}
@@ -0,0 +1,311 @@
+//
+// Created by Omer Mersin on 11/20/24.
+//
+#include "networking/reliable_channel.h"
+#include "networking/framing.h"
+#include <algorithm>
+#include <cmath>
+
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+static constexpr double CUBIC_C = 0.4;
+static constexpr double CUBIC_BETA = 0.7;
+static constexpr int DUP_THRESHOLD = 3;
+static constexpr microseconds MIN_RTO = std::chrono::milliseconds(50);
+static constexpr microseconds MAX_RTO = std::chrono::seconds(60);
+
+// Extends a 32-bit wire sequence number to the 64-bit value closest to reference
+static uint64_t unwrap(uint32_t wire, uint64_t reference) {
+    uint64_t candidate = (reference & ~0xFFFFFFFFull) | wire;
+    if (candidate + 0x80000000ull < reference) {
+        candidate += 0x100000000ull;
+    } else if (candidate > reference + 0x80000000ull && candidate >= 0x100000000ull) {
+        candidate -= 0x100000000ull;
+    }
+    return candidate;
+}
+
+ReliableChannel::ReliableChannel(uint32_t epoch) : epoch(epoch) {}
+
+void ReliableChannel::seedRtt(microseconds seedSrtt, microseconds seedRttvar) {
+    if (srtt) {
+        return;
+    }
+    rttvar = seedRttvar;
+    rto = std::clamp(seedSrtt + std::max(microseconds(1000), seedRttvar * 4), MIN_RTO, MAX_RTO);
+}
+
+void ReliableChannel::send(std::string payload, Clock::time_point now, Output &out) {
+    pending.push_back(std::move(payload));
+    transmitPending(now, out);
+}
+
+// Resends packets marked lost, then moves queued payloads onto the wire,
+// while the congestion and receive windows allow
+void ReliableChannel::transmitPending(Clock::time_point now, Output &out) {
+    for (auto it = outstanding.begin(); lostCount > 0 && it != outstanding.end(); ++it) {
+        if (static_cast<double>(inFlight()) >= cwnd) {
+            return;
+        }
+        if (it->second.lost) {
+            it->second.lost = false;
+            lostCount--;
+            retransmit(it->second, now, out);
+        }
+    }
+
+    while (!pending.empty()) {
+        uint64_t oldest = outstanding.empty() ? nextSeq : outstanding.begin()->first;
+        if (static_cast<double>(inFlight()) >= cwnd || nextSeq - oldest >= WINDOW) {
+            break;
+        }
+
+        std::string frame;
+        frame.reserve(RELIABLE_HEADER_SIZE + pending.front().size());
+        appendFrameHeader(frame, FrameType::Reliable);
+        appendU32(frame, epoch);
+        appendU32(frame, static_cast<uint32_t>(nextSeq));
+        frame += pending.front();
+        pending.pop_front();
+
+        out.frames.push_back(frame);
+        outstanding.emplace(nextSeq++, Outstanding{std::move(frame), now});
+        if (!rtoDeadline) {
+            rtoDeadline = now + rto;
+        }
+    }
+}
+
+void ReliableChannel::onData(const char *frame, size_t len, Clock::time_point, Output &out) {
+    if (len < RELIABLE_HEADER_SIZE) {
+        return;
+    }
+    uint32_t senderEpoch = readU32(frame + 2);
+    uint64_t seq = unwrap(readU32(frame + 6), expected);
+
+    // A new epoch means the remote side restarted its channel; only accept it from the start.
+    // Anything later means this side forgot the epoch, and the sender has to start over.
+    if (remoteEpoch != senderEpoch) {
+        if (readU32(frame + 6) >= WINDOW) {
+            out.frames.push_back(makeReset(senderEpoch));
+            return;
+        }
+        remoteEpoch = senderEpoch;
+        expected = 0;
+        reorder.clear();
+        seq = readU32(frame + 6);
+    }
+
+    if (seq >= expected && seq < expected + WINDOW) {
+        reorder.try_emplace(seq, frame + RELIABLE_HEADER_SIZE, len - RELIABLE_HEADER_SIZE);
+        for (auto it = reorder.begin(); it != reorder.end() && it->first == expected; it = reorder.erase(it)) {
+            out.delivered.push_back(std::move(it->second));
+            expected++;
+        }
+    }
+    // Duplicates are acked too, in case the earlier ack was lost
+    out.frames.push_back(makeAck());
+}
+
+std::string ReliableChannel::makeAck() const {
+    uint64_t sack = 0;
+    for (const auto &[seq, payload] : reorder) {
+        uint64_t offset = seq - expected - 1;
+        if (offset >= 64) break;
+        sack |= 1ull << offset;
+    }
+    std::string frame;
+    frame.reserve(ACK_FRAME_SIZE);
+    appendFrameHeader(frame, FrameType::Ack);
+    appendU32(frame, *remoteEpoch);
+    appendU32(frame, static_cast<uint32_t>(expected));
+    appendU64(frame, sack);
+    return frame;
+}
+
+std::string ReliableChannel::makeReset(uint32_t senderEpoch) const {
+    std::string frame;
+    frame.reserve(RESET_FRAME_SIZE);
+    appendFrameHeader(frame, FrameType::Reset);
+    appendU32(frame, senderEpoch);
+    return frame;
+}
+
+// Unacknowledged packets go back to the front of the queue in order and are sent again
+// from sequence 0; the congestion state carries over, since the path is the same
+void ReliableChannel::onReset(const char *frame, size_t len, Clock::time_point now, Output &out) {
+    if (len < RESET_FRAME_SIZE || readU32(frame + 2) != epoch) {
+        return;
+    }
+    for (auto it = outstanding.rbegin(); it != outstanding.rend(); ++it) {
+        pending.push_front(it->second.frame.substr(RELIABLE_HEADER_SIZE));
+    }
+    // A late reset for the old epoch no longer matches
+    epoch++;
+    outstanding.clear();
+    lostCount = 0;
+    nextSeq = 0;
+    recoveryPoint = 0;
+    rtoDeadline.reset();
+    transmitPending(now, out);
+}
+
+void ReliableChannel::onAck(const char *frame, size_t len, Clock::time_point now, Output &out) {
+    if (len < ACK_FRAME_SIZE || readU32(frame + 2) != epoch || outstanding.empty()) {
+        return;
+    }
+    uint64_t cumulative = unwrap(readU32(frame + 6), outstanding.begin()->first);
+    uint64_t sack = readU64(frame + 10);
+    if (cumulative > nextSeq) {
+        return;
+    }
+
+    size_t acked = 0;
+    std::optional<microseconds> sample;
+    auto take = [&](std::map<uint64_t, Outstanding>::iterator it) {
+        // Karn's rule: only never-retransmitted packets give unambiguous RTT samples
+        if (it->second.transmissions == 1) {
+            sample = duration_cast<microseconds>(now - it->second.sentAt);
+        }
+        if (it->second.lost) {
+            lostCount--;
+        }
+        acked++;
+        return outstanding.erase(it);
+    };
+
+    for (auto it = outstanding.begin(); it != outstanding.end() && it->first < cumulative;) {
+        it = take(it);
+    }
+    uint64_t highestSacked = 0;
+    for (int bit = 0; bit < 64; ++bit) {
+        if (sack & (1ull << bit)) {
+            highestSacked = cumulative + 1 + bit;
+            auto it = outstanding.find(highestSacked);
+            if (it != outstanding.end()) {
+                take(it);
+            }
+        }
+    }
+
+    if (sample) {
+        sampleRtt(*sample);
+        out.rttSamples.push_back(*sample);
+    }
+    out.acked += acked;
+    if (acked > 0) {
+        onAcked(acked, now);
+        rtoDeadline = outstanding.empty() ? std::nullopt : std::optional(now + rto);
+    }
+
+    // Fast retransmit: a hole with at least DUP_THRESHOLD selectively acked packets above it
+    for (auto &[seq, packet] : outstanding) {
+        if (seq >= highestSacked) break;
+        int above = 0;
+        for (uint64_t s = seq + 1; s <= highestSacked && above < DUP_THRESHOLD; ++s) {
+            if (s > cumulative && (sack & (1ull << (s - cumulative - 1)))) above++;
+        }
+        bool recentlySent = now - packet.sentAt < srtt.value_or(rto);
+        if (above >= DUP_THRESHOLD && !recentlySent && !packet.lost) {
+            onLoss(seq, now);
+            fastRetransmits++;
+            out.lost++;
+            retransmit(packet, now, out);
+        }
+    }
+
+    transmitPending(now, out);
+}
+
+void ReliableChannel::onTimer(Clock::time_point now, Output &out) {
+    if (!rtoDeadline || now < *rtoDeadline || outstanding.empty()) {
+        return;
+    }
+    // RTO: collapse the window, back off, and treat everything in flight as lost so it is
+    // resent in slow start instead of waiting out one timeout per missing packet
+    timeouts++;
+    wMax = cwnd;
+    ssthresh = std::max(cwnd * CUBIC_BETA, 2.0);
+    cwnd = 1.0;
+    epochStart.reset();
+    recoveryPoint = nextSeq;
+
+    for (auto &[seq, packet] : outstanding) {
+        if (!packet.lost) {
+            out.lost++;
+        }
+        packet.lost = true;
+    }
+    lostCount = outstanding.size();
+    rto = std::min(rto * 2, MAX_RTO);
+    rtoDeadline = now + rto;
+    transmitPending(now, out);
+}
+
+void ReliableChannel::retransmit(Outstanding &packet, Clock::time_point now, Output &out) {
+    packet.sentAt = now;
+    packet.transmissions++;
+    retransmits++;
+    out.frames.push_back(packet.frame);
+}
+
+void ReliableChannel::sampleRtt(microseconds sample) {
+    if (!srtt) {
+        srtt = sample;
+        rttvar = sample / 2;
+    } else {
+        microseconds delta = *srtt > sample ? *srtt - sample : sample - *srtt;
+        rttvar = (rttvar * 3 + delta) / 4;
+        srtt = (*srtt * 7 + sample) / 8;
+    }
+    rto = std::clamp(*srtt + std::max(microseconds(1000), rttvar * 4), MIN_RTO, MAX_RTO);
+}
+
+// Multiplicative decrease, at most once per window of data
+void ReliableChannel::onLoss(uint64_t seq, Clock::time_point) {
+    if (seq < recoveryPoint) {
+        return;
+    }
+    recoveryPoint = nextSeq;
+    // Fast convergence: release bandwidth sooner when the previous peak was not reached
+    wMax = cwnd < wMax ? cwnd * (1.0 + CUBIC_BETA) / 2.0 : cwnd;
+    cwnd = std::max(cwnd * CUBIC_BETA, 2.0);
+    ssthresh = cwnd;
+    epochStart.reset();
+}
+
+void ReliableChannel::onAcked(size_t packets, Clock::time_point now) {
+    if (cwnd < ssthresh) {
+        cwnd += static_cast<double>(packets);
+        return;
+    }
+
+    if (!epochStart) {
+        epochStart = now;
+        if (cwnd < wMax) {
+            k = std::cbrt((wMax - cwnd) / CUBIC_C);
+            originPoint = wMax;
+        } else {
+            k = 0.0;
+            originPoint = cwnd;
+        }
+        tcpEstimate = cwnd;
+    }
+
+    double rtt = std::chrono::duration<double>(srtt.value_or(rto)).count();
+    double t = std::chrono::duration<double>(now - *epochStart).count() + rtt;
+    double target = originPoint + CUBIC_C * std::pow(t - k, 3.0);
+
+    for (size_t i = 0; i < packets; ++i) {
+        cwnd += target > cwnd ? (target - cwnd) / cwnd : 0.01 / cwnd;
+        // TCP-friendly region: never grow slower than standard AIMD would
+        tcpEstimate += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) / cwnd;
+    }
+    cwnd = std::min(std::max(cwnd, tcpEstimate), static_cast<double>(WINDOW));
+}
+
+ReliableChannel::Stats ReliableChannel::stats() const {
+    return Stats{cwnd, ssthresh, srtt.value_or(microseconds(0)), rttvar, rto,
+                 inFlight(), pending.size() + lostCount, retransmits, fastRetransmits, timeouts};
+}
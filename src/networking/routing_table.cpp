@@ -0,0 +1,312 @@
+//
+// Created by Omer Mersin on 11/27/24.
+//
+#include "networking/routing_table.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool isKeyName(const std::string &id) {
+    return id.size() == NodeId().size() * 2 &&
+           std::all_of(id.begin(), id.end(), [](char c) { return hexValue(c) >= 0; });
+}
+
+NodeId nodeIdOf(const std::string &id) {
+    NodeId key{};
+    if (isKeyName(id)) {
+        for (size_t i = 0; i < key.size(); i++) {
+            key[i] = static_cast<uint8_t>(hexValue(id[2 * i]) << 4 | hexValue(id[2 * i + 1]));
+        }
+        return key;
+    }
+    if (EVP_Digest(id.data(), id.size(), key.data(), nullptr, EVP_sha1(), nullptr) != 1) {
+        throw std::runtime_error("SHA-1 failed.");
+    }
+    return key;
+}
+
+std::string toHex(const NodeId &key) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    text.reserve(key.size() * 2);
+    for (uint8_t byte : key) {
+        text.push_back(digits[byte >> 4]);
+        text.push_back(digits[byte & 0x0F]);
+    }
+    return text;
+}
+
+NodeId xorDistance(const NodeId &a, const NodeId &b) {
+    NodeId distance;
+    for (size_t i = 0; i < distance.size(); i++) {
+        distance[i] = a[i] ^ b[i];
+    }
+    return distance;
+}
+
+size_t commonPrefixLength(const NodeId &a, const NodeId &b) {
+    for (size_t i = 0; i < a.size(); i++) {
+        if (uint8_t diff = a[i] ^ b[i]) {
+            return i * 8 + __builtin_clz(diff) - 24;
+        }
+    }
+    return RoutingTable::ID_BITS;
+}
+
+RoutingTable::RoutingTable(const NodeId &self, Clock::duration staleAfter)
+        : self(self), staleAfter(staleAfter), buckets(1), tableEpoch(std::random_device{}()) {}
+
+void RoutingTable::setStaleAfter(Clock::duration staleAfter) {
+    this->staleAfter = staleAfter;
+}
+
+RoutingTable::Insertion RoutingTable::insert(const DHTNode &node, Clock::time_point now) {
+    NodeId key = nodeIdOf(node.id);
+    if (key == self) {
+        return Insertion::Ignored;
+    }
+    auto sameKey = [&key](const Contact &entry) { return entry.key == key; };
+    Contact entry{key, node};
+    entry.node.lastSeen = now;
+
+    for (;;) {
+        size_t index = bucketIndex(key);
+        Bucket &bucket = buckets[index];
+        auto &entries = bucket.entries;
+        // A known node keeps the endpoint it was first added with
+        if (auto it = std::find_if(entries.begin(), entries.end(), sameKey); it != entries.end()) {
+            it->node.lastSeen = now;
+            if (isKeyName(it->node.id) && !isKeyName(node.id)) {
+                it->node.id = node.id;
+            }
+            std::rotate(it, it + 1, entries.end());
+            return Insertion::Refreshed;
+        }
+        auto &replacements = bucket.replacements;
+        if (auto it = std::find_if(replacements.begin(), replacements.end(), sameKey); it != replacements.end()) {
+            indexRemove(*it);
+            replacements.erase(it);
+        }
+        if (entries.size() < BUCKET_SIZE) {
+            stamp(entry);
+            indexAdd(entry);
+            entries.push_back(std::move(entry));
+            return Insertion::Added;
+        }
+        // Only the bucket covering this node's own range splits; far ranges stay at k nodes
+        if (index == buckets.size() - 1 && buckets.size() < ID_BITS) {
+            split();
+            continue;
+        }
+        if (now - entries.front().node.lastSeen > staleAfter) {
+            indexRemove(entries.front());
+            entries.erase(entries.begin());
+            stamp(entry);
+            indexAdd(entry);
+            entries.push_back(std::move(entry));
+            return Insertion::Added;
+        }
+        indexAdd(entry);
+        replacements.push_back(std::move(entry));
+        if (replacements.size() > BUCKET_SIZE) {
+            indexRemove(replacements.front());
+            replacements.erase(replacements.begin());
+        }
+        return Insertion::Cached;
+    }
+}
+
+// Runs for every incoming message, so only the buckets of the nodes at the endpoint are searched
+void RoutingTable::touch(const std::string &ip, int port, Clock::time_point now) {
+    auto known = endpoints.find({ip, port});
+    if (known == endpoints.end()) {
+        return;
+    }
+    for (const NodeId &key : known->second) {
+        Bucket &bucket = buckets[bucketIndex(key)];
+        // A key is either in the bucket or in its replacement cache, never both
+        for (auto *list : {&bucket.entries, &bucket.replacements}) {
+            auto it = std::find_if(list->begin(), list->end(), [&key](const Contact &entry) { return entry.key == key; });
+            if (it != list->end()) {
+                it->node.lastSeen = now;
+                std::rotate(it, it + 1, list->end());
+                break;
+            }
+        }
+    }
+}
+
+bool RoutingTable::remove(const std::string &id) {
+    NodeId key = nodeIdOf(id);
+    auto sameKey = [&key](const Contact &entry) { return entry.key == key; };
+    Bucket &bucket = buckets[bucketIndex(key)];
+    if (auto it = std::find_if(bucket.entries.begin(), bucket.entries.end(), sameKey); it != bucket.entries.end()) {
+        indexRemove(*it);
+        bucket.entries.erase(it);
+        promote(bucket);
+        return true;
+    }
+    auto &replacements = bucket.replacements;
+    auto it = std::find_if(replacements.begin(), replacements.end(), sameKey);
+    if (it == replacements.end()) {
+        return false;
+    }
+    indexRemove(*it);
+    replacements.erase(it);
+    return true;
+}
+
+std::optional<DHTNode> RoutingTable::find(const std::string &id) const {
+    NodeId key = nodeIdOf(id);
+    for (const auto &entry : buckets[bucketIndex(key)].entries) {
+        if (entry.key == key) {
+            return entry.node;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<RoutingTable::Contact> RoutingTable::closest(const NodeId &target, size_t count) const {
+    std::vector<std::pair<NodeId, const Contact *>> ranked;
+    ranked.reserve(size());
+    for (const auto &bucket : buckets) {
+        for (const auto &entry : bucket.entries) {
+            ranked.emplace_back(xorDistance(entry.key, target), &entry);
+        }
+    }
+    count = std::min(count, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                      [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::vector<Contact> contacts;
+    contacts.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        contacts.push_back(*ranked[i].second);
+    }
+    return contacts;
+}
+
+std::vector<DHTNode> RoutingTable::nodes() const {
+    std::vector<DHTNode> nodes;
+    nodes.reserve(size());
+    for (const auto &bucket : buckets) {
+        for (const auto &entry : bucket.entries) {
+            nodes.push_back(entry.node);
+        }
+    }
+    return nodes;
+}
+
+std::vector<RoutingTable::Contact> RoutingTable::addedSince(uint64_t version) const {
+    std::vector<Contact> added;
+    for (const auto &bucket : buckets) {
+        for (const auto &entry : bucket.entries) {
+            if (entry.version > version) {
+                added.push_back(entry);
+            }
+        }
+    }
+    std::sort(added.begin(), added.end(), [](const Contact &a, const Contact &b) { return a.version < b.version; });
+    return added;
+}
+
+std::vector<DHTNode> RoutingTable::expire(Clock::time_point cutoff) {
+    auto silent = [cutoff](const Contact &entry) { return entry.node.lastSeen < cutoff; };
+    std::vector<DHTNode> expired;
+    for (auto &bucket : buckets) {
+        auto &entries = bucket.entries;
+        auto it = std::stable_partition(entries.begin(), entries.end(), [&](const Contact &entry) {
+            return !silent(entry);
+        });
+        for (auto dead = it; dead != entries.end(); ++dead) {
+            indexRemove(*dead);
+            expired.push_back(std::move(dead->node));
+        }
+        entries.erase(it, entries.end());
+        auto &replacements = bucket.replacements;
+        auto stale = std::stable_partition(replacements.begin(), replacements.end(), [&](const Contact &entry) {
+            return !silent(entry);
+        });
+        for (auto dead = stale; dead != replacements.end(); ++dead) {
+            indexRemove(*dead);
+        }
+        replacements.erase(stale, replacements.end());
+        while (entries.size() < BUCKET_SIZE && !replacements.empty()) {
+            promote(bucket);
+        }
+    }
+    return expired;
+}
+
+size_t RoutingTable::size() const {
+    size_t total = 0;
+    for (const auto &bucket : buckets) {
+        total += bucket.entries.size();
+    }
+    return total;
+}
+
+size_t RoutingTable::bucketIndex(const NodeId &key) const {
+    return std::min(commonPrefixLength(self, key), buckets.size() - 1);
+}
+
+void RoutingTable::indexAdd(const Contact &entry) {
+    endpoints[{entry.node.ip, entry.node.port}].push_back(entry.key);
+}
+
+void RoutingTable::indexRemove(const Contact &entry) {
+    auto it = endpoints.find({entry.node.ip, entry.node.port});
+    if (it == endpoints.end()) {
+        return;
+    }
+    auto &keys = it->second;
+    keys.erase(std::remove(keys.begin(), keys.end(), entry.key), keys.end());
+    if (keys.empty()) {
+        endpoints.erase(it);
+    }
+}
+
+// Moves the nodes of the last bucket that share one more bit with this node into a new last bucket
+void RoutingTable::split() {
+    size_t depth = buckets.size();
+    buckets.emplace_back();
+    Bucket &parent = buckets[depth - 1];
+    Bucket &child = buckets[depth];
+    auto closer = [this, depth](const Contact &entry) { return commonPrefixLength(self, entry.key) >= depth; };
+    for (auto *from : {&parent.entries, &parent.replacements}) {
+        auto *to = from == &parent.entries ? &child.entries : &child.replacements;
+        auto it = std::stable_partition(from->begin(), from->end(), [&](const Contact &entry) {
+            return !closer(entry);
+        });
+        std::move(it, from->end(), std::back_inserter(*to));
+        from->erase(it, from->end());
+    }
+}
+
+// The most recently seen replacement joins the bucket in its place by last-seen order
+void RoutingTable::promote(Bucket &bucket) {
+    if (bucket.replacements.empty()) {
+        return;
+    }
+    Contact entry = std::move(bucket.replacements.back());
+    bucket.replacements.pop_back();
+    stamp(entry);
+    auto &entries = bucket.entries;
+    auto at = std::upper_bound(entries.begin(), entries.end(), entry.node.lastSeen,
+                               [](Clock::time_point lastSeen, const Contact &other) {
+                                   return lastSeen < other.node.lastSeen;
+                               });
+    entries.insert(at, std::move(entry));
+}
+
+void RoutingTable::stamp(Contact &entry) {
+    entry.version = ++tableVersion;
+}
@@ -2,11 +2,16 @@
 // Created by Omer Mersin on 11/16/24.
 //
 #include "networking/stun.h"
+#include "networking/wakeup.h"
 #include <iostream>
 #include <boost/asio.hpp>
+#include <algorithm>
 #include <cstring>
 
-std::pair<std::string, int> STUN::getPublicAddress(const std::string &stunServer, int port) {
+static constexpr auto INITIAL_RTO = std::chrono::milliseconds(500);
+
+std::pair<std::string, int> STUN::getPublicAddress(const std::string &stunServer, int port,
+                                                   std::chrono::milliseconds timeout, TimerService &timers) {
     try {
         boost::asio::io_context io_context;
 
@@ -26,6 +31,7 @@ std::pair<std::string, int> STUN::getPublicAddress(const std::string &stunServer
         } else {
             throw std::runtime_error("Unknown address type for STUN server");
         }
+        socket.non_blocking(true);
 
         std::cout << "Resolved STUN server: " << stunEndpoint.address().to_string()
                   << ":" << stunEndpoint.port() << std::endl;
@@ -36,33 +42,60 @@ std::pair<std::string, int> STUN::getPublicAddress(const std::string &stunServer
         request[1] = 0x01;
         request[2] = 0x00; // Length (16 bytes)
         request[3] = 0x00;
+        request[4] = 0x21; // Magic cookie, which the XOR-MAPPED-ADDRESS below is masked with
+        request[5] = 0x12;
+        request[6] = 0xA4;
+        request[7] = 0x42;
 
         // Generate a random Transaction ID (12 bytes)
-        for (int i = 4; i < 20; ++i) {
+        for (int i = 8; i < 20; ++i) {
             request[i] = static_cast<unsigned char>(rand() % 256);
         }
 
-        // Send the request to the STUN server
-        socket.send_to(boost::asio::buffer(request, 20), stunEndpoint);
+        // Each attempt waits one RTO for an answer; the timer ends the wait by signalling
+        Wakeup expired;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        auto rto = std::chrono::milliseconds(INITIAL_RTO);
+        for (;;) {
+            socket.send_to(boost::asio::buffer(request, 20), stunEndpoint);
+            auto waitUntil = std::min<std::chrono::steady_clock::time_point>(
+                    std::chrono::steady_clock::now() + rto, deadline);
+            TimerId timer = timers.scheduleAt(waitUntil, [&expired] { expired.signal(); });
 
-        // Receive the response
-        unsigned char response[1024];
-        boost::asio::ip::udp::endpoint senderEndpoint;
-        size_t length = socket.receive_from(boost::asio::buffer(response, 1024), senderEndpoint);
+            unsigned char response[1024];
+            size_t length = 0;
+            while (expired.waitReadable(socket.native_handle())) {
+                boost::asio::ip::udp::endpoint senderEndpoint;
+                boost::system::error_code error;
+                length = socket.receive_from(boost::asio::buffer(response, 1024), senderEndpoint, 0, error);
+                // Anything but the answer to this transaction is ignored, including late duplicates
+                if (!error && length >= 32 && std::memcmp(response + 4, request + 4, 16) == 0) {
+                    break;
+                }
+                length = 0;
+            }
+            timers.cancel(timer);
+            expired.reset();
 
-        // Parse the response (Basic Parsing)
-        if (length > 0 && response[0] == 0x01 && response[1] == 0x01) { // Binding Success Response
-            unsigned short port = (response[26] << 8) | response[27];
-            port ^= 0x2112; // XOR port with magic cookie
+            // Parse the response (Basic Parsing)
+            if (length > 0) {
+                if (response[0] != 0x01 || response[1] != 0x01) { // Binding Success Response
+                    throw std::runtime_error("Invalid STUN response");
+                }
+                unsigned short port = (response[26] << 8) | response[27];
+                port ^= 0x2112; // XOR port with magic cookie
 
-            char ip[16];
-            snprintf(ip, sizeof(ip), "%d.%d.%d.%d",
-                     response[28] ^ 0x21, response[29] ^ 0x12,
-                     response[30] ^ 0xA4, response[31] ^ 0x42);
+                char ip[16];
+                snprintf(ip, sizeof(ip), "%d.%d.%d.%d",
+                         response[28] ^ 0x21, response[29] ^ 0x12,
+                         response[30] ^ 0xA4, response[31] ^ 0x42);
 
-            return {std::string(ip), port};
-        } else {
-            throw std::runtime_error("Invalid STUN response");
+                return {std::string(ip), port};
+            }
+            if (std::chrono::steady_clock::now() >= deadline) {
+                throw std::runtime_error("STUN request timed out");
+            }
+            rto *= 2;
         }
     } catch (std::exception &e) {
         std::cerr << "STUN Error: " << e.what() << std::endl;
@@ -0,0 +1,354 @@
+//
+// Created by Omer Mersin on 11/24/24.
+//
+#include "networking/timer_wheel.h"
+#include <algorithm>
+#include <iostream>
+
+TimerWheel::TimerWheel(uint64_t startTick) : current(startTick) {
+    heads.fill(NONE);
+}
+
+TimerId TimerWheel::add(uint64_t expiryTick, uint64_t intervalTicks, const void *owner, Callback callback) {
+    uint32_t index;
+    if (!freeNodes.empty()) {
+        index = freeNodes.back();
+        freeNodes.pop_back();
+    } else {
+        index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+    }
+    Node &node = nodes[index];
+    node.expiry = expiryTick;
+    node.interval = intervalTicks;
+    node.owner = owner;
+    node.callback = std::move(callback);
+    place(index);
+    count++;
+    return makeId(index, node.generation);
+}
+
+bool TimerWheel::cancel(TimerId id) {
+    Node *node = lookup(id);
+    if (!node) {
+        return false;
+    }
+    uint32_t index = static_cast<uint32_t>(id);
+    unlink(index);
+    release(index);
+    return true;
+}
+
+size_t TimerWheel::cancelAll(const void *owner) {
+    size_t cancelled = 0;
+    for (uint32_t index = 0; index < nodes.size(); ++index) {
+        if (nodes[index].bucket != NONE && nodes[index].owner == owner) {
+            unlink(index);
+            release(index);
+            cancelled++;
+        }
+    }
+    return cancelled;
+}
+
+void TimerWheel::advance(uint64_t tick, std::vector<Expired> &out) {
+    expireSlot(DUE, out);
+    while (current < tick) {
+        // Jump straight to the next occupied slot or cascade boundary; empty ticks cost nothing
+        uint64_t next = nextEventTick();
+        if (next > tick) {
+            current = tick;
+            break;
+        }
+        current = next;
+        if (heads[OVERFLOW] != NONE && static_cast<uint32_t>(current) == 0) {
+            cascade(LEVELS);
+        }
+        for (int level = LEVELS - 1; level > 0; --level) {
+            if ((current & ((uint64_t{1} << (SLOT_BITS * level)) - 1)) == 0) {
+                cascade(level);
+            }
+        }
+        expireSlot(DUE, out);
+        expireSlot(current & (SLOTS - 1), out);
+    }
+}
+
+uint64_t TimerWheel::nextEventTick() const {
+    if (heads[DUE] != NONE) {
+        return current;
+    }
+    if (count == 0) {
+        return UINT64_MAX;
+    }
+    // The first level with an occupied slot ahead of the current one holds the earliest
+    // event: an expiry on level 0, the tick its slot cascades down on higher levels
+    for (int level = 0; level < LEVELS; ++level) {
+        int shift = SLOT_BITS * level;
+        int slot = nextOccupied(level, ((current >> shift) & (SLOTS - 1)) + 1);
+        if (slot >= 0) {
+            uint64_t block = (current >> (shift + SLOT_BITS)) << (shift + SLOT_BITS);
+            return block + (static_cast<uint64_t>(slot) << shift);
+        }
+    }
+    return ((current >> 32) + 1) << 32;
+}
+
+TimerWheel::Node *TimerWheel::lookup(TimerId id) {
+    uint32_t index = static_cast<uint32_t>(id);
+    if (index >= nodes.size()) {
+        return nullptr;
+    }
+    Node &node = nodes[index];
+    if (node.bucket == NONE || node.generation != static_cast<uint32_t>(id >> 32)) {
+        return nullptr;
+    }
+    return &node;
+}
+
+// Level = highest byte in which the expiry differs from the current tick
+void TimerWheel::place(uint32_t index) {
+    uint64_t expiry = nodes[index].expiry;
+    if (expiry <= current) {
+        link(index, DUE);
+        return;
+    }
+    uint64_t difference = expiry ^ current;
+    for (int level = 0; level < LEVELS; ++level) {
+        if (difference < (uint64_t{1} << (SLOT_BITS * (level + 1)))) {
+            link(index, level * SLOTS + ((expiry >> (SLOT_BITS * level)) & (SLOTS - 1)));
+            return;
+        }
+    }
+    link(index, OVERFLOW);
+}
+
+void TimerWheel::link(uint32_t index, uint32_t bucket) {
+    Node &node = nodes[index];
+    node.bucket = bucket;
+    node.prev = NONE;
+    node.next = heads[bucket];
+    if (node.next != NONE) {
+        nodes[node.next].prev = index;
+    }
+    heads[bucket] = index;
+    if (bucket < LEVELS * SLOTS) {
+        occupied[bucket / SLOTS][(bucket % SLOTS) / 64] |= uint64_t{1} << (bucket % 64);
+    }
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node &node = nodes[index];
+    if (node.prev != NONE) {
+        nodes[node.prev].next = node.next;
+    } else {
+        heads[node.bucket] = node.next;
+        if (node.next == NONE && node.bucket < LEVELS * SLOTS) {
+            occupied[node.bucket / SLOTS][(node.bucket % SLOTS) / 64] &= ~(uint64_t{1} << (node.bucket % 64));
+        }
+    }
+    if (node.next != NONE) {
+        nodes[node.next].prev = node.prev;
+    }
+    node.prev = node.next = NONE;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Node &node = nodes[index];
+    node.callback = nullptr;
+    node.owner = nullptr;
+    node.bucket = NONE;
+    if (++node.generation == 0) {
+        node.generation = 1;  // Keeps every id distinct from INVALID_TIMER
+    }
+    freeNodes.push_back(index);
+    count--;
+}
+
+// Re-files the slot the wheel just reached on this level into the levels below
+void TimerWheel::cascade(int level) {
+    uint32_t bucket = level == LEVELS
+                      ? OVERFLOW
+                      : level * SLOTS + ((current >> (SLOT_BITS * level)) & (SLOTS - 1));
+    // Detach first: overflow timers still beyond 2^32 ticks go straight back into the same bucket
+    uint32_t index = heads[bucket];
+    heads[bucket] = NONE;
+    if (bucket < LEVELS * SLOTS) {
+        occupied[bucket / SLOTS][(bucket % SLOTS) / 64] &= ~(uint64_t{1} << (bucket % 64));
+    }
+    while (index != NONE) {
+        uint32_t next = nodes[index].next;
+        place(index);
+        index = next;
+    }
+}
+
+void TimerWheel::expireSlot(uint32_t bucket, std::vector<Expired> &out) {
+    while (heads[bucket] != NONE) {
+        uint32_t index = heads[bucket];
+        unlink(index);
+        fire(index, out);
+    }
+}
+
+void TimerWheel::fire(uint32_t index, std::vector<Expired> &out) {
+    Node &node = nodes[index];
+    TimerId id = makeId(index, node.generation);
+    if (node.interval == 0) {
+        out.push_back({id, node.owner, std::move(node.callback)});
+        release(index);
+        return;
+    }
+    // Repeating timers keep their id and phase; missed periods are skipped rather than replayed
+    out.push_back({id, node.owner, node.callback});
+    node.expiry += node.interval;
+    if (node.expiry <= current) {
+        node.expiry = current + node.interval;
+    }
+    place(index);
+}
+
+int TimerWheel::nextOccupied(int level, uint32_t from) const {
+    for (uint32_t word = from / 64; word < SLOTS / 64; ++word) {
+        uint64_t bits = occupied[level][word];
+        if (word == from / 64) {
+            bits &= ~uint64_t{0} << (from % 64);
+        }
+        if (bits) {
+            return static_cast<int>(word * 64 + __builtin_ctzll(bits));
+        }
+    }
+    return -1;
+}
+
+TimerService::TimerService(std::chrono::microseconds tick)
+        : tick(std::max<Clock::duration>(tick, std::chrono::microseconds(1))), epoch(Clock::now()),
+          thread(&TimerService::run, this) {
+}
+
+TimerService::~TimerService() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+TimerService &TimerService::shared() {
+    static TimerService service;
+    return service;
+}
+
+TimerId TimerService::schedule(Clock::duration delay, TimerWheel::Callback callback, const void *owner) {
+    return scheduleAt(Clock::now() + delay, std::move(callback), owner);
+}
+
+TimerId TimerService::scheduleAt(Clock::time_point when, TimerWheel::Callback callback, const void *owner) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t expiry = toTick(when, true);
+    TimerId id = wheel.add(expiry, 0, owner, std::move(callback));
+    if (expiry < wakeTick) {
+        wake.notify_one();
+    }
+    return id;
+}
+
+TimerId TimerService::scheduleEvery(Clock::duration interval, TimerWheel::Callback callback, const void *owner) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t ticks = std::max<uint64_t>(1, (interval + tick - Clock::duration(1)) / tick);
+    uint64_t expiry = toTick(Clock::now(), false) + ticks;
+    TimerId id = wheel.add(expiry, ticks, owner, std::move(callback));
+    if (expiry < wakeTick) {
+        wake.notify_one();
+    }
+    return id;
+}
+
+bool TimerService::cancel(TimerId id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    bool removed = wheel.cancel(id);
+    // Already taken off the wheel but not yet run
+    for (size_t i = readyNext; i < ready.size(); ++i) {
+        if (ready[i].id == id && ready[i].callback) {
+            ready[i].callback = nullptr;
+            removed = true;
+        }
+    }
+    if (!onServiceThread()) {
+        finished.wait(lock, [&] { return runningId != id; });
+    }
+    return removed;
+}
+
+void TimerService::cancelAll(const void *owner) {
+    if (!owner) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    wheel.cancelAll(owner);
+    for (size_t i = readyNext; i < ready.size(); ++i) {
+        if (ready[i].owner == owner) {
+            ready[i].callback = nullptr;
+        }
+    }
+    if (!onServiceThread()) {
+        finished.wait(lock, [&] { return runningOwner != owner; });
+    }
+}
+
+size_t TimerService::pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return wheel.size();
+}
+
+void TimerService::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        wakeTick = 0;
+        wheel.advance(toTick(Clock::now(), false), ready);
+        if (!ready.empty()) {
+            for (readyNext = 0; readyNext < ready.size() && !stopping;) {
+                auto &timer = ready[readyNext++];
+                if (!timer.callback) continue;
+                TimerWheel::Callback callback = std::move(timer.callback);
+                runningId = timer.id;
+                runningOwner = timer.owner;
+                lock.unlock();
+                try {
+                    callback();
+                } catch (const std::exception &e) {
+                    std::cerr << "[ERROR] Timer callback failed: " << e.what() << std::endl;
+                }
+                callback = nullptr;
+                lock.lock();
+                runningId = INVALID_TIMER;
+                runningOwner = nullptr;
+                finished.notify_all();
+            }
+            ready.clear();
+            readyNext = 0;
+            continue;
+        }
+        wakeTick = wheel.nextEventTick();
+        if (wakeTick == UINT64_MAX) {
+            wake.wait(lock);
+        } else {
+            wake.wait_until(lock, epoch + tick * static_cast<Clock::rep>(wakeTick));
+        }
+    }
+}
+
+uint64_t TimerService::toTick(Clock::time_point when, bool roundUp) const {
+    if (when <= epoch) {
+        return 0;
+    }
+    auto elapsed = when - epoch;
+    uint64_t ticks = elapsed / tick;
+    if (roundUp && elapsed % tick != Clock::duration::zero()) {
+        ticks++;
+    }
+    return ticks;
+}
@@ -0,0 +1,95 @@
+//
+// Created by Omer Mersin on 11/26/24.
+//
+#include "networking/timestamps.h"
+#include <cstring>
+#include <ctime>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#endif
+
+using Clock = ReceiveTimestamps::Clock;
+
+static std::chrono::nanoseconds between(Clock::time_point from, Clock::time_point to) {
+    if (from == Clock::time_point{} || to == Clock::time_point{} || to < from) {
+        return std::chrono::nanoseconds(0);
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from);
+}
+
+std::chrono::nanoseconds ReceiveTimestamps::kernelQueue() const {
+    return between(kernel, received);
+}
+
+std::chrono::nanoseconds ReceiveTimestamps::dispatch() const {
+    return between(received, dequeued);
+}
+
+// Consumers that do not decrypt leave decrypted unset; handling then starts at the dequeue
+std::chrono::nanoseconds ReceiveTimestamps::decrypt() const {
+    return between(dequeued, decrypted);
+}
+
+std::chrono::nanoseconds ReceiveTimestamps::handling() const {
+    return between(decrypted == Clock::time_point{} ? dequeued : decrypted, handled);
+}
+
+static Clock::time_point fromTimespec(const timespec &stamp) {
+    if (stamp.tv_sec == 0 && stamp.tv_nsec == 0) {
+        return {};
+    }
+    auto sinceEpoch = std::chrono::seconds(stamp.tv_sec) + std::chrono::nanoseconds(stamp.tv_nsec);
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(sinceEpoch));
+}
+
+bool enableReceiveTimestamps(int fd) {
+#ifdef __linux__
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+        return true;
+    }
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+#else
+    (void) fd;
+    return false;
+#endif
+}
+
+Clock::time_point kernelTimestamp(const msghdr &header) {
+#ifdef __linux__
+    if (header.msg_controllen == 0 || (header.msg_flags & MSG_CTRUNC)) {
+        return {};
+    }
+    auto &message = const_cast<msghdr &>(header);
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        // SO_TIMESTAMPING reports software, legacy and hardware stamps in that order
+        if ((cmsg->cmsg_type == SCM_TIMESTAMPING || cmsg->cmsg_type == SCM_TIMESTAMPNS) &&
+            cmsg->cmsg_len >= CMSG_LEN(sizeof(timespec))) {
+            timespec stamp;
+            std::memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            return fromTimespec(stamp);
+        }
+    }
+#else
+    (void) header;
+#endif
+    return {};
+}
+
+Clock::time_point lastKernelTimestamp(int fd) {
+#ifdef SIOCGSTAMPNS
+    timespec stamp{};
+    if (ioctl(fd, SIOCGSTAMPNS, &stamp) == 0) {
+        return fromTimespec(stamp);
+    }
+#else
+    (void) fd;
+#endif
+    return {};
+}
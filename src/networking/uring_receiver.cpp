@@ -0,0 +1,360 @@
+//
+// Created by Omer Mersin on 11/22/24.
+//
+#include "networking/uring_receiver.h"
+
+#ifdef P2P_HAVE_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using boost::asio::ip::udp;
+
+static_assert(sizeof(io_uring_recvmsg_out) == 16, "HEADROOM assumes a 16-byte recvmsg header");
+
+static constexpr uint64_t RECEIVE_TAG = 1;
+static constexpr uint64_t CANCEL_TAG = 2;
+static constexpr uint64_t WAKE_TAG = 3;
+
+static boost::system::system_error uringError(int error, const char *what) {
+    return boost::system::system_error(
+            boost::system::error_code(error, boost::system::system_category()), what);
+}
+
+template<typename T>
+static T *at(void *base, size_t offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+static size_t floorPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result * 2 <= value) {
+        result *= 2;
+    }
+    return result;
+}
+
+UringReceiver::UringReceiver(int fd, BufferPool &pool, size_t bufferCount, bool timestamps)
+        : socketFd(fd), pool(pool) {
+    if (pool.slabSize() <= HEADROOM) {
+        throw std::invalid_argument("Pool slabs are too small for io_uring receives.");
+    }
+    bufferCount = floorPowerOfTwo(std::clamp<size_t>(bufferCount, 1, 1 << 15));
+    try {
+        // Every buffer can complete before the next reap, so size the completion ring to match
+        setupRing(static_cast<unsigned>(bufferCount * 2));
+        setupBuffers(bufferCount);
+        header.msg_namelen = sizeof(sockaddr_in6);
+        if (timestamps && enableReceiveTimestamps(fd)) {
+            header.msg_controllen = TIMESTAMP_CONTROL_SPACE;
+        }
+        arm();
+    } catch (...) {
+        teardown();
+        throw;
+    }
+}
+
+UringReceiver::~UringReceiver() {
+    teardown();
+}
+
+bool UringReceiver::compiledIn() {
+    return true;
+}
+
+void UringReceiver::setupRing(unsigned completions) {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = completions;
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, 8, &params));
+    if (fd < 0) {
+        throw uringError(errno, "io_uring_setup");
+    }
+    ringFd = fd;
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        throw uringError(ENOTSUP, "io_uring_setup");
+    }
+
+    sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+    }
+    sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) {
+        sqMap = nullptr;
+        throw uringError(errno, "mmap");
+    }
+    if (single) {
+        cqMap = sqMap;
+    } else {
+        cqMap = mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED) {
+            cqMap = nullptr;
+            throw uringError(errno, "mmap");
+        }
+    }
+    sqeMapSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqeMap = mmap(nullptr, sqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqeMap == MAP_FAILED) {
+        sqeMap = nullptr;
+        throw uringError(errno, "mmap");
+    }
+
+    sqTail = at<unsigned>(sqMap, params.sq_off.tail);
+    sqMask = *at<unsigned>(sqMap, params.sq_off.ring_mask);
+    sqArray = at<unsigned>(sqMap, params.sq_off.array);
+    cqHead = at<unsigned>(cqMap, params.cq_off.head);
+    cqTail = at<unsigned>(cqMap, params.cq_off.tail);
+    cqMask = *at<unsigned>(cqMap, params.cq_off.ring_mask);
+    cqes = at<void>(cqMap, params.cq_off.cqes);
+}
+
+void UringReceiver::setupBuffers(size_t bufferCount) {
+    long page = sysconf(_SC_PAGESIZE);
+    bufferRingSize = (bufferCount * sizeof(io_uring_buf) + page - 1) / page * page;
+    bufferRing = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufferRing == MAP_FAILED) {
+        bufferRing = nullptr;
+        throw uringError(errno, "mmap");
+    }
+
+    io_uring_buf_reg registration{};
+    registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+    registration.ring_entries = static_cast<uint32_t>(bufferCount);
+    registration.bgid = 0;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        throw uringError(errno, "io_uring_register");
+    }
+
+    bufferMask = static_cast<uint16_t>(bufferCount - 1);
+    slots.resize(bufferCount);
+    for (size_t i = 0; i < bufferCount; ++i) {
+        emptySlots.push_back(static_cast<uint16_t>(i));
+    }
+    refill();
+}
+
+// Queues slot's slab at the ring tail; refill() publishes the new tail
+void UringReceiver::provide(uint16_t slot) {
+    // Entry 0's reserved field doubles as the ring tail, so only the buffer fields are written
+    io_uring_buf &entry = static_cast<io_uring_buf *>(bufferRing)[bufferTail & bufferMask];
+    entry.addr = reinterpret_cast<uint64_t>(slots[slot].data());
+    entry.len = static_cast<uint32_t>(slots[slot].capacity());
+    entry.bid = slot;
+    bufferTail++;
+}
+
+void UringReceiver::refill() {
+    bool added = false;
+    while (!emptySlots.empty()) {
+        BufferLease lease = pool.acquire();
+        if (!lease) {
+            break;
+        }
+        uint16_t slot = emptySlots.back();
+        emptySlots.pop_back();
+        slots[slot] = std::move(lease);
+        provide(slot);
+        added = true;
+    }
+    if (added) {
+        __atomic_store_n(&static_cast<io_uring_buf *>(bufferRing)[0].resv, bufferTail, __ATOMIC_RELEASE);
+    }
+}
+
+void *UringReceiver::nextSqe() {
+    unsigned tail = *sqTail;
+    unsigned index = tail & sqMask;
+    auto *sqe = &static_cast<io_uring_sqe *>(sqeMap)[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    return sqe;
+}
+
+int UringReceiver::enter(unsigned submit, unsigned waitFor, std::chrono::milliseconds timeout) {
+    if (submit > 0) {
+        __atomic_store_n(sqTail, *sqTail + submit, __ATOMIC_RELEASE);
+    }
+    if (waitFor == 0) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, submit, 0, 0, nullptr, 0));
+    }
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, submit, waitFor,
+                                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+}
+
+// Multishot recvmsg stays armed until the buffer ring runs dry or an error ends it
+void UringReceiver::arm() {
+    if (emptySlots.size() == slots.size()) {
+        return;
+    }
+    auto *sqe = static_cast<io_uring_sqe *>(nextSqe());
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socketFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&header);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = RECEIVE_TAG;
+    if (enter(1, 0, {}) < 0) {
+        throw uringError(errno, "io_uring_enter");
+    }
+    armed = true;
+}
+
+void UringReceiver::watch(int fd) {
+    auto *sqe = static_cast<io_uring_sqe *>(nextSqe());
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WAKE_TAG;
+    if (enter(1, 0, {}) < 0) {
+        throw uringError(errno, "io_uring_enter");
+    }
+}
+
+size_t UringReceiver::receive(std::vector<Datagram> &out, std::chrono::milliseconds timeout) {
+    if (!armed) {
+        refill();
+        arm();
+    }
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) &&
+        enter(0, 1, timeout) < 0 && errno != ETIME && errno != EINTR) {
+        throw uringError(errno, "io_uring_enter");
+    }
+
+    size_t received = 0;
+    int failure = 0;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = static_cast<io_uring_cqe *>(cqes)[head & cqMask];
+        if (cqe.user_data == WAKE_TAG) {
+            wokenUp = true;
+            continue;
+        }
+        if (cqe.user_data != RECEIVE_TAG) {
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            armed = false;
+        }
+        if (cqe.res < 0) {
+            // ENOBUFS just means every slab is leased out; anything else is a real failure
+            if (cqe.res != -ENOBUFS) {
+                failure = -cqe.res;
+            }
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        auto slot = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        BufferLease lease = std::move(slots[slot]);
+        emptySlots.push_back(slot);
+        io_uring_recvmsg_out meta;
+        std::memcpy(&meta, lease.data(), sizeof(meta));
+        if (meta.flags & MSG_TRUNC) {
+            truncatedCount++;
+            continue;
+        }
+
+        Datagram datagram;
+        size_t nameLen = std::min<size_t>(meta.namelen, header.msg_namelen);
+        std::memcpy(datagram.sender.data(), lease.data() + sizeof(meta), nameLen);
+        datagram.sender.resize(nameLen);
+        if (header.msg_controllen > 0) {
+            // The control messages follow the name, laid out as recvmsg would have written them
+            msghdr control{};
+            control.msg_control = lease.data() + sizeof(meta) + header.msg_namelen;
+            control.msg_controllen = meta.controllen;
+            control.msg_flags = static_cast<int>(meta.flags);
+            datagram.kernelTime = kernelTimestamp(control);
+        }
+        lease.setOffset(sizeof(meta) + header.msg_namelen + header.msg_controllen);
+        lease.setSize(meta.payloadlen);
+        datagram.lease = std::move(lease);
+        out.push_back(std::move(datagram));
+        received++;
+    }
+    // Slabs go back while the request is still armed, so it does not run the ring dry and
+    // end with ENOBUFS just to be re-armed on the next call
+    refill();
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+    if (failure != 0) {
+        throw uringError(failure, "io_uring recvmsg");
+    }
+    return received;
+}
+
+void UringReceiver::teardown() {
+    if (ringFd >= 0 && armed && sqeMap) {
+        // The kernel must stop writing into pool slabs before they can be handed out again
+        auto *sqe = static_cast<io_uring_sqe *>(nextSqe());
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = RECEIVE_TAG;
+        sqe->user_data = CANCEL_TAG;
+        enter(1, 0, {});
+        for (int attempt = 0; armed && attempt < 10; ++attempt) {
+            enter(0, 1, std::chrono::milliseconds(100));
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe &cqe = static_cast<io_uring_cqe *>(cqes)[head & cqMask];
+                if (cqe.user_data == RECEIVE_TAG && !(cqe.flags & IORING_CQE_F_MORE)) {
+                    armed = false;
+                }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+    if (ringFd >= 0) {
+        close(ringFd);
+        ringFd = -1;
+    }
+    if (sqeMap) munmap(sqeMap, sqeMapSize);
+    if (cqMap && cqMap != sqMap) munmap(cqMap, cqMapSize);
+    if (sqMap) munmap(sqMap, sqMapSize);
+    if (bufferRing) munmap(bufferRing, bufferRingSize);
+    sqeMap = cqMap = sqMap = bufferRing = nullptr;
+    slots.clear();
+    emptySlots.clear();
+}
+
+#else
+
+UringReceiver::UringReceiver(int fd, BufferPool &pool, size_t, bool) : socketFd(fd), pool(pool) {
+    throw boost::system::system_error(boost::asio::error::operation_not_supported, "io_uring");
+}
+
+UringReceiver::~UringReceiver() = default;
+
+bool UringReceiver::compiledIn() {
+    return false;
+}
+
+void UringReceiver::watch(int) {}
+
+size_t UringReceiver::receive(std::vector<Datagram> &, std::chrono::milliseconds) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,72 @@
+//
+// Created by Omer Mersin on 11/23/24.
+//
+#include "networking/wakeup.h"
+#include <boost/system/system_error.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+static boost::system::system_error lastError(const char *what) {
+    return boost::system::system_error(
+            boost::system::error_code(errno, boost::system::system_category()), what);
+}
+
+Wakeup::Wakeup() {
+#ifdef __linux__
+    readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readFd < 0) {
+        throw lastError("eventfd");
+    }
+#else
+    int fds[2];
+    if (pipe(fds) < 0) {
+        throw lastError("pipe");
+    }
+    readFd = fds[0];
+    writeFd = fds[1];
+    fcntl(readFd, F_SETFL, O_NONBLOCK);
+    fcntl(writeFd, F_SETFL, O_NONBLOCK);
+#endif
+}
+
+Wakeup::~Wakeup() {
+    close(readFd);
+    if (writeFd != readFd) {
+        close(writeFd);
+    }
+}
+
+void Wakeup::signal() {
+    uint64_t one = 1;
+    // A full pipe or counter is already signalled, so a failed write needs no handling
+    (void) !write(writeFd, &one, writeFd == readFd ? sizeof(one) : 1);
+}
+
+void Wakeup::reset() {
+    char drain[64];
+    while (read(readFd, drain, sizeof(drain)) > 0) {
+    }
+}
+
+bool Wakeup::waitReadable(int socketFd) const {
+    pollfd fds[2] = {{socketFd, POLLIN, 0}, {readFd, POLLIN, 0}};
+    for (;;) {
+        int result = poll(fds, 2, -1);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            throw lastError("poll");
+        }
+        if (fds[1].revents) {
+            return false;
+        }
+        if (fds[0].revents) {
+            return true;
+        }
+    }
+}
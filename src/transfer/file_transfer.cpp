@@ -0,0 +1,1112 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+#include "transfer/file_transfer.h"
+#include "networking/framing.h"
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+static constexpr uint8_t PAGE_MISSING = 0;
+static constexpr uint8_t PAGE_REQUESTED = 1;
+static constexpr uint8_t PAGE_RECEIVED = 2;
+static constexpr size_t RESUME_VERIFY_CHUNKS = 256;  // Hashed per tick when checking an old .part
+static constexpr size_t INFO_SIZE = 52;              // Offer and Info body without the name
+static constexpr auto OFFER_MEMORY = std::chrono::minutes(1);  // Repeats of an offer within this are not reported
+
+static uint32_t chunkLength(uint64_t fileSize, uint32_t chunkSize, uint32_t chunk) {
+    uint64_t offset = static_cast<uint64_t>(chunk) * chunkSize;
+    return static_cast<uint32_t>(std::min<uint64_t>(chunkSize, fileSize - offset));
+}
+
+static uint64_t blockMask(uint32_t length, uint16_t blockSize) {
+    size_t blocks = (length + blockSize - 1) / blockSize;
+    return blocks >= BLOCKS_PER_CHUNK ? ~uint64_t{0} : (uint64_t{1} << blocks) - 1;
+}
+
+static size_t countBlocks(uint64_t mask) {
+    return std::bitset<64>(mask).count();
+}
+
+static uint64_t countChunks(uint64_t fileSize, uint32_t chunkSize) {
+    return (fileSize + chunkSize - 1) / chunkSize;
+}
+
+static std::string transferHeader(TransferMessage kind, uint64_t id, size_t bodySize) {
+    std::string frame;
+    frame.reserve(TRANSFER_HEADER_SIZE + bodySize);
+    appendFrameHeader(frame, FrameType::Transfer);
+    frame.push_back(static_cast<char>(kind));
+    appendU64(frame, id);
+    return frame;
+}
+
+static std::string encodeInfo(TransferMessage kind, const FileOffer &info, uint64_t cookie) {
+    std::string frame = transferHeader(kind, info.id, INFO_SIZE + info.name.size());
+    appendU64(frame, info.size);
+    appendU32(frame, info.chunkSize);
+    frame.append(reinterpret_cast<const char *>(info.root.data()), info.root.size());
+    appendU64(frame, cookie);
+    frame += info.name;
+    return frame;
+}
+
+// Received names are shown to the user and used for saving, so only the last component survives
+static std::string safeFileName(std::string name) {
+    size_t slash = name.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        name.erase(0, slash + 1);
+    }
+    if (name.empty() || name == "." || name == "..") {
+        return "download";
+    }
+    return name;
+}
+
+static std::mt19937_64 &randomGenerator() {
+    static thread_local std::mt19937_64 generator{std::random_device{}()};
+    return generator;
+}
+
+FileTransfer::FileTransfer(Peer &peer, const TransferConfig &config, TimerService &timers)
+        : peer(peer), config(config), timers(timers) {
+    std::random_device random;
+    for (auto &byte : cookieSecret) {
+        byte = static_cast<unsigned char>(random());
+    }
+    peer.setTransferHandler([this](const char *data, size_t len, const udp::endpoint &sender) {
+        onFrame(data, len, sender);
+    });
+}
+
+FileTransfer::~FileTransfer() {
+    peer.setTransferHandler(nullptr);
+    timers.cancelAll(this);
+}
+
+uint64_t FileTransfer::transferId(const Digest &content) {
+    return readU64(reinterpret_cast<const char *>(content.data()));
+}
+
+FileOffer FileTransfer::share(const std::string &path) {
+    auto blob = std::make_unique<Blob>();
+    blob->file = MappedFile::openReadOnly(path);
+    blob->file.adviseSequential();
+    FileOffer &info = blob->info;
+    info.name = safeFileName(std::filesystem::path(path).filename().string());
+    info.size = blob->file.size();
+    info.chunkSize = static_cast<uint32_t>(config.blockSize * BLOCKS_PER_CHUNK);
+    uint64_t chunks = countChunks(info.size, info.chunkSize);
+    if (chunks > UINT32_MAX) {
+        throw std::runtime_error("File too large to transfer: " + path);
+    }
+    blob->chunkCount = static_cast<uint32_t>(chunks);
+    blob->leaves.resize(blob->chunkCount);
+    for (uint32_t chunk = 0; chunk < blob->chunkCount; ++chunk) {
+        blob->leaves[chunk] = sha256(blob->file.data() + static_cast<uint64_t>(chunk) * info.chunkSize,
+                                     chunkLength(info.size, info.chunkSize, chunk));
+    }
+    blob->tree = MerkleTree(blob->leaves);
+    info.root = blob->tree.root();
+    info.content = MerkleTree::contentId(info.size, info.chunkSize, info.root);
+    info.id = transferId(info.content);
+    blob->infoKnown = true;
+    blob->chunkDone.assign(blob->chunkCount, 1);
+    blob->chunksDone = blob->chunkCount;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [entry, added] = blobs.try_emplace(info.id);
+    if (added) {
+        entry->second = std::move(blob);
+    }
+    return entry->second->info;
+}
+
+uint64_t FileTransfer::offerFile(const std::string &path, const std::string &ip, int port) {
+    udp::endpoint destination(boost::asio::ip::make_address(ip), static_cast<unsigned short>(port));
+    FileOffer info = share(path);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Blob *blob = findBlob(info.id);
+        if (!blob) {
+            throw std::runtime_error("Shared file was cancelled: " + path);
+        }
+        blob->offeredTo = destination;
+        blob->offersLeft = config.offerAttempts - 1;
+        blob->nextOffer = Clock::now() + config.offerInterval;
+        blob->answered = false;
+        ensureTicker();
+    }
+    peer.sendFrames({encodeInfo(TransferMessage::Offer, info, addressCookie(destination))}, destination);
+    return info.id;
+}
+
+void FileTransfer::download(const FileOffer &offer, const std::string &savePath) {
+    auto blob = std::make_unique<Blob>();
+    blob->info = offer;
+    blob->infoKnown = true;
+    blob->fetch = std::make_unique<Fetch>();
+    blob->fetch->savePath = savePath;
+    blob->fetch->lastData = Clock::now();
+
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (blobs.count(offer.id)) {
+            throw std::runtime_error("Already receiving or sharing " + offer.name);
+        }
+        Blob &added = *(blobs[offer.id] = std::move(blob));
+        addSourceLocked(offer.id, added, offer.sender, offer.cookie, actions);
+        startFetch(offer.id, added, actions);
+        ensureTicker();
+    }
+    run(actions);
+}
+
+uint64_t FileTransfer::fetch(const Digest &content, const std::string &savePath,
+                             const std::vector<udp::endpoint> &sources) {
+    uint64_t id = transferId(content);
+    auto blob = std::make_unique<Blob>();
+    blob->info.id = id;
+    blob->info.content = content;
+    blob->fetch = std::make_unique<Fetch>();
+    blob->fetch->savePath = savePath;
+    blob->fetch->lastData = blob->fetch->infoRequestedAt = Clock::now();
+
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (blobs.count(id)) {
+            throw std::runtime_error("Already receiving or sharing " + toHex(content));
+        }
+        Blob &added = *(blobs[id] = std::move(blob));
+        for (const auto &source : sources) {
+            addSourceLocked(id, added, source, std::nullopt, actions);
+        }
+        ensureTicker();
+    }
+    run(actions);
+    return id;
+}
+
+void FileTransfer::addSource(uint64_t id, const udp::endpoint &source) {
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Blob *blob = findFetch(id);
+        if (!blob) {
+            return;
+        }
+        addSourceLocked(id, *blob, source, std::nullopt, actions);
+        fillWindows(id, *blob, actions);
+    }
+    run(actions);
+}
+
+void FileTransfer::cancel(uint64_t id) {
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = blobs.find(id);
+        if (found == blobs.end()) {
+            return;
+        }
+        // Whoever the file was offered to stops waiting for it
+        if (found->second->offeredTo.port() != 0) {
+            actions.frames.emplace_back(found->second->offeredTo, transferHeader(TransferMessage::Cancel, id, 0));
+        }
+        blobs.erase(found);
+    }
+    run(actions);
+}
+
+void FileTransfer::setOfferCallback(OfferCallback callback) {
+    offerCallback = std::move(callback);
+}
+
+void FileTransfer::setProgressCallback(ProgressCallback callback) {
+    progressCallback = std::move(callback);
+}
+
+void FileTransfer::setCompletionCallback(CompletionCallback callback) {
+    completionCallback = std::move(callback);
+}
+
+FileTransfer::Stats FileTransfer::getStats() const {
+    Stats stats;
+    stats.blocksSent = blocksSent.load(std::memory_order_relaxed);
+    stats.blocksReceived = blocksReceived.load(std::memory_order_relaxed);
+    stats.duplicateBlocks = duplicateBlocks.load(std::memory_order_relaxed);
+    stats.corruptChunks = corruptChunks.load(std::memory_order_relaxed);
+    stats.requestTimeouts = requestTimeouts.load(std::memory_order_relaxed);
+    stats.resumedBytes = resumedBytes.load(std::memory_order_relaxed);
+    stats.endgameRequests = endgameRequests.load(std::memory_order_relaxed);
+    stats.sourcesDropped = sourcesDropped.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void FileTransfer::onFrame(const char *data, size_t len, const udp::endpoint &sender) {
+    if (len < TRANSFER_HEADER_SIZE) {
+        return;
+    }
+    auto kind = static_cast<TransferMessage>(static_cast<uint8_t>(data[2]));
+    uint64_t id = readU64(data + 3);
+    const char *body = data + TRANSFER_HEADER_SIZE;
+    size_t bodyLen = len - TRANSFER_HEADER_SIZE;
+    try {
+        if (kind == TransferMessage::Offer || kind == TransferMessage::Info) {
+            onOffer(id, body, bodyLen, sender, kind == TransferMessage::Info);
+            return;
+        }
+        Actions actions;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            switch (kind) {
+                case TransferMessage::InfoRequest:
+                    onInfoRequest(id, len, sender, actions);
+                    break;
+                case TransferMessage::ManifestRequest:
+                    onManifestRequest(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::Manifest:
+                    onManifest(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::HaveRequest:
+                    onHaveRequest(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::Have:
+                    onHave(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::ChunkRequest:
+                    onChunkRequest(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::Block:
+                    onBlock(id, body, bodyLen, sender, actions);
+                    break;
+                case TransferMessage::Cancel:
+                    onCancel(id, sender, actions);
+                    break;
+                default:
+                    std::cerr << "[ERROR] Dropping transfer message of unknown kind "
+                              << static_cast<int>(data[2]) << std::endl;
+                    break;
+            }
+        }
+        run(actions);
+    } catch (const std::exception &e) {
+        std::cerr << "[ERROR] Transfer message from " << sender << " failed: " << e.what() << std::endl;
+    }
+}
+
+// Offers go to the application; Info answers a fetch that only knew the content id
+void FileTransfer::onOffer(uint64_t id, const char *body, size_t len, const udp::endpoint &sender, bool info) {
+    if (len < INFO_SIZE) {
+        return;
+    }
+    FileOffer offer;
+    offer.size = readU64(body);
+    offer.chunkSize = readU32(body + 8);
+    std::memcpy(offer.root.data(), body + 12, offer.root.size());
+    offer.cookie = readU64(body + 44);
+    offer.name = safeFileName(std::string(body + INFO_SIZE, len - INFO_SIZE));
+    offer.sender = sender;
+    if (offer.chunkSize == 0 || offer.chunkSize > static_cast<uint64_t>(config.blockSize) * BLOCKS_PER_CHUNK ||
+        countChunks(offer.size, offer.chunkSize) > UINT32_MAX) {
+        std::cerr << "[ERROR] Ignoring file offer with unsupported chunking from " << sender << std::endl;
+        return;
+    }
+    offer.content = MerkleTree::contentId(offer.size, offer.chunkSize, offer.root);
+    offer.id = transferId(offer.content);
+    if (offer.id != id) {
+        std::cerr << "[ERROR] Ignoring file offer with a mismatched id from " << sender << std::endl;
+        return;
+    }
+
+    // Info also hands out the source's cookie, which it may be asked for again later
+    if (info) {
+        Actions actions;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Blob *blob = findFetch(id);
+            uint32_t index = blob ? sourceIndex(*blob->fetch, sender) : NO_SOURCE;
+            if (index == NO_SOURCE || blob->info.content != offer.content) {
+                return;
+            }
+            Source &source = blob->fetch->sources[index];
+            bool first = !source.cookieKnown;
+            source.cookie = offer.cookie;
+            source.cookieKnown = true;
+            if (!blob->infoKnown) {
+                blob->info = offer;
+                blob->infoKnown = true;
+                startFetch(id, *blob, actions);
+            } else if (first && source.alive && blob->file.isOpen()) {
+                requestHave(id, *blob, source, actions);
+                requestPages(id, *blob, false, actions);
+            }
+        }
+        run(actions);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = Clock::now();
+        auto [seen, added] = offersSeen.try_emplace(id, now);
+        if (!added && now - seen->second < OFFER_MEMORY) {
+            return;
+        }
+        seen->second = now;
+    }
+    if (offerCallback) {
+        offerCallback(offer);
+    }
+}
+
+// The sender's address is unproven, so the answer may not be much larger than the request
+void FileTransfer::onInfoRequest(uint64_t id, size_t len, const udp::endpoint &sender, Actions &actions) {
+    Blob *blob = findServed(id);
+    if (!blob) {
+        return;
+    }
+    std::string frame = encodeInfo(TransferMessage::Info, blob->info, addressCookie(sender));
+    if (frame.size() <= len * AMPLIFICATION_LIMIT) {
+        actions.frames.emplace_back(sender, std::move(frame));
+    }
+}
+
+void FileTransfer::onManifestRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                                     Actions &actions) {
+    Blob *blob = findServed(id);
+    if (len < 12 || !blob || blob->tree.empty() || readU64(body + 4) != addressCookie(sender)) {
+        return;
+    }
+    uint32_t page = readU32(body);
+    uint64_t first = static_cast<uint64_t>(page) * MerkleTree::PAGE_LEAVES;
+    if (first >= blob->chunkCount) {
+        return;
+    }
+    size_t count = std::min<size_t>(MerkleTree::PAGE_LEAVES, blob->chunkCount - first);
+    std::vector<Digest> proof = blob->tree.proof(page);
+    std::string frame = transferHeader(TransferMessage::Manifest, id, 6 + (count + proof.size()) * sizeof(Digest));
+    appendU32(frame, page);
+    frame.push_back(static_cast<char>(count));
+    frame.push_back(static_cast<char>(proof.size()));
+    frame.append(reinterpret_cast<const char *>(blob->leaves[first].data()), count * sizeof(Digest));
+    for (const Digest &sibling : proof) {
+        frame.append(reinterpret_cast<const char *>(sibling.data()), sibling.size());
+    }
+    actions.frames.emplace_back(sender, std::move(frame));
+}
+
+void FileTransfer::onManifest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                              Actions &actions) {
+    Blob *blob = findFetch(id);
+    if (len < 6 || !blob || !blob->infoKnown || sourceIndex(*blob->fetch, sender) == NO_SOURCE) {
+        return;
+    }
+    Fetch &fetch = *blob->fetch;
+    uint32_t page = readU32(body);
+    size_t count = static_cast<uint8_t>(body[4]);
+    size_t proofLength = static_cast<uint8_t>(body[5]);
+    if (page >= fetch.pages.size() || fetch.pages[page] == PAGE_RECEIVED ||
+        len != 6 + (count + proofLength) * sizeof(Digest)) {
+        return;
+    }
+    std::vector<Digest> leaves(count);
+    std::vector<Digest> proof(proofLength);
+    const char *digests = body + 6;
+    for (auto *list : {&leaves, &proof}) {
+        for (Digest &digest : *list) {
+            std::memcpy(digest.data(), digests, digest.size());
+            digests += digest.size();
+        }
+    }
+    if (!MerkleTree::verifyPage(blob->chunkCount, page, leaves.data(), count, proof, blob->info.root)) {
+        std::cerr << "[ERROR] Dropping manifest page that fails the Merkle proof from " << sender << std::endl;
+        return;
+    }
+    std::copy(leaves.begin(), leaves.end(), blob->leaves.begin() + static_cast<size_t>(page) * MerkleTree::PAGE_LEAVES);
+    fetch.pages[page] = PAGE_RECEIVED;
+    fetch.pagesReceived++;
+    fetch.pagesRequestedAt = fetch.lastData = Clock::now();
+    if (fetch.pagesReceived < fetch.pages.size()) {
+        requestPages(id, *blob, false, actions);
+        return;
+    }
+    manifestComplete(*blob);
+    fillWindows(id, *blob, actions);
+}
+
+void FileTransfer::onHaveRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                                 Actions &actions) {
+    Blob *blob = findServed(id);
+    if (len < 12 || !blob || blob->chunkDone.empty() || readU64(body + 4) != addressCookie(sender)) {
+        return;
+    }
+    uint32_t first = readU32(body);
+    if (first >= blob->chunkCount) {
+        return;
+    }
+    uint32_t count = std::min<uint32_t>(HAVE_PAGE_CHUNKS, blob->chunkCount - first);
+    std::string frame = transferHeader(TransferMessage::Have, id, 8 + (count + 7) / 8);
+    appendU32(frame, first);
+    appendU32(frame, count);
+    for (uint32_t i = 0; i < count; i += 8) {
+        uint8_t bits = 0;
+        for (uint32_t bit = 0; bit < 8 && i + bit < count; ++bit) {
+            if (blob->chunkDone[first + i + bit]) {
+                bits |= 0x80 >> bit;
+            }
+        }
+        frame.push_back(static_cast<char>(bits));
+    }
+    actions.frames.emplace_back(sender, std::move(frame));
+}
+
+void FileTransfer::onHave(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                          Actions &actions) {
+    Blob *blob = findFetch(id);
+    if (len < 8 || !blob || !blob->infoKnown) {
+        return;
+    }
+    Fetch &fetch = *blob->fetch;
+    uint32_t index = sourceIndex(fetch, sender);
+    uint32_t first = readU32(body);
+    uint32_t count = readU32(body + 4);
+    if (index == NO_SOURCE || !fetch.sources[index].alive || first >= blob->chunkCount ||
+        count != std::min<uint32_t>(HAVE_PAGE_CHUNKS, blob->chunkCount - first) || len != 8 + (count + 7) / 8) {
+        return;
+    }
+    Source &source = fetch.sources[index];
+    const auto *bits = reinterpret_cast<const unsigned char *>(body + 8);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t chunk = first + i;
+        if ((bits[i / 8] & (0x80 >> (i % 8))) && !source.has[chunk]) {
+            source.has[chunk] = 1;
+            source.hasCount++;
+            fetch.availability[chunk]++;
+            fetch.orderDirty = true;
+        }
+    }
+    source.seed = source.hasCount == blob->chunkCount;
+    fillWindows(id, *blob, actions);
+}
+
+void FileTransfer::onChunkRequest(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                                  Actions &actions) {
+    Blob *blob = findServed(id);
+    if (len < 22 || !blob || readU64(body + 14) != addressCookie(sender)) {
+        return;
+    }
+    uint32_t chunk = readU32(body);
+    uint16_t blockSize = readU16(body + 4);
+    if (chunk >= blob->chunkCount || !blob->chunkDone[chunk]) {
+        return;
+    }
+    const FileOffer &info = blob->info;
+    uint32_t length = chunkLength(info.size, info.chunkSize, chunk);
+    // Every block must fit one datagram on the path back to the requester
+    if (blockSize == 0 || (length + blockSize - 1) / blockSize > BLOCKS_PER_CHUNK ||
+        TRANSFER_BLOCK_HEADER_SIZE + blockSize > peer.datagramLimit(sender)) {
+        return;
+    }
+    uint64_t mask = readU64(body + 6) & blockMask(length, blockSize);
+    const char *chunkData = blob->file.data() + static_cast<uint64_t>(chunk) * info.chunkSize;
+
+    // Blocks are copied from the mapping once, into the datagrams handed to the kernel
+    size_t sent = 0;
+    for (uint64_t remaining = mask; remaining; remaining &= remaining - 1) {
+        auto block = static_cast<uint32_t>(__builtin_ctzll(remaining));
+        uint32_t offset = block * blockSize;
+        uint32_t blockLen = std::min<uint32_t>(blockSize, length - offset);
+        std::string frame = transferHeader(TransferMessage::Block, id, 5 + blockLen);
+        appendU32(frame, chunk);
+        frame.push_back(static_cast<char>(block));
+        frame.append(chunkData + offset, blockLen);
+        actions.frames.emplace_back(sender, std::move(frame));
+        sent++;
+    }
+    blocksSent.fetch_add(sent, std::memory_order_relaxed);
+}
+
+void FileTransfer::onBlock(uint64_t id, const char *body, size_t len, const udp::endpoint &sender,
+                           Actions &actions) {
+    Blob *blob = findFetch(id);
+    if (len < 5 || !blob) {
+        return;
+    }
+    Fetch &fetch = *blob->fetch;
+    uint32_t index = sourceIndex(fetch, sender);
+    uint32_t chunk = readU32(body);
+    uint32_t block = static_cast<uint8_t>(body[4]);
+    auto flight = fetch.inFlight.find(chunk);
+    if (index == NO_SOURCE || flight == fetch.inFlight.end() || block >= BLOCKS_PER_CHUNK ||
+        (flight->second.received & (uint64_t{1} << block))) {
+        duplicateBlocks.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const FileOffer &info = blob->info;
+    InFlight &entry = flight->second;
+    uint32_t length = chunkLength(info.size, info.chunkSize, chunk);
+    uint32_t offset = block * fetch.blockSize;
+    size_t blockLen = len - 5;
+    if (!(entry.allBlocks & (uint64_t{1} << block)) || blockLen != std::min<uint32_t>(fetch.blockSize, length - offset)) {
+        std::cerr << "[ERROR] Dropping malformed block from " << sender << std::endl;
+        return;
+    }
+    std::memcpy(blob->file.data() + static_cast<uint64_t>(chunk) * info.chunkSize + offset, body + 5, blockLen);
+    blocksReceived.fetch_add(1, std::memory_order_relaxed);
+    auto now = Clock::now();
+    if (entry.received == 0 && entry.requests == 1 && index == entry.source) {
+        peer.connections().addRttSample(CompactEndpoint::fromUdp(sender),
+                                        std::chrono::duration_cast<std::chrono::microseconds>(now - entry.requestedAt));
+    }
+    entry.received |= uint64_t{1} << block;
+    fetch.sources[index].timeouts = 0;
+    fetch.lastData = now;
+    if (entry.received != entry.allBlocks) {
+        return;
+    }
+
+    if (!chunkVerified(*blob, chunk)) {
+        corruptChunks.fetch_add(1, std::memory_order_relaxed);
+        entry.received = 0;
+        requestChunk(id, *blob, chunk, entry.source, entry.allBlocks, actions);
+        return;
+    }
+    for (uint32_t holder : {entry.source, entry.endgameSource}) {
+        if (holder != NO_SOURCE && fetch.sources[holder].inFlight > 0) {
+            fetch.sources[holder].inFlight--;
+        }
+    }
+    Source &primary = fetch.sources[entry.source];
+    primary.window = std::min(primary.window + 1, std::max<size_t>(1, config.maxWindow));
+    peer.connections().addDeliveries(CompactEndpoint::fromUdp(primary.endpoint), countBlocks(entry.allBlocks), 0);
+    fetch.inFlight.erase(flight);
+    chunkComplete(*blob, chunk);
+    if (blob->chunksDone == blob->chunkCount) {
+        finish(id, true, fetch.savePath, actions);
+    } else {
+        fillWindows(id, *blob, actions);
+    }
+}
+
+// A source that stops sharing is dropped; the download only fails once nobody is left
+void FileTransfer::onCancel(uint64_t id, const udp::endpoint &sender, Actions &actions) {
+    Blob *blob = findFetch(id);
+    if (!blob) {
+        return;
+    }
+    uint32_t index = sourceIndex(*blob->fetch, sender);
+    if (index == NO_SOURCE) {
+        return;
+    }
+    dropSource(*blob, index);
+    const auto &sources = blob->fetch->sources;
+    if (std::none_of(sources.begin(), sources.end(), [](const Source &source) { return source.alive; })) {
+        finish(id, false, "Cancelled by the sender", actions);
+    } else {
+        fillWindows(id, *blob, actions);
+    }
+}
+
+void FileTransfer::onTick() {
+    Actions actions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = Clock::now();
+        bool pending = false;
+        std::vector<std::pair<uint64_t, bool>> finished;
+        for (auto &[id, blob] : blobs) {
+            if (!blob->answered && blob->offersLeft > 0) {
+                pending = true;
+                if (now >= blob->nextOffer) {
+                    actions.frames.emplace_back(blob->offeredTo, encodeInfo(TransferMessage::Offer, blob->info,
+                                                                            addressCookie(blob->offeredTo)));
+                    blob->offersLeft--;
+                    blob->nextOffer = now + config.offerInterval;
+                }
+            }
+            if (!blob->fetch) {
+                continue;
+            }
+            pending = true;
+            Fetch &fetch = *blob->fetch;
+            if (!blob->infoKnown) {
+                if (now - fetch.infoRequestedAt >= config.requestTimeout) {
+                    for (Source &source : fetch.sources) {
+                        if (source.alive) {
+                            requestInfo(id, source, actions);
+                        }
+                    }
+                    fetch.infoRequestedAt = now;
+                }
+            } else if (fetch.pagesReceived < fetch.pages.size()) {
+                if (now - fetch.pagesRequestedAt >= config.requestTimeout) {
+                    requestPages(id, *blob, true, actions);
+                }
+            } else {
+                if (fetch.verifyCursor < blob->chunkCount) {
+                    verifyResumed(*blob, RESUME_VERIFY_CHUNKS);
+                    fetch.lastData = now;
+                }
+                for (Source &source : fetch.sources) {
+                    if (source.alive && !source.seed && now >= source.nextHavePoll) {
+                        requestHave(id, *blob, source, actions);
+                    }
+                }
+
+                // A source is penalised once per tick however many of its requests timed out
+                std::vector<uint8_t> penalised(fetch.sources.size(), 0);
+                std::vector<Clock::duration> timeouts;
+                timeouts.reserve(fetch.sources.size());
+                for (const Source &source : fetch.sources) {
+                    timeouts.push_back(std::max<Clock::duration>(
+                            config.requestTimeout,
+                            peer.connections().retransmitTimeout(CompactEndpoint::fromUdp(source.endpoint),
+                                                                 std::chrono::microseconds(0))));
+                }
+                std::vector<uint32_t> expired;
+                for (auto &[chunk, flight] : fetch.inFlight) {
+                    if (now - flight.requestedAt >= timeouts[flight.source]) {
+                        expired.push_back(chunk);
+                    }
+                }
+                for (uint32_t chunk : expired) {
+                    auto flight = fetch.inFlight.find(chunk);
+                    if (flight == fetch.inFlight.end()) {
+                        continue;
+                    }
+                    InFlight &entry = flight->second;
+                    uint32_t index = entry.source;
+                    Source &source = fetch.sources[index];
+                    requestTimeouts.fetch_add(1, std::memory_order_relaxed);
+                    peer.connections().addDeliveries(CompactEndpoint::fromUdp(source.endpoint), 0,
+                                                     countBlocks(entry.allBlocks & ~entry.received));
+                    if (!penalised[index]) {
+                        penalised[index] = 1;
+                        source.window = std::max<size_t>(1, source.window / 2);
+                        if (++source.timeouts >= config.sourceTimeouts) {
+                            dropSource(*blob, index);
+                            continue;
+                        }
+                        // The source may have restarted or seen our address change; ask for a new cookie
+                        if (source.timeouts >= 2) {
+                            requestInfo(id, source, actions);
+                        }
+                    }
+                    uint64_t missing = entry.allBlocks & ~entry.received;
+                    if (entry.endgameSource != NO_SOURCE) {
+                        requestChunk(id, *blob, chunk, entry.endgameSource, missing, actions);
+                    }
+                    requestChunk(id, *blob, chunk, index, missing, actions);
+                }
+                fillWindows(id, *blob, actions);
+                if (blob->chunksDone == blob->chunkCount) {
+                    finished.emplace_back(id, true);
+                    continue;
+                }
+            }
+            if (now - fetch.lastData >= config.idleTimeout) {
+                finished.emplace_back(id, false);
+                continue;
+            }
+            if (progressCallback && blob->infoKnown && fetch.bytesDone != fetch.bytesReported) {
+                fetch.bytesReported = fetch.bytesDone;
+                actions.callbacks.emplace_back([this, id = id, done = fetch.bytesDone, size = blob->info.size]() {
+                    progressCallback(id, done, size);
+                });
+            }
+        }
+        for (auto &[id, success] : finished) {
+            finish(id, success, success ? blobs[id]->fetch->savePath : "No source is responding", actions);
+        }
+        for (auto seen = offersSeen.begin(); seen != offersSeen.end();) {
+            seen = now - seen->second >= OFFER_MEMORY ? offersSeen.erase(seen) : std::next(seen);
+        }
+
+        // Answered offers, finished downloads and files merely being shared need no ticks
+        if (!pending && offersSeen.empty() && ticker != INVALID_TIMER) {
+            timers.cancel(ticker);
+            ticker = INVALID_TIMER;
+        }
+    }
+    run(actions);
+}
+
+FileTransfer::Blob *FileTransfer::findBlob(uint64_t id) {
+    auto found = blobs.find(id);
+    return found == blobs.end() ? nullptr : found->second.get();
+}
+
+// A blob that can answer requests; being asked also means an offer reached its receiver
+FileTransfer::Blob *FileTransfer::findServed(uint64_t id) {
+    Blob *blob = findBlob(id);
+    if (!blob || !blob->infoKnown) {
+        return nullptr;
+    }
+    blob->answered = true;
+    return blob;
+}
+
+FileTransfer::Blob *FileTransfer::findFetch(uint64_t id) {
+    Blob *blob = findBlob(id);
+    return blob && blob->fetch ? blob : nullptr;
+}
+
+uint32_t FileTransfer::sourceIndex(const Fetch &fetch, const udp::endpoint &endpoint) const {
+    for (uint32_t index = 0; index < fetch.sources.size(); ++index) {
+        if (fetch.sources[index].endpoint == endpoint) {
+            return index;
+        }
+    }
+    return NO_SOURCE;
+}
+
+void FileTransfer::addSourceLocked(uint64_t id, Blob &blob, const udp::endpoint &endpoint,
+                                   std::optional<uint64_t> cookie, Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    uint32_t index = sourceIndex(fetch, endpoint);
+    if (index == NO_SOURCE) {
+        index = static_cast<uint32_t>(fetch.sources.size());
+        fetch.sources.emplace_back();
+        fetch.sources.back().endpoint = endpoint;
+    } else if (fetch.sources[index].alive) {
+        return;
+    }
+    Source &source = fetch.sources[index];
+    source.alive = true;
+    source.timeouts = 0;
+    source.window = std::max<size_t>(1, config.initialWindow);
+    if (cookie) {
+        source.cookie = *cookie;
+        source.cookieKnown = true;
+    }
+    if (!blob.infoKnown) {
+        requestInfo(id, source, actions);
+        return;
+    }
+    // Sources added before the .part was opened get their bitmap in startFetch()
+    if (blob.file.isOpen()) {
+        source.has.assign(blob.chunkCount, 0);
+        requestHave(id, blob, source, actions);
+    }
+}
+
+// Opens the .part once the file's size is known and starts on the manifest
+void FileTransfer::startFetch(uint64_t id, Blob &blob, Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    std::string partPath = fetch.savePath + ".part";
+    try {
+        fetch.resuming = std::filesystem::exists(partPath);
+        blob.file = MappedFile::openWritable(partPath, blob.info.size);
+    } catch (const std::exception &e) {
+        finish(id, false, e.what(), actions);
+        return;
+    }
+    blob.chunkCount = static_cast<uint32_t>(countChunks(blob.info.size, blob.info.chunkSize));
+    blob.leaves.assign(blob.chunkCount, Digest{});
+    blob.chunkDone.assign(blob.chunkCount, 0);
+    fetch.blockSize = static_cast<uint16_t>(std::max<uint32_t>(
+            config.blockSize, (blob.info.chunkSize + BLOCKS_PER_CHUNK - 1) / BLOCKS_PER_CHUNK));
+    fetch.pages.assign((blob.chunkCount + MerkleTree::PAGE_LEAVES - 1) / MerkleTree::PAGE_LEAVES, PAGE_MISSING);
+    fetch.availability.assign(blob.chunkCount, 0);
+    fetch.lastData = Clock::now();
+    for (Source &source : fetch.sources) {
+        if (source.alive) {
+            source.has.assign(blob.chunkCount, 0);
+            requestHave(id, blob, source, actions);
+        }
+    }
+    if (fetch.pages.empty()) {
+        manifestComplete(blob);
+        finish(id, true, fetch.savePath, actions);
+        return;
+    }
+    requestPages(id, blob, false, actions);
+}
+
+void FileTransfer::requestInfo(uint64_t id, Source &source, Actions &actions) {
+    std::string frame = transferHeader(TransferMessage::InfoRequest, id, INFO_REQUEST_SIZE - TRANSFER_HEADER_SIZE);
+    frame.resize(INFO_REQUEST_SIZE, '\0');
+    actions.frames.emplace_back(source.endpoint, std::move(frame));
+}
+
+// A source that has not handed out a cookie yet is asked for one first, and again until it does
+void FileTransfer::requestHave(uint64_t id, Blob &blob, Source &source, Actions &actions) {
+    if (!source.cookieKnown) {
+        requestInfo(id, source, actions);
+        source.nextHavePoll = Clock::now() + config.requestTimeout;
+        return;
+    }
+    for (uint64_t first = 0; first < blob.chunkCount; first += HAVE_PAGE_CHUNKS) {
+        std::string frame = transferHeader(TransferMessage::HaveRequest, id, 12);
+        appendU32(frame, static_cast<uint32_t>(first));
+        appendU64(frame, source.cookie);
+        actions.frames.emplace_back(source.endpoint, std::move(frame));
+    }
+    source.nextHavePoll = Clock::now() + config.haveInterval;
+}
+
+// Keeps up to maxWindow manifest pages requested from the source with the lowest RTT. A
+// retry asks again for every page still outstanding, each time of the next source in turn.
+void FileTransfer::requestPages(uint64_t id, Blob &blob, bool retry, Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    std::vector<udp::endpoint> alive;
+    for (const Source &source : fetch.sources) {
+        if (source.alive && source.cookieKnown) {
+            alive.push_back(source.endpoint);
+        }
+    }
+    if (alive.empty()) {
+        return;
+    }
+    size_t count = alive.size();
+    alive = peer.connections().fastest(std::move(alive), count);
+    size_t limit = std::max<size_t>(1, config.maxWindow);
+    size_t outstanding = std::count(fetch.pages.begin(), fetch.pages.end(), PAGE_REQUESTED);
+    for (uint32_t page = 0; page < fetch.pages.size(); ++page) {
+        bool again = retry && fetch.pages[page] == PAGE_REQUESTED;
+        bool fresh = fetch.pages[page] == PAGE_MISSING && outstanding < limit;
+        if (!again && !fresh) {
+            continue;
+        }
+        outstanding += fresh;
+        const udp::endpoint &source = fresh ? alive.front() : alive[fetch.nextSource++ % alive.size()];
+        std::string frame = transferHeader(TransferMessage::ManifestRequest, id, 12);
+        appendU32(frame, page);
+        appendU64(frame, fetch.sources[sourceIndex(fetch, source)].cookie);
+        actions.frames.emplace_back(source, std::move(frame));
+        fetch.pages[page] = PAGE_REQUESTED;
+    }
+    fetch.pagesRequestedAt = Clock::now();
+}
+
+// Fresh downloads can request every chunk right away; an old .part is verified first, a
+// batch per tick, and only the chunks that fail are requested
+void FileTransfer::manifestComplete(Blob &blob) {
+    blob.tree = MerkleTree(blob.leaves);
+    Fetch &fetch = *blob.fetch;
+    fetch.verifyCursor = fetch.resuming ? 0 : blob.chunkCount;
+    fetch.orderDirty = true;
+}
+
+void FileTransfer::verifyResumed(Blob &blob, size_t budget) {
+    Fetch &fetch = *blob.fetch;
+    for (; budget > 0 && fetch.verifyCursor < blob.chunkCount; --budget) {
+        uint32_t chunk = fetch.verifyCursor++;
+        if (!blob.chunkDone[chunk] && !fetch.inFlight.count(chunk) && chunkVerified(blob, chunk)) {
+            chunkComplete(blob, chunk);
+            resumedBytes.fetch_add(chunkLength(blob.info.size, blob.info.chunkSize, chunk),
+                                   std::memory_order_relaxed);
+        }
+    }
+}
+
+void FileTransfer::chunkComplete(Blob &blob, uint32_t chunk) {
+    blob.chunkDone[chunk] = 1;
+    blob.chunksDone++;
+    blob.fetch->bytesDone += chunkLength(blob.info.size, blob.info.chunkSize, chunk);
+}
+
+// Forgets what the source has; its chunks go to the endgame source if there is one, or back to the pool
+void FileTransfer::dropSource(Blob &blob, uint32_t index) {
+    Fetch &fetch = *blob.fetch;
+    Source &source = fetch.sources[index];
+    if (!source.alive) {
+        return;
+    }
+    sourcesDropped.fetch_add(1, std::memory_order_relaxed);
+    std::cerr << "[ERROR] Giving up on transfer source " << source.endpoint << std::endl;
+    for (uint32_t chunk = 0; chunk < source.has.size(); ++chunk) {
+        if (source.has[chunk]) {
+            fetch.availability[chunk]--;
+        }
+    }
+    source.has.assign(source.has.size(), 0);
+    source.hasCount = 0;
+    source.seed = false;
+    source.alive = false;
+    source.inFlight = 0;
+    fetch.orderDirty = true;
+    for (auto flight = fetch.inFlight.begin(); flight != fetch.inFlight.end();) {
+        InFlight &entry = flight->second;
+        if (entry.endgameSource == index) {
+            entry.endgameSource = NO_SOURCE;
+        }
+        if (entry.source == index) {
+            if (entry.endgameSource == NO_SOURCE) {
+                flight = fetch.inFlight.erase(flight);
+                continue;
+            }
+            entry.source = entry.endgameSource;
+            entry.endgameSource = NO_SOURCE;
+        }
+        ++flight;
+    }
+}
+
+// Chunks still needed, rarest first. Equally rare chunks are shuffled when there are several
+// sources, so downloaders spread over different chunks and can trade them among themselves.
+void FileTransfer::rebuildPickOrder(Blob &blob) {
+    Fetch &fetch = *blob.fetch;
+    fetch.pickOrder.clear();
+    for (uint32_t chunk = 0; chunk < blob.chunkCount; ++chunk) {
+        if (!blob.chunkDone[chunk] && fetch.availability[chunk] > 0) {
+            fetch.pickOrder.push_back(chunk);
+        }
+    }
+    if (fetch.sources.size() > 1) {
+        std::shuffle(fetch.pickOrder.begin(), fetch.pickOrder.end(), randomGenerator());
+    }
+    std::stable_sort(fetch.pickOrder.begin(), fetch.pickOrder.end(), [&fetch](uint32_t a, uint32_t b) {
+        return fetch.availability[a] < fetch.availability[b];
+    });
+    fetch.pickStart = 0;
+    fetch.orderDirty = false;
+}
+
+// Requests one more chunk from source index: the rarest it has that nobody is fetching, or in
+// the endgame, when every missing chunk is already requested, one that another source is slow on
+bool FileTransfer::pickChunk(uint64_t id, Blob &blob, uint32_t index, Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    Source &source = fetch.sources[index];
+    if (fetch.orderDirty) {
+        rebuildPickOrder(blob);
+    }
+    while (fetch.pickStart < fetch.pickOrder.size() && blob.chunkDone[fetch.pickOrder[fetch.pickStart]]) {
+        fetch.pickStart++;
+    }
+    for (size_t i = fetch.pickStart; i < fetch.pickOrder.size(); ++i) {
+        uint32_t chunk = fetch.pickOrder[i];
+        if (blob.chunkDone[chunk] || chunk >= fetch.verifyCursor || !source.has[chunk] ||
+            fetch.inFlight.count(chunk)) {
+            continue;
+        }
+        InFlight &entry = fetch.inFlight[chunk];
+        entry.allBlocks = blockMask(chunkLength(blob.info.size, blob.info.chunkSize, chunk), fetch.blockSize);
+        entry.source = index;
+        source.inFlight++;
+        requestChunk(id, blob, chunk, index, entry.allBlocks, actions);
+        return true;
+    }
+
+    if (fetch.verifyCursor < blob.chunkCount || fetch.inFlight.size() + blob.chunksDone < blob.chunkCount) {
+        return false;
+    }
+    for (auto &[chunk, entry] : fetch.inFlight) {
+        if (entry.source != index && entry.endgameSource == NO_SOURCE && source.has[chunk]) {
+            entry.endgameSource = index;
+            source.inFlight++;
+            endgameRequests.fetch_add(1, std::memory_order_relaxed);
+            requestChunk(id, blob, chunk, index, entry.allBlocks & ~entry.received, actions);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Tops up every live source's window, starting with a different source each time
+void FileTransfer::fillWindows(uint64_t id, Blob &blob, Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    if (!blob.infoKnown || fetch.pagesReceived < fetch.pages.size() || fetch.sources.empty()) {
+        return;
+    }
+    size_t count = fetch.sources.size();
+    uint32_t start = fetch.nextSource++;
+    for (size_t k = 0; k < count; ++k) {
+        auto index = static_cast<uint32_t>((start + k) % count);
+        Source &source = fetch.sources[index];
+        while (source.alive && source.inFlight < source.window && pickChunk(id, blob, index, actions)) {
+        }
+    }
+}
+
+void FileTransfer::requestChunk(uint64_t id, Blob &blob, uint32_t chunk, uint32_t source, uint64_t mask,
+                                Actions &actions) {
+    Fetch &fetch = *blob.fetch;
+    std::string frame = transferHeader(TransferMessage::ChunkRequest, id, 22);
+    appendU32(frame, chunk);
+    appendU16(frame, fetch.blockSize);
+    appendU64(frame, mask);
+    appendU64(frame, fetch.sources[source].cookie);
+    actions.frames.emplace_back(fetch.sources[source].endpoint, std::move(frame));
+    InFlight &entry = fetch.inFlight[chunk];
+    entry.requestedAt = Clock::now();
+    entry.requests++;
+}
+
+bool FileTransfer::chunkVerified(const Blob &blob, uint32_t chunk) const {
+    return sha256(blob.file.data() + static_cast<uint64_t>(chunk) * blob.info.chunkSize,
+                  chunkLength(blob.info.size, blob.info.chunkSize, chunk)) == blob.leaves[chunk];
+}
+
+// Ends a download. A complete file replaces savePath and stays shared; anything else keeps
+// its .part and is forgotten.
+void FileTransfer::finish(uint64_t id, bool success, const std::string &detail, Actions &actions) {
+    auto found = blobs.find(id);
+    if (found == blobs.end() || !found->second->fetch) {
+        return;
+    }
+    Blob &blob = *found->second;
+    std::string result = detail;
+    const std::string &savePath = blob.fetch->savePath;
+    if (success && std::rename((savePath + ".part").c_str(), savePath.c_str()) != 0) {
+        success = false;
+        result = "Failed to rename " + savePath + ".part: " + std::strerror(errno);
+    }
+    if (success) {
+        blob.fetch.reset();
+    } else {
+        blobs.erase(found);
+    }
+    if (completionCallback) {
+        actions.callbacks.emplace_back([this, id, success, result]() { completionCallback(id, success, result); });
+    }
+}
+
+// Keyed hash of the address, so only whoever receives at that address learns it
+uint64_t FileTransfer::addressCookie(const udp::endpoint &endpoint) const {
+    std::string input(reinterpret_cast<const char *>(cookieSecret.data()), cookieSecret.size());
+    const auto address = endpoint.address();
+    if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        input.append(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    } else {
+        auto bytes = address.to_v6().to_bytes();
+        input.append(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+    appendU16(input, endpoint.port());
+    Digest digest = sha256(input.data(), input.size());
+    return readU64(reinterpret_cast<const char *>(digest.data()));
+}
+
+// Caller must hold mutex
+void FileTransfer::ensureTicker() {
+    if (ticker == INVALID_TIMER) {
+        auto interval = std::max<std::chrono::milliseconds>(config.requestTimeout / 2, std::chrono::milliseconds(1));
+        ticker = timers.scheduleEvery(interval, [this]() { onTick(); }, this);
+    }
+}
+
+// Sends the gathered frames, each run to the same destination in one burst, then runs the callbacks
+void FileTransfer::run(Actions &actions) {
+    std::vector<std::string_view> burst;
+    for (size_t i = 0; i < actions.frames.size(); ++i) {
+        burst.emplace_back(actions.frames[i].second);
+        if (i + 1 == actions.frames.size() || actions.frames[i + 1].first != actions.frames[i].first) {
+            peer.sendFrames(burst, actions.frames[i].first);
+            burst.clear();
+        }
+    }
+    for (auto &callback : actions.callbacks) {
+        callback();
+    }
+}
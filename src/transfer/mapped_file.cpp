@@ -0,0 +1,108 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+#include "transfer/mapped_file.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::runtime_error fileError(const std::string &what, const std::string &path) {
+    return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+        : fd(std::exchange(other.fd, -1)), mapping(std::exchange(other.mapping, nullptr)),
+          length(std::exchange(other.length, 0)) {
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        close();
+        fd = std::exchange(other.fd, -1);
+        mapping = std::exchange(other.mapping, nullptr);
+        length = std::exchange(other.length, 0);
+    }
+    return *this;
+}
+
+MappedFile MappedFile::openReadOnly(const std::string &path) {
+    return map(path, false, 0);
+}
+
+MappedFile MappedFile::openWritable(const std::string &path, uint64_t size) {
+    return map(path, true, size);
+}
+
+MappedFile MappedFile::map(const std::string &path, bool writable, uint64_t size) {
+    MappedFile file;
+    file.fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (file.fd < 0) {
+        throw fileError("Failed to open", path);
+    }
+    if (writable) {
+        if (::ftruncate(file.fd, static_cast<off_t>(size)) != 0) {
+            throw fileError("Failed to size", path);
+        }
+        // A sparse file only finds out the disk is full when a store through the mapping
+        // faults with SIGBUS, so every block is reserved before it is mapped
+        if (size > 0) {
+            int error = ::posix_fallocate(file.fd, 0, static_cast<off_t>(size));
+            if (error != 0) {
+                errno = error;
+                throw fileError(error == ENOSPC ? "Not enough disk space for" : "Failed to allocate", path);
+            }
+        }
+    } else {
+        struct stat info{};
+        if (::fstat(file.fd, &info) != 0) {
+            throw fileError("Failed to stat", path);
+        }
+        if (!S_ISREG(info.st_mode)) {
+            throw std::runtime_error("Not a regular file: " + path);
+        }
+        size = static_cast<uint64_t>(info.st_size);
+    }
+    file.length = size;
+    // Empty files have nothing to map; data() stays null
+    if (size > 0) {
+        void *mapped = ::mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file.fd, 0);
+        if (mapped == MAP_FAILED) {
+            throw fileError("Failed to map", path);
+        }
+        file.mapping = static_cast<char *>(mapped);
+    }
+    return file;
+}
+
+void MappedFile::adviseSequential() {
+    if (mapping) {
+        ::madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+}
+
+void MappedFile::sync() {
+    if (mapping && ::msync(mapping, length, MS_SYNC) != 0) {
+        throw std::runtime_error(std::string("Failed to sync mapped file: ") + std::strerror(errno));
+    }
+}
+
+void MappedFile::close() {
+    if (mapping) {
+        ::munmap(mapping, length);
+        mapping = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    length = 0;
+}
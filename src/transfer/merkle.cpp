@@ -0,0 +1,142 @@
+//
+// Created by Omer Mersin on 11/25/24.
+//
+#include "transfer/merkle.h"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <stdexcept>
+
+static constexpr size_t PAGE_LEVEL = 4;  // Tree level holding one digest per page
+static_assert(MerkleTree::PAGE_LEAVES == size_t{1} << PAGE_LEVEL, "pages must be complete subtrees");
+
+static Digest hashNode(uint8_t tag, const unsigned char *first, size_t firstLen, const Digest *second) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    Digest digest{};
+    bool ok = context && EVP_DigestInit_ex(context, EVP_sha256(), nullptr) == 1 &&
+              EVP_DigestUpdate(context, &tag, 1) == 1 &&
+              EVP_DigestUpdate(context, first, firstLen) == 1 &&
+              (!second || EVP_DigestUpdate(context, second->data(), second->size()) == 1) &&
+              EVP_DigestFinal_ex(context, digest.data(), nullptr) == 1;
+    EVP_MD_CTX_free(context);
+    if (!ok) {
+        throw std::runtime_error("SHA-256 failed.");
+    }
+    return digest;
+}
+
+static Digest hashPair(const Digest &left, const Digest &right) {
+    return hashNode(0x01, left.data(), left.size(), &right);
+}
+
+Digest sha256(const char *data, size_t len) {
+    Digest digest{};
+    if (EVP_Digest(data, len, digest.data(), nullptr, EVP_sha256(), nullptr) != 1) {
+        throw std::runtime_error("SHA-256 failed.");
+    }
+    return digest;
+}
+
+std::string toHex(const Digest &digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    text.reserve(digest.size() * 2);
+    for (unsigned char byte : digest) {
+        text.push_back(digits[byte >> 4]);
+        text.push_back(digits[byte & 0x0F]);
+    }
+    return text;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool fromHex(const std::string &text, Digest &digest) {
+    if (text.size() != digest.size() * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < digest.size(); ++i) {
+        int high = hexValue(text[2 * i]);
+        int low = hexValue(text[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        digest[i] = static_cast<unsigned char>(high << 4 | low);
+    }
+    return true;
+}
+
+MerkleTree::MerkleTree(const std::vector<Digest> &leaves) {
+    std::vector<Digest> level(paddedSize(leaves.size()), Digest{});
+    std::copy(leaves.begin(), leaves.end(), level.begin());
+    levels.push_back(std::move(level));
+    while (levels.back().size() > 1) {
+        const std::vector<Digest> &below = levels.back();
+        std::vector<Digest> above(below.size() / 2);
+        for (size_t i = 0; i < above.size(); ++i) {
+            above[i] = hashPair(below[2 * i], below[2 * i + 1]);
+        }
+        levels.push_back(std::move(above));
+    }
+}
+
+std::vector<Digest> MerkleTree::proof(size_t page) const {
+    std::vector<Digest> siblings;
+    size_t index = page;
+    for (size_t level = PAGE_LEVEL; level + 1 < levels.size(); ++level) {
+        siblings.push_back(levels[level][index ^ 1]);
+        index /= 2;
+    }
+    return siblings;
+}
+
+size_t MerkleTree::paddedSize(size_t leafCount) {
+    size_t size = PAGE_LEAVES;
+    while (size < leafCount) {
+        size *= 2;
+    }
+    return size;
+}
+
+bool MerkleTree::verifyPage(size_t leafCount, size_t page, const Digest *leaves, size_t count,
+                            const std::vector<Digest> &proof, const Digest &root) {
+    size_t pages = paddedSize(leafCount) / PAGE_LEAVES;
+    size_t depth = 0;
+    while ((size_t{1} << depth) < pages) {
+        depth++;
+    }
+    if (page >= pages || proof.size() != depth || count > PAGE_LEAVES ||
+        count != std::min(PAGE_LEAVES, leafCount - std::min(leafCount, page * PAGE_LEAVES))) {
+        return false;
+    }
+    std::vector<Digest> level(PAGE_LEAVES, Digest{});
+    std::copy(leaves, leaves + count, level.begin());
+    while (level.size() > 1) {
+        for (size_t i = 0; i < level.size() / 2; ++i) {
+            level[i] = hashPair(level[2 * i], level[2 * i + 1]);
+        }
+        level.resize(level.size() / 2);
+    }
+    Digest node = level.front();
+    size_t index = page;
+    for (const Digest &sibling : proof) {
+        node = (index & 1) ? hashPair(sibling, node) : hashPair(node, sibling);
+        index /= 2;
+    }
+    return node == root;
+}
+
+Digest MerkleTree::contentId(uint64_t size, uint32_t chunkSize, const Digest &root) {
+    unsigned char fields[12 + 32];
+    for (int i = 0; i < 8; ++i) {
+        fields[i] = static_cast<unsigned char>(size >> (56 - 8 * i));
+    }
+    for (int i = 0; i < 4; ++i) {
+        fields[8 + i] = static_cast<unsigned char>(chunkSize >> (24 - 8 * i));
+    }
+    std::copy(root.begin(), root.end(), fields + 12);
+    return hashNode(0x02, fields, sizeof(fields), nullptr);
+}
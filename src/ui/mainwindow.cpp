@@ -6,42 +6,78 @@
 #include "ui/mainwindow.h"
 #include "ui_mainwindow.h"
 #include "networking/stun.h"
+#include "networking/dht_protocol.h"
 #include <QMessageBox>
+#include <QFileDialog>
+#include <QStandardPaths>
+#include <QDir>
 #include <QInputDialog>
 #include <QHostInfo>
 #include <QThread>
 #include <sstream> // For std::istringstream
 #include <vector>
+#include <algorithm>
 #include "utils.h"
 #include <QRandomGenerator> // Include this at the top of your file
 
 
+// DHT nodes come as text; anything that does not parse is simply not tracked
+static std::optional<CompactEndpoint> compactEndpoint(const std::string &ip, int port) {
+    boost::system::error_code error;
+    auto address = boost::asio::ip::make_address(ip, error);
+    if (error) {
+        return std::nullopt;
+    }
+    return CompactEndpoint::fromUdp({address, static_cast<unsigned short>(port)});
+}
 
 MainWindow::MainWindow(QWidget *parent)
-        : QMainWindow(parent), ui(new Ui::MainWindow), peer() {
+        : QMainWindow(parent), ui(new Ui::MainWindow), peer(), transfers(peer), nat(), dht(nullptr) {
     ui->setupUi(this);
 
     // Log the welcome message
     appendLog("=== Welcome to the P2P Messaging App ===");
 
-    // Set up message callback for handling incoming messages
-    peer.setMessageCallback([this](const std::string &message, const std::string &ip, int port) {
-        // Log and route the incoming message
-        QMetaObject::invokeMethod(this, [this, message, ip, port]() {
-            appendLog(QString("Received message from %1:%2 - %3")
-                              .arg(QString::fromStdString(ip))
-                              .arg(port)
-                              .arg(QString::fromStdString(message)));
+    // Run the peer on its own I/O thread pool so sends never block the GUI thread
+    PeerConfig peerConfig;
+    peerConfig.ioThreads = std::max(1u, std::thread::hardware_concurrency());
+    peerConfig.receiveBufferBytes = 4 << 20;
+    peerConfig.compression = true;  // Only used towards peers that offer a codec too
+    peerConfig.receiveTimestamps = true;  // Per-stage latency shows up in the peer's stats
+    peer.setConfig(peerConfig);
+    // Small DHT messages compress against a dictionary every node builds the same way
+    peer.setCompressionDictionary(DHT::compressionDictionary());
+
+    // Incoming messages queue up in the peer; the GUI thread drains each burst with one posted event
+    peer.setInboundQueue(4096, [this]() {
+        QMetaObject::invokeMethod(this, [this]() { processInbound(); });
+    });
+    // When the GUI falls behind, discovery floods go first; chat and DHT replies are kept
+    peer.setPriorityClassifier([](std::string_view message) {
+        return DHT::isDiscoveryMessage(message) ? MessagePriority::Bulk : MessagePriority::Critical;
+    });
 
-            // Pass the message to the DHT for processing
-            if (dht) {
-                dht->handleIncomingMessage(message, ip, port);
-            } else {
-                appendLog("Error: DHT instance is not initialized.");
-            }
+    // File offers are confirmed on the GUI thread; results are logged there too
+    transfers.setOfferCallback([this](const FileOffer &offer) {
+        QMetaObject::invokeMethod(this, [this, offer]() { onFileOffered(offer); });
+    });
+    transfers.setCompletionCallback([this](uint64_t, bool success, const std::string &detail) {
+        QMetaObject::invokeMethod(this, [this, success, detail = QString::fromStdString(detail)]() {
+            appendLog(success ? "File received: " + detail : "File transfer failed: " + detail);
         });
     });
 
+    // Hole punches and keepalives leave from the listening socket, so replies find the mapping they opened
+    nat.setSendFunction([this](const std::string &message, const std::string &ip, int port) {
+        try {
+            peer.sendMessage(message, ip, port);
+        } catch (const std::exception &e) {
+            QMetaObject::invokeMethod(this, [this, reason = QString::fromStdString(e.what())]() {
+                appendLog("Error sending keepalive: " + reason);
+            });
+        }
+    });
+
     // Start the initialization of P2P networking in a separate thread
     QThread *initThread = QThread::create([this]() {
         try {
@@ -55,6 +91,9 @@ MainWindow::MainWindow(QWidget *parent)
 
     // Connect the send button click event to the message sending function
     connect(ui->sendButton, &QPushButton::clicked, this, &MainWindow::onSendButtonClicked);
+    connect(ui->sendFileButton, &QPushButton::clicked, this, &MainWindow::onSendFileButtonClicked);
+    connect(ui->shareFileButton, &QPushButton::clicked, this, &MainWindow::onShareFileButtonClicked);
+    connect(ui->fetchButton, &QPushButton::clicked, this, &MainWindow::onFetchButtonClicked);
 
     appendLog("Initialization process started...");
 }
@@ -121,8 +160,26 @@ void MainWindow::initializeP2P() {
         appendLog("Your Public Port: " + QString::number(publicPort));
     });
 
-    // Initialize the DHT
+    // Initialize the DHT; its small control messages share datagrams per destination
     dht = new DHT(username.toStdString(), publicIP.toStdString(), publicPort);
+    dht->setSendCallback([this](const std::string &message, const std::string &ip, int port) {
+        peer.sendCoalesced(message, ip, port);
+    });
+    // DHT round trips feed the peer's connection table, which in turn ranks nodes for lookups
+    dht->setRttCallbacks(
+            [this](const std::string &ip, int port, std::chrono::microseconds sample) {
+                if (auto remote = compactEndpoint(ip, port)) {
+                    peer.connections().addRttSample(*remote, sample);
+                }
+            },
+            [this](const std::string &ip, int port) -> std::optional<std::chrono::microseconds> {
+                auto remote = compactEndpoint(ip, port);
+                return remote ? peer.connections().srtt(*remote) : std::nullopt;
+            });
+    // Providers answer on the GUI thread, where incoming DHT messages are handled
+    dht->setProviderCallback([this](const std::string &key, const std::vector<DHTProvider> &providers) {
+        onProvidersFound(key, providers);
+    });
 
     // Add self to the DHT
     QString selfID = username;
@@ -132,6 +189,20 @@ void MainWindow::initializeP2P() {
         appendLog("Your Username (Node ID): " + selfID);
     });
 
+    // Start listening before contacting the bootstrap node so its replies are not lost
+    try {
+        peer.bind(publicPort);
+        peer.startListening();
+        QMetaObject::invokeMethod(this, [this]() {
+            appendLog("Listening for incoming messages...");
+        });
+    } catch (const std::exception &e) {
+        QMetaObject::invokeMethod(this, [this, e]() {
+            appendLog("Error starting peer listener: " + QString::fromStdString(e.what()));
+        });
+        return;
+    }
+
     if (!isBootstrap) {
         DHTNode bootstrapNode{"bootstrap", bootstrapIP.toStdString(), bootstrapPort};
 
@@ -146,28 +217,20 @@ void MainWindow::initializeP2P() {
 
         // Announce self to the bootstrap node
         try {
-            dht->sendMessage("ANNOUNCE " + username.toStdString(), bootstrapNode.ip, bootstrapNode.port);
+            dht->announceTo(bootstrapNode.ip, bootstrapNode.port);
             appendLog("Announced self to the bootstrap node.");
         } catch (const std::exception &e) {
             appendLog("Failed to announce self to bootstrap: " + QString::fromStdString(e.what()));
         }
+
+        // Keep the mapping towards the bootstrap node open so its later messages still reach us
+        nat.startKeepAlive(bootstrapNode.ip, bootstrapNode.port);
     } else {
         appendLog("Running as the bootstrap node.");
     }
 
-    // Start listening for incoming messages
-    try {
-        peer.bind(publicPort);
-        peer.startListening();
-        QMetaObject::invokeMethod(this, [this]() {
-            appendLog("Listening for incoming messages...");
-        });
-    } catch (const std::exception &e) {
-        QMetaObject::invokeMethod(this, [this, e]() {
-            appendLog("Error starting peer listener: " + QString::fromStdString(e.what()));
-        });
-        return;
-    }
+    // Forget nodes that went silent and keep re-announcing this one
+    dht->startMaintenance();
 
     // Log success
     QMetaObject::invokeMethod(this, [this, isBootstrap]() {
@@ -199,13 +262,14 @@ void MainWindow::onSendButtonClicked() {
     try {
         if (!peerID.isEmpty()) {
             // Resolve Peer ID using DHT
-            DHTNode peerNode = dht->findNode(peerID.toStdString());
-            peer.sendMessage(message.toStdString(), peerNode.ip, peerNode.port);
+            resolvePeerID(peerID, [this, text = message.toStdString()](const std::string &ip, int port) {
+                peer.asyncSendMessage(text, ip, port, sendResultHandler());
+            });
             appendLog("You: " + message + " (via Peer ID)");
         } else if (!peerIP.isEmpty() && !peerPortStr.isEmpty()) {
             // Use Peer IP and Port directly
             int peerPort = peerPortStr.toInt();
-            peer.sendMessage(message.toStdString(), peerIP.toStdString(), peerPort);
+            peer.asyncSendMessage(message.toStdString(), peerIP.toStdString(), peerPort, sendResultHandler());
             appendLog("You: " + message + " (via IP and Port)");
         } else {
             QMessageBox::warning(this, "Invalid Input", "Please provide Peer ID or Peer IP and Port.");
@@ -217,3 +281,196 @@ void MainWindow::onSendButtonClicked() {
         appendLog("Error sending message: " + QString::fromStdString(e.what()));
     }
 }
+
+// Calls then on the GUI thread once peerID resolves, which takes a network lookup unless
+// the node is already in the routing table
+void MainWindow::resolvePeerID(const QString &peerID, std::function<void(const std::string &, int)> then) {
+    dht->findNode(peerID.toStdString(), PEER_LOOKUP_TIMEOUT,
+                  [this, peerID, then = std::move(then)](std::optional<DHTNode> node) {
+                      QMetaObject::invokeMethod(this, [this, peerID, then, node]() {
+                          if (!node) {
+                              appendLog("Error: peer " + peerID + " was not found in the DHT.");
+                              return;
+                          }
+                          then(node->ip, node->port);
+                      });
+                  });
+}
+
+void MainWindow::onSendFileButtonClicked() {
+    QString peerID = ui->peerIDInput->text();
+    QString peerIP = ui->peerIPInput->text();
+    QString peerPortStr = ui->peerPortInput->text();
+
+    if (!peerID.isEmpty()) {
+        resolvePeerID(peerID, [this](const std::string &ip, int port) { sendFileTo(ip, port); });
+    } else if (!peerIP.isEmpty() && !peerPortStr.isEmpty()) {
+        sendFileTo(peerIP.toStdString(), peerPortStr.toInt());
+    } else {
+        QMessageBox::warning(this, "Invalid Input", "Please provide Peer ID or Peer IP and Port.");
+    }
+}
+
+void MainWindow::sendFileTo(const std::string &ip, int port) {
+    QString path = QFileDialog::getOpenFileName(this, "Send File");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    // Open our mapping first so the receiver's chunk requests are let through
+    nat.punchHole(ip, port);
+
+    // Offering hashes the whole file, so it runs off the GUI thread
+    QThread *offerThread = QThread::create([this, path, ip, port]() {
+        try {
+            transfers.offerFile(path.toStdString(), ip, port);
+            QMetaObject::invokeMethod(this, [this, path]() { appendLog("Offered file: " + path); });
+        } catch (const std::exception &e) {
+            QMetaObject::invokeMethod(this, [this, reason = QString::fromStdString(e.what())]() {
+                appendLog("Error sending file: " + reason);
+            });
+        }
+    });
+    connect(offerThread, &QThread::finished, offerThread, &QObject::deleteLater);
+    offerThread->start();
+}
+
+void MainWindow::onFileOffered(const FileOffer &offer) {
+    QString name = QString::fromStdString(offer.name);
+    QString sender = QString("%1:%2")
+            .arg(QString::fromStdString(offer.sender.address().to_string()))
+            .arg(offer.sender.port());
+    auto answer = QMessageBox::question(this, "Incoming File",
+                                        QString("Accept %1 (%2 bytes) from %3?").arg(name).arg(offer.size).arg(sender));
+    if (answer != QMessageBox::Yes) {
+        return;
+    }
+    QString downloads = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
+    QString savePath = QFileDialog::getSaveFileName(this, "Save File", QDir(downloads).filePath(name));
+    if (savePath.isEmpty()) {
+        return;
+    }
+    try {
+        transfers.download(offer, savePath.toStdString());
+        appendLog("Receiving " + name + " from " + sender);
+    } catch (const std::exception &e) {
+        appendLog("Error receiving file: " + QString::fromStdString(e.what()));
+    }
+}
+
+void MainWindow::onShareFileButtonClicked() {
+    if (!dht) {
+        appendLog("Error: DHT instance is not initialized.");
+        return;
+    }
+    QString path = QFileDialog::getOpenFileName(this, "Share File");
+    if (path.isEmpty()) {
+        return;
+    }
+
+    // Sharing hashes the whole file, so it runs off the GUI thread
+    QThread *shareThread = QThread::create([this, path]() {
+        try {
+            FileOffer offer = transfers.share(path.toStdString());
+            std::string key = toHex(offer.content);
+            dht->provide(key);
+            QMetaObject::invokeMethod(this, [this, path, key = QString::fromStdString(key)]() {
+                appendLog("Sharing " + path + " as content ID " + key);
+            });
+        } catch (const std::exception &e) {
+            QMetaObject::invokeMethod(this, [this, reason = QString::fromStdString(e.what())]() {
+                appendLog("Error sharing file: " + reason);
+            });
+        }
+    });
+    connect(shareThread, &QThread::finished, shareThread, &QObject::deleteLater);
+    shareThread->start();
+}
+
+void MainWindow::onFetchButtonClicked() {
+    if (!dht) {
+        appendLog("Error: DHT instance is not initialized.");
+        return;
+    }
+    std::string key = ui->contentIDInput->text().trimmed().toLower().toStdString();
+    Digest content;
+    if (!fromHex(key, content)) {
+        QMessageBox::warning(this, "Invalid Input", "Please enter a 64 digit content ID.");
+        return;
+    }
+    QString downloads = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
+    QString savePath = QFileDialog::getSaveFileName(this, "Save File",
+                                                    QDir(downloads).filePath(QString::fromStdString(key.substr(0, 16))));
+    if (savePath.isEmpty()) {
+        return;
+    }
+    try {
+        // Start with the providers already known; the rest join as the DHT answers
+        transfers.fetch(content, savePath.toStdString(), {});
+        onProvidersFound(key, dht->getProviders(key));
+        dht->findProviders(key);
+        appendLog("Fetching " + QString::fromStdString(key) + " into " + savePath);
+        ui->contentIDInput->clear();
+    } catch (const std::exception &e) {
+        appendLog("Error fetching file: " + QString::fromStdString(e.what()));
+    }
+}
+
+void MainWindow::onProvidersFound(const std::string &key, const std::vector<DHTProvider> &providers) {
+    Digest content;
+    if (!fromHex(key, content)) {
+        return;
+    }
+    uint64_t id = FileTransfer::transferId(content);
+    for (const auto &provider : providers) {
+        if (provider.ip == publicIP.toStdString() && provider.port == publicPort) {
+            continue;
+        }
+        try {
+            transfers.addSource(id, {boost::asio::ip::make_address(provider.ip),
+                                     static_cast<unsigned short>(provider.port)});
+        } catch (const std::exception &e) {
+            appendLog("Ignoring provider " + QString::fromStdString(provider.ip) + ": " + e.what());
+        }
+    }
+}
+
+void MainWindow::processInbound() {
+    while (peer.drainInbound(inboundBatch, 256) > 0) {
+        for (auto &received : inboundBatch) {
+            std::string_view message = received.payload.view();
+            std::string ip = received.sender.address().to_string();
+            int port = received.sender.port();
+
+            // Log and route the incoming message; binary DHT messages and keepalives are not worth showing
+            if (!isDhtMessage(message) && message != NAT::KEEPALIVE) {
+                appendLog(QString("Received message from %1:%2 - %3")
+                                  .arg(QString::fromStdString(ip))
+                                  .arg(port)
+                                  .arg(QString::fromUtf8(message.data(), message.size())));
+            }
+
+            // Pass the message to the DHT for processing
+            if (dht) {
+                dht->handleIncomingMessage(message, ip, port);
+            } else {
+                appendLog("Error: DHT instance is not initialized.");
+            }
+            received.times.handled = ReceiveTimestamps::Clock::now();
+            peer.recordLatency(received.times);
+        }
+        // Releasing the leases returns their slabs to the peer's pool
+        inboundBatch.clear();
+    }
+}
+
+// Reports asynchronous send failures back on the GUI thread
+Peer::SendHandler MainWindow::sendResultHandler() {
+    return [this](const boost::system::error_code &error, size_t) {
+        if (error) {
+            QMetaObject::invokeMethod(this, [this, reason = QString::fromStdString(error.message())]() {
+                appendLog("Error sending message: " + reason);
+            });
+        }
+    };
+}